@@ -6,10 +6,23 @@
 #include <assert.h>
 #include <stdarg.h>
 #include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <limits.h>
 
-#include <fcntl.h>  
-#include <sys/stat.h>  
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef _WIN32
 #include <io.h>
+#else
+#include <sys/wait.h>
+#endif
 
 #define global static
 #define local_persist static
@@ -37,6 +50,19 @@ intern void error(const char* buf)
 	exit(1);
 }
 
+// Counts every allocation the parser makes, so tests can check that lookups
+// make none.
+global std::atomic<size_t> toml_malloc_calls;
+
+intern void* counting_malloc(size_t size)
+{
+    toml_malloc_calls++;
+    return malloc(size);
+}
+
+#define TOML_MALLOC(s) counting_malloc(s)
+#define TOML_ALLOC(t) (t*)TOML_MALLOC(sizeof(t))
+
 #include "stretchy_buffer.h"
 #include "toml_parser.h"
 
@@ -51,13 +77,13 @@ void print_toml_value(TomlValue* val)
             printf("%s", val->bool_val ? "true" : "false");
             break;
         case TOMLVALUE_INT:
-            printf("%d", (int)val->float_val);
+            printf("%lld", val->int_val);
             break;
         case TOMLVALUE_FLOAT:
             printf("%f", val->float_val);
             break;
         case TOMLVALUE_STR:
-            printf("\"%s\"", val->str_val);
+            printf("\"%.*s\"", (int)val->str_len, val->str_val);
             break;
         case TOMLVALUE_INLINETABLE:
             printf("{ ");
@@ -73,8 +99,8 @@ void print_toml_value(TomlValue* val)
             printf("[ ");
             for (size_t i = 0; i < val->num_array_vals; i++)
             {
-                TomlValue* array_val = val->array_vals[i];
-                print_toml_value(array_val);
+                TomlValue array_val = toml_array_get(val, i);
+                print_toml_value(&array_val);
                 printf(", ");
             }
             printf(" ]");
@@ -134,21 +160,2456 @@ void print_toml_node(TomlNode* node)
 
 }
 
+bool toml_stmts_equal(TomlStmt* a, TomlStmt* b);
+bool toml_nodes_equal(TomlNodes* a, TomlNodes* b);
+
+bool toml_values_equal(TomlValue* a, TomlValue* b)
+{
+    if (a->kind != b->kind)
+    {
+        return false;
+    }
+    switch (a->kind)
+    {
+        case TOMLVALUE_BOOL:
+            return a->bool_val == b->bool_val;
+        case TOMLVALUE_INT:
+            return a->int_val == b->int_val;
+        case TOMLVALUE_FLOAT:
+            return memcmp(&a->float_val, &b->float_val, sizeof(double)) == 0;
+        case TOMLVALUE_STR:
+            return a->str_len == b->str_len && memcmp(a->str_val, b->str_val, a->str_len) == 0;
+        case TOMLVALUE_ARRAY:
+            if (a->array_kind != b->array_kind || a->num_array_vals != b->num_array_vals)
+            {
+                return false;
+            }
+            for (size_t i = 0; i < a->num_array_vals; i++)
+            {
+                TomlValue a_val = toml_array_get(a, i);
+                TomlValue b_val = toml_array_get(b, i);
+                if (!toml_values_equal(&a_val, &b_val))
+                {
+                    return false;
+                }
+            }
+            return true;
+        case TOMLVALUE_INLINETABLE:
+            return toml_nodes_equal(a->table_nodes, b->table_nodes);
+        default:
+            return false;
+    }
+}
+
+bool toml_stmts_equal(TomlStmt* a, TomlStmt* b)
+{
+    return strcmp(a->name, b->name) == 0 && toml_values_equal(a->value, b->value);
+}
+
+bool toml_stmt_lists_equal(TomlStmt** a, size_t num_a, TomlStmt** b, size_t num_b)
+{
+    if (num_a != num_b)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < num_a; i++)
+    {
+        if (!toml_stmts_equal(a[i], b[i]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool toml_nodes_equal(TomlNodes* a, TomlNodes* b)
+{
+    if (a->num_nodes != b->num_nodes)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < a->num_nodes; i++)
+    {
+        TomlNode* x = a->nodes[i];
+        TomlNode* y = b->nodes[i];
+        if (x->kind != y->kind)
+        {
+            return false;
+        }
+        switch (x->kind)
+        {
+            case TOMLDECL_STMT:
+                if (!toml_stmts_equal(x->stmt, y->stmt))
+                {
+                    return false;
+                }
+                break;
+            case TOMLDECL_TABLE:
+                if (strcmp(x->tbl->name, y->tbl->name) != 0 ||
+                    !toml_stmt_lists_equal(x->tbl->stmts, x->tbl->num_stmts, y->tbl->stmts, y->tbl->num_stmts))
+                {
+                    return false;
+                }
+                break;
+            case TOMLDECL_LIST:
+                if (strcmp(x->list->name, y->list->name) != 0 ||
+                    !toml_stmt_lists_equal(x->list->stmts, x->list->num_stmts, y->list->stmts, y->list->num_stmts))
+                {
+                    return false;
+                }
+                break;
+            default:
+                return false;
+        }
+    }
+    return true;
+}
+
+// Parses a separate copy of the document on each of several threads at once
+// and checks every result matches the serial parse.
+void test_concurrent_parse(const char* buffer, TomlNodes* expected)
+{
+    const int num_threads = 8;
+    size_t len = strlen(buffer);
+    char* buffers[num_threads];
+    TomlNodes* results[num_threads];
+    std::thread threads[num_threads];
+    for (int i = 0; i < num_threads; i++)
+    {
+        buffers[i] = (char*)malloc(len + 1);
+        memcpy(buffers[i], buffer, len + 1);
+        threads[i] = std::thread([i, &buffers, &results]() {
+            for (int iter = 0; iter < 50; iter++)
+            {
+                if (iter)
+                {
+                    toml_free_document(results[i]);
+                }
+                results[i] = parse_toml("concurrent", buffers[i]);
+            }
+        });
+    }
+    for (int i = 0; i < num_threads; i++)
+    {
+        threads[i].join();
+        assert(toml_nodes_equal(results[i], expected));
+        toml_free_document(results[i]);
+        free(buffers[i]);
+    }
+}
+
+// Index lookups use exact paths, so for the keys below they must agree with
+// toml_find_nodes node for node (statement matches are separate wrappers).
+void check_index_matches(TomlIndex* index, TomlNodes* doc, const char* key)
+{
+    TomlNodes* expected = toml_find_nodes(doc->nodes, doc->num_nodes, key);
+    const TomlNodes* found = toml_index_find(index, key);
+    assert(found->num_nodes == expected->num_nodes);
+    for (size_t i = 0; i < found->num_nodes; i++)
+    {
+        TomlNode* a = found->nodes[i];
+        TomlNode* b = expected->nodes[i];
+        assert(a->kind == b->kind);
+        assert(a->kind == TOMLDECL_STMT ? a->stmt == b->stmt : a == b);
+    }
+}
+
+// Every SIMD level must skip exactly what the scalar loops skip, whatever the
+// run length and alignment.
+void test_simd_skipping(const char* buffer, TomlNodes* expected)
+{
+    const char pattern[] = " \t\n\r\v  \n\n   \t ";
+    char storage[256 + 64 + 2];
+    for (int level = TOML_SIMD_SSE2; level <= toml_simd_supported; level++)
+    {
+        TomlSimdLevel simd = (TomlSimdLevel)level;
+        for (size_t offset = 0; offset < 64; offset++)
+        {
+            for (size_t len = 0; len < 200; len++)
+            {
+                char* buf = storage + offset;
+                for (size_t i = 0; i < len; i++)
+                {
+                    buf[i] = pattern[i % (sizeof(pattern) - 1)];
+                }
+                buf[len] = len % 3 ? 'x' : 0;
+                buf[len + 1] = 0;
+
+                size_t expected_line = 0, line = 0;
+                const char* expected_line_start = NULL;
+                const char* line_start = NULL;
+                const char* expected_end = toml_skip_space(TOML_SIMD_SCALAR, buf, buf + len + 2, &expected_line, &expected_line_start);
+                const char* end = toml_skip_space(simd, buf, buf + len + 2, &line, &line_start);
+                assert(end == expected_end && end == buf + len);
+                assert(line == expected_line && line_start == expected_line_start);
+
+                // Cut off at len instead of at the terminator
+                size_t cut_line = 0;
+                const char* cut_line_start = NULL;
+                assert(toml_skip_space(simd, buf, buf + len, &cut_line, &cut_line_start) == buf + len);
+                assert(cut_line == line && cut_line_start == line_start);
+
+                buf[0] = '#';
+                for (size_t i = 1; i <= len; i++)
+                {
+                    buf[i] = (char)('a' + i % 26);
+                }
+                buf[len + 1] = len % 2 ? '\n' : 0;
+                assert(toml_skip_comment(simd, buf, buf + len + 2) == buf + len + 1);
+                assert(toml_skip_comment(simd, buf, buf + len + 1) == buf + len + 1);
+                assert(toml_find_any(simd, buf, buf + len + 1, '"', '\\', '"') == buf + len + 1);
+            }
+        }
+        toml_set_simd_level(simd);
+        TomlNodes* nodes = parse_toml("simd", buffer);
+        assert(toml_nodes_equal(nodes, expected));
+        toml_free_document(nodes);
+    }
+
+    // The level is the calling thread's, and a context keeps the one it
+    // started with.
+    toml_set_simd_level(TOML_SIMD_SCALAR);
+    TomlArena arena = {};
+    TomlParseContext ctx;
+    toml_init_context(&ctx, "simd", buffer, strlen(buffer), &arena);
+    TomlSimdLevel other_thread = TOML_SIMD_SCALAR;
+    std::thread([&other_thread, buffer] {
+        TomlArena other_arena = {};
+        TomlParseContext other;
+        toml_init_context(&other, "simd", buffer, strlen(buffer), &other_arena);
+        other_thread = other.simd;
+        toml_release_context(&other);
+        toml_arena_free(&other_arena);
+    }).join();
+    assert(other_thread == toml_simd_supported);
+    toml_set_simd_level(toml_simd_supported);
+    assert(ctx.simd == TOML_SIMD_SCALAR);
+    toml_release_context(&ctx);
+    toml_arena_free(&arena);
+}
+
+bool toml_str_is(TomlValue* val, const char* expected)
+{
+    return val->kind == TOMLVALUE_STR && val->str_len == strlen(expected) &&
+           memcmp(val->str_val, expected, val->str_len) == 0;
+}
+
+void test_strings()
+{
+    const char* src =
+        "plain = \"no escapes here, so this one is a view into the source buffer\"\n"
+        "empty = \"\"\n"
+        "escaped = \"tab\\there \\\"quoted\\\" \\x41\\x4a back\\\\slash\"\n"
+        "multi = \"\"\"first line\r\nsecond \"quoted\" line\r\n\"\"\"\n"
+        "raw_multi = \"\"\"a\nb\nc\"\"\"\n"
+        "after = \"x\"\n";
+    for (int level = TOML_SIMD_SCALAR; level <= toml_simd_supported; level++)
+    {
+        toml_set_simd_level((TomlSimdLevel)level);
+        TomlNodes* doc = parse_toml("strings", src);
+        assert(doc->num_nodes == 6);
+        TomlValue* plain = doc->nodes[0]->stmt->value;
+        assert(toml_str_is(plain, "no escapes here, so this one is a view into the source buffer"));
+        assert(plain->str_val > src && plain->str_val < src + strlen(src));
+        assert(toml_str_is(doc->nodes[1]->stmt->value, ""));
+        assert(toml_str_is(doc->nodes[2]->stmt->value, "tab\there \"quoted\" AJ back\\slash"));
+        assert(toml_str_is(doc->nodes[3]->stmt->value, "first line\nsecond \"quoted\" line\n"));
+        TomlValue* raw_multi = doc->nodes[4]->stmt->value;
+        assert(toml_str_is(raw_multi, "a\nb\nc"));
+        assert(raw_multi->str_val > src && raw_multi->str_val < src + strlen(src));
+        assert(toml_str_is(doc->nodes[5]->stmt->value, "x"));
+        toml_free_document(doc);
+    }
+    toml_set_simd_level(toml_simd_supported);
+}
+
+double scan_float_literal(const char* literal)
+{
+    TomlArena arena = {};
+    TomlParseContext ctx;
+    toml_init_context(&ctx, "float", literal, strlen(literal), &arena);
+    next_token(&ctx);
+    assert(ctx.token.kind == TOKEN_FLOAT && ctx.stream == ctx.end);
+    toml_release_context(&ctx);
+    toml_arena_free(&arena);
+    return ctx.token.float_val;
+}
+
+void check_float(const char* literal)
+{
+    double expected = strtod(literal, NULL);
+    double val = scan_float_literal(literal);
+    assert(memcmp(&val, &expected, sizeof(double)) == 0);
+}
+
+// The built-in conversion must agree bit for bit with strtod.
+void test_floats()
+{
+    const char* literals[] = {
+        "0.0", "-0.0", "1.0", "3.1415", "-0.01", "5e+22", "1e6", "-2E-2", "6.626e-34",
+        "9224617.445991228313", "1e23", "8.98846567431158e307", "1.7976931348623157e308",
+        "2.2250738585072013e-308", "2.2250738585072011e-308", "4.9406564584124654e-324",
+        "2.4703282292062328e-324", "2.4703282292062327e-324", "1e-400", "0.1e-999999",
+        "9007199254740993.0", "9007199254740992.000000000000000000001", "1.00000000000000011102230246251565404236316680908203125",
+        "1.00000000000000011102230246251565404236316680908203124", "7.3177701707893310e+15",
+        "123456789012345678901234567890.0", "0.000000000000000000000000000000123456789012345678901234567890",
+        "1448997445238699.0", "18446744073709551615.0", "18446744073709551616.0", "1e22", "1e-22", "4.35e-7",
+    };
+    for (size_t i = 0; i < sizeof(literals) / sizeof(literals[0]); i++)
+    {
+        check_float(literals[i]);
+    }
+    assert(scan_float_literal("1_000.000_1e1_0") == 1000.0001e10);
+    assert(scan_float_literal("1e1_000") == HUGE_VAL);
+    assert(scan_float_literal("1.8e308") == HUGE_VAL);
+    check_float("1.7976931348623158e308");
+    check_float("1.7976931348623159e308");
+
+    char buf[64];
+    unsigned long long state = 0x9E3779B97F4A7C15ull;
+    for (int i = 0; i < 20000; i++)
+    {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        double d;
+        memcpy(&d, &state, sizeof(d));
+        if (isnan(d) || isinf(d))
+        {
+            continue;
+        }
+        snprintf(buf, sizeof(buf), "%.*e", (int)(state % 20), fabs(d));
+        check_float(buf); // rounding the digits can push DBL_MAX over to inf
+        snprintf(buf, sizeof(buf), "%.*f", 1 + (int)(state % 8), (double)(state % 100000000) / 977.0);
+        check_float(buf);
+    }
+
+    TomlNodes* doc = parse_toml("special", "a = inf\nb = +inf\nc = -inf\nd = nan\ne = -nan\n");
+    assert(doc->nodes[0]->stmt->value->float_val == HUGE_VAL);
+    assert(doc->nodes[1]->stmt->value->float_val == HUGE_VAL);
+    assert(doc->nodes[2]->stmt->value->float_val == -HUGE_VAL);
+    assert(isnan(doc->nodes[3]->stmt->value->float_val));
+    assert(isnan(doc->nodes[4]->stmt->value->float_val) && signbit(doc->nodes[4]->stmt->value->float_val));
+    toml_free_document(doc);
+}
+
+long long scan_int_literal(const char* literal)
+{
+    TomlArena arena = {};
+    TomlParseContext ctx;
+    toml_init_context(&ctx, "int", literal, strlen(literal), &arena);
+    next_token(&ctx);
+    assert(ctx.token.kind == TOKEN_INT && ctx.stream == ctx.end);
+    toml_release_context(&ctx);
+    toml_arena_free(&arena);
+    return ctx.token.int_val;
+}
+
+void test_ints()
+{
+    assert(scan_int_literal("0") == 0);
+    assert(scan_int_literal("+99") == 99);
+    assert(scan_int_literal("-17") == -17);
+    assert(scan_int_literal("5_349_221") == 5349221);
+    assert(scan_int_literal("9223372036854775807") == LLONG_MAX);
+    assert(scan_int_literal("-9223372036854775808") == LLONG_MIN);
+    assert(scan_int_literal("9007199254740993") == 9007199254740993ll);
+    assert(scan_int_literal("0xDEADBEEF") == 0xDEADBEEF);
+    assert(scan_int_literal("0xdead_beef") == 0xDEADBEEF);
+    assert(scan_int_literal("0x7FFFFFFFFFFFFFFF") == LLONG_MAX);
+    assert(scan_int_literal("0o755") == 0755);
+    assert(scan_int_literal("0o777777777777777777777") == LLONG_MAX);
+    assert(scan_int_literal("0b11010110") == 0xD6);
+    assert(scan_int_literal("0b111111111111111111111111111111111111111111111111111111111111111") == LLONG_MAX);
+    assert(scan_int_literal("000000000000000000000000042") == 42);
+    assert(scan_int_literal("12345678") == 12345678);
+    assert(scan_int_literal("1234567_8") == 12345678);
+    assert(scan_int_literal("123456789012345678") == 123456789012345678ll);
+    assert(scan_int_literal("-1234567890123456789") == -1234567890123456789ll);
+
+    TomlNodes* doc = parse_toml("ints", "big = 9007199254740993\n");
+    assert(doc->nodes[0]->stmt->value->kind == TOMLVALUE_INT);
+    assert(doc->nodes[0]->stmt->value->int_val == 9007199254740993ll);
+    toml_free_document(doc);
+}
+
+struct EventCounts {
+    size_t tables, lists, table_ends, keys, values, arrays, array_ends, inline_tables, inline_table_ends;
+    long long int_sum;
+};
+
+void count_table(void* user, const char*) { ((EventCounts*)user)->tables++; }
+void count_list(void* user, const char*) { ((EventCounts*)user)->lists++; }
+void count_table_end(void* user) { ((EventCounts*)user)->table_ends++; }
+void count_key(void* user, const char*) { ((EventCounts*)user)->keys++; }
+void count_array(void* user) { ((EventCounts*)user)->arrays++; }
+void count_array_end(void* user) { ((EventCounts*)user)->array_ends++; }
+void count_inline_table(void* user) { ((EventCounts*)user)->inline_tables++; }
+void count_inline_table_end(void* user) { ((EventCounts*)user)->inline_table_ends++; }
+
+void count_value(void* user, const TomlValue* value)
+{
+    EventCounts* counts = (EventCounts*)user;
+    counts->values++;
+    if (value->kind == TOMLVALUE_INT)
+    {
+        counts->int_sum += value->int_val;
+    }
+}
+
+void count_tree_value(EventCounts* counts, TomlValue* value);
+
+void count_tree_stmts(EventCounts* counts, TomlStmt** stmts, size_t num_stmts)
+{
+    for (size_t i = 0; i < num_stmts; i++)
+    {
+        counts->keys++;
+        count_tree_value(counts, stmts[i]->value);
+    }
+}
+
+void count_tree_value(EventCounts* counts, TomlValue* value)
+{
+    switch (value->kind)
+    {
+        case TOMLVALUE_ARRAY:
+            counts->arrays++;
+            counts->array_ends++;
+            for (size_t i = 0; i < value->num_array_vals; i++)
+            {
+                TomlValue element = toml_array_get(value, i);
+                count_tree_value(counts, &element);
+            }
+            break;
+        case TOMLVALUE_INLINETABLE:
+            counts->inline_tables++;
+            counts->inline_table_ends++;
+            for (size_t i = 0; i < value->table_nodes->num_nodes; i++)
+            {
+                count_tree_stmts(counts, &value->table_nodes->nodes[i]->stmt, 1);
+            }
+            break;
+        default:
+            counts->values++;
+            if (value->kind == TOMLVALUE_INT)
+            {
+                counts->int_sum += value->int_val;
+            }
+            break;
+    }
+}
+
+// The event stream describes exactly the tree parse_toml builds from it, and
+// consuming it directly doesn't allocate a tree.
+void test_events(const char* buffer, TomlNodes* expected)
+{
+    const TomlEvents counters = {
+        count_table, count_list, count_table_end, count_key, count_value,
+        count_array, count_array_end, count_inline_table, count_inline_table_end,
+    };
+    EventCounts counts = {};
+    TomlArena* arena = toml_new_arena();
+    parse_toml_events("events", buffer, strlen(buffer), &counters, &counts, arena);
+
+    EventCounts tree_counts = {};
+    for (size_t i = 0; i < expected->num_nodes; i++)
+    {
+        TomlNode* node = expected->nodes[i];
+        switch (node->kind)
+        {
+            case TOMLDECL_STMT:
+                count_tree_stmts(&tree_counts, &node->stmt, 1);
+                break;
+            case TOMLDECL_TABLE:
+                tree_counts.tables++;
+                tree_counts.table_ends++;
+                count_tree_stmts(&tree_counts, node->tbl->stmts, node->tbl->num_stmts);
+                break;
+            case TOMLDECL_LIST:
+                tree_counts.lists++;
+                tree_counts.table_ends++;
+                count_tree_stmts(&tree_counts, node->list->stmts, node->list->num_stmts);
+                break;
+            default:
+                assert(0);
+                break;
+        }
+    }
+    assert(memcmp(&counts, &tree_counts, sizeof(counts)) == 0);
+    assert(arena->bytes_allocated < expected->arena->bytes_allocated / 2);
+    toml_arena_free(arena);
+
+    // Callbacks left NULL are skipped
+    const TomlEvents keys_only = { NULL, NULL, NULL, count_key, NULL, NULL, NULL, NULL, NULL };
+    EventCounts key_counts = {};
+    parse_toml_events("events", buffer, strlen(buffer), &keys_only, &key_counts);
+    assert(key_counts.keys == counts.keys && key_counts.values == 0);
+}
+
+// Writes every event out as a line of text, copying the strings, so event
+// streams can be compared after their buffers are gone.
+void log_line(void* user, const char* fmt, ...)
+{
+    char** log = (char**)user;
+    va_list args;
+    va_start(args, fmt);
+    char line[512];
+    int len = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    memcpy(sb_add(*log, len), line, len);
+}
+
+void log_table(void* user, const char* name) { log_line(user, "[%s]\n", name); }
+void log_list(void* user, const char* name) { log_line(user, "[[%s]]\n", name); }
+void log_table_end(void* user) { log_line(user, "end\n"); }
+void log_key(void* user, const char* name) { log_line(user, "%s =", name); }
+void log_array(void* user) { log_line(user, " ["); }
+void log_array_end(void* user) { log_line(user, " ]\n"); }
+void log_inline_table(void* user) { log_line(user, " {"); }
+void log_inline_table_end(void* user) { log_line(user, " }\n"); }
+
+void log_value(void* user, const TomlValue* value)
+{
+    switch (value->kind)
+    {
+        case TOMLVALUE_BOOL: log_line(user, " %d\n", value->bool_val); break;
+        case TOMLVALUE_INT: log_line(user, " %lld\n", value->int_val); break;
+        case TOMLVALUE_FLOAT: log_line(user, " %a\n", value->float_val); break;
+        case TOMLVALUE_STR: log_line(user, " \"%.*s\"\n", (int)value->str_len, value->str_val); break;
+        default: assert(0); break;
+    }
+}
+
+global const TomlEvents log_events = {
+    log_table, log_list, log_table_end, log_key, log_value,
+    log_array, log_array_end, log_inline_table, log_inline_table_end,
+};
+
+// Feeding a document in chunks of any size gives the same events as parsing
+// it in one go, and single byte chunks never pile up more than a line.
+void test_stream(const char* buffer)
+{
+    char* expected = NULL;
+    size_t len = strlen(buffer);
+    parse_toml_events("stream", buffer, len, &log_events, &expected);
+
+    for (size_t chunk_size = 1; chunk_size <= len; chunk_size++)
+    {
+        char* log = NULL;
+        TomlStream* stream = toml_stream_new("stream", &log_events, &log);
+        for (size_t pos = 0; pos < len; pos += chunk_size)
+        {
+            size_t n = len - pos < chunk_size ? len - pos : chunk_size;
+            toml_stream_feed(stream, buffer + pos, n);
+            assert(chunk_size > 1 || sb_count(stream->pending) < 200);
+            assert(pos < 200 || sb_count(log) > 0);
+        }
+        toml_stream_finish(stream);
+        assert(sb_count(log) == sb_count(expected) && memcmp(log, expected, sb_count(log)) == 0);
+        sb_free(log);
+    }
+
+    // Quotes and escapes split right at the chunk boundary
+    const char* tricky = "a = \"\"\nb = \"x\\\"y\"\nc = \"\"\"one\n\"two\"\n\"\"\"\nd = [\n1,\n2 ]\n[t] # [x\ne = \"\\\\\"\n";
+    char* tricky_expected = NULL;
+    parse_toml_events("stream", tricky, strlen(tricky), &log_events, &tricky_expected);
+    for (size_t chunk_size = 1; chunk_size <= 4; chunk_size++)
+    {
+        char* log = NULL;
+        TomlStream* stream = toml_stream_new("stream", &log_events, &log);
+        for (size_t pos = 0; pos < strlen(tricky); pos += chunk_size)
+        {
+            size_t n = strlen(tricky) - pos < chunk_size ? strlen(tricky) - pos : chunk_size;
+            toml_stream_feed(stream, tricky + pos, n);
+        }
+        toml_stream_finish(stream);
+        assert(sb_count(log) == sb_count(tricky_expected) && memcmp(log, tricky_expected, sb_count(log)) == 0);
+        sb_free(log);
+    }
+    sb_free(tricky_expected);
+    sb_free(expected);
+}
+
+// Parallel parses split anywhere between every header and none give the
+// serial result, with every name in the one intern table.
+void test_parallel_parse(const char* buffer, TomlNodes* expected)
+{
+    char* big = NULL;
+    for (int i = 0; i < 2000; i++)
+    {
+        char section[256];
+        int len = snprintf(section, sizeof(section),
+                           "[[products]]\nname = \"item %d\" # [[not]] a header\nsku = %d\n"
+                           "tags = [\n\"a\",\n\"[b]\"\n]\nnote = \"\"\"\n[not.a.header]\n\"\"\"\n\n[products.dims]\nw = %d.5\n",
+                           i, i * 7, i);
+        memcpy(sb_add(big, len), section, len);
+    }
+    TomlNodes* big_expected = parse_toml_buffer("big", big, sb_count(big));
+
+    size_t thread_counts[] = { 1, 2, 4 };
+    size_t min_ranges[] = { 1, 64, 1000, 1 << 20 };
+    for (size_t t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t++)
+    {
+        TomlThreadPool* pool = toml_new_thread_pool(thread_counts[t]);
+        for (size_t r = 0; r < sizeof(min_ranges) / sizeof(min_ranges[0]); r++)
+        {
+            TomlNodes* doc = toml_parse_parallel("parallel", buffer, strlen(buffer), pool, min_ranges[r]);
+            assert(toml_nodes_equal(doc, expected));
+            TomlNodes* names = toml_find_nodes(doc, "products.name");
+            assert(names->num_nodes == 2 && names->nodes[0]->stmt->name == names->nodes[1]->stmt->name);
+            toml_free_document(doc);
+
+            doc = toml_parse_parallel("parallel", big, sb_count(big), pool, min_ranges[r]);
+            assert(toml_nodes_equal(doc, big_expected));
+            assert(toml_find_nodes(doc, "products.sku")->num_nodes == 2000);
+            toml_free_document(doc);
+        }
+        toml_free_thread_pool(pool);
+    }
+    toml_free_document(big_expected);
+    sb_free(big);
+}
+
+// Scans src with both tokenizer backends and checks they produce the same
+// tokens at the same places on the same lines.
+void check_tokenizers_agree(const char* src, size_t len)
+{
+    TomlArena arena = {};
+    TomlParseContext scan, indexed;
+    toml_init_context(&scan, "scan", src, len, &arena);
+    toml_init_context(&indexed, "index", src, len, &arena);
+    toml_build_structural_index(&indexed);
+    do
+    {
+        next_token(&scan);
+        next_token(&indexed);
+        assert(scan.token.kind == indexed.token.kind);
+        assert(scan.token.start == indexed.token.start && scan.token.end == indexed.token.end);
+        assert(scan.token.pos.line == indexed.token.pos.line && scan.line_start == indexed.line_start);
+        switch (scan.token.kind)
+        {
+            case TOKEN_NAME: assert(strcmp(scan.token.name, indexed.token.name) == 0); break;
+            case TOKEN_INT: assert(scan.token.int_val == indexed.token.int_val); break;
+            case TOKEN_FLOAT: assert(memcmp(&scan.token.float_val, &indexed.token.float_val, sizeof(double)) == 0); break;
+            case TOKEN_STR:
+                assert(scan.token.str_len == indexed.token.str_len);
+                assert(memcmp(scan.token.str_val, indexed.token.str_val, scan.token.str_len) == 0);
+                break;
+            default: break;
+        }
+    } while (scan.token.kind != TOKEN_EOF);
+    toml_release_context(&scan);
+    toml_release_context(&indexed);
+    toml_arena_free(&arena);
+}
+
+// The structural index tokenizer against the scanning one, over test.toml and
+// documents whose quotes, escapes and comments land on every offset of a
+// 64 byte block and whose ends fall anywhere in one.
+void test_structural_index(const char* buffer, TomlNodes* expected)
+{
+    const char* fragments[] = {
+        "a = \"\"\nb = \"x\\\"y # not a comment\"\n",
+        "c = \"\"\"one\n\"two\" # [x]\n\"\"\"\n",
+        "d = [\n1,\n2, # \"\n3 ]\n[t] # [x\ne = \"\\\\\"f=1\n",
+        "g = {h=1,i=\"\\\\\\\"\"} #\n\n\t k.l = +1.5e3\r\n",
+        "\"\"\"\"\"\" m = \"\"\"a\"\"\"",
+    };
+    char doc[512];
+    for (int level = TOML_SIMD_SCALAR; level <= toml_simd_supported; level++)
+    {
+        toml_set_simd_level((TomlSimdLevel)level);
+        check_tokenizers_agree(buffer, strlen(buffer));
+        for (size_t i = 0; i < sizeof(fragments) / sizeof(fragments[0]); i++)
+        {
+            for (int pad = 0; pad < 130; pad++)
+            {
+                for (int tail = 0; tail < 64; tail += 7)
+                {
+                    int len = snprintf(doc, sizeof(doc), "%*s%s%s%*s", pad, "", fragments[i], fragments[(i + 1) % 5], tail, "");
+                    check_tokenizers_agree(doc, len);
+                }
+            }
+        }
+    }
+    toml_set_simd_level(toml_simd_supported);
+
+    // Past the limit the index is never built, so the pages are never touched
+    char* huge = (char*)malloc(TOML_MAX_INDEXED_LEN + 1);
+    TomlArena arena = {};
+    TomlParseContext ctx;
+    toml_init_context(&ctx, "huge", huge, TOML_MAX_INDEXED_LEN + 1, &arena);
+    toml_build_structural_index(&ctx);
+    assert(sb_count(ctx.index) == 0 && !ctx.index_base);
+    toml_init_context(&ctx, "small", buffer, strlen(buffer), &arena);
+    toml_build_structural_index(&ctx);
+    assert(sb_count(ctx.index) > 0 && ctx.index_base == buffer);
+    toml_release_context(&ctx);
+    toml_arena_free(&arena);
+    free(huge);
+
+    assert(toml_set_tokenizer(TOML_TOKENIZER_INDEX) == TOML_TOKENIZER_SCAN);
+    TomlNodes* doc_nodes = parse_toml("index", buffer);
+    assert(toml_nodes_equal(doc_nodes, expected));
+    toml_free_document(doc_nodes);
+    test_stream(buffer);
+
+    // The backend is the calling thread's; others keep scanning meanwhile.
+    TomlTokenizer other_thread = TOML_TOKENIZER_INDEX;
+    std::thread([&other_thread, buffer, expected] {
+        TomlArena other_arena = {};
+        TomlParseContext other;
+        toml_init_context(&other, "scan", buffer, strlen(buffer), &other_arena);
+        other_thread = other.tokenizer;
+        TomlNodes* nodes = parse_toml_nodes(&other);
+        assert(toml_nodes_equal(nodes, expected) && !other.index_base);
+        toml_release_context(&other);
+        toml_arena_free(&other_arena);
+    }).join();
+    assert(other_thread == TOML_TOKENIZER_SCAN);
+    assert(toml_set_tokenizer(TOML_TOKENIZER_SCAN) == TOML_TOKENIZER_INDEX);
+}
+
+// Parses a copy of src that ends exactly at the end of its heap block, with no
+// terminator, so any read past the end trips the address sanitizer.
+void parse_unterminated(const char* src, size_t len)
+{
+    char* copy = (char*)malloc(len ? len : 1);
+    memcpy(copy, src, len);
+    TomlNodes* doc = parse_toml_buffer("unterminated", copy, len);
+    TomlNodes* expected = parse_toml("terminated", src);
+    assert(toml_nodes_equal(doc, expected));
+    toml_free_document(expected);
+    toml_free_document(doc);
+    free(copy);
+}
+
+void test_unterminated_input(const char* buffer)
+{
+    const char* docs[] = {
+        "",
+        "a = 1",
+        "a = 12345678",
+        "a = -9223372036854775808",
+        "a = 0xff",
+        "a = 1.5e3",
+        "a = 2.5",
+        "a = inf",
+        "a = true",
+        "a = \"abc\"",
+        "a = \"a\\tb\"",
+        "a = \"\"\"multi\nline\"\"\"",
+        "a = [ 1, 2 ]",
+        "a = { b = 1 }",
+        "[table]",
+        "[[list]]\nname = \"x\"",
+        "a = 1 # trailing comment",
+        "a = 1\n\n   \t",
+    };
+    for (size_t i = 0; i < sizeof(docs) / sizeof(docs[0]); i++)
+    {
+        parse_unterminated(docs[i], strlen(docs[i]));
+    }
+    parse_unterminated(buffer, strlen(buffer));
+}
+
+// Errors in the text come back from toml_try_parse_buffer instead of exiting.
+void test_recoverable_errors()
+{
+    const char* invalid[] = {
+        "a = \n",
+        "a = \"abc",
+        "a = \"\"\"abc",
+        "a = [ 1, 2",
+        "a = { b = 1",
+        "[t",
+        "a = 1\na = 2",
+        "[t]\n[t]",
+        "x = [ { y = 1, y = 2 } ]",
+        "a = 0xfg",
+        "= 1",
+        "a = 'x'",
+        "a = \\",
+    };
+    for (int tokenizer = TOML_TOKENIZER_SCAN; tokenizer <= TOML_TOKENIZER_INDEX; tokenizer++)
+    {
+        TomlTokenizer previous = toml_set_tokenizer((TomlTokenizer)tokenizer);
+        for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++)
+        {
+            char* message = NULL;
+            assert(!toml_try_parse_buffer("invalid", invalid[i], strlen(invalid[i]), &message));
+            assert(message && strncmp(message, "invalid(", 8) == 0 && strstr(message, "Error"));
+            free(message);
+        }
+        toml_set_tokenizer(previous);
+    }
+    char* message;
+    TomlNodes* doc = toml_try_parse_buffer("empty", "a = \n", 4, &message);
+    assert(!doc && strstr(message, "Unexpected token <EOF>"));
+    free(message);
+    doc = toml_try_parse_buffer("valid", "a = 1\n[t]\nb = \"x\"\n", 18, &message);
+    assert(doc && !message && toml_lookup(doc, "t.b")->value->str_len == 1);
+    toml_free_document(doc);
+}
+
+// Documents parsed from a mapped file keep pointing into the mapping.
+void test_parse_file(TomlNodes* expected)
+{
+    TomlNodes* doc = toml_parse_file("test.toml");
+    assert(doc && doc->mapped);
+    assert(toml_nodes_equal(doc, expected));
+    TomlNodes* names = toml_find_nodes(doc, "table.key");
+    const char* str = names->nodes[0]->stmt->value->str_val;
+    assert(str >= (const char*)doc->mapped && str < (const char*)doc->mapped + doc->mapped_size);
+    toml_free_document(doc);
+
+    assert(toml_parse_file("does_not_exist.toml") == NULL);
+
+    FILE* file = fopen("empty_test.toml", "w");
+    fclose(file);
+    doc = toml_parse_file("empty_test.toml");
+    assert(doc && doc->num_nodes == 0);
+    toml_free_document(doc);
+    remove("empty_test.toml");
+}
+
+bool snap_value_equal(const TomlSnapshot* snapshot, const TomlSnapValue* a, TomlValue* b)
+{
+    if (a->kind != (uint32_t)b->kind)
+    {
+        return false;
+    }
+    switch (b->kind)
+    {
+        case TOMLVALUE_BOOL:
+            return (a->bool_val != 0) == b->bool_val;
+        case TOMLVALUE_INT:
+            return a->int_val == b->int_val;
+        case TOMLVALUE_FLOAT:
+            return memcmp(&a->float_val, &b->float_val, sizeof(double)) == 0;
+        case TOMLVALUE_STR:
+            return a->count == b->str_len && memcmp(toml_snap_str_val(snapshot, a), b->str_val, b->str_len) == 0;
+        case TOMLVALUE_ARRAY:
+            if (a->count != b->num_array_vals)
+            {
+                return false;
+            }
+            for (size_t i = 0; i < b->num_array_vals; i++)
+            {
+                TomlValue element = toml_array_get(b, i);
+                if (!snap_value_equal(snapshot, toml_snap_array_vals(snapshot, a) + i, &element))
+                {
+                    return false;
+                }
+            }
+            return true;
+        case TOMLVALUE_INLINETABLE:
+            if (a->count != b->table_nodes->num_nodes)
+            {
+                return false;
+            }
+            for (size_t i = 0; i < a->count; i++)
+            {
+                const TomlSnapStmt* stmt = toml_snap_table_stmts(snapshot, a) + i;
+                TomlStmt* expected = b->table_nodes->nodes[i]->stmt;
+                if (strcmp(toml_snap_str(snapshot, stmt->name), expected->name) != 0 ||
+                    !snap_value_equal(snapshot, &stmt->value, expected->value))
+                {
+                    return false;
+                }
+            }
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool snap_stmts_equal(const TomlSnapshot* snapshot, const TomlSnapStmt* a, TomlStmt* b)
+{
+    return strcmp(toml_snap_str(snapshot, a->name), b->name) == 0 && a->name_len == strlen(b->name) &&
+           snap_value_equal(snapshot, &a->value, b->value);
+}
+
+// Every key in the index must find the same matches in the snapshot.
+void check_snapshot(const TomlSnapshot* snapshot, TomlIndex* index, TomlNodes* doc)
+{
+    assert(snapshot->header->num_nodes == doc->num_nodes);
+    const TomlSnapNode* nodes = toml_snap_nodes(snapshot);
+    for (size_t i = 0; i < doc->num_nodes; i++)
+    {
+        assert(nodes[i].kind == (uint32_t)doc->nodes[i]->kind);
+        if (doc->nodes[i]->kind == TOMLDECL_STMT)
+        {
+            assert(nodes[i].num_stmts == 1 && snap_stmts_equal(snapshot, toml_snap_stmts(snapshot, &nodes[i]), doc->nodes[i]->stmt));
+        }
+    }
+    for (size_t i = 0; i < index->num_slots; i++)
+    {
+        TomlIndexEntry* entry = &index->slots[i];
+        if (!entry->key)
+        {
+            continue;
+        }
+        char key[256];
+        assert(entry->key_len < sizeof(key));
+        memcpy(key, entry->key, entry->key_len);
+        key[entry->key_len] = 0;
+        TomlSnapMatches found = toml_snapshot_find(snapshot, key);
+        assert(found.num_matches == entry->matches.num_nodes);
+        for (size_t j = 0; j < found.num_matches; j++)
+        {
+            const TomlSnapMatch* match = &found.matches[j];
+            TomlNode* expected = entry->matches.nodes[j];
+            assert(match->kind == (uint32_t)expected->kind);
+            if (expected->kind == TOMLDECL_STMT)
+            {
+                assert(snap_stmts_equal(snapshot, toml_snap_match_stmt(snapshot, match), expected->stmt));
+                continue;
+            }
+            const TomlSnapNode* node = toml_snap_match_node(snapshot, match);
+            TomlStmt** stmts = expected->kind == TOMLDECL_TABLE ? expected->tbl->stmts : expected->list->stmts;
+            size_t num_stmts = expected->kind == TOMLDECL_TABLE ? expected->tbl->num_stmts : expected->list->num_stmts;
+            const char* name = expected->kind == TOMLDECL_TABLE ? expected->tbl->name : expected->list->name;
+            assert(strcmp(toml_snap_str(snapshot, node->name), name) == 0);
+            assert(node->num_stmts == num_stmts);
+            for (size_t k = 0; k < num_stmts; k++)
+            {
+                assert(snap_stmts_equal(snapshot, toml_snap_stmts(snapshot, node) + k, stmts[k]));
+            }
+        }
+    }
+    assert(toml_snapshot_find(snapshot, "nope").num_matches == 0);
+    assert(toml_snapshot_find(snapshot, "products.name").num_matches == 2);
+}
+
+void write_test_file(const char* path, const char* text)
+{
+    FILE* file = fopen(path, "wb");
+    fwrite(text, 1, strlen(text), file);
+    fclose(file);
+}
+
+// Snapshots answer the same lookups as the index, and stale or damaged ones
+// are replaced by a parse of the source.
+void test_snapshot(TomlNodes* expected, TomlIndex* index)
+{
+    assert(toml_compile_snapshot("test.toml", "test.tomlsnap"));
+    TomlSnapshot snapshot;
+    assert(toml_open_snapshot(&snapshot, "test.tomlsnap", "test.toml"));
+    assert(snapshot.mapped && !snapshot.owned);
+    check_snapshot(&snapshot, index, expected);
+    toml_close_snapshot(&snapshot);
+    remove("test.tomlsnap");
+
+    write_test_file("snap_test.toml", "a = 1\n[t]\nb = \"x\"\n");
+    assert(toml_compile_snapshot("snap_test.toml", "snap_test.tomlsnap"));
+    assert(toml_load_snapshot(&snapshot, "snap_test.toml", "snap_test.tomlsnap"));
+    assert(snapshot.mapped);
+    toml_close_snapshot(&snapshot);
+
+    // Same size, different text: stale even if the mtime were unchanged
+    write_test_file("snap_test.toml", "a = 2\n[t]\nb = \"y\"\n");
+    assert(!toml_open_snapshot(&snapshot, "snap_test.tomlsnap", "snap_test.toml"));
+    assert(toml_load_snapshot(&snapshot, "snap_test.toml", "snap_test.tomlsnap"));
+    assert(!snapshot.mapped && snapshot.owned);
+    TomlSnapMatches a = toml_snapshot_find(&snapshot, "a");
+    assert(a.num_matches == 1 && toml_snap_match_stmt(&snapshot, &a.matches[0])->value.int_val == 2);
+    toml_close_snapshot(&snapshot);
+
+    // A flipped byte fails the checksum
+    assert(toml_compile_snapshot("snap_test.toml", "snap_test.tomlsnap"));
+    FILE* file = fopen("snap_test.tomlsnap", "r+b");
+    fseek(file, -3, SEEK_END);
+    int c = fgetc(file);
+    fseek(file, -3, SEEK_END);
+    fputc(c ^ 1, file);
+    fclose(file);
+    assert(!toml_open_snapshot(&snapshot, "snap_test.tomlsnap", "snap_test.toml"));
+
+    remove("snap_test.toml");
+    remove("snap_test.tomlsnap");
+    assert(!toml_load_snapshot(&snapshot, "snap_test.toml", "snap_test.tomlsnap"));
+
+    // Below the size it needs, the writer fails cleanly instead of truncating
+    TomlNodes* doc = parse_toml("limits", "a = 1\n[t]\nb = \"x\"\n[[l]]\nc = [ 1, 2 ]\nd = { e = \"f\", g = [ \"h\" ] }\n");
+    TomlSourceInfo source = {};
+    size_t size;
+    void* blob = toml_write_snapshot(doc, &source, &size);
+    for (size_t max_size = 0; max_size <= size; max_size++)
+    {
+        TomlSnapWriter writer = {};
+        writer.max_size = max_size;
+        size_t limited_size;
+        void* limited = snap_write_document(&writer, doc, &source, &limited_size);
+        assert(max_size < size ? !limited && limited_size == 0 : limited_size == size && memcmp(limited, blob, size) == 0);
+        snap_free_writer(&writer);
+        TOML_FREE(limited);
+    }
+    TOML_FREE(blob);
+    toml_free_document(doc);
+}
+
+// A compact document shared by name reads the same in any process that
+// attaches to it.
+void test_shared_document(TomlNodes* expected, TomlIndex* index)
+{
+#ifdef _WIN32
+    const char* shm_name = "Local\\toml_parser_test";
+#else
+    char shm_name[64];
+    sprintf(shm_name, "/toml_parser_test_%d", (int)getpid());
+#endif
+    size_t size;
+    void* block = toml_compact(expected, &size);
+    TomlSnapshot view;
+    assert(toml_view_compact(&view, block, size));
+    check_snapshot(&view, index, expected);
+    assert(!toml_view_compact(&view, block, size - 1));
+
+    TomlSnapshot shared;
+    assert(toml_share_document(&shared, expected, shm_name));
+    assert(shared.mapped_size == size && memcmp(shared.mapped, block, size) == 0);
+    TOML_FREE(block);
+
+    TomlSnapshot attached;
+    assert(toml_attach_document(&attached, shm_name));
+    assert(attached.mapped != shared.mapped);
+    check_snapshot(&attached, index, expected);
+    toml_close_snapshot(&attached);
+
+#ifndef _WIN32
+    pid_t child = fork();
+    if (child == 0)
+    {
+        TomlSnapshot worker;
+        if (!toml_attach_document(&worker, shm_name))
+        {
+            _exit(1);
+        }
+        check_snapshot(&worker, index, expected);
+        toml_close_snapshot(&worker);
+        _exit(0);
+    }
+    int status;
+    assert(waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    // Sharing a smaller document under the same name leaves views of the old
+    // one intact, where truncating the object in place would fault them.
+    assert(toml_attach_document(&attached, shm_name));
+    TomlNodes* small = parse_toml("small", "only = 1\n");
+    TomlSnapshot reshared;
+    assert(toml_share_document(&reshared, small, shm_name));
+    assert(reshared.mapped_size < attached.mapped_size);
+    check_snapshot(&attached, index, expected);
+    toml_close_snapshot(&attached);
+    assert(toml_attach_document(&attached, shm_name));
+    assert(attached.mapped_size == reshared.mapped_size && toml_snapshot_find(&attached, "only").num_matches == 1);
+    toml_close_snapshot(&attached);
+    toml_close_snapshot(&reshared);
+    toml_free_document(small);
+#endif
+
+    toml_unlink_document(shm_name);
+    toml_close_snapshot(&shared);
+#ifndef _WIN32
+    assert(!toml_attach_document(&attached, shm_name));
+#endif
+}
+
+// Readers keep querying while documents are swapped underneath them; the
+// address sanitizer catches any document freed too early.
+void test_hot_reload(const char* buffer)
+{
+    const int num_readers = 8;
+    const int num_reloads = 400;
+    const char* small = "test = false\n[[products]]\nname = \"x\"\n";
+    TomlDocumentHandle* handle = toml_new_document_handle(parse_toml("reload", buffer));
+    std::atomic<bool> done(false);
+    std::vector<uint32_t> latencies[num_readers];
+    std::thread readers[num_readers];
+    for (int i = 0; i < num_readers; i++)
+    {
+        readers[i] = std::thread([&, i] {
+            int reader = toml_register_reader(handle);
+            while (!done)
+            {
+                auto start = std::chrono::steady_clock::now();
+                TomlNodes* doc = toml_read_begin(handle, reader);
+                TomlNodes* products = toml_find_nodes(doc, "products");
+                assert(products->num_nodes == 1 || products->num_nodes == 3);
+                assert(products->nodes[0]->list->num_stmts >= 1);
+                toml_read_end(handle, reader);
+                auto elapsed = std::chrono::steady_clock::now() - start;
+                latencies[i].push_back((uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+                free(products->nodes);
+                free(products);
+            }
+            toml_unregister_reader(handle, reader);
+        });
+    }
+    for (int i = 0; i < num_reloads; i++)
+    {
+        toml_handle_publish(handle, parse_toml("reload", i & 1 ? buffer : small));
+    }
+    done = true;
+    for (int i = 0; i < num_readers; i++)
+    {
+        readers[i].join();
+    }
+    assert(toml_handle_collect(handle) == 0);
+    assert(handle->num_freed == num_reloads);
+
+    std::vector<uint32_t> all;
+    for (int i = 0; i < num_readers; i++)
+    {
+        all.insert(all.end(), latencies[i].begin(), latencies[i].end());
+    }
+    std::sort(all.begin(), all.end());
+    if (!all.empty())
+    {
+        printf("hot reload: %d readers, %d reloads, %zu reads, latency p50 %u ns, p99 %u ns, p99.9 %u ns, max %u ns\n",
+               num_readers, num_reloads, all.size(), all[all.size() / 2], all[all.size() * 99 / 100],
+               all[all.size() * 999 / 1000], all.back());
+    }
+
+    // A watched file is reloaded when it is rewritten
+    write_test_file("watch_test.toml", "test = 1\n");
+    assert(toml_handle_reload(handle, "watch_test.toml"));
+    TomlFileWatch* watch = toml_watch_file(handle, "watch_test.toml");
+    assert(watch);
+#ifndef __linux__
+    // The polling watch compares mtimes, which may not have moved yet
+    std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+#endif
+    write_test_file("watch_test.toml", "test = 2\n");
+    for (int i = 0; i < 500 && !watch->num_reloads; i++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    int reader = toml_register_reader(handle);
+    TomlNodes* doc = toml_read_begin(handle, reader);
+    assert(doc->nodes[0]->stmt->value->int_val == 2);
+    toml_read_end(handle, reader);
+
+    // A version that doesn't parse is counted, and the document is kept
+    write_test_file("watch_test.toml", "test = \n");
+    for (int i = 0; i < 500 && !watch->num_failed; i++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    assert(watch->num_failed == 1);
+    doc = toml_read_begin(handle, reader);
+    assert(doc->nodes[0]->stmt->value->int_val == 2);
+    toml_read_end(handle, reader);
+    char* message;
+    assert(!toml_handle_reload(handle, "watch_test.toml", &message));
+    assert(strstr(message, "watch_test.toml(2) : Error: Unexpected token <EOF>"));
+    free(message);
+    assert(toml_read_begin(handle, reader) == doc);
+    toml_read_end(handle, reader);
+    toml_unregister_reader(handle, reader);
+
+    // Files recreated and written a line at a time are only loaded once
+    // complete, so readers never see a partial document
+    done = false;
+    for (int i = 0; i < num_readers; i++)
+    {
+        readers[i] = std::thread([&] {
+            int reader = toml_register_reader(handle);
+            while (!done)
+            {
+                TomlNodes* doc = toml_read_begin(handle, reader);
+                TomlNodes* last = toml_find_nodes(doc, "last");
+                assert(doc->num_nodes == 1 || (doc->num_nodes == 21 && last->num_nodes == 1));
+                toml_read_end(handle, reader);
+                free(last->nodes);
+                free(last);
+            }
+            toml_unregister_reader(handle, reader);
+        });
+    }
+    const int num_rewrites = 3;
+    uint64_t reloads = watch->num_reloads;
+    for (int i = 0; i < num_rewrites; i++)
+    {
+        remove("watch_test.toml");
+        FILE* file = fopen("watch_test.toml", "w");
+        for (int line = 0; line < 20; line++)
+        {
+            fprintf(file, "k%d = %d\n", line, i);
+            fflush(file);
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+        fprintf(file, "last = true\n");
+        fclose(file);
+        for (int j = 0; j < 500 && watch->num_reloads < reloads + i + 1; j++)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+    done = true;
+    for (int i = 0; i < num_readers; i++)
+    {
+        readers[i].join();
+    }
+    assert(watch->num_reloads >= reloads + num_rewrites);
+    reader = toml_register_reader(handle);
+    doc = toml_read_begin(handle, reader);
+    assert(doc->num_nodes == 21 && doc->nodes[0]->stmt->value->int_val == num_rewrites - 1);
+    toml_read_end(handle, reader);
+
+    // Reloaded documents own their text, so rewriting or truncating the file
+    // in place never changes or faults a document readers still hold
+    reloads = watch->num_reloads;
+    write_test_file("watch_test.toml", "name = \"alpha\"\n");
+    for (int i = 0; i < 500 && watch->num_reloads == reloads; i++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    doc = toml_read_begin(handle, reader);
+    const TomlValue* name = toml_lookup(doc, "name")->value;
+    FILE* file = fopen("watch_test.toml", "r+b");
+    fseek(file, 8, SEEK_SET);
+    fwrite("OMEGA", 1, 5, file);
+    fclose(file);
+    assert(name->str_len == 5 && memcmp(name->str_val, "alpha", 5) == 0);
+    fclose(fopen("watch_test.toml", "wb"));
+    assert(name->str_len == 5 && memcmp(name->str_val, "alpha", 5) == 0);
+    toml_read_end(handle, reader);
+    toml_unregister_reader(handle, reader);
+
+    done = false;
+    for (int i = 0; i < num_readers; i++)
+    {
+        readers[i] = std::thread([&] {
+            int reader = toml_register_reader(handle);
+            while (!done)
+            {
+                TomlNodes* doc = toml_read_begin(handle, reader);
+                // Empty while the file was caught truncated
+                const TomlKeyEntry* entry = toml_lookup(doc, "name");
+                if (entry)
+                {
+                    char seen[5];
+                    assert(entry->value->str_len == 5);
+                    memcpy(seen, entry->value->str_val, 5);
+                    assert(memcmp(seen, "alpha", 5) == 0 || memcmp(seen, "OMEGA", 5) == 0);
+                    std::this_thread::yield();
+                    assert(memcmp(entry->value->str_val, seen, 5) == 0);
+                }
+                toml_read_end(handle, reader);
+            }
+            toml_unregister_reader(handle, reader);
+        });
+    }
+    for (int i = 0; i < 40; i++)
+    {
+        if (i & 1)
+        {
+            file = fopen("watch_test.toml", "r+b");
+            fseek(file, 8, SEEK_SET);
+            fwrite(i & 2 ? "OMEGA" : "alpha", 1, 5, file);
+            fclose(file);
+        }
+        else
+        {
+            fclose(fopen("watch_test.toml", "wb"));
+            write_test_file("watch_test.toml", "name = \"alpha\"\n");
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    done = true;
+    for (int i = 0; i < num_readers; i++)
+    {
+        readers[i].join();
+    }
+    toml_stop_watch(watch);
+
+    // Running out of reader slots is reported, not fatal
+    int slots[TOML_MAX_READERS];
+    for (int i = 0; i < TOML_MAX_READERS; i++)
+    {
+        slots[i] = toml_register_reader(handle);
+        assert(slots[i] >= 0);
+    }
+    assert(toml_register_reader(handle) == -1);
+    toml_unregister_reader(handle, slots[0]);
+    slots[0] = toml_register_reader(handle);
+    assert(slots[0] >= 0);
+    for (int i = 0; i < TOML_MAX_READERS; i++)
+    {
+        toml_unregister_reader(handle, slots[i]);
+    }
+    assert(!toml_handle_reload(handle, "does_not_exist.toml"));
+    remove("watch_test.toml");
+    toml_free_document_handle(handle);
+}
+
+// Units are whole snippets with unique names, so any sequence of them is a
+// valid document. Edits are made by swapping units and then diffed down to
+// the bytes that actually changed.
+intern uint32_t edit_random(uint32_t* state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+void make_edit_unit(char* out, size_t size, uint32_t* rng, int* next_id)
+{
+    int id = (*next_id)++;
+    switch (edit_random(rng) % 10)
+    {
+        case 0: snprintf(out, size, "[t%d]\n", id); break;
+        case 1: snprintf(out, size, "[[items]]\n"); break;
+        case 2: snprintf(out, size, "s%d = \"\"\"\n[fake%d]\nline\n\"\"\"\n", id, id); break;
+        case 3: snprintf(out, size, "# comment %d [c]\n", id); break;
+        case 4: snprintf(out, size, "\n"); break;
+        case 5: snprintf(out, size, "a%d = [ 1,\n  [ 2, 3 ] ]\n", id); break;
+        case 6: snprintf(out, size, "i%d = { x = %d, y = \"s\" }\n", id, id); break;
+        case 7: snprintf(out, size, "  [t%d]\n", id); break;
+        case 8: snprintf(out, size, "e%d = \"esc\\t\\\"q\\\"\"\n", id); break;
+        default: snprintf(out, size, "k%d = %d\n", id, id * 7); break;
+    }
+}
+
+char* join_edit_units(char (*units)[64], size_t num_units)
+{
+    char* text = NULL;
+    for (size_t i = 0; i < num_units; i++)
+    {
+        size_t len = strlen(units[i]);
+        memcpy(sb_add(text, (int)len), units[i], len);
+    }
+    sb_push(text, 0);
+    return text;
+}
+
+void test_incremental_reparse()
+{
+    const size_t max_units = 2000;
+    char (*units)[64] = (char (*)[64])malloc(max_units * sizeof(*units));
+    size_t num_units = 400;
+    uint32_t rng = 12345;
+    int next_id = 0;
+    for (size_t i = 0; i < num_units; i++)
+    {
+        make_edit_unit(units[i], sizeof(units[i]), &rng, &next_id);
+    }
+    char* text = join_edit_units(units, num_units);
+    TomlEditable* editable = toml_new_editable("editable", text, sb_count(text) - 1);
+
+    // Fragments of typing that mostly leave the text invalid. None of them
+    // can name a key twice, so they parse exactly when the syntax allows.
+    const char* typed[] = { "\"", "\"\"\"", "'", "=", "= ", "[", "[[", "]", "{ x = ", "}", "a = [ 1,", ",", "\\", "0x", "x", "\n=" };
+    int num_rejected = 0;
+    for (int iter = 0; iter < 1000; iter++)
+    {
+        if (iter % 2 == 0)
+        {
+            // Turned down without touching the text or the document, or
+            // applied like any other edit and then undone
+            size_t len = sb_count(text) - 1;
+            const char* fragment = typed[edit_random(&rng) % (sizeof(typed) / sizeof(typed[0]))];
+            TomlEdit edit = { edit_random(&rng) % (len + 1), 0, fragment, strlen(fragment) };
+            char* tried = NULL;
+            memcpy(sb_add(tried, (int)edit.offset), text, edit.offset);
+            memcpy(sb_add(tried, (int)edit.inserted_len), fragment, edit.inserted_len);
+            memcpy(sb_add(tried, (int)(len - edit.offset)), text + edit.offset, len - edit.offset);
+            char* expected_message;
+            TomlNodes* expected = toml_try_parse_buffer("editable", tried, sb_count(tried), &expected_message);
+            char* message;
+            bool edited = toml_edit_document(editable, edit, &message);
+            assert(edited == (expected != NULL));
+            if (edited)
+            {
+                assert(!message && toml_nodes_equal(editable->doc, expected));
+                toml_free_document(expected);
+                TomlEdit undo = { edit.offset, edit.inserted_len, "", 0 };
+                assert(toml_edit_document(editable, undo));
+            }
+            else
+            {
+                assert(message && strstr(expected_message, "Error") && strstr(message, "Error"));
+                free(expected_message);
+                free(message);
+                num_rejected++;
+            }
+            sb_free(tried);
+            assert((size_t)sb_count(editable->text) == len && memcmp(editable->text, text, len) == 0);
+            TomlNodes* current = parse_toml("full", text);
+            assert(toml_nodes_equal(editable->doc, current));
+            toml_free_document(current);
+        }
+
+        size_t at = edit_random(&rng) % (num_units + 1);
+        size_t removed = at < num_units ? edit_random(&rng) % 3 : 0;
+        if (at + removed > num_units)
+        {
+            removed = num_units - at;
+        }
+        size_t added = edit_random(&rng) % 3;
+        if (num_units - removed + added > max_units || num_units - removed + added == 0)
+        {
+            continue;
+        }
+        memmove(units + at + added, units + at + removed, (num_units - at - removed) * sizeof(*units));
+        for (size_t i = 0; i < added; i++)
+        {
+            make_edit_unit(units[at + i], sizeof(units[0]), &rng, &next_id);
+        }
+        num_units = num_units - removed + added;
+
+        char* new_text = join_edit_units(units, num_units);
+        size_t old_len = sb_count(text) - 1;
+        size_t new_len = sb_count(new_text) - 1;
+        size_t prefix = 0;
+        while (prefix < old_len && prefix < new_len && text[prefix] == new_text[prefix])
+        {
+            prefix++;
+        }
+        size_t suffix = 0;
+        while (suffix < old_len - prefix && suffix < new_len - prefix && text[old_len - 1 - suffix] == new_text[new_len - 1 - suffix])
+        {
+            suffix++;
+        }
+        TomlEdit edit = { prefix, old_len - prefix - suffix, new_text + prefix, new_len - prefix - suffix };
+        assert(toml_edit_document(editable, edit));
+        sb_free(text);
+        text = new_text;
+
+        assert((size_t)sb_count(editable->text) == new_len && memcmp(editable->text, text, new_len) == 0);
+        TomlNodes* expected = parse_toml("full", text);
+        assert(toml_nodes_equal(editable->doc, expected));
+        toml_free_document(expected);
+    }
+
+    assert(num_rejected > 100);
+
+    // Changing one value in a large document only reparses its section
+    char* value = strstr(text + sb_count(text) / 2, " = ");
+    assert(value);
+    TomlEdit edit = { (size_t)(value - text) + 3, 0, "\"x\" # ", 6 };
+    toml_edit_document(editable, edit);
+    assert(editable->bytes_reparsed < (size_t)sb_count(text) / 10);
+
+    toml_free_editable(editable);
+    sb_free(text);
+    free(units);
+
+    // A long run of one-character edits stays incremental: each reparses a
+    // section or two, the arena grows by about that much and never forces a
+    // full parse, and rebuilding the tables for lookups doesn't add to it
+    const int num_tables = 5000;
+    char* big = NULL;
+    size_t* digits = (size_t*)malloc(num_tables * sizeof(size_t));
+    for (int i = 0; i < num_tables; i++)
+    {
+        char line[64];
+        int len = snprintf(line, sizeof(line), "[t%d]\nk = 0\ns = \"abc\"\n", i);
+        digits[i] = sb_count(big) + (strstr(line, "= 0") + 2 - line);
+        memcpy(sb_add(big, len), line, len);
+    }
+    editable = toml_new_editable("big", big, sb_count(big));
+    TomlNodes* doc = editable->doc;
+    size_t arena_start = doc->arena->bytes_allocated;
+    for (int i = 0; i < 1000; i++)
+    {
+        int table = (int)(edit_random(&rng) % num_tables);
+        char digit = (char)('0' + i % 10);
+        TomlEdit one = { digits[table], 1, &digit, 1 };
+        toml_edit_document(editable, one);
+        assert(editable->doc == doc && editable->bytes_reparsed < 256);
+        if (i % 50 == 0)
+        {
+            char path[32];
+            snprintf(path, sizeof(path), "t%d.k", table);
+            assert(toml_edit_lookup(editable, path)->value->int_val == i % 10);
+        }
+    }
+    assert(doc->arena->bytes_allocated - arena_start < 1000 * 512);
+    toml_free_editable(editable);
+    free(digits);
+    sb_free(big);
+}
+
+// Batched compiled queries find what toml_find_nodes finds, in the same order.
+void test_compiled_queries(TomlNodes* doc)
+{
+    const char* keys[] = { "test", "table", "float", "products", "bool", "boolean", "integer.key1",
+                           "products.name", "x.y", "fruit.variety.name", "fruit.physical.color", "nope",
+                           "table.inline.name", "fruit", "", ".", "x", "x.y.z", "fruit.physical", "table.subtable.key" };
+    const size_t num_keys = sizeof(keys) / sizeof(keys[0]);
+    // Enough copies of the keys that the batch's hashes spill to the heap
+    const size_t num_copies = 10;
+    const size_t num_queries = num_keys * num_copies;
+    TomlQuery* queries[num_queries];
+    TomlQueryMatch storage[num_queries][8];
+    TomlQueryResult results[num_queries];
+    for (size_t i = 0; i < num_queries; i++)
+    {
+        queries[i] = toml_compile_query(keys[i % num_keys]);
+        results[i].matches = storage[i];
+        results[i].max_matches = 8;
+    }
+    for (size_t batch_size = num_keys; batch_size <= num_queries; batch_size += num_queries - num_keys)
+    {
+        toml_find_batch(doc, queries, batch_size, results);
+        for (size_t i = 0; i < batch_size; i++)
+        {
+            TomlNodes* expected = toml_find_nodes(doc, keys[i % num_keys]);
+            assert(results[i].num_matches == expected->num_nodes);
+            for (size_t j = 0; j < expected->num_nodes; j++)
+            {
+                TomlNode* node = expected->nodes[j];
+                TomlQueryMatch* match = &results[i].matches[j];
+                if (node->kind == TOMLDECL_STMT)
+                {
+                    assert(match->stmt == node->stmt);
+                    if (match->node != node)
+                    {
+                        // Wrapper for a statement inside a table
+                        free(node);
+                    }
+                }
+                else
+                {
+                    assert(match->node == node && !match->stmt);
+                }
+            }
+            free(expected->nodes);
+            free(expected);
+        }
+    }
+    assert(results[1].num_matches == 3 && results[16].num_matches == 1 && results[19].num_matches == 1);
+
+    // Matches past the buffer are counted but not stored
+    TomlQueryMatch one[1] = {};
+    assert(toml_find_query(doc, queries[3], one, 1) == 3);
+    assert(one[0].node->kind == TOMLDECL_LIST);
+    assert(toml_find_query(doc, queries[3], NULL, 0) == 3);
+
+    for (size_t i = 0; i < num_queries; i++)
+    {
+        TOML_FREE(queries[i]);
+    }
+}
+
+// Walks everything the iterators can reach, returning a count so the walk
+// can't be optimized away.
+size_t walk_with_iterators(TomlNodes* doc, const char** keys, size_t num_keys)
+{
+    size_t visited = 0;
+    for (size_t i = 0; i < num_keys; i++)
+    {
+        TomlMatchIter match;
+        toml_match_begin(&match, doc, keys[i]);
+        while (toml_match_next(&match))
+        {
+            visited++;
+            if (match.stmt)
+            {
+                continue;
+            }
+            TomlStmtIter stmts;
+            toml_stmts_begin(&stmts, match.node);
+            while (toml_stmts_next(&stmts))
+            {
+                visited++;
+                TomlValue* value = stmts.stmt->value;
+                if (value->kind == TOMLVALUE_ARRAY)
+                {
+                    TomlArrayIter array;
+                    toml_array_begin(&array, value);
+                    while (toml_array_next(&array))
+                    {
+                        visited++;
+                    }
+                }
+                else if (value->kind == TOMLVALUE_INLINETABLE)
+                {
+                    TomlStmtIter entries;
+                    toml_inline_table_begin(&entries, value);
+                    while (toml_stmts_next(&entries))
+                    {
+                        visited++;
+                    }
+                }
+            }
+        }
+    }
+    return visited;
+}
+
+void test_iterators(TomlNodes* doc)
+{
+    const char* keys[] = { "test", "table", "float", "products", "bool", "boolean", "integer.key1",
+                           "products.name", "x.y", "fruit.variety.name", "fruit.physical.color", "nope",
+                           "table.inline.name", "array", "fruit", "" };
+    const size_t num_keys = sizeof(keys) / sizeof(keys[0]);
+    for (size_t i = 0; i < num_keys; i++)
+    {
+        TomlNodes* expected = toml_find_nodes(doc, keys[i]);
+        TomlMatchIter match;
+        toml_match_begin(&match, doc, keys[i]);
+        size_t num_matches = 0;
+        while (toml_match_next(&match))
+        {
+            assert(num_matches < expected->num_nodes);
+            TomlNode* node = expected->nodes[num_matches++];
+            assert(node->kind == TOMLDECL_STMT ? match.stmt == node->stmt : match.node == node && !match.stmt);
+        }
+        assert(num_matches == expected->num_nodes);
+        assert(!toml_match_next(&match));
+    }
+
+    TomlListIter products;
+    toml_list_begin(&products, doc, "products");
+    const char* names[] = { "Hammer", NULL, "Nail" };
+    size_t num_products = 0;
+    while (toml_list_next(&products))
+    {
+        TomlStmtIter stmts;
+        toml_stmts_begin(&stmts, products.node);
+        const char* name = NULL;
+        while (toml_stmts_next(&stmts))
+        {
+            if (strcmp(stmts.stmt->name, "name") == 0)
+            {
+                name = stmts.stmt->value->str_val;
+            }
+        }
+        assert(name ? strncmp(name, names[num_products], strlen(names[num_products])) == 0 : !names[num_products]);
+        num_products++;
+    }
+    assert(num_products == 3);
+
+    // The old API allocates on every lookup; the new ones never do.
+    size_t before = toml_malloc_calls;
+    toml_find_nodes(doc, "products.name");
+    assert(toml_malloc_calls > before);
+
+    TomlQuery* queries[num_keys];
+    for (size_t i = 0; i < num_keys; i++)
+    {
+        queries[i] = toml_compile_query(keys[i]);
+    }
+    TomlQueryMatch storage[num_keys][4];
+    TomlQueryResult results[num_keys];
+    for (size_t i = 0; i < num_keys; i++)
+    {
+        results[i].matches = storage[i];
+        results[i].max_matches = 4;
+    }
+
+    before = toml_malloc_calls;
+    size_t visited = walk_with_iterators(doc, keys, num_keys);
+    toml_list_begin(&products, doc, "fruit.variety");
+    while (toml_list_next(&products))
+    {
+        visited++;
+    }
+    toml_find_batch(doc, queries, num_keys, results);
+    assert(toml_malloc_calls == before);
+    assert(visited > 50);
+
+    for (size_t i = 0; i < num_keys; i++)
+    {
+        TOML_FREE(queries[i]);
+    }
+}
+
+bool key_tables_equal(const TomlKeyTable* a, const TomlKeyTable* b)
+{
+    if (a->num_entries != b->num_entries || a->origin != b->origin)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < a->num_entries; i++)
+    {
+        const TomlKeyEntry* x = &a->entries[i];
+        const TomlKeyEntry* y = &b->entries[i];
+        if (x->kind != y->kind || strcmp(x->name, y->name) != 0)
+        {
+            return false;
+        }
+        if (x->kind == TOMLKEY_VALUE && !toml_values_equal(x->value, y->value))
+        {
+            return false;
+        }
+        if (x->kind == TOMLKEY_TABLE && !key_tables_equal(x->table, y->table))
+        {
+            return false;
+        }
+        if (x->kind == TOMLKEY_LIST)
+        {
+            if (x->list->num_items != y->list->num_items)
+            {
+                return false;
+            }
+            for (size_t j = 0; j < x->list->num_items; j++)
+            {
+                if (!key_tables_equal(x->list->items[j], y->list->items[j]))
+                {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// Whether parsing src stops with an error, checked in a child process since
+// errors exit.
+bool parse_fails(const char* src)
+{
+#ifdef _WIN32
+    (void)src;
+    return true;
+#else
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0)
+    {
+        freopen("/dev/null", "w", stdout);
+        TomlNodes* doc = parse_toml("invalid", src);
+        toml_free_document(doc);
+        _exit(0);
+    }
+    int status;
+    waitpid(child, &status, 0);
+    return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+#endif
+}
+
+void test_key_tables(const char* buffer, TomlNodes* doc)
+{
+    const TomlKeyEntry* entry = toml_lookup(doc, "table.subtable.key");
+    assert(entry && entry->kind == TOMLKEY_VALUE && entry->value->str_len == 13);
+    assert(memcmp(entry->value->str_val, "another value", 13) == 0);
+    entry = toml_lookup(doc, "table.inline.name.first");
+    assert(entry && entry->kind == TOMLKEY_VALUE && memcmp(entry->value->str_val, "Tom", 3) == 0);
+    assert(toml_lookup(doc, "table.inline.name")->table->origin == TOMLTABLE_INLINE);
+    assert(toml_lookup(doc, "x.y.z.w")->kind == TOMLKEY_TABLE);
+    assert(toml_lookup(doc, "x.y")->table->origin == TOMLTABLE_IMPLICIT);
+    assert(toml_lookup(doc, "integer.key4")->value->int_val == -17);
+    assert(!toml_lookup(doc, "nope") && !toml_lookup(doc, "test.x") && !toml_lookup(doc, "table.nope"));
+
+    const TomlKeyEntry* products = toml_lookup(doc, "products");
+    assert(products->kind == TOMLKEY_LIST && products->list->num_items == 3);
+    assert(products->list->items[1]->num_entries == 0);
+    const TomlKeyEntry* fruit = toml_lookup(doc, "fruit");
+    assert(fruit->kind == TOMLKEY_LIST && fruit->list->num_items == 2);
+    const TomlKeyTable* apple = fruit->list->items[0];
+    assert(apple->num_entries == 3);
+    assert(toml_key_table_find(apple, toml_intern_find(doc->interns, "variety", 7, toml_hash("variety", 7)))->list->num_items == 2);
+    // Paths through a list continue into its last item
+    assert(toml_lookup(doc, "fruit.variety")->list->num_items == 1);
+    assert(memcmp(toml_lookup(doc, "fruit.name")->value->str_val, "banana", 6) == 0);
+
+    // Documents put together from pieces get the same tree
+#ifndef TOML_NO_THREADS
+    TomlThreadPool* pool = toml_new_thread_pool(3);
+    TomlNodes* parallel = toml_parse_parallel("parallel", buffer, strlen(buffer), pool, 64);
+    assert(key_tables_equal(parallel->root, doc->root));
+    toml_free_document(parallel);
+    toml_free_thread_pool(pool);
+#endif
+    TomlEditable* editable = toml_new_editable("editable", buffer, strlen(buffer));
+    toml_edit_key_tables(editable);
+    assert(key_tables_equal(editable->doc->root, doc->root));
+    TomlEdit edit = { 0, 0, "added.key = 1\n", 14 };
+    toml_edit_document(editable, edit);
+    assert(!editable->doc->root);
+    assert(toml_edit_lookup(editable, "added.key")->value->int_val == 1);
+    assert(toml_edit_lookup(editable, "added")->table->origin == TOMLTABLE_DOTTED);
+    TomlNodes* edited = parse_toml_buffer("edited", editable->text, sb_count(editable->text));
+    assert(key_tables_equal(editable->doc->root, edited->root));
+    toml_free_document(edited);
+    toml_free_editable(editable);
+
+    const char* valid[] = {
+        "[a.b]\n[a]\nx = 1",
+        "a.b = 1\na.c = 2\n[a.d]",
+        "[[f]]\n[f.p]\n[[f]]\n[f.p]",
+        "[[f]]\n[[f.v]]\n[[f.v]]",
+        "a = [ { b = 1 }, { b = 2 } ]",
+        "k0 = 0\nk1 = 1\nk2 = 2\nk3 = 3\nk4 = 4\nk5 = 5\nk6 = 6\nk7 = 7\nk8 = 8\nk9 = 9\nk10 = 10\nk11 = 11",
+    };
+    for (size_t i = 0; i < sizeof(valid) / sizeof(valid[0]); i++)
+    {
+        TomlNodes* parsed = parse_toml("valid", valid[i]);
+        toml_free_document(parsed);
+    }
+    TomlNodes* many = parse_toml("many", valid[5]);
+    assert(many->root->slots && toml_lookup(many, "k11")->value->int_val == 11 && !toml_lookup(many, "k12"));
+    toml_free_document(many);
+
+    const char* invalid[] = {
+        "a = 1\na = 2",
+        "k0 = 0\nk1 = 1\nk2 = 2\nk3 = 3\nk4 = 4\nk5 = 5\nk6 = 6\nk7 = 7\nk8 = 8\nk9 = 9\nk3 = 3",
+        "[t]\n[t]",
+        "a = 1\n[a]",
+        "[[a]]\n[a]",
+        "[a]\n[[a]]",
+        "a = { b = 1 }\n[a]",
+        "a = { b = 1 }\n[a.c]",
+        "a = [ 1 ]\n[[a]]",
+        "a.b = 1\n[a]",
+        "[a.b]\nx = 1\n[a]\nb.y = 2",
+        "x = { y = 1, y = 2 }",
+        "x = [ { y = 1, y = 2 } ]",
+        "a = 1\na.b = 2",
+        "a = { b = 1 }\na.c = 2",
+    };
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++)
+    {
+        assert(parse_fails(invalid[i]));
+    }
+    assert(!parse_fails(valid[0]));
+}
+
+// Arrays of one scalar kind are packed, everything else keeps a TomlValue
+// per element, and both read back the same.
+void test_packed_arrays()
+{
+    const char* src =
+        "floats = [ 1.5, -2.25, 3e10 ]\n"
+        "ints = [ 1, -2, 9223372036854775807 ]\n"
+        "bools = [ true, false, true, true, false, false, false, false, true, false ]\n"
+        "strs = [ \"a\", \"b\\tc\", \"\" ]\n"
+        "mixed = [ 1, 2.0 ]\n"
+        "nested = [ [ 1, 2 ], [ \"x\" ] ]\n"
+        "tables = [ { a = 1 }, { a = 2 } ]\n";
+    TomlNodes* doc = parse_toml("packed", src);
+    size_t count;
+
+    TomlValue* floats = toml_lookup(doc, "floats")->value;
+    const double* float_vals = toml_array_floats(floats, &count);
+    assert(floats->array_kind == TOMLVALUE_FLOAT && float_vals && count == 3);
+    assert(float_vals[0] == 1.5 && float_vals[1] == -2.25 && float_vals[2] == 3e10);
+    assert(!toml_array_ints(floats, &count) && !toml_array_bools(floats, &count) && !toml_array_strs(floats, &count));
+
+    TomlValue* ints = toml_lookup(doc, "ints")->value;
+    const long long* int_vals = toml_array_ints(ints, &count);
+    assert(int_vals && count == 3 && int_vals[0] == 1 && int_vals[1] == -2 && int_vals[2] == LLONG_MAX);
+
+    TomlValue* bools = toml_lookup(doc, "bools")->value;
+    const uint8_t* bits = toml_array_bools(bools, &count);
+    assert(bits && count == 10 && bits[0] == 0x0D && bits[1] == 0x01);
+    assert(toml_array_get(bools, 8).kind == TOMLVALUE_BOOL && toml_array_get(bools, 8).bool_val);
+    assert(!toml_array_get(bools, 9).bool_val);
+
+    TomlValue* strs = toml_lookup(doc, "strs")->value;
+    const TomlStr* str_vals = toml_array_strs(strs, &count);
+    assert(str_vals && count == 3 && str_vals[1].len == 3 && memcmp(str_vals[1].str, "b\tc", 3) == 0 && str_vals[2].len == 0);
+    TomlValue str = toml_array_get(strs, 0);
+    assert(str.kind == TOMLVALUE_STR && str.str_len == 1 && str.str_val[0] == 'a');
+
+    TomlValue* mixed = toml_lookup(doc, "mixed")->value;
+    assert(mixed->array_kind == TOMLVALUE_NONE && !toml_array_ints(mixed, &count) && !toml_array_floats(mixed, &count));
+    // Non-arrays and arrays of another kind report no elements
+    count = 99;
+    assert(!toml_array_ints(mixed, &count) && count == 0);
+    count = 99;
+    assert(!toml_array_strs(&str, &count) && count == 0);
+    count = 99;
+    assert(!toml_array_bools(toml_lookup(doc, "floats")->value, &count) && count == 0);
+    assert(mixed->array_vals[0]->int_val == 1 && mixed->array_vals[1]->float_val == 2.0);
+    TomlValue* nested = toml_lookup(doc, "nested")->value;
+    assert(nested->array_kind == TOMLVALUE_NONE && nested->num_array_vals == 2);
+    assert(nested->array_vals[0]->array_kind == TOMLVALUE_INT && nested->array_vals[1]->array_kind == TOMLVALUE_STR);
+    TomlValue* tables = toml_lookup(doc, "tables")->value;
+    assert(tables->array_kind == TOMLVALUE_NONE && tables->array_vals[1]->kind == TOMLVALUE_INLINETABLE);
+
+    // The iterator reads packed elements too
+    TomlArrayIter iter;
+    double sum = 0;
+    for (toml_array_begin(&iter, floats); toml_array_next(&iter);)
+    {
+        assert(iter.value->kind == TOMLVALUE_FLOAT);
+        sum += iter.value->float_val;
+    }
+    assert(sum == 1.5 - 2.25 + 3e10);
+    toml_free_document(doc);
+
+    // A big float array costs about a double per element
+    const size_t num_floats = 100000;
+    char* big = NULL;
+    sb_add(big, 10);
+    memcpy(big, "weights = ", 10);
+    sb_push(big, '[');
+    for (size_t i = 0; i < num_floats; i++)
+    {
+        char num[32];
+        int len = snprintf(num, sizeof(num), "%zu.5, ", i);
+        memcpy(sb_add(big, len), num, len);
+    }
+    sb_push(big, ']');
+    sb_push(big, '\n');
+    doc = parse_toml_buffer("big", big, sb_count(big));
+    const double* weights = toml_array_floats(toml_lookup(doc, "weights")->value, &count);
+    assert(weights && count == num_floats && weights[num_floats - 1] == num_floats - 1 + 0.5);
+    assert(doc->arena->bytes_allocated < num_floats * sizeof(double) + 4096);
+    toml_free_document(doc);
+    sb_free(big);
+}
+
+struct ServerSchema {
+    TomlStr host;
+    int port;
+    double timeout;
+    float ratio;
+    long long max_bytes;
+    bool verbose;
+    TomlStr user;
+    int retries;
+    bool tls;
+    int workers;
+};
+
+TOML_SCHEMA(ServerSchema,
+    TOML_FIELD(ServerSchema, "server.host", host),
+    TOML_FIELD(ServerSchema, "server.port", port),
+    TOML_OPTIONAL(ServerSchema, "server.timeout", timeout),
+    TOML_OPTIONAL(ServerSchema, "server.ratio", ratio),
+    TOML_FIELD(ServerSchema, "limits.max_bytes", max_bytes),
+    TOML_OPTIONAL(ServerSchema, "verbose", verbose),
+    TOML_FIELD(ServerSchema, "server.auth.user", user),
+    TOML_OPTIONAL(ServerSchema, "server.auth.retries", retries),
+    TOML_OPTIONAL(ServerSchema, "tls", tls),
+    TOML_OPTIONAL(ServerSchema, "pool.workers", workers));
+
+// Scalar keys bound to elements of array members
+struct RangeSchema {
+    int limits[2];
+    double weights[3];
+};
+
+TOML_SCHEMA(RangeSchema,
+    TOML_FIELD(RangeSchema, "limits.first", limits[0]),
+    TOML_FIELD(RangeSchema, "limits.last", limits[1]),
+    TOML_OPTIONAL(RangeSchema, "weights.a", weights[0]),
+    TOML_OPTIONAL(RangeSchema, "weights.c", weights[2]));
+
+// Enough fields to need several displacements
+struct WideSchema {
+    int v0;
+    int v1;
+    int v2;
+    int v3;
+    int v4;
+    int v5;
+    int v6;
+    int v7;
+    int v8;
+    int v9;
+    int v10;
+    int v11;
+    int v12;
+    int v13;
+    int v14;
+    int v15;
+    int v16;
+    int v17;
+    int v18;
+    int v19;
+    int v20;
+    int v21;
+    int v22;
+    int v23;
+    int v24;
+    int v25;
+    int v26;
+    int v27;
+    int v28;
+    int v29;
+    int v30;
+    int v31;
+    int v32;
+    int v33;
+    int v34;
+    int v35;
+    int v36;
+    int v37;
+    int v38;
+    int v39;
+    int v40;
+    int v41;
+    int v42;
+    int v43;
+    int v44;
+    int v45;
+    int v46;
+    int v47;
+};
+
+TOML_SCHEMA(WideSchema,
+    TOML_FIELD(WideSchema, "group0.k0", v0),
+    TOML_FIELD(WideSchema, "group1.k1", v1),
+    TOML_FIELD(WideSchema, "group2.k2", v2),
+    TOML_FIELD(WideSchema, "group3.k3", v3),
+    TOML_FIELD(WideSchema, "group0.k4", v4),
+    TOML_FIELD(WideSchema, "group1.k5", v5),
+    TOML_FIELD(WideSchema, "group2.k6", v6),
+    TOML_FIELD(WideSchema, "group3.k7", v7),
+    TOML_FIELD(WideSchema, "group0.k8", v8),
+    TOML_FIELD(WideSchema, "group1.k9", v9),
+    TOML_FIELD(WideSchema, "group2.k10", v10),
+    TOML_FIELD(WideSchema, "group3.k11", v11),
+    TOML_FIELD(WideSchema, "group0.k12", v12),
+    TOML_FIELD(WideSchema, "group1.k13", v13),
+    TOML_FIELD(WideSchema, "group2.k14", v14),
+    TOML_FIELD(WideSchema, "group3.k15", v15),
+    TOML_FIELD(WideSchema, "group0.k16", v16),
+    TOML_FIELD(WideSchema, "group1.k17", v17),
+    TOML_FIELD(WideSchema, "group2.k18", v18),
+    TOML_FIELD(WideSchema, "group3.k19", v19),
+    TOML_FIELD(WideSchema, "group0.k20", v20),
+    TOML_FIELD(WideSchema, "group1.k21", v21),
+    TOML_FIELD(WideSchema, "group2.k22", v22),
+    TOML_FIELD(WideSchema, "group3.k23", v23),
+    TOML_FIELD(WideSchema, "group0.k24", v24),
+    TOML_FIELD(WideSchema, "group1.k25", v25),
+    TOML_FIELD(WideSchema, "group2.k26", v26),
+    TOML_FIELD(WideSchema, "group3.k27", v27),
+    TOML_FIELD(WideSchema, "group0.k28", v28),
+    TOML_FIELD(WideSchema, "group1.k29", v29),
+    TOML_FIELD(WideSchema, "group2.k30", v30),
+    TOML_FIELD(WideSchema, "group3.k31", v31),
+    TOML_FIELD(WideSchema, "group0.k32", v32),
+    TOML_FIELD(WideSchema, "group1.k33", v33),
+    TOML_FIELD(WideSchema, "group2.k34", v34),
+    TOML_FIELD(WideSchema, "group3.k35", v35),
+    TOML_FIELD(WideSchema, "group0.k36", v36),
+    TOML_FIELD(WideSchema, "group1.k37", v37),
+    TOML_FIELD(WideSchema, "group2.k38", v38),
+    TOML_FIELD(WideSchema, "group3.k39", v39),
+    TOML_FIELD(WideSchema, "group0.k40", v40),
+    TOML_FIELD(WideSchema, "group1.k41", v41),
+    TOML_FIELD(WideSchema, "group2.k42", v42),
+    TOML_FIELD(WideSchema, "group3.k43", v43),
+    TOML_FIELD(WideSchema, "group0.k44", v44),
+    TOML_FIELD(WideSchema, "group1.k45", v45),
+    TOML_FIELD(WideSchema, "group2.k46", v46),
+    TOML_FIELD(WideSchema, "group3.k47", v47));
+
+intern bool report_has(char** keys, const char* key)
+{
+    for (int i = 0; i < sb_count(keys); i++)
+    {
+        if (strcmp(keys[i], key) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Decoding into structs through compile-time schemas.
+// As parse_fails, for decoding src into a ServerSchema.
+bool decode_fails(const char* src)
+{
+#ifdef _WIN32
+    (void)src;
+    return true;
+#else
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0)
+    {
+        freopen("/dev/null", "w", stdout);
+        ServerSchema config = {};
+        TomlDecodeReport report;
+        TomlArena arena = {};
+        toml_decode("invalid", src, strlen(src), &config, &report, &arena);
+        toml_free_decode_report(&report);
+        toml_arena_free(&arena);
+        _exit(0);
+    }
+    int status;
+    waitpid(child, &status, 0);
+    return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+#endif
+}
+
+void test_schema_binding()
+{
+    static_assert(toml_field("server.port", TOMLFIELD_INT, 0, true).hash == toml_hash("server.port", 11), "hashed at compile time");
+
+    const char* src =
+        "verbose = true\n"
+        "pool.workers = 8\n"
+        "[server]\n"
+        "host = \"example.com\"\n"
+        "port = 8080\n"
+        "timeout = 2\n"
+        "ratio = 0.5\n"
+        "auth = { user = \"admin\", retries = 3 }\n"
+        "[limits]\n"
+        "max_bytes = 9000000000\n";
+    TomlArena* arena = toml_new_arena();
+    ServerSchema config = {};
+    config.retries = -1;
+    TomlDecodeReport report;
+    assert(toml_decode("schema", src, strlen(src), &config, &report, arena));
+    assert(config.host.len == 11 && memcmp(config.host.str, "example.com", 11) == 0);
+    assert(config.port == 8080 && config.timeout == 2.0 && config.ratio == 0.5f && config.max_bytes == 9000000000ll);
+    assert(config.verbose && !config.tls && config.workers == 8 && config.retries == 3);
+    assert(config.user.len == 5 && memcmp(config.user.str, "admin", 5) == 0);
+    toml_free_decode_report(&report);
+
+    // Defaults survive, and everything wrong is reported
+    const char* bad =
+        "tls = 1\n"
+        "extra = \"x\"\n"
+        "[server]\n"
+        "host = \"h\"\n"
+        "port = 4294967296\n"
+        "hosts = [ \"a\", \"b\" ]\n"
+        "timeout = [ 1.0 ]\n"
+        "auth.user = \"root\"\n"
+        "[[limits]]\n"
+        "max_bytes = 1\n";
+    ServerSchema partial = {};
+    partial.timeout = 30.0;
+    assert(!toml_decode("schema", bad, strlen(bad), &partial, &report, arena));
+    assert(partial.host.len == 1 && partial.timeout == 30.0 && !partial.tls);
+    assert(partial.user.len == 4 && memcmp(partial.user.str, "root", 4) == 0);
+    assert(sb_count(report.unknown) == 3 && report_has(report.unknown, "extra"));
+    assert(report_has(report.unknown, "server.hosts") && report_has(report.unknown, "limits.max_bytes"));
+    assert(sb_count(report.mismatched) == 3 && report_has(report.mismatched, "tls"));
+    assert(report_has(report.mismatched, "server.port") && report_has(report.mismatched, "server.timeout"));
+    assert(sb_count(report.missing) == 1 && strcmp(report.missing[0], "limits.max_bytes") == 0);
+    toml_free_decode_report(&report);
+
+    // Array members are filled element by element from scalar keys, while an
+    // array value is still a mismatch
+    const char* range_src = "limits = { first = 1, last = 9 }\n[weights]\na = 0.5\nc = [ 1.0 ]\n";
+    RangeSchema range = {};
+    range.weights[1] = 2.0;
+    assert(!toml_decode("range", range_src, strlen(range_src), &range, &report));
+    assert(range.limits[0] == 1 && range.limits[1] == 9);
+    assert(range.weights[0] == 0.5 && range.weights[1] == 2.0 && range.weights[2] == 0.0);
+    assert(sb_count(report.mismatched) == 1 && report_has(report.mismatched, "weights.c"));
+    assert(sb_count(report.unknown) == 0 && sb_count(report.missing) == 0);
+    toml_free_decode_report(&report);
+
+    // Every one of a larger schema's keys finds its own field
+    char* wide_src = NULL;
+    for (int group = 0; group < 4; group++)
+    {
+        char line[64];
+        int len = snprintf(line, sizeof(line), "[group%d]\n", group);
+        memcpy(sb_add(wide_src, len), line, len);
+        for (int i = group; i < 48; i += 4)
+        {
+            len = snprintf(line, sizeof(line), "k%d = %d\n", i, i * 10);
+            memcpy(sb_add(wide_src, len), line, len);
+        }
+    }
+    WideSchema wide = {};
+    assert(toml_decode("wide", wide_src, sb_count(wide_src), &wide, &report));
+    const int* wide_vals = &wide.v0;
+    for (int i = 0; i < 48; i++)
+    {
+        assert(wide_vals[i] == i * 10);
+    }
+    sb_free(wide_src);
+
+    // Whatever parse_toml rejects as redefined, decoding rejects too
+    const char* redefined[] = {
+        "[server]\nport = 1\nport = 2\n[server]\nport = 3\n",
+        "[server]\nport = 1\n[server]\n",
+        "verbose = true\nverbose = false\n",
+        "[server]\nauth = { user = \"a\", user = \"b\" }\n",
+        "[server]\nauth = { user = \"a\" }\nauth.retries = 1\n",
+        "[server]\nlist = [ { a = 1, a = 2 } ]\n",
+        "[server.host]\n[server]\nhost = \"h\"\n",
+        "[[limits]]\n[limits]\n",
+    };
+    for (size_t i = 0; i < sizeof(redefined) / sizeof(redefined[0]); i++)
+    {
+        assert(parse_fails(redefined[i]) && decode_fails(redefined[i]));
+    }
+    const char* redefinable = "[server.auth]\nuser = \"a\"\n[server]\nport = 1\n[[limits]]\n[[limits]]\nlist = [ { a = 1 }, { a = 2 } ]\n";
+    assert(!parse_fails(redefinable) && !decode_fails(redefinable));
+    toml_arena_free(arena);
+}
+
+#ifdef TOML_STATIC_PARSE
+// test.toml without most of its comments, parsed while compiling.
+global TOML_STATIC_DOCUMENT(static_test_doc, R"(
+test = true
+[table]
+key = "value" # Yeah, you can do this.
+[table.subtable]
+key = "another value"
+[x.y.z.w] # for this to work
+[table.inline]
+name = { first = "Tom", last = "Preston-Werner" }
+point = { x = 1, y = 2 }
+[integer]
+key1 = +99
+key2 = 42
+key3 = 0
+key4 = -17
+[integer.underscores]
+key1 = 1_000
+key2 = 5_349_221
+key3 = 1_2_3_4_5     # valid but inadvisable
+[float.fractional]
+key1 = +1.0
+key2 = 3.1415
+key3 = -0.01
+[float.exponent]
+key1 = 5e+22
+key2 = 1e6
+key3 = -2E-2
+[float.both]
+key = 6.626e-34
+[float.underscores]
+key1 = 9_224_617.445_991_228_313
+key2 = 1e1_000
+[boolean]
+True = true
+False = false
+#[datetime]
+#key1 = 1979-05-27T07:32:00Z
+[array]
+key1 = [ 1, 2, 3 ]
+key2 = [ "red", "yellow", "green" ]
+key3 = [ [ 1, 2 ], [3, 4, 5] ]
+key4 = [ [ 1, 2 ], ["a", "b", "c"] ] # this is ok
+key5 = [
+  1, 2, 3
+]
+key6 = [
+  1,
+  2, # this is ok
+]
+[[products]]
+name = "Hammer"
+sku = 738594937
+[[products]]
+[[products]]
+name = "Nail"
+sku = 284758393
+color = "gray"
+[[fruit]]
+  name = "apple"
+  [fruit.physical]
+    color = "red"
+    shape = "round"
+  [[fruit.variety]]
+    name = "red delicious"
+  [[fruit.variety]]
+    name = "granny smith"
+[[fruit]]
+  name = "banana"
+  [[fruit.variety]]
+    name = "plantain"
+)");
+
+global constexpr char static_literals_src[] = R"(
+hex = 0xFF_FF
+zero = -0
+mode = 0o755
+mask = 0b1010
+min = -9223372036854775808
+avogadro = 6.02214076e23
+long = 3.14159265358979323846264338327950288
+tiny = 5e-324
+specials = [ inf, -inf, nan, +nan ]
+escaped = "tab\there \"quoted\" \x41\x7e\\"
+text = """
+one
+two"""
+flags = [ true, false, true, true, false, false, true, false, true ]
+names = [ "a", "b\n", "" ]
+mixed = [ 1, "two", [ 3.0 ], { four = 4 } ]
+owner = { name = "Tom", dob = { year = 1979 } }
+)";
+
+global TOML_STATIC_DOCUMENT(static_literals, static_literals_src);
+
+// Enough keys in one table for it to be hashed, into more than the first
+// 32 slots.
+global constexpr char static_wide_src[] = R"(
+[wide]
+k0 = 0
+k1 = 1
+k2 = 2
+k3 = 3
+k4 = 4
+k5 = 5
+k6 = 6
+k7 = 7
+k8 = 8
+k9 = 9
+k10 = 10
+k11 = 11
+k12 = 12
+k13 = 13
+k14 = 14
+k15 = 15
+k16 = 16
+k17 = 17
+k18 = 18
+k19 = 19
+a.b.c = 20
+)";
+
+global TOML_STATIC_DOCUMENT(static_wide, static_wide_src);
+
+// Sizing is exact for what the lexer can tell apart.
+static_assert(toml_static_caps(static_literals_src).stmts == 19);
+static_assert(toml_static_caps(static_literals_src).tables == 0 && toml_static_caps(static_literals_src).lists == 0);
+static_assert(toml_static_caps("[a]\n[[b]]\nc = [ [ 1 ] ]\n").tables == 1 &&
+              toml_static_caps("[a]\n[[b]]\nc = [ [ 1 ] ]\n").lists == 1);
+
+// Documents parsed at compile time come out as parse_toml makes them, names
+// interned and arrays packed, so lookups run on them as they are.
+void test_static_document(TomlNodes* expected)
+{
+    TomlNodes* doc = &static_test_doc.doc;
+    assert(toml_nodes_equal(doc, expected));
+    assert(!doc->arena && doc->root && doc->interns);
+    assert(key_tables_equal(doc->root, expected->root));
+    const char* paths[] = { "test", "table.subtable.key", "x.y.z", "table.inline.name.last", "products.sku", "fruit.variety.name", "fruit.name" };
+    for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++)
+    {
+        const TomlKeyEntry* entry = toml_lookup(doc, paths[i]);
+        const TomlKeyEntry* parsed_entry = toml_lookup(expected, paths[i]);
+        assert(entry && parsed_entry && entry->kind == parsed_entry->kind && strcmp(entry->name, parsed_entry->name) == 0);
+    }
+    assert(toml_lookup(doc, "table.inline.name.last")->value->kind == TOMLVALUE_STR);
+    assert(!toml_lookup(doc, "table.nope") && !toml_lookup(doc, "test.nope") && !toml_lookup(doc, "fruit.physical"));
+    test_compiled_queries(doc);
+    test_iterators(doc);
+    const char* keys[] = { "test", "table", "products.name", "x.y", "fruit.variety.name", "table.inline.name", "nope" };
+    for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+    {
+        TomlNodes* by_string = toml_find_nodes(doc->nodes, doc->num_nodes, keys[i]);
+        TomlNodes* interned = toml_find_nodes(doc, keys[i]);
+        assert(toml_nodes_equal(by_string, interned) && toml_nodes_equal(interned, toml_find_nodes(expected, keys[i])));
+    }
+    TomlNodes* names = toml_find_nodes(doc, "products.name");
+    assert(names->num_nodes == 2 && names->nodes[0]->stmt->name == names->nodes[1]->stmt->name);
+    assert(toml_intern_find(doc->interns, "name", 4, toml_hash("name", 4)) == names->nodes[0]->stmt->name);
+    assert(toml_name_len(names->nodes[0]->stmt->name) == 4 && toml_name_hash(names->nodes[0]->stmt->name) == toml_hash("name", 4));
+
+    TomlNodes* literals = &static_literals.doc;
+    TomlNodes* parsed = parse_toml("literals", static_literals_src);
+    assert(toml_nodes_equal(literals, parsed));
+    assert(key_tables_equal(literals->root, parsed->root));
+    assert(toml_lookup(literals, "owner.dob.year")->value->int_val == 1979);
+    TomlNodes* found = toml_find_nodes(literals, "hex");
+    assert(found->num_nodes == 1 && found->nodes[0]->stmt->value->int_val == 0xFFFF);
+    found = toml_find_nodes(literals, "min");
+    assert(found->nodes[0]->stmt->value->int_val == LLONG_MIN);
+    found = toml_find_nodes(literals, "tiny");
+    assert(found->nodes[0]->stmt->value->float_val == 5e-324);
+    found = toml_find_nodes(literals, "escaped");
+    assert(toml_str_is(found->nodes[0]->stmt->value, "tab\there \"quoted\" A~\\"));
+    found = toml_find_nodes(literals, "text");
+    assert(toml_str_is(found->nodes[0]->stmt->value, "\none\ntwo"));
+
+    size_t count;
+    found = toml_find_nodes(literals, "specials");
+    const double* specials = toml_array_floats(found->nodes[0]->stmt->value, &count);
+    assert(specials && count == 4 && specials[0] == HUGE_VAL && specials[1] == -HUGE_VAL && isnan(specials[2]) && isnan(specials[3]));
+    found = toml_find_nodes(literals, "flags");
+    const uint8_t* bits = toml_array_bools(found->nodes[0]->stmt->value, &count);
+    assert(bits && count == 9 && bits[0] == 0x4D && bits[1] == 0x01);
+    found = toml_find_nodes(literals, "names");
+    const TomlStr* strs = toml_array_strs(found->nodes[0]->stmt->value, &count);
+    assert(strs && count == 3 && strs[1].len == 2 && strs[1].str[1] == '\n' && strs[2].len == 0);
+    found = toml_find_nodes(literals, "mixed");
+    assert(found->nodes[0]->stmt->value->array_kind == TOMLVALUE_NONE);
+    TomlValue table = toml_array_get(found->nodes[0]->stmt->value, 3);
+    assert(table.kind == TOMLVALUE_INLINETABLE && table.table_nodes->nodes[0]->stmt->value->int_val == 4);
+    // Node lists found by key have no key tables to look in.
+    assert(!found->root && !toml_lookup(found, "mixed"));
+    toml_free_document(parsed);
+
+    TomlNodes* wide = &static_wide.doc;
+    parsed = parse_toml("wide", static_wide_src);
+    assert(key_tables_equal(wide->root, parsed->root));
+    const TomlKeyTable* wide_table = toml_lookup(wide, "wide")->table;
+    assert(wide_table->num_slots == 64 && wide_table->num_slots == toml_lookup(parsed, "wide")->table->num_slots);
+    assert(memcmp(wide_table->slots, toml_lookup(parsed, "wide")->table->slots, 64 * sizeof(uint32_t)) == 0);
+    for (int i = 0; i < 20; i++)
+    {
+        char path[16];
+        snprintf(path, sizeof(path), "wide.k%d", i);
+        assert(toml_lookup(wide, path)->value->int_val == i);
+    }
+    assert(toml_lookup(wide, "wide.a.b.c")->value->int_val == 20 && !toml_lookup(wide, "wide.k20"));
+    toml_free_document(parsed);
+}
+#endif
+
+#ifdef TOML_STATS
+// Stats add up to what a parse and a few lookups can be seen doing from
+// outside, and nothing is recorded once they're uninstalled.
+void test_stats(const char* buffer)
+{
+    size_t tokens[TOML_STATS_MAX_TOKEN_KINDS] = {};
+    TomlArena* arena = toml_new_arena();
+    TomlParseContext ctx;
+    toml_init_context(&ctx, "stats", buffer, strlen(buffer), arena);
+    do
+    {
+        next_token(&ctx);
+        tokens[ctx.token.kind]++;
+    } while (!is_token(&ctx, TOKEN_EOF));
+    toml_release_context(&ctx);
+    toml_arena_free(arena);
+
+    TomlStats stats = {};
+    assert(toml_set_stats(&stats) == NULL);
+    size_t mallocs = toml_malloc_calls;
+    TomlNodes* doc = parse_toml("stats", buffer);
+    assert(stats.num_mallocs == toml_malloc_calls - mallocs);
+    assert(stats.parses == 1 && stats.bytes_parsed == strlen(buffer));
+    assert(stats.arena_bytes > 0 && stats.arena_bytes <= doc->arena->bytes_allocated);
+    assert(memcmp(stats.tokens, tokens, sizeof(tokens)) == 0);
+    assert(stats.max_depth == 2);
+    assert(stats.lex_ticks >= stats.string_ticks + stats.number_ticks);
+    assert(stats.parse_ticks >= stats.lex_ticks + stats.build_ticks && stats.build_ticks > 0);
+
+    toml_find_nodes(doc->nodes, doc->num_nodes, "products.name");
+    toml_find_nodes(doc, "table");
+    toml_find_nodes(doc, "nope");
+    assert(stats.lookups == 3 && stats.lookup_hits == 2 && stats.lookup_matches == 5);
+    toml_print_stats(&stats, stdout);
+
+    TomlStats before = stats;
+    assert(toml_set_stats(NULL) == &stats);
+    toml_free_document(parse_toml("stats", buffer));
+    toml_find_nodes(doc, "table");
+    assert(memcmp(&before, &stats, sizeof(stats)) == 0);
+    toml_free_document(doc);
+}
+#endif
+
 int main(int argc, char** argv)
 {
     char* buffer;
-    FILE* file = fopen(".\\test.toml", "r");
+    FILE* file = fopen("test.toml", "r");
     fseek(file, 0, SEEK_END);
     long end = ftell(file);
     fseek(file, 0, SEEK_SET);
 
-    buffer = (char*)malloc(end);
+    buffer = (char*)malloc(end + 1);
     size_t len = fread(buffer, 1, end, file);
     buffer[len] = 0;
 	
 	TomlNodes* nodes = parse_toml("blah", buffer);
 
-    for (int i = 0; i < nodes->num_nodes; i++)
+    for (size_t i = 0; i < nodes->num_nodes; i++)
     {
         TomlNode* node = nodes->nodes[i];
         print_toml_node(node);
@@ -171,5 +2632,85 @@ int main(int argc, char** argv)
     results = toml_find_nodes(nodes->nodes, nodes->num_nodes, "products.name");
     assert(results->num_nodes == 2);
 
+    // Interned lookups agree with the string matching for these keys
+    const char* keys[] = { "test", "table", "float", "products", "bool", "boolean", "integer.key1",
+                           "products.name", "x.y", "fruit.variety.name", "fruit.physical.color", "nope" };
+    for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+    {
+        TomlNodes* expected = toml_find_nodes(nodes->nodes, nodes->num_nodes, keys[i]);
+        TomlNodes* found = toml_find_nodes(nodes, keys[i]);
+        assert(found->num_nodes == expected->num_nodes);
+        for (size_t j = 0; j < found->num_nodes; j++)
+        {
+            TomlNode* a = found->nodes[j];
+            TomlNode* b = expected->nodes[j];
+            assert(a->kind == b->kind && (a->kind == TOMLDECL_STMT ? a->stmt == b->stmt : a == b));
+        }
+    }
+    // Repeated keys share one copy
+    TomlNodes* names = toml_find_nodes(nodes, "products.name");
+    assert(names->nodes[0]->stmt->name == names->nodes[1]->stmt->name);
+    assert(toml_intern_find(nodes->interns, "name", 4, toml_hash("name", 4)) == names->nodes[0]->stmt->name);
+    // Keys with more dots than fit on the stack still split at every dot
+    char deep_src[256];
+    char deep_key[256];
+    char* deep_end = deep_src + sprintf(deep_src, "[t");
+    for (int i = 0; i < TOML_MAX_KEY_DOTS + 8; i++)
+    {
+        deep_end += sprintf(deep_end, ".t");
+    }
+    sprintf(deep_end, "]\nk = 1\n");
+    sprintf(deep_key, "%.*s.k", (int)(deep_end - deep_src - 1), deep_src + 1);
+    TomlNodes* deep = parse_toml("deep", deep_src);
+    TomlNodes* deep_found = toml_find_nodes(deep, deep_key);
+    assert(deep_found->num_nodes == 1 && deep_found->nodes[0]->kind == TOMLDECL_STMT);
+    assert(toml_find_nodes(deep->nodes, deep->num_nodes, deep_key)->num_nodes == 1);
+    toml_free_document(deep);
+
+    TomlIndex* index = toml_build_index(nodes);
+    const char* index_keys[] = { "test", "table", "float", "products", "bool", "boolean",
+                                 "integer.key1", "products.name", "x.y", "fruit.variety.name", "nope" };
+    for (size_t i = 0; i < sizeof(index_keys) / sizeof(index_keys[0]); i++)
+    {
+        check_index_matches(index, nodes, index_keys[i]);
+    }
+    assert(toml_index_find(index, "table")->num_nodes == 3);
+    assert(toml_index_find(index, "products.name")->num_nodes == 2);
+
+    test_concurrent_parse(buffer, nodes);
+    test_simd_skipping(buffer, nodes);
+    test_strings();
+    test_floats();
+    test_ints();
+    test_unterminated_input(buffer);
+    test_recoverable_errors();
+    test_events(buffer, nodes);
+    test_stream(buffer);
+    test_parallel_parse(buffer, nodes);
+    test_structural_index(buffer, nodes);
+    test_parse_file(nodes);
+    test_snapshot(nodes, index);
+    test_shared_document(nodes, index);
+    test_hot_reload(buffer);
+    test_incremental_reparse();
+    test_compiled_queries(nodes);
+    test_iterators(nodes);
+    test_key_tables(buffer, nodes);
+    test_packed_arrays();
+    test_schema_binding();
+#ifdef TOML_STATIC_PARSE
+    test_static_document(nodes);
+#endif
+#ifdef TOML_STATS
+    test_stats(buffer);
+#endif
+
+    // The whole document should come out of a couple of arena chunks rather
+    // than one malloc per node.
+    TomlArena* arena = nodes->arena;
+    assert(arena->num_chunks <= 2);
+    assert(arena->num_allocs > 100 * arena->num_chunks);
+    toml_free_document(nodes);
+
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,912 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdarg.h>
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+
+#include <atomic>
+#include <chrono>
+
+#define global static
+#define local_persist static
+#define intern static
+
+#ifndef IS_SPACE
+#define IS_SPACE(c) ((c) == ' ' || (c) == '\n' || (c) == '\t' || (c) == '\r' || (c) == '\v')
+#endif
+#ifndef IS_DIGIT
+#define IS_DIGIT(c) ('0' <= (c) && (c) <= '9')
+#endif
+#ifndef IS_ALPHA
+#define IS_ALPHA(c) (('a' <= (c) && (c) <= 'z') || ('A' <= (c) && (c) <= 'Z'))
+#endif
+#ifndef IS_ALNUM
+#define IS_ALNUM(c) (IS_DIGIT(c) || IS_ALPHA(c))
+#endif
+#ifndef TO_LOWER
+#define TO_LOWER(c) (('A' <= (c) && (c) <= 'Z') ? (c) + ('a' - 'A') : (c))
+#endif
+
+intern void error(const char* buf)
+{
+	printf("Error: %s\n", buf);
+	exit(1);
+}
+
+global std::atomic<size_t> toml_malloc_calls;
+
+intern void* counting_malloc(size_t size)
+{
+    toml_malloc_calls++;
+    return malloc(size);
+}
+
+#define TOML_MALLOC(s) counting_malloc(s)
+#define TOML_ALLOC(t) (t*)TOML_MALLOC(sizeof(t))
+
+#include "stretchy_buffer.h"
+#include "toml_parser.h"
+
+#ifdef _WIN32
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#include <sys/wait.h>
+#endif
+
+/*
+Benchmarks for the parser and everything built on it. Each corpus is
+generated to roughly --size megabytes so runs are comparable across
+versions, and every measurement is appended to one flat list of
+(group, name, metric, value) records, which is printed as a table and can be
+written as JSON with --json for tracking over time.
+
+Timings are the best of several runs of at least TOML_BENCH_MIN_TIME
+seconds in total. Allocation counts are TOML_MALLOC calls; stretchy buffers
+used while parsing go through realloc and aren't counted.
+*/
+
+#define TOML_BENCH_MIN_TIME 0.25
+#define TOML_BENCH_MIN_RUNS 3
+
+struct BenchRecord {
+    const char* group;
+    char name[64];
+    const char* metric;
+    double value;
+};
+
+global BenchRecord* bench_records;  // Stretchy buffer
+
+intern void bench_record(const char* group, const char* metric, double value, const char* fmt, ...)
+{
+    BenchRecord record = {};
+    record.group = group;
+    record.metric = metric;
+    record.value = value;
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(record.name, sizeof(record.name), fmt, args);
+    va_end(args);
+    sb_push(bench_records, record);
+    printf("  %-12s %-36s %14.3f %s\n", group, record.name, value, metric);
+    fflush(stdout);
+}
+
+intern double bench_now()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Runs fn until enough time has passed and returns the fastest run, in seconds.
+template <typename Fn>
+intern double bench_best(Fn fn)
+{
+    double best = 1e30;
+    double start = bench_now();
+    for (int runs = 0; runs < TOML_BENCH_MIN_RUNS || bench_now() - start < TOML_BENCH_MIN_TIME; runs++)
+    {
+        double t = bench_now();
+        fn();
+        t = bench_now() - t;
+        best = t < best ? t : best;
+    }
+    return best;
+}
+
+/* Memory */
+
+// Peak resident set of the process so far, in kilobytes.
+intern size_t bench_peak_rss_kb()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+    return counters.PeakWorkingSetSize / 1024;
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return (size_t)usage.ru_maxrss / 1024;
+#else
+    return (size_t)usage.ru_maxrss;
+#endif
+#endif
+}
+
+#ifdef __linux__
+// A "Field:   123 kB" line from a /proc file, or 0.
+intern size_t bench_proc_kb(const char* path, const char* field)
+{
+    FILE* file = fopen(path, "r");
+    if (!file)
+    {
+        return 0;
+    }
+    char line[256];
+    size_t result = 0;
+    size_t field_len = strlen(field);
+    while (fgets(line, sizeof(line), file))
+    {
+        if (strncmp(line, field, field_len) == 0 && line[field_len] == ':')
+        {
+            result = (size_t)strtoull(line + field_len + 1, NULL, 10);
+            break;
+        }
+    }
+    fclose(file);
+    return result;
+}
+#endif
+
+/* Corpora */
+
+struct BenchCorpus {
+    const char* name;
+    char* text;                 // Stretchy buffer, NUL terminated
+    size_t len;
+};
+
+intern void corpus_printf(char** text, const char* fmt, ...)
+{
+    char line[4096];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    memcpy(sb_add(*text, len), line, len);
+}
+
+intern uint64_t bench_random(uint64_t* state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+intern void corpus_small_keys(char** text, size_t i, uint64_t* rng)
+{
+    if (i % 50 == 0)
+    {
+        corpus_printf(text, "\n[section%zu]\n", i / 50);
+    }
+    corpus_printf(text, "key%zu = %llu\n", i % 50, (unsigned long long)(bench_random(rng) % 100000));
+}
+
+intern void corpus_deep_tables(char** text, size_t i, uint64_t* rng)
+{
+    corpus_printf(text, "[level0.level1.level2.level3.level4.level5.level6.t%zu]\nenabled = true\nname = \"table %zu\"\nweight = %llu\n\n",
+                  i, i, (unsigned long long)(bench_random(rng) % 1000));
+}
+
+intern void corpus_array_of_tables(char** text, size_t i, uint64_t* rng)
+{
+    corpus_printf(text, "[[products]]\nname = \"Product %zu\"\nsku = %llu\nprice = %llu.%02llu\ntags = [ \"hardware\", \"tools\" ]\n\n",
+                  i, (unsigned long long)(bench_random(rng) % 1000000000), (unsigned long long)(bench_random(rng) % 1000),
+                  (unsigned long long)(bench_random(rng) % 100));
+}
+
+intern void corpus_floats(char** text, size_t i, uint64_t* rng)
+{
+    corpus_printf(text, "f%zu = [ ", i);
+    for (int j = 0; j < 16; j++)
+    {
+        double value = (double)(int64_t)(bench_random(rng) % 2000000001 - 1000000000) / (double)(1 + bench_random(rng) % 100000);
+        corpus_printf(text, j % 4 == 3 ? "%.16e, " : "%.6f, ", value);
+    }
+    corpus_printf(text, "]\n");
+}
+
+intern void corpus_ints(char** text, size_t i, uint64_t* rng)
+{
+    corpus_printf(text, "i%zu = [ ", i);
+    for (int j = 0; j < 16; j++)
+    {
+        corpus_printf(text, "%lld, ", (long long)(bench_random(rng) % 2000000000000000ull) - 1000000000000000ll);
+    }
+    corpus_printf(text, "]\n");
+}
+
+intern void corpus_multiline_strings(char** text, size_t i, uint64_t* rng)
+{
+    corpus_printf(text, "s%zu = \"\"\"\n", i);
+    for (int j = 0; j < 20; j++)
+    {
+        corpus_printf(text, "Line %d of a long string, with \\\"escapes\\\" now and then %llu.\n", j, (unsigned long long)(bench_random(rng) % 1000));
+    }
+    corpus_printf(text, "\"\"\"\n");
+}
+
+intern void corpus_comments(char** text, size_t i, uint64_t* rng)
+{
+    for (int j = 0; j < 8; j++)
+    {
+        corpus_printf(text, "# Comment %d explaining key%zu at some length, as config files tend to do.\n", j, i);
+    }
+    corpus_printf(text, "key%zu = %llu # and a trailing one\n", i, (unsigned long long)(bench_random(rng) % 1000));
+}
+
+intern void corpus_whitespace(char** text, size_t i, uint64_t* rng)
+{
+    corpus_printf(text, "\n\n        \t        key%zu        =        %llu                                \n\n\n",
+                  i, (unsigned long long)(bench_random(rng) % 1000));
+}
+
+intern BenchCorpus make_corpus(const char* name, void (*generate)(char**, size_t, uint64_t*), size_t size)
+{
+    BenchCorpus corpus = {};
+    corpus.name = name;
+    uint64_t rng = 0x9E3779B97F4A7C15ull;
+    for (size_t i = 0; (size_t)sb_count(corpus.text) < size; i++)
+    {
+        generate(&corpus.text, i, &rng);
+    }
+    corpus.len = sb_count(corpus.text);
+    sb_push(corpus.text, 0);
+    return corpus;
+}
+
+/* Benchmarks */
+
+intern size_t bench_count_tokens(const BenchCorpus* corpus)
+{
+    TomlArena* arena = toml_new_arena();
+    TomlParseContext ctx;
+    toml_init_context(&ctx, corpus->name, corpus->text, corpus->len, arena);
+    size_t tokens = 0;
+    do
+    {
+        next_token(&ctx);
+        tokens++;
+    } while (!is_token(&ctx, TOKEN_EOF));
+    toml_release_context(&ctx);
+    toml_arena_free(arena);
+    return tokens;
+}
+
+intern double bench_parse(const BenchCorpus* corpus)
+{
+    return bench_best([&] {
+        TomlNodes* doc = parse_toml_buffer(corpus->name, corpus->text, corpus->len);
+        toml_free_document(doc);
+    });
+}
+
+intern double bench_mb_per_s(const BenchCorpus* corpus, double seconds)
+{
+    return corpus->len / seconds / (1024.0 * 1024.0);
+}
+
+intern void bench_corpora(BenchCorpus* corpora, size_t num_corpora)
+{
+    printf("Parsing\n");
+    for (size_t i = 0; i < num_corpora; i++)
+    {
+        BenchCorpus* corpus = &corpora[i];
+        size_t tokens = bench_count_tokens(corpus);
+        double lex = bench_best([&] { bench_count_tokens(corpus); });
+        double parse = bench_parse(corpus);
+
+        size_t before = toml_malloc_calls;
+        TomlNodes* doc = parse_toml_buffer(corpus->name, corpus->text, corpus->len);
+        size_t allocs = toml_malloc_calls - before;
+        size_t arena_bytes = doc->arena->bytes_allocated;
+        toml_free_document(doc);
+
+        bench_record("parse", "MB/s", bench_mb_per_s(corpus, parse), "%s", corpus->name);
+        bench_record("parse", "Mtokens/s", tokens / parse / 1e6, "%s", corpus->name);
+        bench_record("lex", "Mtokens/s", tokens / lex / 1e6, "%s", corpus->name);
+        bench_record("memory", "mallocs/parse", (double)allocs, "%s", corpus->name);
+        bench_record("memory", "arena bytes/input byte", (double)arena_bytes / corpus->len, "%s", corpus->name);
+    }
+}
+
+intern void bench_simd(BenchCorpus* corpora, size_t num_corpora)
+{
+    printf("Scanner SIMD level (whitespace, comments and strings)\n");
+    const char* levels[] = { "scalar", "sse2", "avx2" };
+    for (size_t i = 0; i < num_corpora; i++)
+    {
+        for (int level = TOML_SIMD_SCALAR; level <= toml_simd_supported; level++)
+        {
+            toml_set_simd_level((TomlSimdLevel)level);
+            bench_record("simd", "MB/s", bench_mb_per_s(&corpora[i], bench_parse(&corpora[i])), "%s/%s", corpora[i].name, levels[level]);
+        }
+    }
+    toml_set_simd_level(toml_simd_supported);
+}
+
+intern void bench_tokenizers(BenchCorpus* corpora, size_t num_corpora)
+{
+    printf("Tokenizer (character scan vs experimental structural index)\n");
+    for (size_t i = 0; i < num_corpora; i++)
+    {
+        toml_set_tokenizer(TOML_TOKENIZER_SCAN);
+        bench_record("tokenizer", "MB/s", bench_mb_per_s(&corpora[i], bench_parse(&corpora[i])), "%s/scan", corpora[i].name);
+        toml_set_tokenizer(TOML_TOKENIZER_INDEX);
+        bench_record("tokenizer", "MB/s", bench_mb_per_s(&corpora[i], bench_parse(&corpora[i])), "%s/index", corpora[i].name);
+    }
+    toml_set_tokenizer(TOML_TOKENIZER_SCAN);
+}
+
+intern void bench_events(BenchCorpus* corpora, size_t num_corpora)
+{
+    printf("Events vs tree\n");
+    TomlEvents events = {};
+    for (size_t i = 0; i < num_corpora; i++)
+    {
+        BenchCorpus* corpus = &corpora[i];
+        double sax = bench_best([&] { parse_toml_events(corpus->name, corpus->text, corpus->len, &events, NULL); });
+        bench_record("events", "MB/s", bench_mb_per_s(corpus, sax), "%s/events", corpus->name);
+        bench_record("events", "MB/s", bench_mb_per_s(corpus, bench_parse(corpus)), "%s/tree", corpus->name);
+    }
+}
+
+// Numbers are lexed without building anything, against the C library
+// converting the same literals.
+intern void bench_numbers(const BenchCorpus* floats, const BenchCorpus* ints)
+{
+    printf("Number parsing\n");
+    TomlEvents events = {};
+    const BenchCorpus* corpora[] = { floats, ints };
+    for (int i = 0; i < 2; i++)
+    {
+        const BenchCorpus* corpus = corpora[i];
+        const char** literals = NULL;
+        for (const char* c = corpus->text; *c; c++)
+        {
+            if ((IS_DIGIT(*c) || *c == '-') && (c[-1] == ' '))
+            {
+                sb_push(literals, c);
+            }
+        }
+        size_t count = sb_count(literals);
+        double parser = bench_best([&] { parse_toml_events(corpus->name, corpus->text, corpus->len, &events, NULL); });
+        volatile double sink = 0;
+        double libc = bench_best([&] {
+            double sum = 0;
+            for (size_t j = 0; j < count; j++)
+            {
+                sum += i == 0 ? strtod(literals[j], NULL) : (double)strtoll(literals[j], NULL, 10);
+            }
+            sink = sum;
+        });
+        (void)sink;
+        bench_record("numbers", "ns/number", parser / count * 1e9, "%s/parser", corpus->name);
+        bench_record("numbers", "ns/number", libc / count * 1e9, "%s/%s", corpus->name, i == 0 ? "strtod" : "strtoll");
+        sb_free(literals);
+    }
+}
+
+// Reading every element of the float arrays, straight out of the packed
+// storage vs one TomlValue at a time.
+intern void bench_arrays(const BenchCorpus* corpus)
+{
+    printf("Array access\n");
+    TomlNodes* doc = parse_toml_buffer(corpus->name, corpus->text, corpus->len);
+    size_t num_elements = 0;
+    for (size_t i = 0; i < doc->num_nodes; i++)
+    {
+        num_elements += doc->nodes[i]->stmt->value->num_array_vals;
+    }
+    volatile double sink = 0;
+    double span = bench_best([&] {
+        double sum = 0;
+        for (size_t i = 0; i < doc->num_nodes; i++)
+        {
+            size_t count;
+            const double* vals = toml_array_floats(doc->nodes[i]->stmt->value, &count);
+            assert(vals);
+            for (size_t j = 0; j < count; j++)
+            {
+                sum += vals[j];
+            }
+        }
+        sink = sum;
+    });
+    double get = bench_best([&] {
+        double sum = 0;
+        for (size_t i = 0; i < doc->num_nodes; i++)
+        {
+            TomlValue* array = doc->nodes[i]->stmt->value;
+            for (size_t j = 0; j < array->num_array_vals; j++)
+            {
+                sum += toml_array_get(array, j).float_val;
+            }
+        }
+        sink = sum;
+    });
+    (void)sink;
+    bench_record("arrays", "ns/element", span / num_elements * 1e9, "%s/toml_array_floats", corpus->name);
+    bench_record("arrays", "ns/element", get / num_elements * 1e9, "%s/toml_array_get", corpus->name);
+    toml_free_document(doc);
+}
+
+#ifndef TOML_NO_THREADS
+intern void bench_parallel(const BenchCorpus* corpus)
+{
+    printf("Parallel parse\n");
+    size_t max_threads = std::thread::hardware_concurrency();
+    max_threads = max_threads ? max_threads : 1;
+    double serial = bench_parse(corpus);
+    bench_record("parallel", "MB/s", bench_mb_per_s(corpus, serial), "%s/parse_toml", corpus->name);
+    for (size_t threads = 1; threads <= max_threads; threads++)
+    {
+        TomlThreadPool* pool = toml_new_thread_pool(threads);
+        double seconds = bench_best([&] {
+            TomlNodes* doc = toml_parse_parallel(corpus->name, corpus->text, corpus->len, pool, 64 * 1024);
+            toml_free_document(doc);
+        });
+        toml_free_thread_pool(pool);
+        bench_record("parallel", "MB/s", bench_mb_per_s(corpus, seconds), "%s/threads=%zu", corpus->name, threads);
+        bench_record("parallel", "speedup", serial / seconds, "%s/threads=%zu", corpus->name, threads);
+    }
+}
+#endif
+
+// Frees what toml_find_nodes returns, including the wrappers it allocates
+// for statement matches.
+intern void bench_free_matches(TomlNodes* matches)
+{
+    for (size_t i = 0; i < matches->num_nodes; i++)
+    {
+        if (matches->nodes[i]->kind == TOMLDECL_STMT)
+        {
+            TOML_FREE(matches->nodes[i]);
+        }
+    }
+    TOML_FREE(matches->nodes);
+    TOML_FREE(matches);
+}
+
+intern void bench_lookups(const BenchCorpus* corpus)
+{
+    printf("Lookups\n");
+    const size_t num_keys = 30;
+    char keys[num_keys][64];
+    const char* key_ptrs[num_keys];
+    for (size_t i = 0; i < num_keys; i++)
+    {
+        snprintf(keys[i], sizeof(keys[i]), "section%zu.key%zu", i * 37 % 200, i * 7 % 50);
+        key_ptrs[i] = keys[i];
+    }
+    TomlNodes* doc = parse_toml_buffer(corpus->name, corpus->text, corpus->len);
+    double lookups = (double)num_keys;
+
+    double seconds = bench_best([&] {
+        for (size_t i = 0; i < num_keys; i++)
+        {
+            bench_free_matches(toml_find_nodes(doc->nodes, doc->num_nodes, key_ptrs[i]));
+        }
+    });
+    bench_record("lookup", "ns/lookup", seconds / lookups * 1e9, "toml_find_nodes (strings)");
+
+    double separate = bench_best([&] {
+        for (size_t i = 0; i < num_keys; i++)
+        {
+            bench_free_matches(toml_find_nodes(doc, key_ptrs[i]));
+        }
+    });
+    bench_record("lookup", "ns/lookup", separate / lookups * 1e9, "toml_find_nodes (interned)");
+
+    seconds = bench_best([&] {
+        for (size_t i = 0; i < num_keys; i++)
+        {
+            TomlMatchIter iter;
+            toml_match_begin(&iter, doc, key_ptrs[i]);
+            while (toml_match_next(&iter))
+            {
+            }
+        }
+    });
+    bench_record("lookup", "ns/lookup", seconds / lookups * 1e9, "TomlMatchIter");
+
+    TomlQuery* queries[num_keys];
+    TomlQueryMatch storage[num_keys][4];
+    TomlQueryResult results[num_keys];
+    for (size_t i = 0; i < num_keys; i++)
+    {
+        queries[i] = toml_compile_query(key_ptrs[i]);
+        results[i].matches = storage[i];
+        results[i].max_matches = 4;
+    }
+    seconds = bench_best([&] { toml_find_batch(doc, queries, num_keys, results); });
+    bench_record("lookup", "ns/lookup", seconds / lookups * 1e9, "toml_find_batch (%zu keys)", num_keys);
+    bench_record("lookup", "speedup", separate / seconds, "toml_find_batch vs toml_find_nodes");
+    for (size_t i = 0; i < num_keys; i++)
+    {
+        TOML_FREE(queries[i]);
+    }
+
+    TomlIndex* index = toml_build_index(doc);
+    volatile size_t sink = 0;
+    seconds = bench_best([&] {
+        for (int rep = 0; rep < 1000; rep++)
+        {
+            for (size_t i = 0; i < num_keys; i++)
+            {
+                sink = sink + toml_index_find(index, key_ptrs[i])->num_nodes;
+            }
+        }
+    });
+    bench_record("lookup", "ns/lookup", seconds / (lookups * 1000) * 1e9, "toml_index_find");
+
+    seconds = bench_best([&] {
+        for (int rep = 0; rep < 1000; rep++)
+        {
+            for (size_t i = 0; i < num_keys; i++)
+            {
+                sink = sink + (toml_lookup(doc, key_ptrs[i]) != NULL);
+            }
+        }
+    });
+    bench_record("lookup", "ns/lookup", seconds / (lookups * 1000) * 1e9, "toml_lookup (nested tables)");
+
+    size_t snapshot_size;
+    TomlSourceInfo source = {};
+    void* blob = toml_write_snapshot(doc, &source, &snapshot_size);
+    TomlSnapshot snapshot;
+    toml_view_compact(&snapshot, blob, snapshot_size);
+    seconds = bench_best([&] {
+        for (int rep = 0; rep < 1000; rep++)
+        {
+            for (size_t i = 0; i < num_keys; i++)
+            {
+                sink = sink + toml_snapshot_find(&snapshot, key_ptrs[i]).num_matches;
+            }
+        }
+    });
+    bench_record("lookup", "ns/lookup", seconds / (lookups * 1000) * 1e9, "toml_snapshot_find");
+    TOML_FREE(blob);
+    toml_free_document(doc);
+}
+
+struct BenchConfig {
+    TomlStr host;
+    int port;
+    double timeout;
+    bool verbose;
+    long long max_bytes;
+    int workers;
+    double weight[8];
+    TomlStr names[4];
+};
+
+TOML_SCHEMA(BenchConfig,
+    TOML_FIELD(BenchConfig, "server.host", host),
+    TOML_FIELD(BenchConfig, "server.port", port),
+    TOML_FIELD(BenchConfig, "server.timeout", timeout),
+    TOML_FIELD(BenchConfig, "server.verbose", verbose),
+    TOML_FIELD(BenchConfig, "limits.max_bytes", max_bytes),
+    TOML_FIELD(BenchConfig, "limits.workers", workers),
+    TOML_FIELD(BenchConfig, "model.w0", weight[0]),
+    TOML_FIELD(BenchConfig, "model.w1", weight[1]),
+    TOML_FIELD(BenchConfig, "model.w2", weight[2]),
+    TOML_FIELD(BenchConfig, "model.w3", weight[3]),
+    TOML_FIELD(BenchConfig, "model.w4", weight[4]),
+    TOML_FIELD(BenchConfig, "model.w5", weight[5]),
+    TOML_FIELD(BenchConfig, "model.w6", weight[6]),
+    TOML_FIELD(BenchConfig, "model.w7", weight[7]),
+    TOML_FIELD(BenchConfig, "names.first", names[0]),
+    TOML_FIELD(BenchConfig, "names.second", names[1]),
+    TOML_FIELD(BenchConfig, "names.third", names[2]),
+    TOML_FIELD(BenchConfig, "names.fourth", names[3]));
+
+// Loading a small config into a struct: decoding through its schema, or
+// parsing a tree and looking every field up.
+intern void bench_schema()
+{
+    printf("Config loading\n");
+    const char* src =
+        "[server]\nhost = \"example.com\"\nport = 8080\ntimeout = 2.5\nverbose = true\n"
+        "[limits]\nmax_bytes = 1000000000\nworkers = 16\n"
+        "[model]\nw0 = 0.1\nw1 = 0.2\nw2 = 0.3\nw3 = 0.4\nw4 = 0.5\nw5 = 0.6\nw6 = 0.7\nw7 = 0.8\n"
+        "[names]\nfirst = \"a\"\nsecond = \"b\"\nthird = \"c\"\nfourth = \"d\"\n";
+    size_t len = strlen(src);
+    const TomlSchemaInfo* schema = TomlSchema<BenchConfig>::info();
+    TomlArena* arena = toml_new_arena();
+    BenchConfig config;
+    TomlDecodeReport report;
+    const int reps = 1000;
+    double decode = bench_best([&] {
+        for (int i = 0; i < reps; i++)
+        {
+            bool decoded = toml_decode("config", src, len, &config, &report, arena);
+            assert(decoded);
+            (void)decoded;
+            toml_free_decode_report(&report);
+        }
+    });
+    toml_arena_free(arena);
+    double find = bench_best([&] {
+        for (int i = 0; i < reps; i++)
+        {
+            TomlNodes* doc = parse_toml_buffer("config", src, len);
+            for (size_t f = 0; f < schema->num_fields; f++)
+            {
+                bench_free_matches(toml_find_nodes(doc, schema->fields[f].key));
+            }
+            toml_free_document(doc);
+        }
+    });
+    double lookup = bench_best([&] {
+        for (int i = 0; i < reps; i++)
+        {
+            TomlNodes* doc = parse_toml_buffer("config", src, len);
+            for (size_t f = 0; f < schema->num_fields; f++)
+            {
+                const TomlKeyEntry* entry = toml_lookup(doc, schema->fields[f].key);
+                assert(entry);
+                (void)entry;
+            }
+            toml_free_document(doc);
+        }
+    });
+    bench_record("schema", "us/config", decode / reps * 1e6, "toml_decode (%zu fields)", schema->num_fields);
+    bench_record("schema", "us/config", find / reps * 1e6, "parse_toml + toml_find_nodes");
+    bench_record("schema", "us/config", lookup / reps * 1e6, "parse_toml + toml_lookup");
+}
+
+intern bool bench_write_file(const char* path, const BenchCorpus* corpus)
+{
+    FILE* file = fopen(path, "wb");
+    if (!file)
+    {
+        return false;
+    }
+    bool written = fwrite(corpus->text, 1, corpus->len, file) == corpus->len;
+    return fclose(file) == 0 && written;
+}
+
+// Startup cost: parse the text and index it, or map a compiled snapshot.
+intern void bench_snapshot(const BenchCorpus* corpus)
+{
+    printf("Snapshot load\n");
+    const char* source_path = "toml_bench_corpus.toml";
+    const char* snapshot_path = "toml_bench_corpus.tomlsnap";
+    if (!bench_write_file(source_path, corpus) || !toml_compile_snapshot(source_path, snapshot_path))
+    {
+        printf("  skipped: can't write %s\n", source_path);
+        return;
+    }
+    double parse = bench_best([&] {
+        TomlNodes* doc = toml_parse_file(source_path);
+        TomlIndex* index = toml_build_index(doc);
+        (void)index;
+        toml_free_document(doc);
+    });
+    double load = bench_best([&] {
+        TomlSnapshot snapshot;
+        bool opened = toml_open_snapshot(&snapshot, snapshot_path, source_path);
+        assert(opened);
+        (void)opened;
+        toml_close_snapshot(&snapshot);
+    });
+    bench_record("snapshot", "ms/load", parse * 1e3, "%s/parse+index", corpus->name);
+    bench_record("snapshot", "ms/load", load * 1e3, "%s/open snapshot", corpus->name);
+    remove(source_path);
+    remove(snapshot_path);
+}
+
+intern void bench_incremental(const BenchCorpus* corpus)
+{
+    printf("Incremental reparse\n");
+    TomlEditable* editable = toml_new_editable(corpus->name, corpus->text, corpus->len);
+    size_t offset = (size_t)(strstr(corpus->text + corpus->len / 2, " = ") - corpus->text) + 3;
+    int edits = 0;
+    double seconds = bench_best([&] {
+        TomlEdit edit = { offset, 0, "1", 1 };
+        toml_edit_document(editable, edit);
+        TomlEdit undo = { offset, 1, "", 0 };
+        toml_edit_document(editable, undo);
+        edits += 2;
+    });
+    bench_record("incremental", "us/edit", seconds / 2 * 1e6, "%s/one value", corpus->name);
+    bench_record("incremental", "us/edit", bench_parse(corpus) * 1e6, "%s/full parse", corpus->name);
+    toml_free_editable(editable);
+}
+
+#ifdef __linux__
+/*
+Every worker either parses its own copy of the document or attaches to one
+compact copy in shared memory, then reads every index slot. What the worker
+dirtied itself is its private cost; a shared block is paid once and split
+between the workers mapping it, which is what a pre-fork server actually
+pays per worker.
+*/
+intern void bench_shared_memory(const BenchCorpus* corpus)
+{
+    printf("Per-worker memory, private parse vs shared compact document\n");
+    const int num_workers = 4;
+    char shm_name[64];
+    snprintf(shm_name, sizeof(shm_name), "/toml_bench_%d", (int)getpid());
+    TomlNodes* doc = parse_toml_buffer(corpus->name, corpus->text, corpus->len);
+    TomlSnapshot shared;
+    if (!toml_share_document(&shared, doc, shm_name))
+    {
+        printf("  skipped: no shared memory\n");
+        toml_free_document(doc);
+        return;
+    }
+    toml_free_document(doc);
+
+    for (int mode = 0; mode < 2; mode++)
+    {
+        int report[2];
+        if (pipe(report) != 0)
+        {
+            break;
+        }
+        fflush(stdout);
+        for (int w = 0; w < num_workers; w++)
+        {
+            if (fork() != 0)
+            {
+                continue;
+            }
+            size_t base = bench_proc_kb("/proc/self/smaps_rollup", "Private_Dirty");
+            volatile size_t touched = 0;
+            if (mode == 0)
+            {
+                TomlNodes* own = parse_toml_buffer(corpus->name, corpus->text, corpus->len);
+                TomlIndex* index = toml_build_index(own);
+                for (size_t i = 0; i < index->num_slots; i++)
+                {
+                    touched = touched + index->slots[i].matches.num_nodes;
+                }
+            }
+            else
+            {
+                TomlSnapshot attached;
+                toml_attach_document(&attached, shm_name);
+                const TomlSnapEntry* slots = (const TomlSnapEntry*)(attached.base + attached.header->slots);
+                for (size_t i = 0; i < attached.header->num_slots; i++)
+                {
+                    touched = touched + slots[i].num_matches;
+                }
+            }
+            size_t result = bench_proc_kb("/proc/self/smaps_rollup", "Private_Dirty") - base;
+            ssize_t io = write(report[1], &result, sizeof(result));
+            (void)io;
+            _exit(0);
+        }
+        double private_kb = 0;
+        for (int w = 0; w < num_workers; w++)
+        {
+            size_t result = 0;
+            ssize_t io = read(report[0], &result, sizeof(result));
+            (void)io;
+            private_kb += result;
+        }
+        for (int w = 0; w < num_workers; w++)
+        {
+            wait(NULL);
+        }
+        close(report[0]);
+        close(report[1]);
+        private_kb /= num_workers;
+        double shared_kb = mode == 0 ? 0 : shared.mapped_size / 1024.0 / num_workers;
+        const char* mode_name = mode == 0 ? "private parse" : "shared compact";
+        bench_record("shared", "KB/worker", private_kb, "%s/%s private", corpus->name, mode_name);
+        bench_record("shared", "KB/worker", private_kb + shared_kb, "%s/%s total", corpus->name, mode_name);
+    }
+    toml_unlink_document(shm_name);
+    toml_close_snapshot(&shared);
+}
+#endif
+
+intern void write_json(const char* path, double size_mb)
+{
+    FILE* file = fopen(path, "w");
+    if (!file)
+    {
+        printf("Error: can't write %s\n", path);
+        return;
+    }
+    const char* levels[] = { "scalar", "sse2", "avx2" };
+    fprintf(file, "{\n  \"corpus_mb\": %g,\n  \"simd\": \"%s\",\n  \"peak_rss_kb\": %zu,\n  \"results\": [\n",
+            size_mb, levels[toml_simd_supported], bench_peak_rss_kb());
+    for (int i = 0; i < sb_count(bench_records); i++)
+    {
+        BenchRecord* record = &bench_records[i];
+        fprintf(file, "    { \"group\": \"%s\", \"name\": \"%s\", \"metric\": \"%s\", \"value\": %.6g }%s\n",
+                record->group, record->name, record->metric, record->value, i + 1 < sb_count(bench_records) ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    fclose(file);
+}
+
+int main(int argc, char** argv)
+{
+    double size_mb = 2;
+    const char* json_path = NULL;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--size") == 0 && i + 1 < argc)
+        {
+            size_mb = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc)
+        {
+            json_path = argv[++i];
+        }
+        else
+        {
+            printf("Usage: toml_bench [--size MB] [--json results.json]\n");
+            return 2;
+        }
+    }
+    size_t size = (size_t)(size_mb * 1024 * 1024);
+
+    BenchCorpus corpora[] = {
+        make_corpus("small_keys", corpus_small_keys, size),
+        make_corpus("deep_tables", corpus_deep_tables, size),
+        make_corpus("array_of_tables", corpus_array_of_tables, size),
+        make_corpus("float_arrays", corpus_floats, size),
+        make_corpus("int_arrays", corpus_ints, size),
+        make_corpus("multiline_strings", corpus_multiline_strings, size),
+        make_corpus("comments", corpus_comments, size),
+        make_corpus("whitespace", corpus_whitespace, size),
+    };
+    const size_t num_corpora = sizeof(corpora) / sizeof(corpora[0]);
+    BenchCorpus* small_keys = &corpora[0];
+    BenchCorpus* array_of_tables = &corpora[2];
+
+    bench_corpora(corpora, num_corpora);
+    bench_simd(corpora + 5, 3);
+    bench_tokenizers(corpora, num_corpora);
+    BenchCorpus event_corpora[] = { corpora[0], corpora[2] };
+    bench_events(event_corpora, 2);
+    bench_numbers(&corpora[3], &corpora[4]);
+    bench_arrays(&corpora[3]);
+#ifndef TOML_NO_THREADS
+    bench_parallel(array_of_tables);
+#endif
+    bench_lookups(small_keys);
+    bench_schema();
+    bench_snapshot(array_of_tables);
+    bench_incremental(small_keys);
+#ifdef __linux__
+    bench_shared_memory(array_of_tables);
+#endif
+
+    printf("Peak RSS %zu KB\n", bench_peak_rss_kb());
+    if (json_path)
+    {
+        write_json(json_path, size_mb);
+    }
+    for (size_t i = 0; i < num_corpora; i++)
+    {
+        sb_free(corpora[i].text);
+    }
+    sb_free(bench_records);
+    return 0;
+}
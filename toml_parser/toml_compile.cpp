@@ -0,0 +1,56 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdarg.h>
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+
+#define global static
+#define local_persist static
+#define intern static
+
+#ifndef IS_SPACE
+#define IS_SPACE(c) ((c) == ' ' || (c) == '\n' || (c) == '\t' || (c) == '\r' || (c) == '\v')
+#endif
+#ifndef IS_DIGIT
+#define IS_DIGIT(c) ('0' <= (c) && (c) <= '9')
+#endif
+#ifndef IS_ALPHA
+#define IS_ALPHA(c) (('a' <= (c) && (c) <= 'z') || ('A' <= (c) && (c) <= 'Z'))
+#endif
+#ifndef IS_ALNUM
+#define IS_ALNUM(c) (IS_DIGIT(c) || IS_ALPHA(c))
+#endif
+#ifndef TO_LOWER
+#define TO_LOWER(c) (('A' <= (c) && (c) <= 'Z') ? (c) + ('a' - 'A') : (c))
+#endif
+
+intern void error(const char* buf)
+{
+	printf("Error: %s\n", buf);
+	exit(1);
+}
+
+#include "stretchy_buffer.h"
+#include "toml_parser.h"
+
+// Compiles a TOML file into a snapshot that toml_open_snapshot can map.
+int main(int argc, char** argv)
+{
+    if (argc != 3)
+    {
+        printf("Usage: toml_compile input.toml output.tomlsnap\n");
+        return 2;
+    }
+    if (!toml_compile_snapshot(argv[1], argv[2]))
+    {
+        printf("Error: couldn't compile %s to %s\n", argv[1], argv[2]);
+        return 1;
+    }
+    return 0;
+}
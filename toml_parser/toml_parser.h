@@ -1,14 +1,184 @@
-
 #ifndef TOML_MALLOC
 #define TOML_MALLOC(s) malloc(s)
 #define TOML_ALLOC(t) (t*)TOML_MALLOC(sizeof(t))
 #endif
+#ifndef TOML_FREE
+#define TOML_FREE(p) free(p)
+#endif
+
+#ifdef TOML_STATS
+struct TomlStats;
+
+// Allocations are counted into the current thread's TomlStats, see below.
+intern void* toml_stats_malloc(size_t size);
+intern void* toml_base_malloc(size_t size)
+{
+    return TOML_MALLOC(size);
+}
+#undef TOML_MALLOC
+#define TOML_MALLOC(s) toml_stats_malloc(s)
+#endif
+
+#ifndef TOML_ARENA_CHUNK_SIZE
+#define TOML_ARENA_CHUNK_SIZE (64 * 1024)
+#endif
+#define TOML_ARENA_ALIGN 16
+
+// C++20 builds can also parse documents at compile time, see "Compile-time
+// documents" at the end. Number conversion is shared with the runtime
+// scanner, so it is constexpr there and takes portable paths while being
+// constant evaluated.
+#if !defined(TOML_NO_STATIC_PARSE) && (__cplusplus >= 202002L || (defined(_MSVC_LANG) && _MSVC_LANG >= 202002L))
+#define TOML_STATIC_PARSE 1
+#define TOML_CONSTEXPR constexpr
+#else
+#define TOML_CONSTEXPR
+#endif
+
+// Every standard header goes here, with the includer's global, intern and
+// local_persist out of the way: "#define global static" breaks
+// std::locale::global, which C++20's <chrono> pulls in.
+#pragma push_macro("global")
+#pragma push_macro("intern")
+#pragma push_macro("local_persist")
+#undef global
+#undef intern
+#undef local_persist
+#include <setjmp.h>
+#ifdef TOML_STATIC_PARSE
+#include <bit>
+#include <limits>
+#include <type_traits>
+#endif
+#ifdef TOML_STATS
+#include <chrono>
+#endif
+#ifndef TOML_NO_THREADS
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif
+#pragma pop_macro("local_persist")
+#pragma pop_macro("intern")
+#pragma pop_macro("global")
+
+intern TOML_CONSTEXPR bool toml_constant_evaluated()
+{
+#ifdef TOML_STATIC_PARSE
+    return std::is_constant_evaluated();
+#else
+    return false;
+#endif
+}
+
+/*
+Every node, string and pointer array of a parsed document is bump allocated
+out of a TomlArena. Chunks are chained together and released all at once, so
+tearing a document down is O(chunks) instead of one free per allocation.
+A zero initialized TomlArena is a valid empty arena.
+*/
+
+struct TomlArenaChunk {
+    TomlArenaChunk* next;
+    size_t size;
+};
+
+struct TomlArena {
+    TomlArenaChunk* chunks;
+    char* ptr;
+    char* end;
+    size_t num_chunks;      // TOML_MALLOC calls made by the arena
+    size_t num_allocs;      // allocations served out of the chunks
+    size_t bytes_allocated;
+};
+
+intern void* toml_arena_alloc(TomlArena* arena, size_t size)
+{
+    size = (size + TOML_ARENA_ALIGN - 1) & ~(size_t)(TOML_ARENA_ALIGN - 1);
+    if (size > (size_t)(arena->end - arena->ptr))
+    {
+        // Chunks grow geometrically so large documents still only need a
+        // handful of them.
+        size_t shift = arena->num_chunks < 8 ? arena->num_chunks : 8;
+        size_t chunk_size = (size_t)TOML_ARENA_CHUNK_SIZE << shift;
+        size_t header_size = (sizeof(TomlArenaChunk) + TOML_ARENA_ALIGN - 1) & ~(size_t)(TOML_ARENA_ALIGN - 1);
+        if (chunk_size < size + header_size)
+        {
+            chunk_size = size + header_size;
+        }
+        TomlArenaChunk* chunk = (TomlArenaChunk*)TOML_MALLOC(chunk_size);
+        chunk->next = arena->chunks;
+        chunk->size = chunk_size;
+        arena->chunks = chunk;
+        arena->ptr = (char*)chunk + header_size;
+        arena->end = (char*)chunk + chunk_size;
+        arena->num_chunks++;
+    }
+    void* result = arena->ptr;
+    arena->ptr += size;
+    arena->num_allocs++;
+    arena->bytes_allocated += size;
+    return result;
+}
+
+#define TOML_ARENA_ALLOC(a, t) (t*)toml_arena_alloc(a, sizeof(t))
+
+intern void toml_arena_free(TomlArena* arena)
+{
+    // The arena header may itself live in one of its chunks (see parse_toml),
+    // so grab the chain before clearing it.
+    TomlArenaChunk* chunk = arena->chunks;
+    memset(arena, 0, sizeof(*arena));
+    while (chunk)
+    {
+        TomlArenaChunk* next = chunk->next;
+        TOML_FREE(chunk);
+        chunk = next;
+    }
+}
+
+// Moves every chunk of src into dest, leaving dest's current chunk in place.
+// src (which may live in one of its own chunks) must not be used afterwards.
+intern void toml_arena_adopt(TomlArena* dest, TomlArena* src)
+{
+    TomlArenaChunk* chunks = src->chunks;
+    if (!chunks)
+    {
+        return;
+    }
+    size_t num_chunks = src->num_chunks;
+    size_t num_allocs = src->num_allocs;
+    size_t bytes_allocated = src->bytes_allocated;
+    if (!dest->chunks)
+    {
+        char* ptr = src->ptr;
+        char* end = src->end;
+        dest->chunks = chunks;
+        dest->ptr = ptr;
+        dest->end = end;
+    }
+    else
+    {
+        TomlArenaChunk* last = chunks;
+        while (last->next)
+        {
+            last = last->next;
+        }
+        last->next = dest->chunks->next;
+        dest->chunks->next = chunks;
+    }
+    dest->num_chunks += num_chunks;
+    dest->num_allocs += num_allocs;
+    dest->bytes_allocated += bytes_allocated;
+}
 
-intern const char* dup_str(const char* str, size_t len)
+intern const char* dup_str(TomlArena* arena, const char* str, size_t len)
 {
-    char* dest = (char*)TOML_MALLOC(len + 1);
+    char* dest = (char*)toml_arena_alloc(arena, len + 1);
     char* ptr = dest;
-    while (*str && len)
+    while (len && *str)
     {
         *ptr++ = *str++;
         len--;
@@ -17,11 +187,159 @@ intern const char* dup_str(const char* str, size_t len)
     return dest;
 }
 
-struct Parser {
-    const char* stream;
-    const char* line_start;
+// FNV-1a. Can be continued across pieces of a key by passing the previous
+// result back in as hash.
+intern constexpr uint64_t toml_hash(const char* str, size_t len, uint64_t hash = 0xcbf29ce484222325ull)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= (unsigned char)str[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// Stretchy buffers used as scratch stacks are truncated instead of freed so
+// their storage is reused for the whole parse.
+#define toml_sb_truncate(a, n) ((a) ? stb__sbn(a) = (int)(n) : 0)
+
+/*
+Every name the scanner produces is interned in a per-document table, so each
+distinct key is stored once and names can be compared by pointer. The header
+in front of the characters caches the length and hash, and marks keywords
+such as true/false so the parser can resolve them without a strcmp.
+*/
+
+enum TomlKeyword {
+    TOML_KEYWORD_NONE,
+    TOML_KEYWORD_TRUE,
+    TOML_KEYWORD_FALSE,
+    TOML_KEYWORD_INF,
+    TOML_KEYWORD_NAN,
 };
 
+struct TomlInternHeader {
+    uint64_t hash;
+    size_t len;
+    TomlKeyword keyword;
+    // NUL terminated characters follow
+};
+
+struct TomlInterns {
+    const char** slots;     // Always a power of two of them
+    size_t num_slots;
+    size_t num_names;
+};
+
+intern const TomlInternHeader* toml_name_header(const char* name)
+{
+    return (const TomlInternHeader*)name - 1;
+}
+
+intern size_t toml_name_len(const char* name)
+{
+    return toml_name_header(name)->len;
+}
+
+intern uint64_t toml_name_hash(const char* name)
+{
+    return toml_name_header(name)->hash;
+}
+
+intern TomlKeyword toml_name_keyword(const char* name)
+{
+    return toml_name_header(name)->keyword;
+}
+
+// Returns the interned copy of str, or NULL if it was never interned.
+intern const char* toml_intern_find(const TomlInterns* interns, const char* str, size_t len, uint64_t hash)
+{
+    size_t slot = hash & (interns->num_slots - 1);
+    for (;;)
+    {
+        const char* name = interns->slots[slot];
+        if (!name)
+        {
+            return NULL;
+        }
+        const TomlInternHeader* header = toml_name_header(name);
+        if (header->hash == hash && header->len == len && memcmp(name, str, len) == 0)
+        {
+            return name;
+        }
+        slot = (slot + 1) & (interns->num_slots - 1);
+    }
+}
+
+intern void intern_grow(TomlInterns* interns, TomlArena* arena)
+{
+    // The old slots stay behind in the arena, which at most doubles their
+    // total footprint.
+    size_t num_slots = interns->num_slots ? interns->num_slots * 2 : 256;
+    const char** slots = (const char**)toml_arena_alloc(arena, num_slots * sizeof(const char*));
+    memset(slots, 0, num_slots * sizeof(const char*));
+    for (size_t i = 0; i < interns->num_slots; i++)
+    {
+        const char* name = interns->slots[i];
+        if (name)
+        {
+            size_t slot = toml_name_hash(name) & (num_slots - 1);
+            while (slots[slot])
+            {
+                slot = (slot + 1) & (num_slots - 1);
+            }
+            slots[slot] = name;
+        }
+    }
+    interns->slots = slots;
+    interns->num_slots = num_slots;
+}
+
+intern const char* toml_intern_keyword(TomlInterns* interns, TomlArena* arena, const char* str, size_t len, TomlKeyword keyword)
+{
+    if ((interns->num_names + 1) * 2 > interns->num_slots)
+    {
+        intern_grow(interns, arena);
+    }
+    uint64_t hash = toml_hash(str, len);
+    const char* existing = toml_intern_find(interns, str, len, hash);
+    if (existing)
+    {
+        return existing;
+    }
+    TomlInternHeader* header = (TomlInternHeader*)toml_arena_alloc(arena, sizeof(TomlInternHeader) + len + 1);
+    header->hash = hash;
+    header->len = len;
+    header->keyword = keyword;
+    char* name = (char*)(header + 1);
+    memcpy(name, str, len);
+    name[len] = 0;
+    size_t slot = hash & (interns->num_slots - 1);
+    while (interns->slots[slot])
+    {
+        slot = (slot + 1) & (interns->num_slots - 1);
+    }
+    interns->slots[slot] = name;
+    interns->num_names++;
+    return name;
+}
+
+intern const char* toml_intern(TomlInterns* interns, TomlArena* arena, const char* str, size_t len)
+{
+    return toml_intern_keyword(interns, arena, str, len, TOML_KEYWORD_NONE);
+}
+
+intern TomlInterns* toml_new_interns(TomlArena* arena)
+{
+    TomlInterns* interns = TOML_ARENA_ALLOC(arena, TomlInterns);
+    memset(interns, 0, sizeof(*interns));
+    toml_intern_keyword(interns, arena, "true", 4, TOML_KEYWORD_TRUE);
+    toml_intern_keyword(interns, arena, "false", 5, TOML_KEYWORD_FALSE);
+    toml_intern_keyword(interns, arena, "inf", 3, TOML_KEYWORD_INF);
+    toml_intern_keyword(interns, arena, "nan", 3, TOML_KEYWORD_NAN);
+    return interns;
+}
+
 enum TokenKind {
     TOKEN_EOF,
     TOKEN_LBRACKET,
@@ -73,24 +391,108 @@ struct Token {
     long long int_val;
     double float_val;
     const char* str_val;
+    size_t str_len;
+};
+
+struct TomlEvents;
+
+// Which vector extensions the scanner uses; see toml_skip_space.
+enum TomlSimdLevel {
+    TOML_SIMD_SCALAR,
+    TOML_SIMD_SSE2,
+    TOML_SIMD_AVX2,
+};
+
+// How next_token finds tokens; the index is experimental, see
+// toml_build_structural_index.
+enum TomlTokenizer {
+    TOML_TOKENIZER_SCAN,
+    TOML_TOKENIZER_INDEX,
+};
+
+// All state of an in-flight parse. Nothing in the scanner or parser touches
+// globals, so separate contexts can parse on separate threads.
+struct TomlParseContext {
+    const char* stream;
+    const char* end;
+    const char* line_start;
+    Token token;
+    TomlArena* arena;
+    TomlArena* str_arena;   // Unescaped strings; arena unless streaming
+    TomlInterns* interns;
+    const TomlEvents* events;
+    void* user;
+    uint32_t* index;            // Stretchy buffer, see toml_build_structural_index
+    size_t next_index;
+    const char* index_base;     // What index offsets are relative to, NULL without one
+    TomlSimdLevel simd;
+    TomlTokenizer tokenizer;
+#ifdef TOML_STATS
+    TomlStats* stats;
+    int depth;
+    uint64_t emit_start;
+#endif
+};
+
+// The input is not required to be NUL terminated (a mapped file isn't), so
+// the scanner reads through these, which yield 0 past the end.
+intern char peek_char(TomlParseContext* ctx, size_t offset)
+{
+    return offset < (size_t)(ctx->end - ctx->stream) ? ctx->stream[offset] : 0;
+}
+
+intern char cur_char(TomlParseContext* ctx)
+{
+    return peek_char(ctx, 0);
+}
+
+intern const char* token_info(TomlParseContext* ctx)
+{
+    return token_name(ctx->token.kind);
+}
+
+/*
+Recoverable errors
+
+parse_error hands its message to the includer's error(), which isn't expected
+to return. Code that has to live through bad input, such as a reload or an
+edit that is still being typed, runs the parse under toml_recover instead,
+and the first error longjmps back out with the message. A parse allocates
+only out of its arena and stretchy buffers its caller can reach, so the
+caller releases those once it is back.
+*/
+
+struct TomlRecovery {
+    jmp_buf jump;
+    char** message;
+    TomlRecovery* outer;
 };
 
-global Parser parser;
-global Token token;
+global thread_local TomlRecovery* toml_recovery;
 
-intern const char* token_info()
+// Takes a message allocated with TOML_MALLOC to the innermost toml_recover, or
+// to error() outside of one.
+intern void toml_raise_error(char* message)
 {
-    return token_name(token.kind);
+    if (toml_recovery)
+    {
+        *toml_recovery->message = message;
+        longjmp(toml_recovery->jump, 1);
+    }
+    error(message);
 }
 
 intern void parse_error(SrcPos pos, const char* fmt, ...)
 {
     va_list args;
     va_start(args, fmt);
+    va_list measure;
+    va_copy(measure, args);
     size_t len = snprintf(NULL, 0, "%s(%zu) : Error: ", pos.name, pos.line);
-    len += vsnprintf(NULL, 0, fmt, args);
+    len += vsnprintf(NULL, 0, fmt, measure);
+    va_end(measure);
     len += 2;
-    char* buf = (char*)malloc(len);
+    char* buf = (char*)TOML_MALLOC(len);
     char* ptr = buf;
     int chars_written = sprintf(ptr, "%s(%zu) : Error: ", pos.name, pos.line);
     ptr += chars_written;
@@ -98,811 +500,8279 @@ intern void parse_error(SrcPos pos, const char* fmt, ...)
     ptr += chars_written;
     sprintf(ptr, "\n");
     va_end(args);
-    error(buf);
+    toml_raise_error(buf);
 }
 
-#define error_here(...) parse_error(token.pos, __VA_ARGS__)
-
-intern unsigned char char_to_digit(unsigned char c)
+// Runs run(data), returning false instead of reaching error() if it hits a
+// parse error. *message then holds the error, to be released with TOML_FREE,
+// and is NULL otherwise. run's frames are abandoned on error, so anything it
+// allocates outside an arena has to be reachable from data.
+intern bool toml_recover(void (*run)(void*), void* data, char** message)
 {
-    switch (c)
+    TomlRecovery recovery;
+    recovery.message = message;
+    recovery.outer = toml_recovery;
+    *message = NULL;
+    toml_recovery = &recovery;
+    if (setjmp(recovery.jump) != 0)
     {
-        case '0': return 0;
-        case '1': return 1;
-        case '2': return 2;
-        case '3': return 3;
-        case '4': return 4;
-        case '5': return 5;
-        case '6': return 6;
-        case '7': return 7;
-        case '8': return 8;
-        case '9': return 9;
-        case 'a': case 'A': return 10;
-        case 'b': case 'B': return 11;
-        case 'c': case 'C': return 12;
-        case 'd': case 'D': return 13;
-        case 'e': case 'E': return 14;
-        case 'f': case 'F': return 15;
-        default:
-            return 0;
+        toml_recovery = recovery.outer;
+        return false;
     }
+    run(data);
+    toml_recovery = recovery.outer;
+    return true;
+}
+
+#define error_here(...) parse_error(ctx->token.pos, __VA_ARGS__)
+
+/*
+Statistics
+
+Built with TOML_STATS defined, parses and lookups record what they spend
+their time on into the TomlStats installed with toml_set_stats on the calling
+thread. Each parse context picks the thread's stats up when it's initialized,
+so ranges that toml_parse_parallel hands to pool threads aren't recorded.
+Times are in toml_stats_clock ticks (the TSC on x86) and nest: lexing
+includes string and number scanning. Allocations are TOML_MALLOC calls made
+on the thread while stats are installed, whatever they were for.
+
+Without TOML_STATS none of this exists and the hooks in the scanner, parser
+and lookups expand to nothing.
+*/
+
+#ifdef TOML_STATS
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#define TOML_STATS_MAX_TOKEN_KINDS 16
+static_assert(TOKEN_COMMA < TOML_STATS_MAX_TOKEN_KINDS, "TomlStats::tokens is too small");
+
+struct TomlStats {
+    size_t parses;
+    size_t bytes_parsed;
+    uint64_t parse_ticks;
+    uint64_t lex_ticks;         // next_token
+    uint64_t string_ticks;      // scan_str
+    uint64_t number_ticks;      // scan_int and scan_float
+    uint64_t build_ticks;       // Event callbacks, which build the tree for parse_toml
+    size_t tokens[TOML_STATS_MAX_TOKEN_KINDS];  // By TokenKind
+    size_t num_mallocs;
+    size_t malloc_bytes;
+    size_t arena_bytes;
+    int max_depth;              // Arrays and inline tables
+    size_t lookups;
+    size_t lookup_hits;
+    size_t lookup_matches;
+    uint64_t lookup_ticks;
 };
 
-intern void scan_float(int sign)
+global thread_local TomlStats* toml_stats;
+
+// Installs stats for the calling thread (NULL to stop recording) and returns
+// the previous ones.
+intern TomlStats* toml_set_stats(TomlStats* stats)
+{
+    TomlStats* previous = toml_stats;
+    toml_stats = stats;
+    return previous;
+}
+
+intern uint64_t toml_stats_clock()
+{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    return __rdtsc();
+#elif defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+intern double toml_stats_calibrate()
 {
-    char* buf = NULL;
-    while (IS_DIGIT(*parser.stream) || *parser.stream == '_')
+    auto start = std::chrono::steady_clock::now();
+    uint64_t start_ticks = toml_stats_clock();
+    while (std::chrono::steady_clock::now() - start < std::chrono::milliseconds(10))
     {
-        if (*parser.stream != '_')
-        {
-            sb_push(buf, *parser.stream);
-        }
-        parser.stream++;
     }
-    if (*parser.stream == '.')
+    double ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    return (toml_stats_clock() - start_ticks) / ns;
+}
+
+intern double toml_stats_ns(uint64_t ticks)
+{
+    local_persist const double ticks_per_ns = toml_stats_calibrate();
+    return ticks / ticks_per_ns;
+}
+
+intern void* toml_stats_malloc(size_t size)
+{
+    if (toml_stats)
     {
-        sb_push(buf, *parser.stream);
-        parser.stream++;
+        toml_stats->num_mallocs++;
+        toml_stats->malloc_bytes += size;
     }
-    while (IS_DIGIT(*parser.stream) || *parser.stream == '_')
+    return toml_base_malloc(size);
+}
+
+intern void toml_stats_enter(TomlParseContext* ctx)
+{
+    ctx->depth++;
+    if (ctx->stats && ctx->depth > ctx->stats->max_depth)
     {
-        if (*parser.stream != '_')
-        {
-            sb_push(buf, *parser.stream);
-        }
-        parser.stream++;
+        ctx->stats->max_depth = ctx->depth;
     }
-    if (TO_LOWER(*parser.stream) == 'e')
+}
+
+// Callbacks can't call back into the parser, so emits never nest.
+intern void toml_stats_emit_begin(TomlParseContext* ctx)
+{
+    ctx->emit_start = ctx->stats ? toml_stats_clock() : 0;
+}
+
+intern void toml_stats_emit_end(TomlParseContext* ctx)
+{
+    if (ctx->stats)
     {
-        sb_push(buf, *parser.stream);
-        parser.stream++;
-        if (*parser.stream == '+' || *parser.stream == '-')
-        {
-            sb_push(buf, *parser.stream);
-            parser.stream++;
-        }
-        if (!IS_DIGIT(*parser.stream))
-        {
-            error_here("Expected digit after float literal exponent, found '%c'.", *parser.stream);
-        }
-        while (IS_DIGIT(*parser.stream) || *parser.stream == '_')
-        {
-            if (*parser.stream != '_')
-            {
-                sb_push(buf, *parser.stream);
-            }
-            parser.stream++;
-        }
+        ctx->stats->build_ticks += toml_stats_clock() - ctx->emit_start;
     }
-    sb_push(buf, 0);
-    double val = strtod(buf, NULL);
-    sb_free(buf);
-    if (val == DBL_MAX)
+}
+
+intern void toml_stats_lookup(uint64_t start, size_t num_matches)
+{
+    if (toml_stats)
     {
-        error_here("Float literal overflow");
+        toml_stats->lookups++;
+        toml_stats->lookup_hits += num_matches > 0;
+        toml_stats->lookup_matches += num_matches;
+        toml_stats->lookup_ticks += toml_stats_clock() - start;
     }
-    token.kind = TOKEN_FLOAT;
-    token.float_val = val * sign;
 }
 
-intern void scan_int(int sign)
+intern void toml_print_stats(const TomlStats* stats, FILE* file)
 {
-    int base = 10;
-    const char* start_digits = parser.stream;
-    long long val = 0;
-    for (;;)
+    double parse_ns = toml_stats_ns(stats->parse_ticks);
+    fprintf(file, "%zu parses, %zu bytes, %.3f ms", stats->parses, stats->bytes_parsed, parse_ns / 1e6);
+    if (parse_ns > 0)
     {
-        if (*parser.stream == '_')
-        {
-            parser.stream++;
-            continue;
-        }
-        int digit = char_to_digit((unsigned char)*parser.stream);
-        if (digit == 0 && *parser.stream != '0')
-        {
-            break;
-        }
-        if (digit >= base)
-        {
-            error_here("Digit '%c' out of range for base %d", *parser.stream, base);
-            digit = 0;
-        }
-        if (val > (LLONG_MAX - digit) / base)
-        {
-            error_here("Integer literal overflow");
-            while (IS_DIGIT(*parser.stream))
-            {
-                parser.stream++;
-            }
-            val = 0;
-        }
-        val = val * base + digit;
-        parser.stream++;
+        fprintf(file, " (%.1f MB/s)", stats->bytes_parsed / parse_ns * 1e3);
     }
-    if (parser.stream == start_digits)
+    fprintf(file, "\n  lexing %.3f ms, strings %.3f ms, numbers %.3f ms, building %.3f ms\n",
+            toml_stats_ns(stats->lex_ticks) / 1e6, toml_stats_ns(stats->string_ticks) / 1e6,
+            toml_stats_ns(stats->number_ticks) / 1e6, toml_stats_ns(stats->build_ticks) / 1e6);
+    fprintf(file, "  tokens:");
+    for (int kind = TOKEN_EOF; kind <= TOKEN_COMMA; kind++)
     {
-        error_here("Expected base %d digit, got '%c'", base, *parser.stream);
+        fprintf(file, " %s %zu", token_name((TokenKind)kind), stats->tokens[kind]);
     }
-    token.kind = TOKEN_INT;
-    token.int_val = val * sign;
+    fprintf(file, "\n  %zu mallocs (%zu bytes), %zu arena bytes, max depth %d\n",
+            stats->num_mallocs, stats->malloc_bytes, stats->arena_bytes, stats->max_depth);
+    fprintf(file, "  %zu lookups, %zu hits, %zu matches, %.1f ns per lookup\n", stats->lookups, stats->lookup_hits,
+            stats->lookup_matches, stats->lookups ? toml_stats_ns(stats->lookup_ticks) / stats->lookups : 0.0);
 }
 
-intern char escape_to_char(unsigned char c)
+#define TOML_STATS_START(ctx, start) uint64_t start = (ctx)->stats ? toml_stats_clock() : 0
+#define TOML_STATS_STOP(ctx, start, field) ((ctx)->stats ? (void)((ctx)->stats->field += toml_stats_clock() - (start)) : (void)0)
+#define TOML_STATS_TOKEN(ctx) ((ctx)->stats ? (void)(ctx)->stats->tokens[(ctx)->token.kind]++ : (void)0)
+#define TOML_STATS_ENTER(ctx) toml_stats_enter(ctx)
+#define TOML_STATS_LEAVE(ctx) ((ctx)->depth--)
+#define TOML_STATS_LOOKUP_START(start) uint64_t start = toml_stats ? toml_stats_clock() : 0
+#define TOML_STATS_LOOKUP_STOP(start, num_matches) toml_stats_lookup(start, num_matches)
+#else
+#define TOML_STATS_START(ctx, start)
+#define TOML_STATS_STOP(ctx, start, field) ((void)0)
+#define TOML_STATS_TOKEN(ctx) ((void)0)
+#define TOML_STATS_ENTER(ctx) ((void)0)
+#define TOML_STATS_LEAVE(ctx) ((void)0)
+#define TOML_STATS_LOOKUP_START(start)
+#define TOML_STATS_LOOKUP_STOP(start, num_matches) ((void)0)
+#endif
+
+/*
+Whitespace runs, comment bodies and string literals are scanned 16 (SSE2) or
+32 (AVX2) bytes at a time. The widest level the CPU supports is picked at
+startup; the scalar loops are kept as the fallback and as the reference the
+vector paths must agree with. Newlines inside a skipped run are counted with
+popcount so line numbers stay exact.
+
+The input is bounded by an end pointer rather than a NUL terminator. The
+vector loops only ever do aligned loads, which never straddle a page, and
+stop at the block holding end, so the bytes they read past end are always
+mapped and are masked off.
+*/
+
+#if !defined(TOML_NO_SIMD) && (defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86))
+#define TOML_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(_MSC_VER)
+#define TOML_TARGET_SSE2
+#define TOML_TARGET_AVX2
+#define TOML_NO_SANITIZE
+#else
+#define TOML_TARGET_SSE2 __attribute__((target("sse2")))
+#define TOML_TARGET_AVX2 __attribute__((target("avx2")))
+#define TOML_NO_SANITIZE __attribute__((no_sanitize_address, no_sanitize_thread))
+#endif
+
+intern int toml_ctz32(unsigned int x)
 {
-    switch (c)
-    {
-        case '0': return '\0';
-        case '\'': return '\'';
-        case '"': return '"';
-        case '\\': return '\\';
-        case 'n': return '\n';
-        case 'r': return '\r';
-        case 't': return '\t';
-        case 'v': return '\v';
-        case 'b': return '\b';
-        case 'a': return '\a';
-        default: return c;
-    }
-};
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, x);
+    return (int)index;
+#else
+    return __builtin_ctz(x);
+#endif
+}
 
-intern int scan_hex_escape(void) {
-    assert(*parser.stream == 'x');
-    parser.stream++;
-    int val = char_to_digit((unsigned char)*parser.stream);
-    if (!val && *parser.stream != '0') {
-        error_here("\\x needs at least 1 hex digit");
-    }
-    parser.stream++;
-    int digit = char_to_digit((unsigned char)*parser.stream);
-    if (digit || *parser.stream == '0') {
-        val *= 16;
-        val += digit;
-        if (val > 0xFF) {
-            error_here("\\x argument out of range");
-            val = 0xFF;
-        }
-        parser.stream++;
-    }
-    return val;
+intern int toml_bsr32(unsigned int x)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanReverse(&index, x);
+    return (int)index;
+#else
+    return 31 - __builtin_clz(x);
+#endif
 }
 
-intern void scan_str(void) {
-    assert(*parser.stream == '"');
-    parser.stream++;
-    char *str = NULL;
-    if (parser.stream[0] == '"' && parser.stream[1] == '"') {
-        parser.stream += 2;
-        while (*parser.stream) {
-            if (parser.stream[0] == '"' && parser.stream[1] == '"' && parser.stream[2] == '"') {
-                parser.stream += 3;
-                break;
-            }
-            if (*parser.stream != '\r') {
-                // TODO: Should probably just read files in text mode instead.
-                sb_push(str, *parser.stream);
+intern int toml_popcount32(unsigned int x)
+{
+#if defined(_MSC_VER)
+    // __popcnt needs the POPCNT extension, which SSE2 parts may not have.
+    x = x - ((x >> 1) & 0x55555555);
+    x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+    x = (x + (x >> 4)) & 0x0F0F0F0F;
+    return (int)((x * 0x01010101) >> 24);
+#else
+    return __builtin_popcount(x);
+#endif
+}
+
+intern TomlSimdLevel toml_detect_simd()
+{
+#if defined(TOML_X86) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    int max_leaf = info[0];
+    __cpuid(info, 1);
+    bool sse2 = (info[3] & (1 << 26)) != 0;
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    if (max_leaf >= 7 && osxsave && avx && (_xgetbv(0) & 6) == 6)
+    {
+        __cpuidex(info, 7, 0);
+        if (info[1] & (1 << 5))
+        {
+            return TOML_SIMD_AVX2;
+        }
+    }
+    return sse2 ? TOML_SIMD_SSE2 : TOML_SIMD_SCALAR;
+#elif defined(TOML_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return TOML_SIMD_AVX2;
+    }
+    return __builtin_cpu_supports("sse2") ? TOML_SIMD_SSE2 : TOML_SIMD_SCALAR;
+#else
+    return TOML_SIMD_SCALAR;
+#endif
+}
+
+global const TomlSimdLevel toml_simd_supported = toml_detect_simd();
+global thread_local TomlSimdLevel toml_simd_level = toml_simd_supported;
+
+// Mostly for tests and benchmarks: restricts the scanner to at most level in
+// contexts the calling thread initializes from now on. Returns the level set.
+intern TomlSimdLevel toml_set_simd_level(TomlSimdLevel level)
+{
+    toml_simd_level = level < toml_simd_supported ? level : toml_simd_supported;
+    return toml_simd_level;
+}
+
+intern const char* skip_space_scalar(const char* ptr, const char* end, size_t* line, const char** line_start)
+{
+    while (ptr < end && IS_SPACE(*ptr))
+    {
+        if (*ptr == '\n')
+        {
+            *line_start = ptr;
+            (*line)++;
+        }
+        ptr++;
+    }
+    return ptr;
+}
+
+intern const char* skip_comment_scalar(const char* ptr, const char* end)
+{
+    while (ptr < end && *ptr != '\n' && *ptr != 0)
+    {
+        ptr++;
+    }
+    return ptr;
+}
+
+intern const char* find_any_scalar(const char* ptr, const char* end, char a, char b, char c)
+{
+    while (ptr < end && *ptr != a && *ptr != b && *ptr != c && *ptr != 0)
+    {
+        ptr++;
+    }
+    return ptr;
+}
+
+#ifdef TOML_X86
+// Bits of a block of size bytes starting at block that lie at or past end.
+intern unsigned int past_end_mask(const char* block, const char* end, size_t size)
+{
+    size_t remaining = end - block;
+    return remaining < size ? ~0u << remaining : 0;
+}
+
+TOML_TARGET_SSE2 TOML_NO_SANITIZE
+intern const char* skip_space_sse2(const char* ptr, const char* end, size_t* line, const char** line_start)
+{
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i vtab = _mm_set1_epi8('\v');
+    size_t misalign = (size_t)ptr & 15;
+    const char* block = ptr - misalign;
+    unsigned int live = (0xFFFFu << misalign) & 0xFFFFu;
+    while (block < end)
+    {
+        __m128i v = _mm_load_si128((const __m128i*)block);
+        __m128i is_newline = _mm_cmpeq_epi8(v, newline);
+        __m128i is_space = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, space), is_newline),
+                                        _mm_or_si128(_mm_cmpeq_epi8(v, tab),
+                                                     _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, vtab))));
+        unsigned int past_end = past_end_mask(block, end, 16);
+        unsigned int stop = (~(unsigned int)_mm_movemask_epi8(is_space) | past_end) & live;
+        unsigned int newlines = (unsigned int)_mm_movemask_epi8(is_newline) & ~past_end & live;
+        if (stop)
+        {
+            newlines &= (1u << toml_ctz32(stop)) - 1;
+        }
+        if (newlines)
+        {
+            *line += toml_popcount32(newlines);
+            *line_start = block + toml_bsr32(newlines);
+        }
+        if (stop)
+        {
+            return block + toml_ctz32(stop);
+        }
+        block += 16;
+        live = 0xFFFFu;
+    }
+    return end;
+}
+
+TOML_TARGET_SSE2 TOML_NO_SANITIZE
+intern const char* skip_comment_sse2(const char* ptr, const char* end)
+{
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+    size_t misalign = (size_t)ptr & 15;
+    const char* block = ptr - misalign;
+    unsigned int live = (0xFFFFu << misalign) & 0xFFFFu;
+    while (block < end)
+    {
+        __m128i v = _mm_load_si128((const __m128i*)block);
+        unsigned int hits = (unsigned int)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, newline), _mm_cmpeq_epi8(v, zero)));
+        unsigned int stop = (hits | past_end_mask(block, end, 16)) & live;
+        if (stop)
+        {
+            return block + toml_ctz32(stop);
+        }
+        block += 16;
+        live = 0xFFFFu;
+    }
+    return end;
+}
+
+TOML_TARGET_SSE2 TOML_NO_SANITIZE
+intern const char* find_any_sse2(const char* ptr, const char* end, char a, char b, char c)
+{
+    const __m128i va = _mm_set1_epi8(a);
+    const __m128i vb = _mm_set1_epi8(b);
+    const __m128i vc = _mm_set1_epi8(c);
+    const __m128i zero = _mm_setzero_si128();
+    size_t misalign = (size_t)ptr & 15;
+    const char* block = ptr - misalign;
+    unsigned int live = (0xFFFFu << misalign) & 0xFFFFu;
+    while (block < end)
+    {
+        __m128i v = _mm_load_si128((const __m128i*)block);
+        __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)),
+                                   _mm_or_si128(_mm_cmpeq_epi8(v, vc), _mm_cmpeq_epi8(v, zero)));
+        unsigned int stop = ((unsigned int)_mm_movemask_epi8(hit) | past_end_mask(block, end, 16)) & live;
+        if (stop)
+        {
+            return block + toml_ctz32(stop);
+        }
+        block += 16;
+        live = 0xFFFFu;
+    }
+    return end;
+}
+
+TOML_TARGET_AVX2 TOML_NO_SANITIZE
+intern const char* skip_space_avx2(const char* ptr, const char* end, size_t* line, const char** line_start)
+{
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i vtab = _mm256_set1_epi8('\v');
+    size_t misalign = (size_t)ptr & 31;
+    const char* block = ptr - misalign;
+    unsigned int live = 0xFFFFFFFFu << misalign;
+    while (block < end)
+    {
+        __m256i v = _mm256_load_si256((const __m256i*)block);
+        __m256i is_newline = _mm256_cmpeq_epi8(v, newline);
+        __m256i is_space = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, space), is_newline),
+                                           _mm256_or_si256(_mm256_cmpeq_epi8(v, tab),
+                                                           _mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, vtab))));
+        unsigned int past_end = past_end_mask(block, end, 32);
+        unsigned int stop = (~(unsigned int)_mm256_movemask_epi8(is_space) | past_end) & live;
+        unsigned int newlines = (unsigned int)_mm256_movemask_epi8(is_newline) & ~past_end & live;
+        if (stop)
+        {
+            newlines &= (1u << toml_ctz32(stop)) - 1;
+        }
+        if (newlines)
+        {
+            *line += toml_popcount32(newlines);
+            *line_start = block + toml_bsr32(newlines);
+        }
+        if (stop)
+        {
+            return block + toml_ctz32(stop);
+        }
+        block += 32;
+        live = 0xFFFFFFFFu;
+    }
+    return end;
+}
+
+TOML_TARGET_AVX2 TOML_NO_SANITIZE
+intern const char* skip_comment_avx2(const char* ptr, const char* end)
+{
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i zero = _mm256_setzero_si256();
+    size_t misalign = (size_t)ptr & 31;
+    const char* block = ptr - misalign;
+    unsigned int live = 0xFFFFFFFFu << misalign;
+    while (block < end)
+    {
+        __m256i v = _mm256_load_si256((const __m256i*)block);
+        unsigned int hits = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, newline), _mm256_cmpeq_epi8(v, zero)));
+        unsigned int stop = (hits | past_end_mask(block, end, 32)) & live;
+        if (stop)
+        {
+            return block + toml_ctz32(stop);
+        }
+        block += 32;
+        live = 0xFFFFFFFFu;
+    }
+    return end;
+}
+
+TOML_TARGET_AVX2 TOML_NO_SANITIZE
+intern const char* find_any_avx2(const char* ptr, const char* end, char a, char b, char c)
+{
+    const __m256i va = _mm256_set1_epi8(a);
+    const __m256i vb = _mm256_set1_epi8(b);
+    const __m256i vc = _mm256_set1_epi8(c);
+    const __m256i zero = _mm256_setzero_si256();
+    size_t misalign = (size_t)ptr & 31;
+    const char* block = ptr - misalign;
+    unsigned int live = 0xFFFFFFFFu << misalign;
+    while (block < end)
+    {
+        __m256i v = _mm256_load_si256((const __m256i*)block);
+        __m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)),
+                                      _mm256_or_si256(_mm256_cmpeq_epi8(v, vc), _mm256_cmpeq_epi8(v, zero)));
+        unsigned int stop = ((unsigned int)_mm256_movemask_epi8(hit) | past_end_mask(block, end, 32)) & live;
+        if (stop)
+        {
+            return block + toml_ctz32(stop);
+        }
+        block += 32;
+        live = 0xFFFFFFFFu;
+    }
+    return end;
+}
+#endif
+
+// Returns the first non-whitespace byte at or after ptr, or end. Every
+// newline skipped bumps *line and the last one is stored in *line_start.
+intern const char* toml_skip_space(TomlSimdLevel simd, const char* ptr, const char* end, size_t* line, const char** line_start)
+{
+#ifdef TOML_X86
+    switch (simd)
+    {
+        case TOML_SIMD_AVX2: return skip_space_avx2(ptr, end, line, line_start);
+        case TOML_SIMD_SSE2: return skip_space_sse2(ptr, end, line, line_start);
+        default: break;
+    }
+#endif
+    return skip_space_scalar(ptr, end, line, line_start);
+}
+
+// Returns the newline, NUL or end that finishes the comment starting at ptr.
+intern const char* toml_skip_comment(TomlSimdLevel simd, const char* ptr, const char* end)
+{
+#ifdef TOML_X86
+    switch (simd)
+    {
+        case TOML_SIMD_AVX2: return skip_comment_avx2(ptr, end);
+        case TOML_SIMD_SSE2: return skip_comment_sse2(ptr, end);
+        default: break;
+    }
+#endif
+    return skip_comment_scalar(ptr, end);
+}
+
+// Returns the first of a, b, c or NUL at or after ptr, or end.
+intern const char* toml_find_any(TomlSimdLevel simd, const char* ptr, const char* end, char a, char b, char c)
+{
+#ifdef TOML_X86
+    switch (simd)
+    {
+        case TOML_SIMD_AVX2: return find_any_avx2(ptr, end, a, b, c);
+        case TOML_SIMD_SSE2: return find_any_sse2(ptr, end, a, b, c);
+        default: break;
+    }
+#endif
+    return find_any_scalar(ptr, end, a, b, c);
+}
+
+// Value of c as a digit in bases up to 16, TOML_NOT_DIGIT otherwise.
+#define TOML_NOT_DIGIT 0xFF
+#define X TOML_NOT_DIGIT
+global constexpr unsigned char toml_digit_values[256] = {
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, X, X, X, X, X, X,
+    X, 10, 11, 12, 13, 14, 15, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, 10, 11, 12, 13, 14, 15, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+};
+#undef X
+
+/*
+Floats are converted straight from the source span, skipping '_' separators,
+without copying digits or calling into libc. Up to 19 significant digits are
+gathered into a 64-bit mantissa w and the value is w * 10^q:
+
+- If w < 2^53 and |q| <= 22 both are exact doubles and one multiply or divide
+  gives the correctly rounded result (Clinger's fast path).
+- Otherwise the Eisel-Lemire algorithm multiplies w by a 128-bit approximation
+  of 5^q (toml_pow5_table.h) and rounds, which is exact except for a few
+  ambiguous products it detects.
+- When digits had to be dropped the result is accepted only if w and w + 1
+  round to the same double. Ambiguous cases fall back to strtod on a copy of
+  the literal, which is rare enough that its cost does not matter.
+*/
+
+#include "toml_pow5_table.h"
+
+#define TOML_DOUBLE_INFINITE_POWER 0x7FF
+
+global const double toml_exact_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+intern TOML_CONSTEXPR uint64_t toml_mul128(uint64_t a, uint64_t b, uint64_t* hi)
+{
+#if defined(__SIZEOF_INT128__)
+    unsigned __int128 product = (unsigned __int128)a * b;
+    *hi = (uint64_t)(product >> 64);
+    return (uint64_t)product;
+#else
+#if defined(_MSC_VER) && defined(_M_X64)
+    if (!toml_constant_evaluated())
+    {
+        return _umul128(a, b, hi);
+    }
+#endif
+    uint64_t a_lo = (uint32_t)a, a_hi = a >> 32;
+    uint64_t b_lo = (uint32_t)b, b_hi = b >> 32;
+    uint64_t lo_lo = a_lo * b_lo;
+    uint64_t hi_lo = a_hi * b_lo;
+    uint64_t lo_hi = a_lo * b_hi;
+    uint64_t cross = (lo_lo >> 32) + (uint32_t)hi_lo + lo_hi;
+    *hi = a_hi * b_hi + (hi_lo >> 32) + (cross >> 32);
+    return (cross << 32) | (uint32_t)lo_lo;
+#endif
+}
+
+intern TOML_CONSTEXPR int toml_clz64(uint64_t x)
+{
+#if defined(_MSC_VER)
+    if (toml_constant_evaluated())
+    {
+        int count = 0;
+        for (; !(x >> 63); x <<= 1)
+        {
+            count++;
+        }
+        return count;
+    }
+#endif
+#if defined(_MSC_VER) && defined(_M_X64)
+    unsigned long index;
+    _BitScanReverse64(&index, x);
+    return 63 - (int)index;
+#elif defined(_MSC_VER)
+    unsigned long index;
+    if (_BitScanReverse(&index, (unsigned long)(x >> 32)))
+    {
+        return 31 - (int)index;
+    }
+    _BitScanReverse(&index, (unsigned long)x);
+    return 63 - (int)index;
+#else
+    return __builtin_clzll(x);
+#endif
+}
+
+// Computes the bits of the double nearest w * 10^q. Returns false when the
+// 128-bit product is too close to a rounding boundary to decide.
+intern TOML_CONSTEXPR bool toml_eisel_lemire(uint64_t w, long long q, uint64_t* bits)
+{
+    if (w == 0 || q < TOML_POW5_MIN_EXP)
+    {
+        *bits = 0;
+        return true;
+    }
+    if (q > TOML_POW5_MAX_EXP)
+    {
+        *bits = (uint64_t)TOML_DOUBLE_INFINITE_POWER << 52;
+        return true;
+    }
+    int lz = toml_clz64(w);
+    w <<= lz;
+    size_t index = 2 * (size_t)(q - TOML_POW5_MIN_EXP);
+    uint64_t hi;
+    uint64_t lo = toml_mul128(w, toml_pow5_table[index], &hi);
+    if ((hi & 0x1FF) == 0x1FF)
+    {
+        uint64_t hi2;
+        toml_mul128(w, toml_pow5_table[index + 1], &hi2);
+        lo += hi2;
+        if (hi2 > lo)
+        {
+            hi++;
+        }
+        if (lo == ~(uint64_t)0 && (q < -27 || q > 55))
+        {
+            return false;
+        }
+    }
+
+    int upperbit = (int)(hi >> 63);
+    int shift = upperbit + 64 - 52 - 3;
+    uint64_t mantissa = hi >> shift;
+    // ((152170 + 65536) * q) >> 16 is floor(q * log2(10)) for the table range
+    long long power2 = (((152170 + 65536) * q) >> 16) + 63 + upperbit - lz + 1023;
+    if (power2 <= 0)
+    {
+        // Subnormal, or zero if the value lies entirely below the smallest
+        // subnormal.
+        if (-power2 + 1 >= 64)
+        {
+            *bits = 0;
+            return true;
+        }
+        mantissa >>= -power2 + 1;
+        mantissa += mantissa & 1;
+        mantissa >>= 1;
+        power2 = mantissa < ((uint64_t)1 << 52) ? 0 : 1;
+        *bits = mantissa | ((uint64_t)power2 << 52);
+        return true;
+    }
+
+    // Exactly halfway between two doubles: round to even rather than up.
+    if (lo <= 1 && q >= -4 && q <= 23 && (mantissa & 3) == 1 && (mantissa << shift) == hi)
+    {
+        mantissa &= ~(uint64_t)1;
+    }
+    mantissa += mantissa & 1;
+    mantissa >>= 1;
+    if (mantissa >= ((uint64_t)2 << 52))
+    {
+        mantissa = (uint64_t)1 << 52;
+        power2++;
+    }
+    mantissa &= ~((uint64_t)1 << 52);
+    if (power2 >= TOML_DOUBLE_INFINITE_POWER)
+    {
+        power2 = TOML_DOUBLE_INFINITE_POWER;
+        mantissa = 0;
+    }
+    *bits = mantissa | ((uint64_t)power2 << 52);
+    return true;
+}
+
+intern TOML_CONSTEXPR double toml_bits_to_double(uint64_t bits)
+{
+#ifdef TOML_STATIC_PARSE
+    return std::bit_cast<double>(bits);
+#else
+    double result;
+    memcpy(&result, &bits, sizeof(result));
+    return result;
+#endif
+}
+
+intern double toml_strtod_fallback(TomlParseContext* ctx, const char* start, const char* end)
+{
+    char small[128];
+    size_t len = end - start;
+    char* buf = len < sizeof(small) ? small : (char*)toml_arena_alloc(ctx->str_arena, len + 1);
+    char* out = buf;
+    for (const char* ptr = start; ptr < end; ptr++)
+    {
+        if (*ptr != '_')
+        {
+            *out++ = *ptr;
+        }
+    }
+    *out = 0;
+    return strtod(buf, NULL);
+}
+
+intern void scan_float(TomlParseContext* ctx, int sign)
+{
+    const char* start = ctx->stream;
+    uint64_t mantissa = 0;
+    int num_digits = 0;
+    long long exp10 = 0;
+    bool truncated = false;
+    for (;; ctx->stream++)
+    {
+        char c = cur_char(ctx);
+        if (c == '_')
+        {
+            continue;
+        }
+        if (!IS_DIGIT(c))
+        {
+            break;
+        }
+        if (num_digits < 19)
+        {
+            mantissa = mantissa * 10 + (c - '0');
+            num_digits += mantissa != 0;
+        }
+        else
+        {
+            exp10++;
+            truncated |= c != '0';
+        }
+    }
+    if (cur_char(ctx) == '.')
+    {
+        ctx->stream++;
+        for (;; ctx->stream++)
+        {
+            char c = cur_char(ctx);
+            if (c == '_')
+            {
+                continue;
+            }
+            if (!IS_DIGIT(c))
+            {
+                break;
+            }
+            if (num_digits < 19)
+            {
+                mantissa = mantissa * 10 + (c - '0');
+                num_digits += mantissa != 0;
+                exp10--;
+            }
+            else
+            {
+                truncated |= c != '0';
+            }
+        }
+    }
+    if (TO_LOWER(cur_char(ctx)) == 'e')
+    {
+        ctx->stream++;
+        int exp_sign = 1;
+        if (cur_char(ctx) == '+' || cur_char(ctx) == '-')
+        {
+            exp_sign = cur_char(ctx) == '-' ? -1 : 1;
+            ctx->stream++;
+        }
+        if (!IS_DIGIT(cur_char(ctx)))
+        {
+            error_here("Expected digit after float literal exponent, found '%c'.", cur_char(ctx));
+        }
+        long long exp = 0;
+        while (IS_DIGIT(cur_char(ctx)) || cur_char(ctx) == '_')
+        {
+            // Anything this large is already far outside the double range.
+            if (cur_char(ctx) != '_' && exp < 100000)
+            {
+                exp = exp * 10 + (cur_char(ctx) - '0');
+            }
+            ctx->stream++;
+        }
+        exp10 += exp_sign * exp;
+    }
+
+    double val;
+    uint64_t bits, bits_up;
+    if (!truncated && mantissa <= ((uint64_t)1 << 53) && exp10 >= -22 && exp10 <= 22)
+    {
+        val = (double)mantissa;
+        val = exp10 < 0 ? val / toml_exact_pow10[-exp10] : val * toml_exact_pow10[exp10];
+    }
+    else if (toml_eisel_lemire(mantissa, exp10, &bits) &&
+             (!truncated || (toml_eisel_lemire(mantissa + 1, exp10, &bits_up) && bits == bits_up)))
+    {
+        val = toml_bits_to_double(bits);
+    }
+    else
+    {
+        val = toml_strtod_fallback(ctx, start, ctx->stream);
+    }
+    // Literals past DBL_MAX round to infinity, as strtod and IEEE rounding do.
+    ctx->token.kind = TOKEN_FLOAT;
+    ctx->token.float_val = sign < 0 ? -val : val;
+}
+
+// inf and nan, optionally signed, are float literals in their own right.
+intern bool scan_float_special(TomlParseContext* ctx, int sign)
+{
+    double val;
+    if (peek_char(ctx, 0) == 'i' && peek_char(ctx, 1) == 'n' && peek_char(ctx, 2) == 'f')
+    {
+        val = HUGE_VAL;
+    }
+    else if (peek_char(ctx, 0) == 'n' && peek_char(ctx, 1) == 'a' && peek_char(ctx, 2) == 'n')
+    {
+        val = NAN;
+    }
+    else
+    {
+        return false;
+    }
+    char next = peek_char(ctx, 3);
+    if (IS_ALNUM(next) || next == '_' || next == '.')
+    {
+        return false;
+    }
+    ctx->stream += 3;
+    ctx->token.kind = TOKEN_FLOAT;
+    ctx->token.float_val = sign < 0 ? -val : val;
+    return true;
+}
+
+// Number of digits that can never overflow a long long, per base.
+intern constexpr int int_safe_digits(int base)
+{
+    switch (base)
+    {
+        case 2: return 63;
+        case 8: return 21;
+        case 16: return 15;
+        default: return 18;
+    }
+}
+
+// Eight bytes as a little-endian word, so the first character is the low byte.
+intern uint64_t toml_load_le64(const char* ptr)
+{
+    uint64_t val;
+    memcpy(&val, ptr, sizeof(val));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    val = __builtin_bswap64(val);
+#endif
+    return val;
+}
+
+// SWAR check that all eight bytes of a word are '0'..'9'.
+intern bool toml_is_eight_digits(uint64_t val)
+{
+    return ((val & 0xF0F0F0F0F0F0F0F0ull) | (((val + 0x0606060606060606ull) & 0xF0F0F0F0F0F0F0F0ull) >> 4)) == 0x3333333333333333ull;
+}
+
+// Decodes eight decimal digits at once by combining neighbouring lanes:
+// pairs of digits, then pairs of pairs, then the two halves.
+intern uint64_t toml_parse_eight_digits(uint64_t val)
+{
+    val = ((val & 0x0F0F0F0F0F0F0F0Full) * 2561) >> 8;
+    val = ((val & 0x00FF00FF00FF00FFull) * 6553601) >> 16;
+    return ((val & 0x0000FFFF0000FFFFull) * 42949672960001ull) >> 32;
+}
+
+intern void scan_int(TomlParseContext* ctx, int sign)
+{
+    int base = 10;
+    if (peek_char(ctx, 0) == '0')
+    {
+        switch (peek_char(ctx, 1))
+        {
+            case 'x': base = 16; break;
+            case 'o': base = 8; break;
+            case 'b': base = 2; break;
+            default: break;
+        }
+        if (base != 10)
+        {
+            if (ctx->token.start != ctx->stream)
+            {
+                error_here("Prefixed integer literals cannot have a sign");
+            }
+            ctx->stream += 2;
+        }
+    }
+    const char* start_digits = ctx->stream;
+    // Accumulated as a magnitude so LLONG_MIN can be written out.
+    uint64_t limit = sign < 0 ? (uint64_t)LLONG_MAX + 1 : (uint64_t)LLONG_MAX;
+    int safe_digits = int_safe_digits(base);
+    int num_digits = 0;
+    uint64_t val = 0;
+    for (;;)
+    {
+        if (base == 10 && num_digits + 8 <= safe_digits && ctx->end - ctx->stream >= 8)
+        {
+            uint64_t word = toml_load_le64(ctx->stream);
+            if (toml_is_eight_digits(word))
+            {
+                val = val * 100000000 + toml_parse_eight_digits(word);
+                num_digits += 8;
+                ctx->stream += 8;
+                continue;
+            }
+        }
+        unsigned int digit = toml_digit_values[(unsigned char)cur_char(ctx)];
+        if (digit >= (unsigned int)base)
+        {
+            if (cur_char(ctx) == '_')
+            {
+                ctx->stream++;
+                continue;
+            }
+            if (digit == TOML_NOT_DIGIT)
+            {
+                break;
+            }
+            error_here("Digit '%c' out of range for base %d", cur_char(ctx), base);
+            digit = 0;
+        }
+        // Only literals long enough to possibly overflow pay for the check.
+        if (++num_digits > safe_digits && val > (limit - digit) / base)
+        {
+            error_here("Integer literal overflow");
+            while (toml_digit_values[(unsigned char)cur_char(ctx)] != TOML_NOT_DIGIT || cur_char(ctx) == '_')
+            {
+                ctx->stream++;
+            }
+            val = 0;
+            break;
+        }
+        val = val * base + digit;
+        ctx->stream++;
+    }
+    if (ctx->stream == start_digits)
+    {
+        error_here("Expected base %d digit, got '%c'", base, cur_char(ctx));
+    }
+    ctx->token.kind = TOKEN_INT;
+    ctx->token.int_val = sign < 0 ? (long long)(0 - val) : (long long)val;
+}
+
+intern constexpr char escape_to_char(unsigned char c)
+{
+    switch (c)
+    {
+        case '0': return '\0';
+        case '\'': return '\'';
+        case '"': return '"';
+        case '\\': return '\\';
+        case 'n': return '\n';
+        case 'r': return '\r';
+        case 't': return '\t';
+        case 'v': return '\v';
+        case 'b': return '\b';
+        case 'a': return '\a';
+        default: return c;
+    }
+};
+
+intern int scan_hex_escape(TomlParseContext* ctx) {
+    assert(cur_char(ctx) == 'x');
+    ctx->stream++;
+    int val = toml_digit_values[(unsigned char)cur_char(ctx)];
+    if (val == TOML_NOT_DIGIT) {
+        error_here("\\x needs at least 1 hex digit");
+    }
+    ctx->stream++;
+    int digit = toml_digit_values[(unsigned char)cur_char(ctx)];
+    if (digit != TOML_NOT_DIGIT) {
+        val *= 16;
+        val += digit;
+        if (val > 0xFF) {
+            error_here("\\x argument out of range");
+            val = 0xFF;
+        }
+        ctx->stream++;
+    }
+    return val;
+}
+
+/*
+Strings that need no decoding are returned as views straight into the source
+buffer, so token.str_val / TomlValue::str_val are not NUL terminated in
+general and str_len must be used. Only strings with escapes (or carriage
+returns in multi-line strings) are copied into the arena, each in a single
+pass once the closing quote has been found.
+*/
+
+intern void scan_multiline_str(TomlParseContext* ctx) {
+    const char* start = ctx->stream;
+    const char* end = NULL;
+    bool has_cr = false;
+    for (;;) {
+        const char* ptr = toml_find_any(ctx->simd, ctx->stream, ctx->end, '"', '\r', '\n');
+        ctx->stream = ptr;
+        if (ptr == ctx->end || *ptr == 0) {
+            error_here("Unexpected end of file within multi-line string literal");
+            break;
+        }
+        ctx->stream++;
+        if (*ptr == '"') {
+            if (peek_char(ctx, 0) == '"' && peek_char(ctx, 1) == '"') {
+                end = ptr;
+                ctx->stream += 2;
+                break;
+            }
+        }
+        else if (*ptr == '\n') {
+            ctx->token.pos.line++;
+        }
+        else {
+            has_cr = true;
+        }
+    }
+    ctx->token.str_val = start;
+    ctx->token.str_len = end - start;
+    if (has_cr) {
+        // TODO: Should probably just read files in text mode instead.
+        char* str = (char*)toml_arena_alloc(ctx->str_arena, end - start + 1);
+        char* out = str;
+        for (const char* ptr = start; ptr < end; ptr++) {
+            if (*ptr != '\r') {
+                *out++ = *ptr;
+            }
+        }
+        *out = 0;
+        ctx->token.str_val = str;
+        ctx->token.str_len = out - str;
+    }
+}
+
+intern void scan_str(TomlParseContext* ctx) {
+    assert(cur_char(ctx) == '"');
+    ctx->stream++;
+    ctx->token.kind = TOKEN_STR;
+    if (peek_char(ctx, 0) == '"' && peek_char(ctx, 1) == '"') {
+        ctx->stream += 2;
+        scan_multiline_str(ctx);
+        return;
+    }
+
+    // Find the closing quote, stepping over escaped characters.
+    const char* start = ctx->stream;
+    bool has_escapes = false;
+    const char* ptr = toml_find_any(ctx->simd, start, ctx->end, '"', '\\', '\n');
+    while (ptr < ctx->end && *ptr == '\\') {
+        has_escapes = true;
+        if (ptr + 1 == ctx->end || ptr[1] == 0) {
+            ptr++;
+            break;
+        }
+        ptr = toml_find_any(ctx->simd, ptr + 2, ctx->end, '"', '\\', '\n');
+    }
+    if (ptr == ctx->end || *ptr != '"') {
+        ctx->stream = ptr;
+        if (ptr < ctx->end && *ptr == '\n') {
+            error_here("String literal cannot contain newline");
+        }
+        else {
+            error_here("Unexpected end of file within string literal");
+        }
+    }
+    const char* end = ptr;
+    if (!has_escapes) {
+        ctx->token.str_val = start;
+        ctx->token.str_len = end - start;
+        ctx->stream = end + 1;
+        return;
+    }
+
+    // Escapes only ever shrink the text, so its length bounds the result.
+    char* str = (char*)toml_arena_alloc(ctx->str_arena, end - start + 1);
+    char* out = str;
+    ctx->stream = start;
+    while (ctx->stream < end) {
+        const char* run_end = toml_find_any(ctx->simd, ctx->stream, end, '\\', '"', '"');
+        if (run_end > end) {
+            run_end = end;
+        }
+        memcpy(out, ctx->stream, run_end - ctx->stream);
+        out += run_end - ctx->stream;
+        ctx->stream = run_end;
+        if (ctx->stream == end) {
+            break;
+        }
+        char val;
+        ctx->stream++;
+        if (cur_char(ctx) == 'x') {
+            val = (char)scan_hex_escape(ctx);
+        }
+        else {
+            val = escape_to_char((unsigned char)cur_char(ctx));
+            if (val == 0 && cur_char(ctx) != '0') {
+                error_here("Invalid string literal escape '\\%c'", cur_char(ctx));
+            }
+            ctx->stream++;
+        }
+        *out++ = val;
+    }
+    *out = 0;
+    ctx->stream = end + 1;
+    ctx->token.str_val = str;
+    ctx->token.str_len = out - str;
+}
+
+/*
+The structural index is an optional second tokenizer backend, in the style of
+simdjson. Stage 1 classifies the whole input 64 bytes at a time with SIMD
+compares into bitmasks of quotes, backslashes, '#', newlines, structural
+characters ([ ] { } = , and NUL) and whitespace. The few quote, backslash,
+'#' and newline bits are walked in order to find string and comment
+interiors, which are masked out, and what is left is recorded as offsets:
+every newline, every structural character and opening quote, and the first
+byte of every run of other characters (names and numbers).
+
+Stage 2 is next_token: whenever the stream sits on whitespace or a comment it
+jumps straight to the next recorded offset, counting the newlines it passes,
+instead of skipping byte by byte. Tokens themselves are still scanned by the
+same code, so both backends produce identical tokens. The index can hold an
+entry per input byte, and stretchy buffers size themselves in int, so inputs
+over TOML_MAX_INDEXED_LEN (about 256MB) always use the scanning backend. That
+also keeps every offset within 32 bits.
+
+The index is experimental and off by default. The scanner already skips
+whitespace, comments and strings with SIMD, so building the index is extra
+work that next_token rarely earns back. In toml_bench it at best matches the
+scanner (deep_tables, array_of_tables, the number arrays) and runs at about
+half its speed on multi-line strings and whitespace.
+*/
+
+// Entries are 4 bytes and a stretchy buffer can grow to twice its count plus
+// the 64 entries of one block, all of which must stay below INT_MAX bytes.
+#define TOML_MAX_INDEXED_LEN (((size_t)INT_MAX - 1024) / 8)
+
+global thread_local TomlTokenizer toml_tokenizer = TOML_TOKENIZER_SCAN;
+
+// Picks the backend for parses the calling thread starts from now on, and
+// returns the previous one. Contexts keep the one they were initialized with.
+intern TomlTokenizer toml_set_tokenizer(TomlTokenizer tokenizer)
+{
+    TomlTokenizer previous = toml_tokenizer;
+    toml_tokenizer = tokenizer;
+    return previous;
+}
+
+// Shared with the prescanner, which resolves strings and comments the same way.
+enum TomlPrescanState {
+    TOML_PRESCAN_PLAIN,
+    TOML_PRESCAN_COMMENT,
+    TOML_PRESCAN_STR,
+    TOML_PRESCAN_MULTILINE_STR,
+};
+
+struct TomlBlockMasks {
+    uint64_t quote;
+    uint64_t backslash;
+    uint64_t hash;
+    uint64_t newline;
+    uint64_t nul;
+    uint64_t structural;    // Includes nul
+    uint64_t space;         // Includes newline
+};
+
+intern int toml_ctz64(uint64_t x)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+    unsigned long index;
+    _BitScanForward64(&index, x);
+    return (int)index;
+#elif defined(_MSC_VER)
+    unsigned long index;
+    if (_BitScanForward(&index, (unsigned long)x))
+    {
+        return (int)index;
+    }
+    _BitScanForward(&index, (unsigned long)(x >> 32));
+    return 32 + (int)index;
+#else
+    return __builtin_ctzll(x);
+#endif
+}
+
+intern void classify_block_scalar(const char* block, TomlBlockMasks* masks)
+{
+    memset(masks, 0, sizeof(*masks));
+    for (int i = 0; i < 64; i++)
+    {
+        uint64_t bit = 1ull << i;
+        switch (block[i])
+        {
+            case '"': masks->quote |= bit; break;
+            case '\\': masks->backslash |= bit; break;
+            case '#': masks->hash |= bit; break;
+            case '\n': masks->newline |= bit; masks->space |= bit; break;
+            case ' ': case '\t': case '\r': case '\v': masks->space |= bit; break;
+            case 0: masks->nul |= bit; masks->structural |= bit; break;
+            case '[': case ']': case '{': case '}': case '=': case ',': masks->structural |= bit; break;
+            default: break;
+        }
+    }
+}
+
+#ifdef TOML_X86
+TOML_TARGET_SSE2
+intern void classify_block_sse2(const char* block, TomlBlockMasks* masks)
+{
+    memset(masks, 0, sizeof(*masks));
+    for (int i = 0; i < 64; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(block + i));
+        __m128i newline = _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'));
+        __m128i nul = _mm_cmpeq_epi8(v, _mm_setzero_si128());
+        __m128i space = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), newline),
+                                     _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\t')),
+                                                  _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\r')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\v')))));
+        __m128i brackets = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('[')), _mm_cmpeq_epi8(v, _mm_set1_epi8(']'))),
+                                        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('{')), _mm_cmpeq_epi8(v, _mm_set1_epi8('}'))));
+        __m128i structural = _mm_or_si128(brackets,
+                                          _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('=')), _mm_cmpeq_epi8(v, _mm_set1_epi8(','))), nul));
+        masks->quote |= (uint64_t)(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('"'))) << i;
+        masks->backslash |= (uint64_t)(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))) << i;
+        masks->hash |= (uint64_t)(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('#'))) << i;
+        masks->newline |= (uint64_t)(unsigned int)_mm_movemask_epi8(newline) << i;
+        masks->nul |= (uint64_t)(unsigned int)_mm_movemask_epi8(nul) << i;
+        masks->structural |= (uint64_t)(unsigned int)_mm_movemask_epi8(structural) << i;
+        masks->space |= (uint64_t)(unsigned int)_mm_movemask_epi8(space) << i;
+    }
+}
+
+TOML_TARGET_AVX2
+intern void classify_block_avx2(const char* block, TomlBlockMasks* masks)
+{
+    memset(masks, 0, sizeof(*masks));
+    for (int i = 0; i < 64; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(block + i));
+        __m256i newline = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'));
+        __m256i nul = _mm256_cmpeq_epi8(v, _mm256_setzero_si256());
+        __m256i space = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), newline),
+                                        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')),
+                                                        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\v')))));
+        __m256i brackets = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('[')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8(']'))),
+                                           _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('{')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('}'))));
+        __m256i structural = _mm256_or_si256(brackets,
+                                             _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('=')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8(','))), nul));
+        masks->quote |= (uint64_t)(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"'))) << i;
+        masks->backslash |= (uint64_t)(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))) << i;
+        masks->hash |= (uint64_t)(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('#'))) << i;
+        masks->newline |= (uint64_t)(unsigned int)_mm256_movemask_epi8(newline) << i;
+        masks->nul |= (uint64_t)(unsigned int)_mm256_movemask_epi8(nul) << i;
+        masks->structural |= (uint64_t)(unsigned int)_mm256_movemask_epi8(structural) << i;
+        masks->space |= (uint64_t)(unsigned int)_mm256_movemask_epi8(space) << i;
+    }
+}
+#endif
+
+// block must hold 64 readable bytes.
+intern void toml_classify_block(TomlSimdLevel simd, const char* block, TomlBlockMasks* masks)
+{
+#ifdef TOML_X86
+    switch (simd)
+    {
+        case TOML_SIMD_AVX2: classify_block_avx2(block, masks); return;
+        case TOML_SIMD_SSE2: classify_block_sse2(block, masks); return;
+        default: break;
+    }
+#endif
+    classify_block_scalar(block, masks);
+}
+
+// Bits from..to (exclusive) of the block starting at base.
+intern uint64_t toml_block_range(size_t base, size_t from, size_t to)
+{
+    uint64_t below_to = to - base >= 64 ? ~0ull : (1ull << (to - base)) - 1;
+    return below_to & ~((1ull << (from - base)) - 1);
+}
+
+// Where string and comment interiors start and stop, carried across blocks.
+struct TomlInteriors {
+    bool inside;
+    size_t from;            // Where the current run of bits started
+    size_t pending;         // A start or stop past the end of the last block, 0 for none
+    uint64_t mask;          // Interior bits of the current block
+};
+
+intern void toml_interior_toggle(TomlInteriors* interiors, size_t base, size_t pos)
+{
+    if (pos >= base + 64)
+    {
+        interiors->pending = pos;
+        return;
+    }
+    if (interiors->inside)
+    {
+        interiors->mask |= toml_block_range(base, interiors->from, pos);
+    }
+    interiors->inside = !interiors->inside;
+    interiors->from = pos;
+}
+
+// Builds the index for ctx->stream..ctx->end and makes next_token use it.
+intern void toml_build_structural_index(TomlParseContext* ctx)
+{
+    const char* buf = ctx->stream;
+    size_t len = ctx->end - ctx->stream;
+    toml_sb_truncate(ctx->index, 0);
+    ctx->next_index = 0;
+    ctx->index_base = NULL;
+    if (len > TOML_MAX_INDEXED_LEN)
+    {
+        return;
+    }
+
+    TomlPrescanState state = TOML_PRESCAN_PLAIN;
+    size_t resume = 0;          // Bits before this belong to something already resolved
+    TomlInteriors interiors = {};
+    uint64_t prev_scalar = 0;
+    for (size_t base = 0; base < len; base += 64)
+    {
+        TomlBlockMasks masks;
+        size_t block_len = len - base < 64 ? len - base : 64;
+        if (block_len == 64)
+        {
+            toml_classify_block(ctx->simd, buf + base, &masks);
+        }
+        else
+        {
+            char tail[64] = {};
+            memcpy(tail, buf + base, block_len);
+            toml_classify_block(ctx->simd, tail, &masks);
+        }
+        uint64_t valid = block_len == 64 ? ~0ull : (1ull << block_len) - 1;
+
+        interiors.mask = 0;
+        interiors.from = base;
+        if (interiors.pending)
+        {
+            size_t pending = interiors.pending;
+            interiors.pending = 0;
+            interiors.from = interiors.inside ? base : pending;
+            toml_interior_toggle(&interiors, base, pending);
+        }
+
+        uint64_t special = (masks.quote | masks.backslash | masks.hash | masks.newline | masks.nul) & valid;
+        while (special)
+        {
+            size_t pos = base + toml_ctz64(special);
+            special &= special - 1;
+            if (pos < resume)
+            {
+                continue;
+            }
+            char c = buf[pos];
+            switch (state)
+            {
+                case TOML_PRESCAN_PLAIN:
+                    if (c == '"')
+                    {
+                        if (pos + 2 < len && buf[pos + 1] == '"' && buf[pos + 2] == '"')
+                        {
+                            state = TOML_PRESCAN_MULTILINE_STR;
+                            resume = pos + 3;
+                        }
+                        else
+                        {
+                            state = TOML_PRESCAN_STR;
+                        }
+                        toml_interior_toggle(&interiors, base, pos + 1);
+                    }
+                    else if (c == '#')
+                    {
+                        state = TOML_PRESCAN_COMMENT;
+                        toml_interior_toggle(&interiors, base, pos);
+                    }
+                    break;
+                case TOML_PRESCAN_COMMENT:
+                    if (c == '\n' || c == 0)
+                    {
+                        state = TOML_PRESCAN_PLAIN;
+                        toml_interior_toggle(&interiors, base, pos);
+                    }
+                    break;
+                case TOML_PRESCAN_STR:
+                    if (c == '\\')
+                    {
+                        resume = pos + 2;
+                    }
+                    else if (c == '"')
+                    {
+                        state = TOML_PRESCAN_PLAIN;
+                        toml_interior_toggle(&interiors, base, pos + 1);
+                    }
+                    else if (c == '\n' || c == 0)
+                    {
+                        // An error the scanner will report
+                        state = TOML_PRESCAN_PLAIN;
+                        toml_interior_toggle(&interiors, base, pos);
+                    }
+                    break;
+                case TOML_PRESCAN_MULTILINE_STR:
+                    if (c == '"' && pos + 2 < len && buf[pos + 1] == '"' && buf[pos + 2] == '"')
+                    {
+                        state = TOML_PRESCAN_PLAIN;
+                        resume = pos + 3;
+                        toml_interior_toggle(&interiors, base, pos + 3);
+                    }
+                    else if (c == 0)
+                    {
+                        state = TOML_PRESCAN_PLAIN;
+                        toml_interior_toggle(&interiors, base, pos);
+                    }
+                    break;
+            }
+        }
+        if (interiors.inside)
+        {
+            interiors.mask |= toml_block_range(base, interiors.from, base + 64);
+        }
+
+        uint64_t scalar = ~(masks.space | masks.structural | masks.quote | masks.hash) & valid;
+        uint64_t scalar_start = scalar & ~((scalar << 1) | prev_scalar);
+        prev_scalar = scalar >> 63;
+        uint64_t entries = (masks.structural | masks.quote | masks.newline | scalar_start) & ~interiors.mask & valid;
+        uint32_t* out = sb_add(ctx->index, (int)toml_popcount32((unsigned int)entries) + toml_popcount32((unsigned int)(entries >> 32)));
+        while (entries)
+        {
+            *out++ = (uint32_t)(base + toml_ctz64(entries));
+            entries &= entries - 1;
+        }
+    }
+    ctx->index_base = buf;
+}
+
+// With an index, moves the stream from whitespace or a comment to the next
+// token start, counting the newlines on the way.
+intern void toml_next_structural(TomlParseContext* ctx)
+{
+    char c = cur_char(ctx);
+    if (!IS_SPACE(c) && c != '#')
+    {
+        return;
+    }
+    while (ctx->next_index < (size_t)sb_count(ctx->index))
+    {
+        const char* pos = ctx->index_base + ctx->index[ctx->next_index++];
+        if (pos < ctx->stream)
+        {
+            continue;
+        }
+        if (*pos == '\n')
+        {
+            ctx->token.pos.line++;
+            ctx->line_start = pos;
+            continue;
+        }
+        ctx->stream = pos;
+        return;
+    }
+    ctx->stream = ctx->end;
+}
+
+intern void next_token(TomlParseContext* ctx)
+{
+    TOML_STATS_START(ctx, lex_start);
+repeat:
+    if (ctx->index_base)
+    {
+        toml_next_structural(ctx);
+    }
+    ctx->token.start = ctx->stream;
+    switch (cur_char(ctx))
+    {
+        case ' ': case '\n': case '\t': case '\v': case '\r':
+            ctx->stream = toml_skip_space(ctx->simd, ctx->stream, ctx->end, &ctx->token.pos.line, &ctx->line_start);
+            goto repeat;
+        case '#':
+            ctx->stream = toml_skip_comment(ctx->simd, ctx->stream, ctx->end);
+            goto repeat;
+        case '0': case '1': case '2': case '3': case '4': case '5': case '6': case '7': case '8': case '9':
+        case '-': case '+': {
+            int sign = 1;
+            if (cur_char(ctx) == '-')
+            {
+                ctx->stream++;
+                sign = -1;
+            }
+            if (cur_char(ctx) == '+')
+            {
+                ctx->stream++;
+            }
+            if (!IS_DIGIT(cur_char(ctx)))
+            {
+                if (scan_float_special(ctx, sign))
+                {
+                    break;
+                }
+                error_here("Expected digit after sign");
+            }
+            TOML_STATS_START(ctx, number_start);
+            const char* start = ctx->stream;
+            while (IS_DIGIT(cur_char(ctx)) || cur_char(ctx) == '_')
+            {
+                ctx->stream++;
+            }
+            char c = cur_char(ctx);
+            ctx->stream = start;
+            if (c == '.' || TO_LOWER(c) == 'e')
+            {
+                scan_float(ctx, sign);
+            }
+            else
+            {
+                scan_int(ctx, sign);
+            }
+            TOML_STATS_STOP(ctx, number_start, number_ticks);
+        } break;
+        case 'a': case 'b': case 'c': case 'd': case 'e': case 'f': case 'g': case 'h': case 'i': case 'j':
+        case 'k': case 'l': case 'm': case 'n': case 'o': case 'p': case 'q': case 'r': case 's': case 't':
+        case 'u': case 'v': case 'w': case 'x': case 'y': case 'z':
+        case 'A': case 'B': case 'C': case 'D': case 'E': case 'F': case 'G': case 'H': case 'I': case 'J':
+        case 'K': case 'L': case 'M': case 'N': case 'O': case 'P': case 'Q': case 'R': case 'S': case 'T':
+        case 'U': case 'V': case 'W': case 'X': case 'Y': case 'Z':
+        case '_': {
+            for (char c = cur_char(ctx); IS_ALNUM(c) || c == '_' || c == '.'; c = cur_char(ctx))
+            {
+                ctx->stream++;
+            }
+            ctx->token.name = toml_intern(ctx->interns, ctx->arena, ctx->token.start, ctx->stream - ctx->token.start);
+            ctx->token.kind = TOKEN_NAME;
+        } break;
+        case '[':
+            ctx->token.kind = TOKEN_LBRACKET;
+            ctx->stream++;
+            break;
+        case ']':
+            ctx->token.kind = TOKEN_RBRACKET;
+            ctx->stream++;
+            break;
+        case '{':
+            ctx->token.kind = TOKEN_LBRACE;
+            ctx->stream++;
+            break;
+        case '}':
+            ctx->token.kind = TOKEN_RBRACE;
+            ctx->stream++;
+            break;
+        case '.':
+            ctx->token.kind = TOKEN_DOT;
+            ctx->stream++;
+            break;
+        case ',':
+            ctx->token.kind = TOKEN_COMMA;
+            ctx->stream++;
+            break;
+        case '=':
+            ctx->token.kind = TOKEN_EQ;
+            ctx->stream++;
+            break;
+        case 0:
+            ctx->token.kind = TOKEN_EOF;
+            if (ctx->stream < ctx->end)
+            {
+                ctx->stream++;
+            }
+            break;
+        case '"': {
+            TOML_STATS_START(ctx, string_start);
+            scan_str(ctx);
+            TOML_STATS_STOP(ctx, string_start, string_ticks);
+        } break;
+        default:
+            error_here("Unexpected character '%c'", cur_char(ctx));
+            break;
+    }
+    ctx->token.end = ctx->stream;
+    TOML_STATS_TOKEN(ctx);
+    TOML_STATS_STOP(ctx, lex_start, lex_ticks);
+}
+
+intern bool is_token(TomlParseContext* ctx, TokenKind kind)
+{
+    return ctx->token.kind == kind;
+}
+
+intern bool match_token(TomlParseContext* ctx, TokenKind kind)
+{
+    if (ctx->token.kind == kind)
+    {
+        next_token(ctx);
+        return true;
+    }
+    else
+    {
+        return false;
+    }
+}
+
+intern bool expect_token(TomlParseContext* ctx, TokenKind kind)
+{
+    if (ctx->token.kind == kind)
+    {
+        next_token(ctx);
+        return true;
+    }
+    else
+    {
+        error_here("Expected token %s, got %s", token_name(kind), token_info(ctx));
+        return false;
+    }
+}
+
+/*
+Syntax looks something like:
+
+array = '[' value (, value)* ']'
+
+value = INT
+| FLOAT
+| STRING
+| array
+
+stmt = NAME '=' value
+
+table = '[' NAME ']' (stmt)+
+
+list_item = '[' '[' NAME ']' ']' (stmt)+
+
+list = (list_item)+
+*/
+
+enum TomlValueKind {
+    TOMLVALUE_NONE,
+    TOMLVALUE_BOOL,
+    TOMLVALUE_INT,
+    TOMLVALUE_FLOAT,
+    TOMLVALUE_STR,
+    TOMLVALUE_ARRAY,
+    TOMLVALUE_INLINETABLE,
+};
+
+struct TomlNodes;
+
+struct TomlStr {
+    const char* str;
+    size_t len;
+};
+
+struct TomlValue {
+    TomlValueKind kind;
+    TomlValueKind array_kind;       // See "Arrays" below; TOMLVALUE_NONE unless packed
+    union {
+        bool bool_val;
+        double float_val;
+        long long int_val;
+        struct {
+            const char* str_val;    // Not NUL terminated, see scan_str
+            size_t str_len;
+        };
+        struct {
+            union {
+                TomlValue** array_vals;
+                double* float_vals;
+                long long* int_vals;
+                uint8_t* bool_bits;
+                TomlStr* str_vals;
+            };
+            size_t num_array_vals;
+        };
+        struct {
+            TomlNodes* table_nodes;
+        };
+    };
+};
+
+struct TomlStmt {
+    const char* name;
+    TomlValue* value;
+};
+
+struct TomlTable {
+    const char* name;
+    TomlStmt** stmts;
+    size_t num_stmts;
+};
+
+struct TomlList {
+    const char* name;
+    TomlStmt** stmts;
+    size_t num_stmts;
+};
+
+enum TomlDeclKind {
+    TOMLDECL_NONE,
+    TOMLDECL_STMT,
+    TOMLDECL_TABLE,
+    TOMLDECL_LIST,
+};
+
+struct TomlNode {
+    TomlDeclKind kind;
+    union {
+        TomlStmt* stmt;
+        TomlTable* tbl;
+        TomlList* list;
+    };
+};
+
+struct TomlKeyTable;
+
+struct TomlNodes {
+    TomlNode** nodes;
+    size_t num_nodes;
+    TomlArena* arena;       // Set on documents returned by parse_toml, NULL otherwise
+    TomlInterns* interns;   // Likewise
+    void* mapped;           // File view the document's strings point into, if any
+    size_t mapped_size;
+    TomlKeyTable* root;     // Nested tables, on documents returned by parse_toml
+};
+
+intern void* toml_dup(const void* src, size_t size)
+{
+    if (size == 0)
+    {
+        return NULL;
+    }
+    void* ptr = TOML_MALLOC(size);
+    memcpy(ptr, src, size);
+    return ptr;
+}
+
+intern void* toml_arena_dup(TomlArena* arena, const void* src, size_t size)
+{
+    if (size == 0)
+    {
+        return NULL;
+    }
+    void* ptr = toml_arena_alloc(arena, size);
+    memcpy(ptr, src, size);
+    return ptr;
+}
+
+#define TOML_DUP(x) toml_dup(x, num_##x * sizeof(*x))
+#define TOML_ARENA_DUP(a, x) toml_arena_dup(a, x, num_##x * sizeof(*x))
+
+intern TomlNodes* new_tomlnodes(TomlArena* arena, TomlNode** nodes, size_t num_nodes)
+{
+    TomlNodes* result = TOML_ARENA_ALLOC(arena, TomlNodes);
+    result->nodes = nodes;
+    result->num_nodes = num_nodes;
+    result->arena = NULL;
+    result->interns = NULL;
+    result->mapped = NULL;
+    result->mapped_size = 0;
+    result->root = NULL;
+    return result;
+}
+
+intern TomlTable* new_toml_table(TomlArena* arena, const char* name, TomlStmt** stmts, size_t num_stmts)
+{
+    TomlTable* result = TOML_ARENA_ALLOC(arena, TomlTable);
+    result->name = name;
+    result->stmts = stmts;
+    result->num_stmts = num_stmts;
+    return result;
+}
+
+intern TomlList* new_toml_list(TomlArena* arena, const char* name, TomlStmt** stmts, size_t num_stmts)
+{
+    TomlList* result = TOML_ARENA_ALLOC(arena, TomlList);
+    result->name = name;
+    result->stmts = stmts;
+    result->num_stmts = num_stmts;
+    return result;
+}
+
+intern TomlStmt* new_toml_stmt(TomlArena* arena, const char* name, TomlValue* value)
+{
+    TomlStmt* result = TOML_ARENA_ALLOC(arena, TomlStmt);
+    result->name = name;
+    result->value = value;
+    return result;
+}
+
+intern TomlNode* new_toml_node(TomlArena* arena, TomlDeclKind kind)
+{
+    TomlNode* result = TOML_ARENA_ALLOC(arena, TomlNode);
+    result->kind = kind;
+    return result;
+}
+
+/*
+Arrays
+
+An array whose elements are all bools, all ints, all floats or all strings is
+packed: array_kind is that kind and the elements sit in one arena block, as
+doubles, long longs, TomlStrs or a bitset of bools (bit i of byte i / 8), with
+no TomlValue per element. Anything else (mixed kinds, nested arrays, inline
+tables, or no elements at all) has array_kind TOMLVALUE_NONE and array_vals
+pointing at one TomlValue per element.
+
+toml_array_get reads any element of either. The typed accessors hand out a
+packed array's elements as they are stored, or NULL and a count of 0 if
+the value isn't an array packed as that kind.
+*/
+
+intern TomlValue toml_array_get(const TomlValue* array, size_t i)
+{
+    assert(array->kind == TOMLVALUE_ARRAY && i < array->num_array_vals);
+    TomlValue result;
+    result.kind = array->array_kind;
+    result.array_kind = TOMLVALUE_NONE;
+    switch (array->array_kind)
+    {
+        case TOMLVALUE_BOOL:
+            result.bool_val = (array->bool_bits[i >> 3] >> (i & 7)) & 1;
+            break;
+        case TOMLVALUE_INT:
+            result.int_val = array->int_vals[i];
+            break;
+        case TOMLVALUE_FLOAT:
+            result.float_val = array->float_vals[i];
+            break;
+        case TOMLVALUE_STR:
+            result.str_val = array->str_vals[i].str;
+            result.str_len = array->str_vals[i].len;
+            break;
+        default:
+            result = *array->array_vals[i];
+            break;
+    }
+    return result;
+}
+
+intern const double* toml_array_floats(const TomlValue* array, size_t* count)
+{
+    bool packed = array->kind == TOMLVALUE_ARRAY && array->array_kind == TOMLVALUE_FLOAT;
+    *count = packed ? array->num_array_vals : 0;
+    return packed ? array->float_vals : NULL;
+}
+
+intern const long long* toml_array_ints(const TomlValue* array, size_t* count)
+{
+    bool packed = array->kind == TOMLVALUE_ARRAY && array->array_kind == TOMLVALUE_INT;
+    *count = packed ? array->num_array_vals : 0;
+    return packed ? array->int_vals : NULL;
+}
+
+intern const uint8_t* toml_array_bools(const TomlValue* array, size_t* count)
+{
+    bool packed = array->kind == TOMLVALUE_ARRAY && array->array_kind == TOMLVALUE_BOOL;
+    *count = packed ? array->num_array_vals : 0;
+    return packed ? array->bool_bits : NULL;
+}
+
+intern const TomlStr* toml_array_strs(const TomlValue* array, size_t* count)
+{
+    bool packed = array->kind == TOMLVALUE_ARRAY && array->array_kind == TOMLVALUE_STR;
+    *count = packed ? array->num_array_vals : 0;
+    return packed ? array->str_vals : NULL;
+}
+
+// Builds array out of count elements, packing them if they allow it.
+intern void toml_pack_array(TomlArena* arena, TomlValue* array, const TomlValue* vals, size_t count)
+{
+    TomlValueKind kind = count > 0 ? vals[0].kind : TOMLVALUE_NONE;
+    if (kind == TOMLVALUE_ARRAY || kind == TOMLVALUE_INLINETABLE)
+    {
+        kind = TOMLVALUE_NONE;
+    }
+    for (size_t i = 1; i < count && kind != TOMLVALUE_NONE; i++)
+    {
+        kind = vals[i].kind == kind ? kind : TOMLVALUE_NONE;
+    }
+    array->kind = TOMLVALUE_ARRAY;
+    array->array_kind = kind;
+    array->num_array_vals = count;
+    switch (kind)
+    {
+        case TOMLVALUE_BOOL:
+            array->bool_bits = (uint8_t*)toml_arena_alloc(arena, (count + 7) / 8);
+            memset(array->bool_bits, 0, (count + 7) / 8);
+            for (size_t i = 0; i < count; i++)
+            {
+                array->bool_bits[i >> 3] |= (uint8_t)(vals[i].bool_val << (i & 7));
+            }
+            break;
+        case TOMLVALUE_INT:
+            array->int_vals = (long long*)toml_arena_alloc(arena, count * sizeof(long long));
+            for (size_t i = 0; i < count; i++)
+            {
+                array->int_vals[i] = vals[i].int_val;
+            }
+            break;
+        case TOMLVALUE_FLOAT:
+            array->float_vals = (double*)toml_arena_alloc(arena, count * sizeof(double));
+            for (size_t i = 0; i < count; i++)
+            {
+                array->float_vals[i] = vals[i].float_val;
+            }
+            break;
+        case TOMLVALUE_STR:
+            array->str_vals = (TomlStr*)toml_arena_alloc(arena, count * sizeof(TomlStr));
+            for (size_t i = 0; i < count; i++)
+            {
+                array->str_vals[i].str = vals[i].str_val;
+                array->str_vals[i].len = vals[i].str_len;
+            }
+            break;
+        default: {
+            TomlValue* elements = (TomlValue*)toml_arena_dup(arena, vals, count * sizeof(TomlValue));
+            array->array_vals = count > 0 ? (TomlValue**)toml_arena_alloc(arena, count * sizeof(TomlValue*)) : NULL;
+            for (size_t i = 0; i < count; i++)
+            {
+                array->array_vals[i] = &elements[i];
+            }
+        } break;
+    }
+}
+
+/*
+The parser builds nothing itself. The recursive descent below reports what it
+finds through a TomlEvents table as it goes, and parse_toml's tree is just one
+consumer of those events (see the tree builder further down). Any callback
+may be NULL. Names are interned and values are passed by pointer to a stack
+TomlValue, so no event allocates; only the scanner does, for names it hasn't
+seen yet and for strings that need unescaping.
+
+A document produces, in order:
+    on_key, value                           for each top-level statement
+    on_table_begin / on_array_table_begin,
+    { on_key, value }, on_table_end         for each [table] / [[list]]
+where a value is either a single on_value (never an array or inline table),
+    on_array_begin, { value }, on_array_end
+or  on_inline_table_begin, { on_key, value }, on_inline_table_end
+*/
+
+struct TomlEvents {
+    void (*on_table_begin)(void* user, const char* name);
+    void (*on_array_table_begin)(void* user, const char* name);
+    void (*on_table_end)(void* user);
+    void (*on_key)(void* user, const char* name);
+    void (*on_value)(void* user, const TomlValue* value);
+    void (*on_array_begin)(void* user);
+    void (*on_array_end)(void* user);
+    void (*on_inline_table_begin)(void* user);
+    void (*on_inline_table_end)(void* user);
+};
+
+#ifdef TOML_STATS
+#define toml_emit(ctx, event) \
+    ((ctx)->events->event ? (toml_stats_emit_begin(ctx), (ctx)->events->event((ctx)->user), toml_stats_emit_end(ctx)) : (void)0)
+#define toml_emit_arg(ctx, event, arg) \
+    ((ctx)->events->event ? (toml_stats_emit_begin(ctx), (ctx)->events->event((ctx)->user, arg), toml_stats_emit_end(ctx)) : (void)0)
+#else
+#define toml_emit(ctx, event) ((ctx)->events->event ? (ctx)->events->event((ctx)->user) : (void)0)
+#define toml_emit_arg(ctx, event, arg) ((ctx)->events->event ? (ctx)->events->event((ctx)->user, arg) : (void)0)
+#endif
+
+intern void parse_toml_stmt(TomlParseContext* ctx);
+
+intern void parse_toml_value(TomlParseContext* ctx)
+{
+    TomlValue value;
+    value.array_kind = TOMLVALUE_NONE;
+    if (is_token(ctx, TOKEN_NAME))
+    {
+        switch (toml_name_keyword(ctx->token.name))
+        {
+            case TOML_KEYWORD_TRUE:
+                value.kind = TOMLVALUE_BOOL;
+                value.bool_val = true;
+                break;
+            case TOML_KEYWORD_FALSE:
+                value.kind = TOMLVALUE_BOOL;
+                value.bool_val = false;
+                break;
+            case TOML_KEYWORD_INF:
+                value.kind = TOMLVALUE_FLOAT;
+                value.float_val = HUGE_VAL;
+                break;
+            case TOML_KEYWORD_NAN:
+                value.kind = TOMLVALUE_FLOAT;
+                value.float_val = NAN;
+                break;
+            default:
+                error_here("Expected value type, found name");
+                break;
+        }
+        toml_emit_arg(ctx, on_value, &value);
+        next_token(ctx);
+    }
+    else if (is_token(ctx, TOKEN_INT))
+    {
+        value.kind = TOMLVALUE_INT;
+        value.int_val = ctx->token.int_val;
+        toml_emit_arg(ctx, on_value, &value);
+        next_token(ctx);
+    }
+    else if (is_token(ctx, TOKEN_FLOAT))
+    {
+        value.kind = TOMLVALUE_FLOAT;
+        value.float_val = ctx->token.float_val;
+        toml_emit_arg(ctx, on_value, &value);
+        next_token(ctx);
+    }
+    else if (is_token(ctx, TOKEN_STR))
+    {
+        value.kind = TOMLVALUE_STR;
+        value.str_val = ctx->token.str_val;
+        value.str_len = ctx->token.str_len;
+        toml_emit_arg(ctx, on_value, &value);
+        next_token(ctx);
+    }
+    else if (is_token(ctx, TOKEN_LBRACKET))
+    {
+        TOML_STATS_ENTER(ctx);
+        toml_emit(ctx, on_array_begin);
+        next_token(ctx);
+        parse_toml_value(ctx);
+        while (is_token(ctx, TOKEN_COMMA))
+        {
+            next_token(ctx);
+            if (is_token(ctx, TOKEN_RBRACKET)) // trailing commas are permitted
+            {
+                break;
+            }
+            parse_toml_value(ctx);
+        }
+        expect_token(ctx, TOKEN_RBRACKET);
+        toml_emit(ctx, on_array_end);
+        TOML_STATS_LEAVE(ctx);
+    }
+    else if (is_token(ctx, TOKEN_LBRACE))
+    {
+        TOML_STATS_ENTER(ctx);
+        toml_emit(ctx, on_inline_table_begin);
+        next_token(ctx);
+        parse_toml_stmt(ctx);
+        while (is_token(ctx, TOKEN_COMMA))
+        {
+            next_token(ctx);
+            if (is_token(ctx, TOKEN_RBRACE)) // trailing commas are permitted
+            {
+                break;
+            }
+            parse_toml_stmt(ctx);
+        }
+        expect_token(ctx, TOKEN_RBRACE);
+        toml_emit(ctx, on_inline_table_end);
+        TOML_STATS_LEAVE(ctx);
+    }
+    else
+    {
+        error_here("Unexpected token %s", token_info(ctx));
+    }
+}
+
+intern void parse_toml_stmt(TomlParseContext* ctx)
+{
+    const char* name = ctx->token.name;
+    expect_token(ctx, TOKEN_NAME);
+    expect_token(ctx, TOKEN_EQ);
+    toml_emit_arg(ctx, on_key, name);
+    parse_toml_value(ctx);
+}
+
+// Parses a [table] or [[list]] header. Its statements follow as top-level
+// ones do, until the next header.
+intern void parse_toml_header(TomlParseContext* ctx)
+{
+    expect_token(ctx, TOKEN_LBRACKET);
+    if (match_token(ctx, TOKEN_LBRACKET))
+    {
+        const char* name = ctx->token.name;
+        expect_token(ctx, TOKEN_NAME);
+        // Emitted before the closing brackets so the position is still on
+        // the header's line.
+        toml_emit_arg(ctx, on_array_table_begin, name);
+        expect_token(ctx, TOKEN_RBRACKET);
+        expect_token(ctx, TOKEN_RBRACKET);
+    }
+    else
+    {
+        const char* name = ctx->token.name;
+        expect_token(ctx, TOKEN_NAME);
+        toml_emit_arg(ctx, on_table_begin, name);
+        expect_token(ctx, TOKEN_RBRACKET);
+    }
+}
+
+// Parses declarations up to the end of the input. *in_table says whether a
+// table or list is open, both on the way in and out, so a document can be
+// parsed in pieces that split a table's statements.
+intern void parse_toml_nodes_until_eof(TomlParseContext* ctx, bool* in_table)
+{
+    if (ctx->tokenizer == TOML_TOKENIZER_INDEX)
+    {
+        toml_build_structural_index(ctx);
+    }
+    next_token(ctx);
+    while (!is_token(ctx, TOKEN_EOF))
+    {
+        if (is_token(ctx, TOKEN_LBRACKET))
+        {
+            if (*in_table)
+            {
+                toml_emit(ctx, on_table_end);
+            }
+            parse_toml_header(ctx);
+            *in_table = true;
+        }
+        else if (is_token(ctx, TOKEN_NAME))
+        {
+            parse_toml_stmt(ctx);
+        }
+        else
+        {
+            error_here("Expected one or more declarations");
+        }
+    }
+}
+
+intern void parse_toml_document(TomlParseContext* ctx)
+{
+    TOML_STATS_START(ctx, parse_start);
+#ifdef TOML_STATS
+    const char* stream_start = ctx->stream;
+    size_t arena_start = ctx->arena->bytes_allocated;
+#endif
+    bool in_table = false;
+    parse_toml_nodes_until_eof(ctx, &in_table);
+    if (in_table)
+    {
+        toml_emit(ctx, on_table_end);
+    }
+    TOML_STATS_STOP(ctx, parse_start, parse_ticks);
+#ifdef TOML_STATS
+    if (ctx->stats)
+    {
+        ctx->stats->parses++;
+        ctx->stats->bytes_parsed += ctx->end - stream_start;
+        ctx->stats->arena_bytes += ctx->arena->bytes_allocated - arena_start;
+    }
+#endif
+}
+
+/*
+Nested tables
+
+Alongside the flat list of nodes, documents returned by parse_toml carry the
+tree TOML describes: headers and dotted keys are split at their dots and
+resolved into tables of single-segment keys, and [[lists]] into arrays of
+tables. The tree builder inserts into it as the events arrive, so the checks
+TOML requires (no key defined twice, no table defined twice, no header over
+a value, an inline table or a list, and so on) cost a lookup per key.
+
+Keys are interned, so each table is a small hash table keyed by name
+pointer, and looking up a path is one probe per segment. Tables only get a
+hash once they outgrow a linear scan.
+*/
+
+#define TOML_KEY_TABLE_LINEAR 8
+
+enum TomlKeyKind {
+    TOMLKEY_VALUE,
+    TOMLKEY_TABLE,
+    TOMLKEY_LIST,
+};
+
+enum TomlKeyTableOrigin {
+    TOMLTABLE_IMPLICIT,     // Only named as the parent of something else so far
+    TOMLTABLE_HEADER,       // Defined by a [header]
+    TOMLTABLE_DOTTED,       // Created by a dotted key
+    TOMLTABLE_INLINE,       // An inline table value, closed to additions
+    TOMLTABLE_LIST_ITEM,    // One [[list]] entry
+};
+
+struct TomlKeyTable;
+
+struct TomlKeyList {
+    TomlKeyTable** items;
+    size_t num_items;
+    size_t max_items;
+};
+
+struct TomlKeyEntry {
+    const char* name;       // Interned single segment
+    TomlKeyKind kind;
+    union {
+        TomlValue* value;
+        TomlKeyTable* table;
+        TomlKeyList* list;
+    };
+};
+
+struct TomlKeyTable {
+    TomlKeyEntry* entries;  // In definition order
+    size_t num_entries;
+    size_t max_entries;
+    uint32_t* slots;        // Entry index + 1, or 0; NULL while the table is small
+    size_t num_slots;
+    TomlKeyTableOrigin origin;
+};
+
+// Where errors are reported: the parse position, or the document name
+// when building from finished nodes.
+struct TomlKeyBuilder {
+    TomlArena* arena;       // Tables and lists
+    TomlArena* name_arena;  // Segment names new to interns
+    TomlInterns* interns;
+    const SrcPos* pos;
+    const char* name;
+    TomlKeyTable* root;
+    TomlKeyTable* current;  // Where statements go
+};
+
+intern void toml_key_error(TomlKeyBuilder* keys, const char* fmt, const char* name)
+{
+    SrcPos pos = {};
+    if (keys->pos)
+    {
+        pos = *keys->pos;
+    }
+    else
+    {
+        pos.name = keys->name;
+    }
+    parse_error(pos, fmt, name);
+}
+
+intern TomlKeyTable* toml_new_key_table(TomlArena* arena, TomlKeyTableOrigin origin)
+{
+    TomlKeyTable* table = TOML_ARENA_ALLOC(arena, TomlKeyTable);
+    memset(table, 0, sizeof(*table));
+    table->origin = origin;
+    return table;
+}
+
+intern void toml_key_table_rehash(TomlArena* arena, TomlKeyTable* table, size_t num_slots)
+{
+    table->slots = (uint32_t*)toml_arena_alloc(arena, num_slots * sizeof(uint32_t));
+    memset(table->slots, 0, num_slots * sizeof(uint32_t));
+    table->num_slots = num_slots;
+    for (size_t i = 0; i < table->num_entries; i++)
+    {
+        size_t slot = toml_name_hash(table->entries[i].name) & (num_slots - 1);
+        while (table->slots[slot])
+        {
+            slot = (slot + 1) & (num_slots - 1);
+        }
+        table->slots[slot] = (uint32_t)(i + 1);
+    }
+}
+
+// name must be interned in the document's table.
+intern TomlKeyEntry* toml_key_table_find(const TomlKeyTable* table, const char* name)
+{
+    if (!table->slots)
+    {
+        for (size_t i = 0; i < table->num_entries; i++)
+        {
+            if (table->entries[i].name == name)
+            {
+                return &table->entries[i];
+            }
+        }
+        return NULL;
+    }
+    for (size_t slot = toml_name_hash(name) & (table->num_slots - 1);; slot = (slot + 1) & (table->num_slots - 1))
+    {
+        uint32_t index = table->slots[slot];
+        if (!index)
+        {
+            return NULL;
+        }
+        if (table->entries[index - 1].name == name)
+        {
+            return &table->entries[index - 1];
+        }
+    }
+}
+
+// The entry stays valid until the next insertion into the same table.
+intern TomlKeyEntry* toml_key_table_add(TomlArena* arena, TomlKeyTable* table, const char* name, TomlKeyKind kind)
+{
+    if (table->num_entries == table->max_entries)
+    {
+        size_t max_entries = table->max_entries ? table->max_entries * 2 : 4;
+        TomlKeyEntry* entries = (TomlKeyEntry*)toml_arena_alloc(arena, max_entries * sizeof(TomlKeyEntry));
+        if (table->num_entries)
+        {
+            memcpy(entries, table->entries, table->num_entries * sizeof(TomlKeyEntry));
+        }
+        table->entries = entries;
+        table->max_entries = max_entries;
+    }
+    TomlKeyEntry* entry = &table->entries[table->num_entries++];
+    memset(entry, 0, sizeof(*entry));
+    entry->name = name;
+    entry->kind = kind;
+    if (table->slots && table->num_entries * 2 > table->num_slots)
+    {
+        toml_key_table_rehash(arena, table, table->num_slots * 2);
+    }
+    else if (table->slots)
+    {
+        size_t slot = toml_name_hash(name) & (table->num_slots - 1);
+        while (table->slots[slot])
+        {
+            slot = (slot + 1) & (table->num_slots - 1);
+        }
+        table->slots[slot] = (uint32_t)table->num_entries;
+    }
+    else if (table->num_entries > TOML_KEY_TABLE_LINEAR)
+    {
+        toml_key_table_rehash(arena, table, TOML_KEY_TABLE_LINEAR * 4);
+    }
+    return entry;
+}
+
+intern TomlKeyTable* toml_key_list_push(TomlArena* arena, TomlKeyList* list)
+{
+    if (list->num_items == list->max_items)
+    {
+        size_t max_items = list->max_items ? list->max_items * 2 : 4;
+        TomlKeyTable** items = (TomlKeyTable**)toml_arena_alloc(arena, max_items * sizeof(TomlKeyTable*));
+        if (list->num_items)
+        {
+            memcpy(items, list->items, list->num_items * sizeof(TomlKeyTable*));
+        }
+        list->items = items;
+        list->max_items = max_items;
+    }
+    TomlKeyTable* item = toml_new_key_table(arena, TOMLTABLE_LIST_ITEM);
+    list->items[list->num_items++] = item;
+    return item;
+}
+
+// Splits an interned dotted name into interned segments; returns how many.
+intern size_t toml_key_segments(TomlKeyBuilder* keys, const char* name, const char** segments, size_t max_segments)
+{
+    size_t len = toml_name_len(name);
+    if (!memchr(name, '.', len))
+    {
+        segments[0] = name;
+        return 1;
+    }
+    size_t num_segments = 0;
+    size_t start = 0;
+    for (size_t i = 0; i <= len; i++)
+    {
+        if (i == len || name[i] == '.')
+        {
+            if (i == start)
+            {
+                toml_key_error(keys, "Empty key segment in '%s'", name);
+            }
+            if (num_segments == max_segments)
+            {
+                toml_key_error(keys, "Too many dotted segments in '%s'", name);
+            }
+            segments[num_segments++] = toml_intern(keys->interns, keys->name_arena, name + start, i - start);
+            start = i + 1;
+        }
+    }
+    return num_segments;
+}
+
+#define TOML_MAX_KEY_SEGMENTS 64
+
+// Walks to the table that will hold the last segment of a header name,
+// creating implicit tables and descending into the latest [[list]] item.
+intern TomlKeyTable* toml_key_header_parent(TomlKeyBuilder* keys, const char* name, const char** segments, size_t num_segments)
+{
+    TomlKeyTable* table = keys->root;
+    for (size_t i = 0; i + 1 < num_segments; i++)
+    {
+        TomlKeyEntry* entry = toml_key_table_find(table, segments[i]);
+        if (!entry)
+        {
+            TomlKeyTable* child = toml_new_key_table(keys->arena, TOMLTABLE_IMPLICIT);
+            toml_key_table_add(keys->arena, table, segments[i], TOMLKEY_TABLE)->table = child;
+            table = child;
+        }
+        else if (entry->kind == TOMLKEY_TABLE && entry->table->origin != TOMLTABLE_INLINE)
+        {
+            table = entry->table;
+        }
+        else if (entry->kind == TOMLKEY_LIST)
+        {
+            table = entry->list->items[entry->list->num_items - 1];
+        }
+        else
+        {
+            toml_key_error(keys, "Table [%s] extends a key that isn't a table", name);
+        }
+    }
+    return table;
+}
+
+intern void toml_key_open_table(TomlKeyBuilder* keys, const char* name)
+{
+    const char* segments[TOML_MAX_KEY_SEGMENTS];
+    size_t num_segments = toml_key_segments(keys, name, segments, TOML_MAX_KEY_SEGMENTS);
+    TomlKeyTable* parent = toml_key_header_parent(keys, name, segments, num_segments);
+    TomlKeyEntry* entry = toml_key_table_find(parent, segments[num_segments - 1]);
+    if (!entry)
+    {
+        keys->current = toml_new_key_table(keys->arena, TOMLTABLE_HEADER);
+        toml_key_table_add(keys->arena, parent, segments[num_segments - 1], TOMLKEY_TABLE)->table = keys->current;
+    }
+    else if (entry->kind == TOMLKEY_TABLE && entry->table->origin == TOMLTABLE_IMPLICIT)
+    {
+        entry->table->origin = TOMLTABLE_HEADER;
+        keys->current = entry->table;
+    }
+    else if (entry->kind == TOMLKEY_TABLE)
+    {
+        toml_key_error(keys, "Table [%s] is already defined", name);
+    }
+    else if (entry->kind == TOMLKEY_LIST)
+    {
+        toml_key_error(keys, "Table [%s] is already defined as an array of tables", name);
+    }
+    else
+    {
+        toml_key_error(keys, "Table [%s] is already defined as a value", name);
+    }
+}
+
+intern void toml_key_open_list_item(TomlKeyBuilder* keys, const char* name)
+{
+    const char* segments[TOML_MAX_KEY_SEGMENTS];
+    size_t num_segments = toml_key_segments(keys, name, segments, TOML_MAX_KEY_SEGMENTS);
+    TomlKeyTable* parent = toml_key_header_parent(keys, name, segments, num_segments);
+    TomlKeyEntry* entry = toml_key_table_find(parent, segments[num_segments - 1]);
+    if (!entry)
+    {
+        TomlKeyList* list = TOML_ARENA_ALLOC(keys->arena, TomlKeyList);
+        memset(list, 0, sizeof(*list));
+        toml_key_table_add(keys->arena, parent, segments[num_segments - 1], TOMLKEY_LIST)->list = list;
+        keys->current = toml_key_list_push(keys->arena, list);
+    }
+    else if (entry->kind == TOMLKEY_LIST)
+    {
+        keys->current = toml_key_list_push(keys->arena, entry->list);
+    }
+    else
+    {
+        toml_key_error(keys, "Array of tables [[%s]] is already defined as a table or value", name);
+    }
+}
+
+intern TomlKeyTable* toml_key_add_stmt(TomlKeyBuilder* keys, TomlKeyTable* table, const char* name, TomlValue* value);
+
+// Inline tables become closed tables; those inside arrays are only checked.
+intern TomlKeyTable* toml_key_inline_table(TomlKeyBuilder* keys, TomlValue* value)
+{
+    TomlKeyTable* table = toml_new_key_table(keys->arena, TOMLTABLE_INLINE);
+    for (size_t i = 0; i < value->table_nodes->num_nodes; i++)
+    {
+        TomlStmt* stmt = value->table_nodes->nodes[i]->stmt;
+        toml_key_add_stmt(keys, table, stmt->name, stmt->value);
+    }
+    return table;
+}
+
+intern void toml_key_check_array(TomlKeyBuilder* keys, TomlValue* value)
+{
+    // Packed arrays hold only scalars
+    for (size_t i = 0; value->array_kind == TOMLVALUE_NONE && i < value->num_array_vals; i++)
+    {
+        TomlValue* element = value->array_vals[i];
+        if (element->kind == TOMLVALUE_INLINETABLE)
+        {
+            toml_key_inline_table(keys, element);
+        }
+        else if (element->kind == TOMLVALUE_ARRAY)
+        {
+            toml_key_check_array(keys, element);
+        }
+    }
+}
+
+// Returns the table made for an inline table value, NULL for other values.
+intern TomlKeyTable* toml_key_add_stmt(TomlKeyBuilder* keys, TomlKeyTable* table, const char* name, TomlValue* value)
+{
+    const char* segments[TOML_MAX_KEY_SEGMENTS];
+    size_t num_segments = toml_key_segments(keys, name, segments, TOML_MAX_KEY_SEGMENTS);
+    // Dotted keys create or extend tables, but only ones made by dotted keys.
+    for (size_t i = 0; i + 1 < num_segments; i++)
+    {
+        TomlKeyEntry* entry = toml_key_table_find(table, segments[i]);
+        if (!entry)
+        {
+            TomlKeyTable* child = toml_new_key_table(keys->arena, TOMLTABLE_DOTTED);
+            toml_key_table_add(keys->arena, table, segments[i], TOMLKEY_TABLE)->table = child;
+            table = child;
+        }
+        else if (entry->kind == TOMLKEY_TABLE && (entry->table->origin == TOMLTABLE_DOTTED || entry->table->origin == TOMLTABLE_IMPLICIT))
+        {
+            table = entry->table;
+        }
+        else
+        {
+            toml_key_error(keys, "Dotted key '%s' extends a value or a table defined elsewhere", name);
+        }
+    }
+    const char* last = segments[num_segments - 1];
+    if (toml_key_table_find(table, last))
+    {
+        toml_key_error(keys, "Duplicate key '%s'", name);
+    }
+    if (value->kind == TOMLVALUE_INLINETABLE)
+    {
+        TomlKeyTable* inline_table = toml_key_inline_table(keys, value);
+        toml_key_table_add(keys->arena, table, last, TOMLKEY_TABLE)->table = inline_table;
+        return inline_table;
+    }
+    if (value->kind == TOMLVALUE_ARRAY)
+    {
+        toml_key_check_array(keys, value);
+    }
+    toml_key_table_add(keys->arena, table, last, TOMLKEY_VALUE)->value = value;
+    return NULL;
+}
+
+intern void toml_key_builder_init(TomlKeyBuilder* keys, TomlArena* arena, TomlInterns* interns)
+{
+    memset(keys, 0, sizeof(*keys));
+    keys->arena = arena;
+    keys->name_arena = arena;
+    keys->interns = interns;
+    keys->root = toml_new_key_table(arena, TOMLTABLE_HEADER);
+    keys->current = keys->root;
+}
+
+// Builds doc->root from its nodes, for documents that were assembled from
+// pieces parsed separately. name is used in error messages. The tables go in
+// arena; segment names not seen before are interned in the document's.
+intern void toml_build_key_tables(TomlNodes* doc, const char* name, TomlArena* arena)
+{
+    TomlKeyBuilder keys;
+    toml_key_builder_init(&keys, arena, doc->interns);
+    keys.name_arena = doc->arena;
+    keys.name = name;
+    for (size_t i = 0; i < doc->num_nodes; i++)
+    {
+        TomlNode* node = doc->nodes[i];
+        TomlStmt** stmts = NULL;
+        size_t num_stmts = 0;
+        switch (node->kind)
+        {
+            case TOMLDECL_STMT:
+                toml_key_add_stmt(&keys, keys.current, node->stmt->name, node->stmt->value);
+                break;
+            case TOMLDECL_TABLE:
+                toml_key_open_table(&keys, node->tbl->name);
+                stmts = node->tbl->stmts;
+                num_stmts = node->tbl->num_stmts;
+                break;
+            case TOMLDECL_LIST:
+                toml_key_open_list_item(&keys, node->list->name);
+                stmts = node->list->stmts;
+                num_stmts = node->list->num_stmts;
+                break;
+            default:
+                assert(0);
+                break;
+        }
+        for (size_t j = 0; j < num_stmts; j++)
+        {
+            toml_key_add_stmt(&keys, keys.current, stmts[j]->name, stmts[j]->value);
+        }
+    }
+    doc->root = keys.root;
+}
+
+// Looks up a dotted path, one hash probe per segment. Inside a [[list]] the
+// path continues into its last item, as headers do. Returns NULL if there's
+// no such key, or no key tables (root is NULL).
+intern const TomlKeyEntry* toml_lookup(const TomlNodes* doc, const char* path)
+{
+    const TomlKeyTable* table = doc->root;
+    if (!table)
+    {
+        return NULL;
+    }
+    const char* segment = path;
+    for (;;)
+    {
+        const char* dot = strchr(segment, '.');
+        size_t len = dot ? (size_t)(dot - segment) : strlen(segment);
+        const char* name = toml_intern_find(doc->interns, segment, len, toml_hash(segment, len));
+        const TomlKeyEntry* entry = name ? toml_key_table_find(table, name) : NULL;
+        if (!entry || !dot)
+        {
+            return entry;
+        }
+        if (entry->kind == TOMLKEY_TABLE)
+        {
+            table = entry->table;
+        }
+        else if (entry->kind == TOMLKEY_LIST)
+        {
+            table = entry->list->items[entry->list->num_items - 1];
+        }
+        else
+        {
+            return NULL;
+        }
+        segment = dot + 1;
+    }
+}
+
+/*
+The tree builder turns events back into TomlNodes. Each open table, list,
+array and inline table has a frame, and the items parsed inside it so far
+(statements, nodes or values) are kept on the items stack until the frame
+closes and they are copied into the arena in one piece.
+*/
+
+enum TomlFrameKind {
+    TOML_FRAME_DOCUMENT,
+    TOML_FRAME_TABLE,
+    TOML_FRAME_LIST,
+    TOML_FRAME_ARRAY,
+    TOML_FRAME_INLINE_TABLE,
+};
+
+struct TomlTreeFrame {
+    TomlFrameKind kind;
+    const char* name;   // Table or list name
+    const char* key;    // Key of the statement being parsed
+    size_t mark;        // Where the frame's items (or array elements) start
+};
+
+// Array elements are collected by value and only copied out once the array
+// is complete, so packed arrays never allocate a TomlValue per element.
+struct TomlTreeBuilder {
+    TomlArena* arena;
+    TomlTreeFrame* frames;  // Stretchy buffer
+    void** items;           // Stretchy buffer
+    TomlValue* elements;    // Stretchy buffer
+    TomlKeyBuilder* keys;   // Nested tables, if they're being built
+};
+
+intern void tree_push_frame(TomlTreeBuilder* builder, TomlFrameKind kind, const char* name)
+{
+    TomlTreeFrame frame = {};
+    frame.kind = kind;
+    frame.name = name;
+    frame.mark = kind == TOML_FRAME_ARRAY ? sb_count(builder->elements) : sb_count(builder->items);
+    sb_push(builder->frames, frame);
+}
+
+// Pops the innermost frame, copying its items into the arena.
+intern void** tree_pop_frame(TomlTreeBuilder* builder, TomlTreeFrame* frame, size_t* count)
+{
+    *frame = sb_last(builder->frames);
+    toml_sb_truncate(builder->frames, sb_count(builder->frames) - 1);
+    *count = sb_count(builder->items) - frame->mark;
+    void** result = (void**)toml_arena_dup(builder->arena, builder->items + frame->mark, *count * sizeof(void*));
+    toml_sb_truncate(builder->items, frame->mark);
+    return result;
+}
+
+intern void tree_add_value(TomlTreeBuilder* builder, const TomlValue* element)
+{
+    TomlTreeFrame* frame = &sb_last(builder->frames);
+    if (frame->kind == TOML_FRAME_ARRAY)
+    {
+        sb_push(builder->elements, *element);
+        return;
+    }
+    TomlValue* value = TOML_ARENA_ALLOC(builder->arena, TomlValue);
+    *value = *element;
+    TomlStmt* stmt = new_toml_stmt(builder->arena, frame->key, value);
+    if (builder->keys && frame->kind != TOML_FRAME_INLINE_TABLE)
+    {
+        toml_key_add_stmt(builder->keys, builder->keys->current, frame->key, value);
+    }
+    if (frame->kind == TOML_FRAME_TABLE || frame->kind == TOML_FRAME_LIST)
+    {
+        sb_push(builder->items, stmt);
+    }
+    else
+    {
+        TomlNode* node = new_toml_node(builder->arena, TOMLDECL_STMT);
+        node->stmt = stmt;
+        sb_push(builder->items, node);
+    }
+}
+
+intern void tree_on_table_begin(void* user, const char* name)
+{
+    TomlTreeBuilder* builder = (TomlTreeBuilder*)user;
+    if (builder->keys)
+    {
+        toml_key_open_table(builder->keys, name);
+    }
+    tree_push_frame(builder, TOML_FRAME_TABLE, name);
+}
+
+intern void tree_on_array_table_begin(void* user, const char* name)
+{
+    TomlTreeBuilder* builder = (TomlTreeBuilder*)user;
+    if (builder->keys)
+    {
+        toml_key_open_list_item(builder->keys, name);
+    }
+    tree_push_frame(builder, TOML_FRAME_LIST, name);
+}
+
+intern void tree_on_table_end(void* user)
+{
+    TomlTreeBuilder* builder = (TomlTreeBuilder*)user;
+    TomlTreeFrame frame;
+    size_t num_stmts;
+    TomlStmt** stmts = (TomlStmt**)tree_pop_frame(builder, &frame, &num_stmts);
+    TomlNode* node;
+    if (frame.kind == TOML_FRAME_LIST)
+    {
+        node = new_toml_node(builder->arena, TOMLDECL_LIST);
+        node->list = new_toml_list(builder->arena, frame.name, stmts, num_stmts);
+    }
+    else
+    {
+        node = new_toml_node(builder->arena, TOMLDECL_TABLE);
+        node->tbl = new_toml_table(builder->arena, frame.name, stmts, num_stmts);
+    }
+    sb_push(builder->items, node);
+}
+
+intern void tree_on_key(void* user, const char* name)
+{
+    TomlTreeBuilder* builder = (TomlTreeBuilder*)user;
+    sb_last(builder->frames).key = name;
+}
+
+intern void tree_on_value(void* user, const TomlValue* value)
+{
+    tree_add_value((TomlTreeBuilder*)user, value);
+}
+
+intern void tree_on_array_begin(void* user)
+{
+    tree_push_frame((TomlTreeBuilder*)user, TOML_FRAME_ARRAY, NULL);
+}
+
+intern void tree_on_array_end(void* user)
+{
+    TomlTreeBuilder* builder = (TomlTreeBuilder*)user;
+    TomlTreeFrame frame = sb_last(builder->frames);
+    toml_sb_truncate(builder->frames, sb_count(builder->frames) - 1);
+    TomlValue result;
+    toml_pack_array(builder->arena, &result, builder->elements + frame.mark, sb_count(builder->elements) - frame.mark);
+    toml_sb_truncate(builder->elements, frame.mark);
+    tree_add_value(builder, &result);
+}
+
+intern void tree_on_inline_table_begin(void* user)
+{
+    tree_push_frame((TomlTreeBuilder*)user, TOML_FRAME_INLINE_TABLE, NULL);
+}
+
+intern void tree_on_inline_table_end(void* user)
+{
+    TomlTreeBuilder* builder = (TomlTreeBuilder*)user;
+    TomlTreeFrame frame;
+    size_t num_stmts;
+    TomlNode** stmts = (TomlNode**)tree_pop_frame(builder, &frame, &num_stmts);
+    TomlValue result;
+    result.kind = TOMLVALUE_INLINETABLE;
+    result.array_kind = TOMLVALUE_NONE;
+    result.table_nodes = new_tomlnodes(builder->arena, stmts, num_stmts);
+    tree_add_value(builder, &result);
+}
+
+global const TomlEvents toml_tree_events = {
+    tree_on_table_begin,
+    tree_on_array_table_begin,
+    tree_on_table_end,
+    tree_on_key,
+    tree_on_value,
+    tree_on_array_begin,
+    tree_on_array_end,
+    tree_on_inline_table_begin,
+    tree_on_inline_table_end,
+};
+
+// Creates an arena that lives in its own first chunk, so freeing it releases
+// the TomlArena itself along with everything allocated from it.
+intern TomlArena* toml_new_arena()
+{
+    TomlArena bootstrap = {};
+    TomlArena* arena = TOML_ARENA_ALLOC(&bootstrap, TomlArena);
+    *arena = bootstrap;
+    return arena;
+}
+
+// Names are interned in interns, or in a new table allocated from arena.
+intern void toml_init_context(TomlParseContext* ctx, const char* name, const char* buf, size_t len, TomlArena* arena, TomlInterns* interns = NULL)
+{
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->stream = buf;
+    ctx->end = buf + len;
+    ctx->line_start = ctx->stream;
+    ctx->arena = arena;
+    ctx->str_arena = arena;
+    ctx->interns = interns ? interns : toml_new_interns(arena);
+    ctx->simd = toml_simd_level;
+    ctx->tokenizer = toml_tokenizer;
+    ctx->token.pos.name = name;
+    ctx->token.pos.line = 1;
+#ifdef TOML_STATS
+    ctx->stats = toml_stats;
+#endif
+}
+
+// Detaches a context from its arena. Whatever was allocated out of it is left
+// alone.
+intern void toml_release_context(TomlParseContext* ctx)
+{
+    ctx->arena = NULL;
+    ctx->str_arena = NULL;
+    sb_free(ctx->index);
+    ctx->index = NULL;
+    ctx->index_base = NULL;
+}
+
+// Points ctx's events at builder, which builds nested tables into keys unless
+// that is NULL.
+intern void toml_begin_tree(TomlParseContext* ctx, TomlTreeBuilder* builder, TomlKeyBuilder* keys)
+{
+    memset(builder, 0, sizeof(*builder));
+    builder->arena = ctx->arena;
+    if (keys)
+    {
+        toml_key_builder_init(keys, ctx->arena, ctx->interns);
+        keys->pos = &ctx->token.pos;
+        builder->keys = keys;
+    }
+    tree_push_frame(builder, TOML_FRAME_DOCUMENT, NULL);
+    ctx->events = &toml_tree_events;
+    ctx->user = builder;
+}
+
+intern void toml_free_tree_builder(TomlTreeBuilder* builder)
+{
+    sb_free(builder->frames);
+    sb_free(builder->items);
+    sb_free(builder->elements);
+}
+
+intern TomlNodes* toml_finish_tree(TomlParseContext* ctx, TomlTreeBuilder* builder)
+{
+    TomlTreeFrame frame;
+    size_t num_nodes;
+    TomlNode** nodes = (TomlNode**)tree_pop_frame(builder, &frame, &num_nodes);
+    toml_free_tree_builder(builder);
+    TomlNodes* result = new_tomlnodes(ctx->arena, nodes, num_nodes);
+    result->arena = ctx->arena;
+    result->interns = ctx->interns;
+    result->root = builder->keys ? builder->keys->root : NULL;
+    return result;
+}
+
+// Without build_keys the result has no root, for pieces of a document that
+// toml_build_key_tables will put together.
+intern TomlNodes* parse_toml_nodes(TomlParseContext* ctx, bool build_keys = true)
+{
+    TomlKeyBuilder keys;
+    TomlTreeBuilder builder;
+    toml_begin_tree(ctx, &builder, build_keys ? &keys : NULL);
+    parse_toml_document(ctx);
+    return toml_finish_tree(ctx, &builder);
+}
+
+intern void toml_run_parse_document(void* ctx)
+{
+    parse_toml_document((TomlParseContext*)ctx);
+}
+
+// As parse_toml_nodes, but returns NULL with the error in *message (see
+// toml_recover) when the text doesn't parse. What the parse allocated out of
+// ctx's arena stays there.
+intern TomlNodes* toml_try_parse_nodes(TomlParseContext* ctx, char** message, bool build_keys = true)
+{
+    TomlKeyBuilder keys;
+    TomlTreeBuilder builder;
+    toml_begin_tree(ctx, &builder, build_keys ? &keys : NULL);
+    if (!toml_recover(toml_run_parse_document, ctx, message))
+    {
+        toml_free_tree_builder(&builder);
+        return NULL;
+    }
+    return toml_finish_tree(ctx, &builder);
+}
+
+// Parses buf reporting every declaration and value to events instead of
+// building a tree. Names and unescaped strings passed to the callbacks live in
+// arena; without one they only live until this returns.
+intern void parse_toml_events(const char* name, const char* buf, size_t len, const TomlEvents* events, void* user, TomlArena* arena = NULL)
+{
+    TomlArena* own_arena = arena ? NULL : toml_new_arena();
+    TomlParseContext ctx;
+    toml_init_context(&ctx, name, buf, len, arena ? arena : own_arena);
+    ctx.events = events;
+    ctx.user = user;
+    parse_toml_document(&ctx);
+    toml_release_context(&ctx);
+    if (own_arena)
+    {
+        toml_arena_free(own_arena);
+    }
+}
+
+/*
+The prescanner finds the places a document can be cut so that each piece
+parses on its own: line ends outside of strings, comments and brackets. It
+only tracks that much state, so it runs far ahead of the parser, and it can
+be fed a document in pieces, stopping early when a quote or escape needs more
+lookahead than it has been given so far.
+
+When split_every is set it also records, roughly every split_every bytes, the
+start of a [table] or [[list]] header line, along with its line number.
+*/
+
+struct TomlSplit {
+    size_t offset;
+    size_t line;
+};
+
+struct TomlPrescan {
+    TomlPrescanState state;
+    int depth;                  // Open [ and { outside strings and comments
+    size_t scanned;             // Bytes prescanned so far
+    size_t boundary;            // End of the last complete line, 0 for none
+    size_t line;                // Line number at scanned
+    size_t split_every;
+    size_t next_split;
+    TomlSplit* splits;          // Stretchy buffer
+};
+
+intern void toml_prescan_newline(TomlPrescan* scan, const char* buf, size_t len, size_t pos)
+{
+    scan->line++;
+    if (scan->depth > 0)
+    {
+        return;
+    }
+    scan->boundary = pos + 1;
+    if (scan->split_every && pos + 1 >= scan->next_split)
+    {
+        size_t start = pos + 1;
+        while (start < len && (buf[start] == ' ' || buf[start] == '\t'))
+        {
+            start++;
+        }
+        if (start < len && buf[start] == '[')
+        {
+            TomlSplit split = { pos + 1, scan->line };
+            sb_push(scan->splits, split);
+            scan->next_split = pos + 1 + scan->split_every;
+        }
+    }
+}
+
+// Advances the prescan over buf[scan->scanned..len).
+intern void toml_prescan(TomlPrescan* scan, const char* buf, size_t len)
+{
+    TomlSimdLevel simd = toml_simd_level;
+    const char* end = buf + len;
+    size_t pos = scan->scanned;
+    while (pos < len)
+    {
+        char c = buf[pos];
+        switch (scan->state)
+        {
+            case TOML_PRESCAN_PLAIN:
+                if (c == '"')
+                {
+                    if (len - pos < 3)
+                    {
+                        scan->scanned = pos;
+                        return;
+                    }
+                    if (buf[pos + 1] == '"' && buf[pos + 2] == '"')
+                    {
+                        scan->state = TOML_PRESCAN_MULTILINE_STR;
+                        pos += 3;
+                    }
+                    else if (buf[pos + 1] == '"')
+                    {
+                        pos += 2;
+                    }
+                    else
+                    {
+                        scan->state = TOML_PRESCAN_STR;
+                        pos++;
+                    }
+                    continue;
+                }
+                if (c == '#')
+                {
+                    scan->state = TOML_PRESCAN_COMMENT;
+                }
+                else if (c == '[' || c == '{')
+                {
+                    scan->depth++;
+                }
+                else if (c == ']' || c == '}')
+                {
+                    scan->depth--;
+                }
+                else if (c == '\n')
+                {
+                    toml_prescan_newline(scan, buf, len, pos);
+                }
+                pos++;
+                break;
+            case TOML_PRESCAN_COMMENT:
+                pos = toml_skip_comment(simd, buf + pos, end) - buf;
+                if (pos < len)
+                {
+                    // The newline itself is handled in the plain state.
+                    scan->state = TOML_PRESCAN_PLAIN;
+                }
+                break;
+            case TOML_PRESCAN_STR:
+                pos = toml_find_any(simd, buf + pos, end, '"', '\\', '\n') - buf;
+                if (pos == len)
+                {
+                    break;
+                }
+                if (buf[pos] == '\\')
+                {
+                    if (len - pos < 2)
+                    {
+                        scan->scanned = pos;
+                        return;
+                    }
+                    pos += 2;
+                    break;
+                }
+                // A newline is an error the parser will report.
+                scan->state = TOML_PRESCAN_PLAIN;
+                if (buf[pos] == '"')
+                {
+                    pos++;
+                }
+                break;
+            case TOML_PRESCAN_MULTILINE_STR:
+                pos = toml_find_any(simd, buf + pos, end, '"', '\n', '\n') - buf;
+                if (pos == len)
+                {
+                    break;
+                }
+                if (buf[pos] == '\n')
+                {
+                    scan->line++;
+                    pos++;
+                    break;
+                }
+                if (len - pos < 3)
+                {
+                    scan->scanned = pos;
+                    return;
+                }
+                if (buf[pos + 1] == '"' && buf[pos + 2] == '"')
+                {
+                    scan->state = TOML_PRESCAN_PLAIN;
+                    pos += 3;
+                    break;
+                }
+                pos++;
+                break;
+        }
+    }
+    scan->scanned = len;
+}
+
+/*
+A TomlStream parses a document pushed to it in chunks of any size, reporting
+events as it goes. Input is held back only until the prescanner finds the end
+of the line that completes the statement or header it is part of, so memory
+is bounded by the longest such line (or multi-line string/array) rather than
+by the document. Statements split across lines outside of strings and
+brackets, which TOML doesn't allow anyway, can't be streamed.
+
+String values passed to on_value point into the stream's own buffers and are
+only valid during the callback. Names are interned and stay valid until
+toml_stream_finish.
+*/
+
+struct TomlStream {
+    TomlParseContext ctx;
+    TomlArena* arena;           // Interned names
+    TomlArena str_arena;        // Unescaped strings of the piece being parsed
+    char* pending;              // Stretchy buffer of input not parsed yet
+    TomlPrescan scan;
+    bool in_table;
+};
+
+// Parses the first len bytes of pending and drops them.
+intern void toml_stream_parse(TomlStream* stream, size_t len)
+{
+    TomlParseContext* ctx = &stream->ctx;
+    ctx->stream = stream->pending;
+    ctx->end = stream->pending + len;
+    ctx->line_start = ctx->stream;
+    parse_toml_nodes_until_eof(ctx, &stream->in_table);
+
+    size_t rest = sb_count(stream->pending) - len;
+    if (rest)
+    {
+        memmove(stream->pending, stream->pending + len, rest);
+    }
+    toml_sb_truncate(stream->pending, rest);
+    stream->scan.scanned = stream->scan.scanned > len ? stream->scan.scanned - len : 0;
+    stream->scan.boundary = 0;
+    toml_arena_free(&stream->str_arena);
+}
+
+intern TomlStream* toml_stream_new(const char* name, const TomlEvents* events, void* user)
+{
+    TomlArena* arena = toml_new_arena();
+    TomlStream* stream = TOML_ARENA_ALLOC(arena, TomlStream);
+    memset(stream, 0, sizeof(*stream));
+    stream->arena = arena;
+    toml_init_context(&stream->ctx, name, NULL, 0, arena);
+    stream->ctx.str_arena = &stream->str_arena;
+    stream->ctx.events = events;
+    stream->ctx.user = user;
+    return stream;
+}
+
+intern void toml_stream_feed(TomlStream* stream, const char* chunk, size_t len)
+{
+    if (!len)
+    {
+        return;
+    }
+    memcpy(sb_add(stream->pending, (int)len), chunk, len);
+    toml_prescan(&stream->scan, stream->pending, sb_count(stream->pending));
+    if (stream->scan.boundary)
+    {
+        toml_stream_parse(stream, stream->scan.boundary);
+    }
+}
+
+// Parses whatever is left, closes the last table and frees the stream.
+intern void toml_stream_finish(TomlStream* stream)
+{
+    toml_stream_parse(stream, sb_count(stream->pending));
+    if (stream->in_table)
+    {
+        toml_emit(&stream->ctx, on_table_end);
+    }
+    sb_free(stream->pending);
+    toml_arena_free(&stream->str_arena);
+    toml_arena_free(stream->arena);
+}
+
+// Everything the returned document references is allocated out of arena or
+// points into buf, which must outlive it. buf holds len bytes and does not
+// need to be NUL terminated. When no arena is passed the document gets one of
+// its own. Either way toml_free_document releases all of it.
+intern TomlNodes* parse_toml_buffer(const char* name, const char* buf, size_t len, TomlArena* arena = NULL)
+{
+    if (!arena)
+    {
+        arena = toml_new_arena();
+    }
+    TomlParseContext ctx;
+    toml_init_context(&ctx, name, buf, len, arena);
+    TomlNodes* result = parse_toml_nodes(&ctx);
+    toml_release_context(&ctx);
+    return result;
+}
+
+intern TomlNodes* parse_toml(const char* name, const char* buf, TomlArena* arena = NULL)
+{
+    return parse_toml_buffer(name, buf, strlen(buf), arena);
+}
+
+// As parse_toml_buffer, but text that doesn't parse returns NULL with the error
+// in *message, to be released with TOML_FREE, instead of reaching error(). A
+// passed arena keeps what the failed parse allocated; one made here is freed.
+intern TomlNodes* toml_try_parse_buffer(const char* name, const char* buf, size_t len, char** message, TomlArena* arena = NULL)
+{
+    TomlArena* own_arena = arena ? NULL : toml_new_arena();
+    TomlParseContext ctx;
+    toml_init_context(&ctx, name, buf, len, arena ? arena : own_arena);
+    TomlNodes* result = toml_try_parse_nodes(&ctx, message);
+    toml_release_context(&ctx);
+    if (!result && own_arena)
+    {
+        toml_arena_free(own_arena);
+    }
+    return result;
+}
+
+/*
+toml_parse_file maps the file read-only instead of reading it into a heap
+buffer, so the only copy of the text is the page cache's and string values
+without escapes point straight into the mapping. The view stays mapped until
+toml_free_document, so the file mustn't be rewritten in place meanwhile;
+documents that have to outlive edits to their file, such as hot reloads, are
+read in with toml_load_file instead.
+*/
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+#endif
+
+// Returns the file's view and stores its size, or NULL if it can't be mapped.
+// Empty files map to an empty view.
+intern void* toml_map_file(const char* path, size_t* size)
+{
+    static char empty_file[1];
+    *size = 0;
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return NULL;
+    }
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size))
+    {
+        CloseHandle(file);
+        return NULL;
+    }
+    if (file_size.QuadPart == 0)
+    {
+        CloseHandle(file);
+        return empty_file;
+    }
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (!mapping)
+    {
+        return NULL;
+    }
+    // The view keeps the mapping alive on its own.
+    void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!view)
+    {
+        return NULL;
+    }
+    *size = (size_t)file_size.QuadPart;
+    return view;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return NULL;
+    }
+    if (st.st_size == 0)
+    {
+        close(fd);
+        return empty_file;
+    }
+    void* view = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (view == MAP_FAILED)
+    {
+        return NULL;
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(view, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+    *size = (size_t)st.st_size;
+    return view;
+#endif
+}
+
+intern void toml_unmap_file(void* view, size_t size)
+{
+    if (!size)
+    {
+        return;
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(view);
+#else
+    munmap(view, size);
+#endif
+}
+
+// Returns NULL if the file can't be opened. Errors in its contents are
+// reported like those of parse_toml.
+intern TomlNodes* toml_parse_file(const char* path, TomlArena* arena = NULL)
+{
+    size_t size;
+    void* view = toml_map_file(path, &size);
+    if (!view)
+    {
+        return NULL;
+    }
+    TomlNodes* result = parse_toml_buffer(path, (const char*)view, size, arena);
+    result->mapped = view;
+    result->mapped_size = size;
+    return result;
+}
+
+// Reads the whole file into arena and stores its size, or returns NULL if it
+// can't be read. The text is NUL terminated.
+intern char* toml_read_file(const char* path, TomlArena* arena, size_t* size)
+{
+    *size = 0;
+    FILE* file = fopen(path, "rb");
+    if (!file)
+    {
+        return NULL;
+    }
+    long file_size = -1;
+    if (fseek(file, 0, SEEK_END) == 0)
+    {
+        file_size = ftell(file);
+    }
+    if (file_size < 0 || fseek(file, 0, SEEK_SET) != 0)
+    {
+        fclose(file);
+        return NULL;
+    }
+    char* text = (char*)toml_arena_alloc(arena, (size_t)file_size + 1);
+    // A file truncated since the seek just reads short.
+    *size = fread(text, 1, (size_t)file_size, file);
+    text[*size] = 0;
+    fclose(file);
+    return text;
+}
+
+// Unlike toml_parse_file, reads the text into the document's own arena, so
+// the document doesn't change, or fault, when the file is rewritten or
+// truncated under it. Returns NULL if the file can't be read, or with the
+// error in *message (see toml_try_parse_buffer) if it doesn't parse.
+intern TomlNodes* toml_load_file(const char* path, char** message)
+{
+    *message = NULL;
+    TomlArena* arena = toml_new_arena();
+    size_t size;
+    const char* text = toml_read_file(path, arena, &size);
+    TomlNodes* result = NULL;
+    if (text)
+    {
+        const char* name = dup_str(arena, path, strlen(path));
+        result = toml_try_parse_buffer(name, text, size, message, arena);
+    }
+    if (!result)
+    {
+        toml_arena_free(arena);
+    }
+    return result;
+}
+
+intern void toml_free_document(TomlNodes* doc)
+{
+    if (doc && doc->mapped)
+    {
+        toml_unmap_file(doc->mapped, doc->mapped_size);
+    }
+    if (doc && doc->arena)
+    {
+        toml_arena_free(doc->arena);
+    }
+}
+
+/*
+Incremental reparsing
+
+An editable document keeps its text and remembers where each top-level
+section starts: the statements before the first header, and each [table] or
+[[list]] header with the statements under it. Sections start at header lines
+found by the prescanner, so each parses on its own.
+
+An edit reparses from the start of the section it begins in (or the one
+before, in case it merges lines) and prescans forward until a header that was
+also a section start before the edit and lies past the edited bytes. The rest
+of the text is unchanged from there on and was scanned from the same state,
+so those sections and their nodes are kept as they are. An edit that opens a
+multi-line string runs on until the string closes, or to the end.
+
+The reparsed text is copied into the document's arena so strings can keep
+pointing at it, and new names go into the same intern table. Replaced nodes
+stay in the arena until it has grown to TOML_EDIT_GARBAGE_RATIO times its
+size after the last full parse; the next edit then parses from scratch.
+
+An edit that leaves text which doesn't parse, as typing often does on the way
+to the next valid document, is turned down: the window is parsed before
+anything is spliced in, and on an error the text goes back to what it was,
+so the editable keeps the last document that parsed.
+
+Edits leave the nested tables stale, with doc->root NULL. toml_edit_lookup
+rebuilds them from the nodes on the first lookup after a run of edits, which
+costs a probe per key rather than a parse, into an arena of their own that
+is emptied on every rebuild. So typing costs only the sections it touches,
+and keys redefined by an edit are reported by that rebuild.
+*/
+
+#define TOML_EDIT_GARBAGE_RATIO 4
+#define TOML_EDIT_MIN_SCAN 4096
+
+struct TomlSection {
+    size_t offset;
+    size_t line;
+    size_t first_node;
+};
+
+struct TomlEdit {
+    size_t offset;              // In the text before the edit
+    size_t removed;
+    const char* inserted;
+    size_t inserted_len;
+};
+
+struct TomlEditable {
+    const char* name;
+    char* text;                 // Stretchy buffer
+    char* removed;              // Stretchy buffer, what an edit replaced
+    TomlNodes* doc;
+    TomlNode** nodes;           // Stretchy buffer, doc->nodes
+    TomlSection* sections;      // Stretchy buffer
+    size_t arena_budget;
+    size_t bytes_reparsed;      // Text parsed by the last edit
+    TomlArena key_arena;        // doc->root, when it is up to date
+    bool keys_stale;
+};
+
+intern size_t toml_count_lines(const char* text, size_t len)
+{
+    size_t lines = 0;
+    const char* end = text + len;
+    for (const char* c = (const char*)memchr(text, '\n', len); c; c = (const char*)memchr(c + 1, '\n', end - c - 1))
+    {
+        lines++;
+    }
+    return lines;
+}
+
+// Parses text[start, end) into the document's arena and intern table, or
+// returns NULL with the error in *message (see toml_try_parse_nodes).
+intern TomlNodes* toml_edit_parse_range(TomlEditable* editable, size_t start, size_t end, size_t line, char** message)
+{
+    const char* copy = (const char*)toml_arena_dup(editable->doc->arena, editable->text + start, end - start);
+    TomlParseContext ctx;
+    toml_init_context(&ctx, editable->name, copy, end - start, editable->doc->arena, editable->doc->interns);
+    ctx.token.pos.line = line;
+    TomlNodes* result = toml_try_parse_nodes(&ctx, message, false);
+    toml_release_context(&ctx);
+    editable->bytes_reparsed += end - start;
+    return result;
+}
+
+// Turns splits into sections for the nodes parsed from the text they cover,
+// which begin at first_node. Each header line begins one TABLE or LIST node;
+// only the first split can be something else.
+intern void toml_edit_push_sections(TomlEditable* editable, TomlSplit* splits, size_t num_splits, TomlNode** nodes, size_t num_nodes, size_t first_node)
+{
+    size_t node = 0;
+    for (size_t i = 0; i < num_splits; i++)
+    {
+        const char* line = editable->text + splits[i].offset;
+        const char* end = editable->text + sb_count(editable->text);
+        while (line < end && (*line == ' ' || *line == '\t'))
+        {
+            line++;
+        }
+        bool header = line < end && *line == '[';
+        if (header)
+        {
+            while (node < num_nodes && nodes[node]->kind == TOMLDECL_STMT)
+            {
+                node++;
+            }
+        }
+        TomlSection section = { splits[i].offset, splits[i].line, first_node + node };
+        sb_push(editable->sections, section);
+        if (header)
+        {
+            node++;
+        }
+    }
+}
+
+intern TomlSplit* toml_edit_prescan(const char* text, size_t start, size_t len, size_t line)
+{
+    TomlPrescan scan = {};
+    scan.line = line;
+    scan.split_every = 1;
+    scan.next_split = start + 1;
+    scan.scanned = start;
+    TomlSplit first = { start, line };
+    sb_push(scan.splits, first);
+    toml_prescan(&scan, text, len);
+    return scan.splits;
+}
+
+// Replaces the document with a parse of the whole text, or keeps it and
+// returns false if the text doesn't parse.
+intern bool toml_edit_parse_all(TomlEditable* editable, char** message)
+{
+    size_t len = sb_count(editable->text);
+    TomlNodes* old_doc = editable->doc;
+    editable->doc = parse_toml_buffer(editable->name, "", 0);
+    editable->bytes_reparsed = 0;
+    TomlNodes* parsed = toml_edit_parse_range(editable, 0, len, 1, message);
+    if (!parsed)
+    {
+        toml_free_document(editable->doc);
+        editable->doc = old_doc;
+        return false;
+    }
+    toml_free_document(old_doc);
+    toml_sb_truncate(editable->nodes, 0);
+    if (parsed->num_nodes)
+    {
+        memcpy(sb_add(editable->nodes, (int)parsed->num_nodes), parsed->nodes, parsed->num_nodes * sizeof(TomlNode*));
+    }
+    TomlSplit* splits = toml_edit_prescan(editable->text, 0, len, 1);
+    toml_sb_truncate(editable->sections, 0);
+    toml_edit_push_sections(editable, splits, sb_count(splits), parsed->nodes, parsed->num_nodes, 0);
+    sb_free(splits);
+    editable->doc->nodes = editable->nodes;
+    editable->doc->num_nodes = sb_count(editable->nodes);
+    editable->doc->root = NULL;
+    editable->keys_stale = true;
+    editable->arena_budget = TOML_EDIT_GARBAGE_RATIO * editable->doc->arena->bytes_allocated + 64 * 1024;
+    return true;
+}
+
+// Copies buf, which holds len bytes, and parses it. The document is at
+// editable->doc and is updated in place by toml_edit_document. Errors in buf
+// are reported like those of parse_toml.
+intern TomlEditable* toml_new_editable(const char* name, const char* buf, size_t len)
+{
+    TomlEditable* editable = (TomlEditable*)TOML_MALLOC(sizeof(TomlEditable));
+    memset(editable, 0, sizeof(*editable));
+    editable->name = name;
+    if (len)
+    {
+        memcpy(sb_add(editable->text, (int)len), buf, len);
+    }
+    char* message;
+    if (!toml_edit_parse_all(editable, &message))
+    {
+        toml_raise_error(message);
+    }
+    return editable;
+}
+
+intern void toml_free_editable(TomlEditable* editable)
+{
+    toml_free_document(editable->doc);
+    toml_arena_free(&editable->key_arena);
+    sb_free(editable->text);
+    sb_free(editable->removed);
+    sb_free(editable->nodes);
+    sb_free(editable->sections);
+    TOML_FREE(editable);
+}
+
+// Index of the last section starting at or before offset.
+intern size_t toml_edit_find_section(TomlSection* sections, size_t num_sections, size_t offset)
+{
+    size_t lo = 0;
+    size_t hi = num_sections;
+    while (hi - lo > 1)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (sections[mid].offset <= offset)
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+intern void toml_edit_splice(TomlEditable* editable, size_t offset, size_t removed, const char* inserted, size_t inserted_len)
+{
+    size_t old_len = sb_count(editable->text);
+    if (inserted_len > removed)
+    {
+        sb_add(editable->text, (int)(inserted_len - removed));
+    }
+    char* text = editable->text;
+    memmove(text + offset + inserted_len, text + offset + removed, old_len - offset - removed);
+    if (inserted_len)
+    {
+        memcpy(text + offset, inserted, inserted_len);
+    }
+    toml_sb_truncate(editable->text, old_len - removed + inserted_len);
+}
+
+// Puts back the text an edit replaced, and drops the error unless the caller
+// asked for it.
+intern bool toml_edit_reject(TomlEditable* editable, TomlEdit edit, char* unwanted_message)
+{
+    toml_edit_splice(editable, edit.offset, edit.inserted_len, editable->removed, edit.removed);
+    if (unwanted_message)
+    {
+        TOML_FREE(unwanted_message);
+    }
+    return false;
+}
+
+// Replaces edit.removed bytes at edit.offset with edit.inserted and brings
+// the document up to date. Nodes outside the reparsed sections are kept.
+// Returns false, leaving the text and document as they were, if the edited
+// text doesn't parse; the error then goes to *message when one is passed, to
+// be released with TOML_FREE.
+intern bool toml_edit_document(TomlEditable* editable, TomlEdit edit, char** message = NULL)
+{
+    size_t old_len = sb_count(editable->text);
+    assert(edit.offset + edit.removed <= old_len);
+    size_t removed_lines = toml_count_lines(editable->text + edit.offset, edit.removed);
+    size_t inserted_lines = toml_count_lines(edit.inserted, edit.inserted_len);
+
+    char* error_message = NULL;
+    if (!message)
+    {
+        message = &error_message;
+    }
+    toml_sb_truncate(editable->removed, 0);
+    if (edit.removed)
+    {
+        memcpy(sb_add(editable->removed, (int)edit.removed), editable->text + edit.offset, edit.removed);
+    }
+    toml_edit_splice(editable, edit.offset, edit.removed, edit.inserted, edit.inserted_len);
+    size_t len = sb_count(editable->text);
+    char* text = editable->text;
+
+    if (editable->doc->arena->bytes_allocated > editable->arena_budget)
+    {
+        if (!toml_edit_parse_all(editable, message))
+        {
+            return toml_edit_reject(editable, edit, error_message);
+        }
+        return true;
+    }
+    editable->bytes_reparsed = 0;
+
+    TomlSection* sections = editable->sections;
+    size_t num_sections = sb_count(sections);
+    size_t first = toml_edit_find_section(sections, num_sections, edit.offset);
+    if (first > 0 && sections[first].offset == edit.offset)
+    {
+        first--;
+    }
+    size_t start = sections[first].offset;
+    size_t edit_end = edit.offset + edit.removed;   // In the old text
+    ptrdiff_t delta = (ptrdiff_t)edit.inserted_len - (ptrdiff_t)edit.removed;
+
+    // Prescan ever larger windows of the new text until a header lines up
+    // with an old section start past the edit.
+    size_t sync = num_sections;                     // First old section kept
+    size_t sync_offset = len;                       // Where it starts now
+    TomlSplit* splits = NULL;
+    size_t window = edit.offset + edit.inserted_len + TOML_EDIT_MIN_SCAN;
+    for (;;)
+    {
+        size_t limit = window < len ? window : len;
+        sb_free(splits);
+        splits = toml_edit_prescan(text, start, limit, sections[first].line);
+        for (int i = 1; i < sb_count(splits) && sync == num_sections; i++)
+        {
+            ptrdiff_t old_offset = (ptrdiff_t)splits[i].offset - delta;
+            if (old_offset < (ptrdiff_t)edit_end || splits[i].offset < edit.offset + edit.inserted_len)
+            {
+                continue;
+            }
+            size_t j = toml_edit_find_section(sections, num_sections, (size_t)old_offset);
+            if (j > first && sections[j].offset == (size_t)old_offset)
+            {
+                sync = j;
+                sync_offset = splits[i].offset;
+                toml_sb_truncate(splits, i);
+            }
+        }
+        if (sync < num_sections || limit == len)
+        {
+            break;
+        }
+        window = start + (limit - start) * 2;
+    }
+
+    TomlNodes* parsed = toml_edit_parse_range(editable, start, sync_offset, sections[first].line, message);
+    if (!parsed)
+    {
+        sb_free(splits);
+        return toml_edit_reject(editable, edit, error_message);
+    }
+
+    // Splice the nodes and sections
+    size_t first_node = sections[first].first_node;
+    size_t sync_node = sync < num_sections ? sections[sync].first_node : sb_count(editable->nodes);
+    size_t old_num_nodes = sb_count(editable->nodes);
+    size_t num_nodes = old_num_nodes - (sync_node - first_node) + parsed->num_nodes;
+    if (num_nodes > old_num_nodes)
+    {
+        sb_add(editable->nodes, (int)(num_nodes - old_num_nodes));
+    }
+    TomlNode** nodes = editable->nodes;
+    memmove(nodes + first_node + parsed->num_nodes, nodes + sync_node, (old_num_nodes - sync_node) * sizeof(TomlNode*));
+    if (parsed->num_nodes)
+    {
+        memcpy(nodes + first_node, parsed->nodes, parsed->num_nodes * sizeof(TomlNode*));
+    }
+    toml_sb_truncate(editable->nodes, num_nodes);
+
+    TomlSection* kept = NULL;
+    size_t num_kept = num_sections - sync;
+    if (num_kept)
+    {
+        kept = (TomlSection*)toml_dup(sections + sync, num_kept * sizeof(TomlSection));
+    }
+    toml_sb_truncate(editable->sections, first);
+    toml_edit_push_sections(editable, splits, sb_count(splits), parsed->nodes, parsed->num_nodes, first_node);
+    ptrdiff_t node_delta = (ptrdiff_t)parsed->num_nodes - (ptrdiff_t)(sync_node - first_node);
+    for (size_t i = 0; i < num_kept; i++)
+    {
+        TomlSection section = kept[i];
+        section.offset += delta;
+        section.line = section.line + inserted_lines - removed_lines;
+        section.first_node += node_delta;
+        sb_push(editable->sections, section);
+    }
+    TOML_FREE(kept);
+    sb_free(splits);
+
+    editable->doc->nodes = editable->nodes;
+    editable->doc->num_nodes = num_nodes;
+    editable->doc->root = NULL;
+    editable->keys_stale = true;
+    return true;
+}
+
+// Brings editable->doc->root up to date with the edits made since it was
+// last built.
+intern void toml_edit_key_tables(TomlEditable* editable)
+{
+    if (editable->keys_stale)
+    {
+        toml_arena_free(&editable->key_arena);
+        toml_build_key_tables(editable->doc, editable->name, &editable->key_arena);
+        editable->keys_stale = false;
+    }
+}
+
+// toml_lookup on the editable's document, rebuilding its tables if need be.
+intern const TomlKeyEntry* toml_edit_lookup(TomlEditable* editable, const char* path)
+{
+    toml_edit_key_tables(editable);
+    return toml_lookup(editable->doc, path);
+}
+
+#ifndef TOML_NO_THREADS
+/*
+A fixed set of worker threads that run one job at a time. A job is split into
+num_tasks tasks that workers (and the thread that ran it) claim one by one
+until none are left.
+*/
+
+struct TomlThreadPool {
+    std::thread* threads;
+    size_t num_threads;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    void (*job)(void* data, size_t task);
+    void* data;
+    size_t num_tasks;
+    std::atomic<size_t> next_task;
+    size_t busy;            // Workers that haven't finished the current job
+    size_t generation;      // Bumped for every job
+    bool quit;
+};
+
+intern void toml_pool_run_tasks(TomlThreadPool* pool)
+{
+    for (;;)
+    {
+        size_t task = pool->next_task++;
+        if (task >= pool->num_tasks)
+        {
+            break;
+        }
+        pool->job(pool->data, task);
+    }
+}
+
+intern void toml_pool_worker(TomlThreadPool* pool)
+{
+    size_t seen = 0;
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(pool->mutex);
+            pool->wake.wait(lock, [&] { return pool->quit || pool->generation != seen; });
+            if (pool->quit)
+            {
+                return;
+            }
+            seen = pool->generation;
+        }
+        toml_pool_run_tasks(pool);
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        if (--pool->busy == 0)
+        {
+            pool->done.notify_one();
+        }
+    }
+}
+
+// num_threads counts the calling thread, which works too. 0 means one per
+// hardware thread.
+intern TomlThreadPool* toml_new_thread_pool(size_t num_threads = 0)
+{
+    if (!num_threads)
+    {
+        num_threads = std::thread::hardware_concurrency();
+    }
+    TomlThreadPool* pool = new TomlThreadPool();
+    pool->num_threads = num_threads > 1 ? num_threads - 1 : 0;
+    pool->threads = new std::thread[pool->num_threads];
+    for (size_t i = 0; i < pool->num_threads; i++)
+    {
+        pool->threads[i] = std::thread(toml_pool_worker, pool);
+    }
+    return pool;
+}
+
+intern void toml_free_thread_pool(TomlThreadPool* pool)
+{
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        pool->quit = true;
+    }
+    pool->wake.notify_all();
+    for (size_t i = 0; i < pool->num_threads; i++)
+    {
+        pool->threads[i].join();
+    }
+    delete[] pool->threads;
+    delete pool;
+}
+
+// Runs job(data, task) for every task below num_tasks and waits for all of
+// them to finish.
+intern void toml_pool_run(TomlThreadPool* pool, void (*job)(void*, size_t), void* data, size_t num_tasks)
+{
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        pool->job = job;
+        pool->data = data;
+        pool->num_tasks = num_tasks;
+        pool->next_task = 0;
+        pool->busy = pool->num_threads;
+        pool->generation++;
+    }
+    pool->wake.notify_all();
+    toml_pool_run_tasks(pool);
+    std::unique_lock<std::mutex> lock(pool->mutex);
+    pool->done.wait(lock, [&] { return pool->busy == 0; });
+}
+
+/*
+toml_parse_parallel parses a document in ranges that start at [table] or
+[[list]] header lines, on the threads of a pool, and stitches the nodes back
+together in document order.
+
+The ranges are cut without reading the document first: each cut moves on
+from an even share of the text to the next line that starts with '['. That
+line is only a header if the text before it ends outside of any string,
+comment or bracket, which is exactly when the range before it parses, since
+the parser reports whatever is left open at the end of its input. So these
+ranges parse under toml_recover, and if any of them fails the document is
+parsed again in ranges found by the prescanner, which never cuts inside a
+string, comment or multi-line array, and reports errors in the text like
+parse_toml does.
+
+Each range gets its own arena and intern table. The distinct names of those
+tables are merged into the first range's on the calling thread, then the
+pool points each range's names at the merged ones, and the first range's
+arena adopts the other chunks, so the result is indistinguishable from
+parse_toml's. A pool without workers has nobody to share the parse with and
+parses in one piece.
+*/
+
+#define TOML_PARALLEL_MIN_RANGE (256 * 1024)
+
+struct TomlParallelParse {
+    const char* name;
+    const char* buf;
+    size_t len;
+    TomlSplit* ranges;          // Stretchy buffer
+    size_t num_ranges;
+    bool speculative;           // Cut without a prescan, see above
+    TomlNodes** results;        // NULL for a cut range that didn't parse
+    const char*** renames;      // Per range, the merged name for each intern slot
+    TomlSimdLevel simd;         // The calling thread's, for the pool's contexts
+    TomlTokenizer tokenizer;
+};
+
+intern void parse_toml_range(void* data, size_t index)
+{
+    TomlParallelParse* parse = (TomlParallelParse*)data;
+    size_t start = parse->ranges[index].offset;
+    size_t end = index + 1 < parse->num_ranges ? parse->ranges[index + 1].offset : parse->len;
+    TomlArena* arena = toml_new_arena();
+    TomlParseContext ctx;
+    toml_init_context(&ctx, parse->name, parse->buf + start, end - start, arena);
+    ctx.simd = parse->simd;
+    ctx.tokenizer = parse->tokenizer;
+    ctx.token.pos.line = parse->ranges[index].line;
+    if (parse->speculative)
+    {
+        char* message;
+        parse->results[index] = toml_try_parse_nodes(&ctx, &message, false);
+        toml_release_context(&ctx);
+        if (!parse->results[index])
+        {
+            TOML_FREE(message);
+            toml_arena_free(arena);
+        }
+        return;
+    }
+    parse->results[index] = parse_toml_nodes(&ctx, false);
+    toml_release_context(&ctx);
+}
+
+// Parses every range. Returns false, keeping nothing, if a cut range fails.
+intern bool toml_parse_ranges(TomlThreadPool* pool, TomlParallelParse* parse)
+{
+    parse->num_ranges = sb_count(parse->ranges);
+    parse->results = (TomlNodes**)TOML_MALLOC(parse->num_ranges * sizeof(TomlNodes*));
+    memset(parse->results, 0, parse->num_ranges * sizeof(TomlNodes*));
+    toml_pool_run(pool, parse_toml_range, parse, parse->num_ranges);
+    bool parsed = true;
+    for (size_t i = 0; i < parse->num_ranges; i++)
+    {
+        parsed = parsed && parse->results[i];
+    }
+    if (!parsed)
+    {
+        for (size_t i = 0; i < parse->num_ranges; i++)
+        {
+            toml_free_document(parse->results[i]);
+        }
+        TOML_FREE(parse->results);
+        parse->results = NULL;
+    }
+    return parsed;
+}
+
+// Offset of the first line at or after from whose first character past
+// spaces and tabs is '[', or len if there is none.
+intern size_t toml_next_bracket_line(const char* buf, size_t len, size_t from)
+{
+    size_t line = from;
+    while (line < len)
+    {
+        if (line == 0 || buf[line - 1] == '\n')
+        {
+            size_t c = line;
+            while (c < len && (buf[c] == ' ' || buf[c] == '\t'))
+            {
+                c++;
+            }
+            if (c < len && buf[c] == '[')
+            {
+                return line;
+            }
+        }
+        const char* newline = (const char*)memchr(buf + line, '\n', len - line);
+        if (!newline)
+        {
+            break;
+        }
+        line = newline + 1 - buf;
+    }
+    return len;
+}
+
+// The merged name of a range's name, from that range's intern table and the
+// slot-by-slot renames for it.
+struct TomlRename {
+    const TomlInterns* interns;
+    const char* const* names;
+};
+
+intern const char* toml_rename(const TomlRename* rename, const char* name)
+{
+    const TomlInterns* interns = rename->interns;
+    size_t slot = toml_name_hash(name) & (interns->num_slots - 1);
+    while (interns->slots[slot] != name)
+    {
+        slot = (slot + 1) & (interns->num_slots - 1);
+    }
+    return rename->names[slot];
+}
+
+intern void toml_rename_stmts(const TomlRename* rename, TomlStmt** stmts, size_t num_stmts);
+
+intern void toml_rename_value(const TomlRename* rename, TomlValue* value)
+{
+    if (value->kind == TOMLVALUE_ARRAY)
+    {
+        for (size_t i = 0; value->array_kind == TOMLVALUE_NONE && i < value->num_array_vals; i++)
+        {
+            toml_rename_value(rename, value->array_vals[i]);
+        }
+    }
+    else if (value->kind == TOMLVALUE_INLINETABLE)
+    {
+        for (size_t i = 0; i < value->table_nodes->num_nodes; i++)
+        {
+            toml_rename_stmts(rename, &value->table_nodes->nodes[i]->stmt, 1);
+        }
+    }
+}
+
+intern void toml_rename_stmts(const TomlRename* rename, TomlStmt** stmts, size_t num_stmts)
+{
+    for (size_t i = 0; i < num_stmts; i++)
+    {
+        stmts[i]->name = toml_rename(rename, stmts[i]->name);
+        toml_rename_value(rename, stmts[i]->value);
+    }
+}
+
+// Points every name in a range's nodes at the merged intern table. Task i is
+// range i + 1; the first range's names are the merged ones already.
+intern void toml_rename_range(void* data, size_t task)
+{
+    TomlParallelParse* parse = (TomlParallelParse*)data;
+    TomlNodes* result = parse->results[task + 1];
+    TomlRename rename = { result->interns, parse->renames[task + 1] };
+    for (size_t i = 0; i < result->num_nodes; i++)
+    {
+        TomlNode* node = result->nodes[i];
+        switch (node->kind)
+        {
+            case TOMLDECL_STMT:
+                toml_rename_stmts(&rename, &node->stmt, 1);
+                break;
+            case TOMLDECL_TABLE:
+                node->tbl->name = toml_rename(&rename, node->tbl->name);
+                toml_rename_stmts(&rename, node->tbl->stmts, node->tbl->num_stmts);
+                break;
+            case TOMLDECL_LIST:
+                node->list->name = toml_rename(&rename, node->list->name);
+                toml_rename_stmts(&rename, node->list->stmts, node->list->num_stmts);
+                break;
+            default:
+                assert(0);
+                break;
+        }
+    }
+}
+
+// buf holds len bytes and, as with parse_toml_buffer, must outlive the
+// result. Ranges are at least min_range bytes apart.
+intern TomlNodes* toml_parse_parallel(const char* name, const char* buf, size_t len, TomlThreadPool* pool, size_t min_range = TOML_PARALLEL_MIN_RANGE)
+{
+    if (!pool->num_threads)
+    {
+        return parse_toml_buffer(name, buf, len);
+    }
+    // A few ranges per thread keeps them busy when sections vary in size.
+    size_t range_size = len / ((pool->num_threads + 1) * 4);
+    range_size = range_size > min_range ? range_size : min_range;
+
+    TomlParallelParse parse = {};
+    parse.name = name;
+    parse.buf = buf;
+    parse.len = len;
+    parse.simd = toml_simd_level;
+    parse.tokenizer = toml_tokenizer;
+    // Lines aren't known past the first cut, but errors there only reject
+    // the cut.
+    TomlSplit first = { 0, 1 };
+    sb_push(parse.ranges, first);
+    for (size_t cut = range_size; cut < len;)
+    {
+        TomlSplit split = { toml_next_bracket_line(buf, len, cut), 0 };
+        if (split.offset == len)
+        {
+            break;
+        }
+        sb_push(parse.ranges, split);
+        cut = split.offset + range_size;
+    }
+    parse.speculative = sb_count(parse.ranges) > 1;
+    if (!toml_parse_ranges(pool, &parse))
+    {
+        TomlPrescan scan = {};
+        scan.line = 1;
+        scan.split_every = range_size;
+        scan.next_split = scan.split_every;
+        sb_push(scan.splits, first);
+        toml_prescan(&scan, buf, len);
+        sb_free(parse.ranges);
+        parse.ranges = scan.splits;
+        parse.speculative = false;
+        toml_parse_ranges(pool, &parse);
+    }
+
+    // Merge the names, then rename on the pool
+    TomlNodes* doc = parse.results[0];
+    size_t num_renames = 0;
+    for (size_t i = 1; i < parse.num_ranges; i++)
+    {
+        num_renames += parse.results[i]->interns->num_slots;
+    }
+    parse.renames = (const char***)TOML_MALLOC(parse.num_ranges * sizeof(const char**));
+    const char** renames = (const char**)TOML_MALLOC((num_renames ? num_renames : 1) * sizeof(const char*));
+    for (size_t i = 1, at = 0; i < parse.num_ranges; i++)
+    {
+        const TomlInterns* interns = parse.results[i]->interns;
+        parse.renames[i] = renames + at;
+        for (size_t slot = 0; slot < interns->num_slots; slot++)
+        {
+            const char* range_name = interns->slots[slot];
+            renames[at + slot] = range_name ? toml_intern(doc->interns, doc->arena, range_name, toml_name_len(range_name)) : NULL;
+        }
+        at += interns->num_slots;
+    }
+    toml_pool_run(pool, toml_rename_range, &parse, parse.num_ranges - 1);
+
+    size_t num_nodes = 0;
+    for (size_t i = 0; i < parse.num_ranges; i++)
+    {
+        num_nodes += parse.results[i]->num_nodes;
+    }
+    TomlNode** nodes = (TomlNode**)toml_arena_alloc(doc->arena, num_nodes * sizeof(TomlNode*));
+    size_t num_stitched = 0;
+    for (size_t i = 0; i < parse.num_ranges; i++)
+    {
+        TomlNodes* result = parse.results[i];
+        memcpy(nodes + num_stitched, result->nodes, result->num_nodes * sizeof(TomlNode*));
+        num_stitched += result->num_nodes;
+        if (i > 0)
+        {
+            toml_arena_adopt(doc->arena, result->arena);
+        }
+    }
+    doc->nodes = nodes;
+    doc->num_nodes = num_nodes;
+    toml_build_key_tables(doc, name, doc->arena);
+    TOML_FREE(renames);
+    TOML_FREE(parse.renames);
+    TOML_FREE(parse.results);
+    sb_free(parse.ranges);
+    return doc;
+}
+#endif
+
+intern size_t xpath_compare(const char* test, const char* key)
+{
+    size_t matching_chars = 0;
+    while (*test && *key && *test == *key)
+    {
+        matching_chars++;
+        test++;
+        key++;
+    }
+    return matching_chars;
+}
+
+intern TomlNodes* toml_find_nodes(TomlNode** nodes, size_t num_nodes, const char* key)
+{
+    TOML_STATS_LOOKUP_START(lookup_start);
+    TomlNodes* result = TOML_ALLOC(TomlNodes);
+
+    TomlNode** matches = NULL;
+    for (size_t i = 0; i < num_nodes; i++)
+    {
+        TomlNode* node = nodes[i];
+        switch (node->kind)
+        {
+            case TOMLDECL_STMT:
+                if (xpath_compare(node->stmt->name, key) == strlen(node->stmt->name))
+                {
+                    sb_push(matches, node);
+                }
+                break;
+            case TOMLDECL_TABLE: {
+                size_t matching_chars = xpath_compare(node->tbl->name, key);
+                if (matching_chars == strlen(node->tbl->name))
+                {
+                    // Table name is an exact match
+                    if (matching_chars == strlen(key))
+                    {
+                        sb_push(matches, node);
+                    }
+                    // Table name matched up to some dot - try matching a statement in 
+                    // the table to the rest of the key
+                    else if (*(key + matching_chars) == '.')
+                    {
+                        const char* subkey = key + matching_chars + 1;
+                        for (size_t i = 0; i < node->tbl->num_stmts; i++)
+                        {
+                            TomlStmt* stmt = node->tbl->stmts[i];
+                            if (xpath_compare(stmt->name, subkey) == strlen(stmt->name))
+                            {
+                                TomlNode* node = TOML_ALLOC(TomlNode);
+                                node->kind = TOMLDECL_STMT;
+                                node->stmt = stmt;
+                                sb_push(matches, node);
+                                break;
+                            }
+                        }
+                    }
+                }
+                // if this is a subtable of the key asked for, return it as well
+                else if (matching_chars > 0 && strlen(node->tbl->name) > matching_chars && node->tbl->name[matching_chars] == '.')
+                {
+                    sb_push(matches, node);
+                }
+            } break;
+            case TOMLDECL_LIST: {
+                size_t matching_chars = xpath_compare(node->list->name, key);
+                if (matching_chars == strlen(node->list->name))
+                {
+                    // List name is an exact match
+                    if (matching_chars == strlen(key))
+                    {
+                        sb_push(matches, node);
+                    }
+                    // List name matched up to some dot - try matching a statement
+                    // in the list to the rest of the key
+                    else if (*(key + matching_chars) == '.')
+                    {
+                        const char* subkey = key + matching_chars + 1;
+                        for (size_t i = 0; i < node->list->num_stmts; i++)
+                        {
+                            TomlStmt* stmt = node->list->stmts[i];
+                            if (xpath_compare(stmt->name, subkey) == strlen(stmt->name))
+                            {
+                                TomlNode* node = TOML_ALLOC(TomlNode);
+                                node->kind = TOMLDECL_STMT;
+                                node->stmt = stmt;
+                                sb_push(matches, node);
+                                break;
+                            }
+                        }
+                    }
+                }
+                else if (matching_chars > 0 && strlen(node->list->name) > matching_chars && node->list->name[matching_chars] == '.')
+                {
+                    sb_push(matches, node);
+                }
+            } break;
+            default:
+                assert(0);
+                break;
+        }
+    }
+
+    size_t num_matches = sb_count(matches);
+    result->nodes = (TomlNode**)TOML_DUP(matches);
+    result->num_nodes = num_matches;
+    result->arena = NULL;
+    result->interns = NULL;
+    result->mapped = NULL;
+    result->mapped_size = 0;
+    result->root = NULL;
+    TOML_STATS_LOOKUP_STOP(lookup_start, num_matches);
+    return result;
+}
+
+// Keys with more dots than this split into a heap array instead of the stack.
+#define TOML_MAX_KEY_DOTS 32
+
+// For the dot at a key's pos, the interned names on either side of it.
+struct TomlInternSplit {
+    size_t pos;
+    const char* prefix;
+    const char* suffix;
+};
+
+// Matches the first statement named stmt_name (interned, or NULL).
+intern TomlStmt* find_interned_stmt(TomlStmt** stmts, size_t num_stmts, const char* stmt_name)
+{
+    for (size_t i = 0; stmt_name && i < num_stmts; i++)
+    {
+        if (stmts[i]->name == stmt_name)
+        {
+            return stmts[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+Same matching as toml_find_nodes above, but on a document returned by
+parse_toml. The key and each of its "table.stmt" splits are looked up in the
+document's intern table once, after which every name comparison is a pointer
+comparison. Statement names must match the key exactly.
+*/
+intern TomlNodes* toml_find_nodes(TomlNodes* doc, const char* key)
+{
+    TOML_STATS_LOOKUP_START(lookup_start);
+    TomlInterns* interns = doc->interns;
+    size_t key_len = strlen(key);
+    const char* key_name = toml_intern_find(interns, key, key_len, toml_hash(key, key_len));
+
+    size_t num_dots = 0;
+    for (size_t i = 0; i < key_len; i++)
+    {
+        num_dots += key[i] == '.';
+    }
+    TomlInternSplit stack_splits[TOML_MAX_KEY_DOTS];
+    TomlInternSplit* splits = stack_splits;
+    if (num_dots > TOML_MAX_KEY_DOTS)
+    {
+        splits = (TomlInternSplit*)TOML_MALLOC(num_dots * sizeof(TomlInternSplit));
+    }
+    size_t num_splits = 0;
+    for (size_t i = 0; i < key_len; i++)
+    {
+        if (key[i] == '.')
+        {
+            splits[num_splits].pos = i;
+            splits[num_splits].prefix = toml_intern_find(interns, key, i, toml_hash(key, i));
+            splits[num_splits].suffix = toml_intern_find(interns, key + i + 1, key_len - i - 1, toml_hash(key + i + 1, key_len - i - 1));
+            num_splits++;
+        }
+    }
+
+    TomlNode** matches = NULL;
+    for (size_t i = 0; i < doc->num_nodes; i++)
+    {
+        TomlNode* node = doc->nodes[i];
+        const char* name;
+        TomlStmt** stmts;
+        size_t num_stmts;
+        switch (node->kind)
+        {
+            case TOMLDECL_STMT:
+                if (node->stmt->name == key_name)
+                {
+                    sb_push(matches, node);
+                }
+                continue;
+            case TOMLDECL_TABLE:
+                name = node->tbl->name;
+                stmts = node->tbl->stmts;
+                num_stmts = node->tbl->num_stmts;
+                break;
+            case TOMLDECL_LIST:
+                name = node->list->name;
+                stmts = node->list->stmts;
+                num_stmts = node->list->num_stmts;
+                break;
+            default:
+                assert(0);
+                continue;
+        }
+
+        if (name == key_name)
+        {
+            sb_push(matches, node);
+            continue;
+        }
+        size_t name_len = toml_name_len(name);
+        if (name_len < key_len)
+        {
+            // Table name matched up to some dot - try matching a statement in
+            // the table to the rest of the key
+            for (size_t j = 0; j < num_splits; j++)
+            {
+                if (splits[j].pos == name_len && splits[j].prefix == name)
+                {
+                    TomlStmt* stmt = find_interned_stmt(stmts, num_stmts, splits[j].suffix);
+                    if (stmt)
+                    {
+                        TomlNode* stmt_node = TOML_ALLOC(TomlNode);
+                        stmt_node->kind = TOMLDECL_STMT;
+                        stmt_node->stmt = stmt;
+                        sb_push(matches, stmt_node);
+                    }
+                    break;
+                }
+            }
+        }
+        // if this is a subtable of the key asked for, return it as well
+        else if (name[key_len] == '.' && memcmp(name, key, key_len) == 0)
+        {
+            sb_push(matches, node);
+        }
+    }
+
+    TomlNodes* result = TOML_ALLOC(TomlNodes);
+    size_t num_matches = sb_count(matches);
+    result->nodes = (TomlNode**)TOML_DUP(matches);
+    result->num_nodes = num_matches;
+    result->arena = NULL;
+    result->interns = NULL;
+    result->mapped = NULL;
+    result->mapped_size = 0;
+    result->root = NULL;
+    sb_free(matches);
+    if (splits != stack_splits)
+    {
+        TOML_FREE(splits);
+    }
+    TOML_STATS_LOOKUP_STOP(lookup_start, num_matches);
+    return result;
+}
+
+/*
+Compiled queries
+
+toml_compile_query splits and hashes a dotted key once. Matching it against a
+name then compares the hash and length stored in the name's intern header
+before touching any characters, so a query works on any parsed document
+without rescanning or rehashing the key. Results are the same as
+toml_find_nodes(doc, key), except that statement matches inside tables are
+reported as the statement plus the node it belongs to rather than a newly
+allocated wrapper node.
+
+toml_find_batch answers many queries in one pass over the top-level nodes and
+writes into buffers the caller provides. It first files every query's hash
+and the hashes of its dotted prefixes in a small table, so each node probes
+its own name and the prefixes of its name up to each dot rather than being
+tried against every query. The table lives on the stack unless the batch has
+more than TOML_BATCH_STACK_HASHES hashes.
+*/
+
+#define TOML_BATCH_STACK_HASHES 128
+
+struct TomlQuerySplit {
+    size_t pos;                 // Of the dot in the key
+    uint64_t prefix_hash;
+    uint64_t suffix_hash;
+};
+
+struct TomlQuery {
+    const char* key;            // NUL terminated, stored after the splits
+    size_t key_len;
+    uint64_t hash;
+    TomlQuerySplit* splits;
+    size_t num_splits;
+};
+
+struct TomlQueryMatch {
+    TomlNode* node;             // Top-level node that matched or holds stmt
+    TomlStmt* stmt;             // Matched statement, or NULL for a whole node
+};
+
+struct TomlQueryResult {
+    TomlQueryMatch* matches;    // Caller's buffer
+    size_t max_matches;
+    size_t num_matches;         // May exceed max_matches, which are all that were stored
+};
+
+#define TOML_BATCH_WHOLE_KEY UINT32_MAX
+
+// A hash one of the batch's queries matches names by: the whole key, or the
+// part before one of its dots.
+struct TomlBatchHash {
+    uint64_t hash;
+    uint32_t query;             // Index + 1, 0 for an empty slot
+    uint32_t split;             // Index into the query's splits, or TOML_BATCH_WHOLE_KEY
+};
+
+// Returns a query to be released with TOML_FREE.
+intern TomlQuery* toml_compile_query(const char* key)
+{
+    size_t key_len = strlen(key);
+    size_t num_splits = 0;
+    for (size_t i = 0; i < key_len; i++)
+    {
+        num_splits += key[i] == '.';
+    }
+    TomlQuery* query = (TomlQuery*)TOML_MALLOC(sizeof(TomlQuery) + num_splits * sizeof(TomlQuerySplit) + key_len + 1);
+    query->splits = (TomlQuerySplit*)(query + 1);
+    char* key_copy = (char*)(query->splits + num_splits);
+    memcpy(key_copy, key, key_len + 1);
+    query->key = key_copy;
+    query->key_len = key_len;
+    query->hash = toml_hash(key, key_len);
+    query->num_splits = 0;
+    for (size_t i = 0; i < key_len; i++)
+    {
+        if (key[i] == '.')
+        {
+            TomlQuerySplit* split = &query->splits[query->num_splits++];
+            split->pos = i;
+            split->prefix_hash = toml_hash(key, i);
+            split->suffix_hash = toml_hash(key + i + 1, key_len - i - 1);
+        }
+    }
+    return query;
+}
+
+// Whether the interned name is exactly str.
+intern bool toml_name_is(const char* name, const char* str, size_t len, uint64_t hash)
+{
+    const TomlInternHeader* header = toml_name_header(name);
+    return header->hash == hash && header->len == len && memcmp(name, str, len) == 0;
+}
+
+intern void toml_query_add(TomlQueryResult* result, TomlNode* node, TomlStmt* stmt)
+{
+    if (result->num_matches < result->max_matches)
+    {
+        result->matches[result->num_matches].node = node;
+        result->matches[result->num_matches].stmt = stmt;
+    }
+    result->num_matches++;
+}
+
+intern void toml_batch_add_hash(TomlBatchHash* slots, size_t num_slots, uint64_t hash, size_t query, size_t split)
+{
+    size_t slot = hash & (num_slots - 1);
+    while (slots[slot].query)
+    {
+        slot = (slot + 1) & (num_slots - 1);
+    }
+    slots[slot].hash = hash;
+    slots[slot].query = (uint32_t)(query + 1);
+    slots[slot].split = (uint32_t)split;
+}
+
+// Matches a table or list against the queries filed under its name's hash,
+// as in toml_find_nodes: the whole key names it, or the part of a key before
+// a dot does and a statement in it is named by the rest.
+intern void toml_batch_match_table(TomlQuery* const* queries, TomlQueryResult* results, const TomlBatchHash* slots, size_t num_slots,
+                                   TomlNode* node, const char* name, TomlStmt** stmts, size_t num_stmts)
+{
+    const TomlInternHeader* header = toml_name_header(name);
+    for (size_t slot = header->hash & (num_slots - 1); slots[slot].query; slot = (slot + 1) & (num_slots - 1))
+    {
+        if (slots[slot].hash != header->hash)
+        {
+            continue;
+        }
+        size_t q = slots[slot].query - 1;
+        const TomlQuery* query = queries[q];
+        if (slots[slot].split == TOML_BATCH_WHOLE_KEY)
+        {
+            if (query->key_len == header->len && memcmp(name, query->key, header->len) == 0)
+            {
+                toml_query_add(&results[q], node, NULL);
+            }
+            continue;
+        }
+        const TomlQuerySplit* split = &query->splits[slots[slot].split];
+        if (split->pos != header->len || memcmp(name, query->key, header->len) != 0)
+        {
+            continue;
+        }
+        const char* suffix = query->key + split->pos + 1;
+        size_t suffix_len = query->key_len - split->pos - 1;
+        for (size_t j = 0; j < num_stmts; j++)
+        {
+            if (toml_name_is(stmts[j]->name, suffix, suffix_len, split->suffix_hash))
+            {
+                toml_query_add(&results[q], node, stmts[j]);
+                break;
+            }
+        }
+    }
+}
+
+// Matches a table or list that lies under the keys of the queries: those
+// whose whole key is its name up to one of its dots.
+intern void toml_batch_match_subtable(TomlQuery* const* queries, TomlQueryResult* results, const TomlBatchHash* slots, size_t num_slots,
+                                      TomlNode* node, const char* name)
+{
+    size_t name_len = toml_name_len(name);
+    uint64_t hash = toml_hash(name, 0);
+    size_t hashed = 0;
+    for (const char* dot = (const char*)memchr(name, '.', name_len); dot; dot = (const char*)memchr(dot + 1, '.', name + name_len - dot - 1))
+    {
+        size_t len = dot - name;
+        hash = toml_hash(name + hashed, len - hashed, hash);
+        hashed = len;
+        for (size_t slot = hash & (num_slots - 1); slots[slot].query; slot = (slot + 1) & (num_slots - 1))
+        {
+            size_t q = slots[slot].query - 1;
+            if (slots[slot].hash == hash && slots[slot].split == TOML_BATCH_WHOLE_KEY && queries[q]->key_len == len && memcmp(name, queries[q]->key, len) == 0)
+            {
+                toml_query_add(&results[q], node, NULL);
+            }
+        }
+    }
+}
+
+// Fills results[i] with the matches for queries[i], in document order.
+intern void toml_find_batch(TomlNodes* doc, TomlQuery* const* queries, size_t num_queries, TomlQueryResult* results)
+{
+    size_t num_hashes = 0;
+    for (size_t i = 0; i < num_queries; i++)
+    {
+        results[i].num_matches = 0;
+        num_hashes += 1 + queries[i]->num_splits;
+    }
+    size_t num_slots = 16;
+    while (num_slots < num_hashes * 2)
+    {
+        num_slots *= 2;
+    }
+    TomlBatchHash stack_slots[TOML_BATCH_STACK_HASHES * 2];
+    TomlBatchHash* slots = stack_slots;
+    if (num_slots > TOML_BATCH_STACK_HASHES * 2)
+    {
+        slots = (TomlBatchHash*)TOML_MALLOC(num_slots * sizeof(TomlBatchHash));
+    }
+    memset(slots, 0, num_slots * sizeof(TomlBatchHash));
+    for (size_t i = 0; i < num_queries; i++)
+    {
+        toml_batch_add_hash(slots, num_slots, queries[i]->hash, i, TOML_BATCH_WHOLE_KEY);
+        for (size_t j = 0; j < queries[i]->num_splits; j++)
+        {
+            toml_batch_add_hash(slots, num_slots, queries[i]->splits[j].prefix_hash, i, j);
+        }
+    }
+
+    for (size_t i = 0; i < doc->num_nodes; i++)
+    {
+        TomlNode* node = doc->nodes[i];
+        switch (node->kind)
+        {
+            case TOMLDECL_STMT: {
+                const char* name = node->stmt->name;
+                uint64_t hash = toml_name_hash(name);
+                for (size_t slot = hash & (num_slots - 1); slots[slot].query; slot = (slot + 1) & (num_slots - 1))
+                {
+                    size_t q = slots[slot].query - 1;
+                    if (slots[slot].hash == hash && slots[slot].split == TOML_BATCH_WHOLE_KEY && toml_name_is(name, queries[q]->key, queries[q]->key_len, hash))
+                    {
+                        toml_query_add(&results[q], node, node->stmt);
+                    }
+                }
+            } break;
+            case TOMLDECL_TABLE:
+                toml_batch_match_table(queries, results, slots, num_slots, node, node->tbl->name, node->tbl->stmts, node->tbl->num_stmts);
+                toml_batch_match_subtable(queries, results, slots, num_slots, node, node->tbl->name);
+                break;
+            case TOMLDECL_LIST:
+                toml_batch_match_table(queries, results, slots, num_slots, node, node->list->name, node->list->stmts, node->list->num_stmts);
+                toml_batch_match_subtable(queries, results, slots, num_slots, node, node->list->name);
+                break;
+            default:
+                assert(0);
+                break;
+        }
+    }
+    if (slots != stack_slots)
+    {
+        TOML_FREE(slots);
+    }
+}
+
+// Single query version of toml_find_batch. Returns the number of matches,
+// of which at most max_matches are stored.
+intern size_t toml_find_query(TomlNodes* doc, TomlQuery* query, TomlQueryMatch* matches, size_t max_matches)
+{
+    TomlQueryResult result = { matches, max_matches, 0 };
+    toml_find_batch(doc, &query, 1, &result);
+    return result.num_matches;
+}
+
+/*
+Iterators
+
+Cursors for walking a document without touching its arrays directly. They
+live on the caller's stack and never allocate: begin with toml_*_begin, then
+call the matching toml_*_next until it returns false, reading the current
+item from the cursor after each call.
+
+TomlMatchIter visits what toml_find_nodes(doc, key) returns, in the same
+order, with statement matches inside tables given as the statement and the
+node holding it.
+*/
+
+struct TomlMatchIter {
+    TomlNodes* doc;
+    const char* key;
+    size_t key_len;
+    uint64_t hash;
+    size_t next;                // Next top-level node to look at
+    TomlNode* node;             // Current match, or the node holding stmt
+    TomlStmt* stmt;             // Current statement match, NULL for a whole node
+};
+
+intern void toml_match_begin(TomlMatchIter* iter, TomlNodes* doc, const char* key)
+{
+    iter->doc = doc;
+    iter->key = key;
+    iter->key_len = strlen(key);
+    iter->hash = toml_hash(key, iter->key_len);
+    iter->next = 0;
+    iter->node = NULL;
+    iter->stmt = NULL;
+}
+
+intern bool toml_match_next(TomlMatchIter* iter)
+{
+    while (iter->next < iter->doc->num_nodes)
+    {
+        TomlNode* node = iter->doc->nodes[iter->next++];
+        iter->node = node;
+        iter->stmt = NULL;
+        const char* name;
+        TomlStmt** stmts;
+        size_t num_stmts;
+        switch (node->kind)
+        {
+            case TOMLDECL_STMT:
+                if (toml_name_is(node->stmt->name, iter->key, iter->key_len, iter->hash))
+                {
+                    iter->stmt = node->stmt;
+                    return true;
+                }
+                continue;
+            case TOMLDECL_TABLE:
+                name = node->tbl->name;
+                stmts = node->tbl->stmts;
+                num_stmts = node->tbl->num_stmts;
+                break;
+            case TOMLDECL_LIST:
+                name = node->list->name;
+                stmts = node->list->stmts;
+                num_stmts = node->list->num_stmts;
+                break;
+            default:
+                assert(0);
+                continue;
+        }
+
+        size_t name_len = toml_name_len(name);
+        if (name_len == iter->key_len)
+        {
+            if (toml_name_hash(name) == iter->hash && memcmp(name, iter->key, name_len) == 0)
+            {
+                return true;
+            }
+        }
+        else if (name_len < iter->key_len)
+        {
+            if (iter->key[name_len] == '.' && memcmp(name, iter->key, name_len) == 0)
+            {
+                const char* suffix = iter->key + name_len + 1;
+                size_t suffix_len = iter->key_len - name_len - 1;
+                for (size_t i = 0; i < num_stmts; i++)
+                {
+                    if (toml_name_len(stmts[i]->name) == suffix_len && memcmp(stmts[i]->name, suffix, suffix_len) == 0)
+                    {
+                        iter->stmt = stmts[i];
+                        return true;
+                    }
+                }
+            }
+        }
+        else if (name[iter->key_len] == '.' && memcmp(name, iter->key, iter->key_len) == 0)
+        {
+            return true;
+        }
+    }
+    iter->node = NULL;
+    iter->stmt = NULL;
+    return false;
+}
+
+// Statements of a table, a [[list]] item or an inline table.
+struct TomlStmtIter {
+    TomlStmt** stmts;           // Table and list statements
+    TomlNode** nodes;           // Inline table statements, one per node
+    size_t count;
+    size_t next;
+    TomlStmt* stmt;             // Current statement
+};
+
+intern void toml_stmts_begin(TomlStmtIter* iter, TomlNode* node)
+{
+    memset(iter, 0, sizeof(*iter));
+    if (node->kind == TOMLDECL_TABLE)
+    {
+        iter->stmts = node->tbl->stmts;
+        iter->count = node->tbl->num_stmts;
+    }
+    else if (node->kind == TOMLDECL_LIST)
+    {
+        iter->stmts = node->list->stmts;
+        iter->count = node->list->num_stmts;
+    }
+}
+
+intern void toml_inline_table_begin(TomlStmtIter* iter, TomlValue* value)
+{
+    assert(value->kind == TOMLVALUE_INLINETABLE);
+    memset(iter, 0, sizeof(*iter));
+    iter->nodes = value->table_nodes->nodes;
+    iter->count = value->table_nodes->num_nodes;
+}
+
+intern bool toml_stmts_next(TomlStmtIter* iter)
+{
+    if (iter->next >= iter->count)
+    {
+        iter->stmt = NULL;
+        return false;
+    }
+    iter->stmt = iter->stmts ? iter->stmts[iter->next] : iter->nodes[iter->next]->stmt;
+    iter->next++;
+    return true;
+}
+
+// Every [[name]] item in the document, in order. Pair with TomlStmtIter to
+// walk each item's entries.
+struct TomlListIter {
+    TomlNodes* doc;
+    const char* name;
+    size_t name_len;
+    uint64_t hash;
+    size_t next;
+    TomlNode* node;             // Current item
+    TomlList* list;
+};
+
+intern void toml_list_begin(TomlListIter* iter, TomlNodes* doc, const char* name)
+{
+    iter->doc = doc;
+    iter->name = name;
+    iter->name_len = strlen(name);
+    iter->hash = toml_hash(name, iter->name_len);
+    iter->next = 0;
+    iter->node = NULL;
+    iter->list = NULL;
+}
+
+intern bool toml_list_next(TomlListIter* iter)
+{
+    while (iter->next < iter->doc->num_nodes)
+    {
+        TomlNode* node = iter->doc->nodes[iter->next++];
+        if (node->kind == TOMLDECL_LIST && toml_name_is(node->list->name, iter->name, iter->name_len, iter->hash))
+        {
+            iter->node = node;
+            iter->list = node->list;
+            return true;
+        }
+    }
+    iter->node = NULL;
+    iter->list = NULL;
+    return false;
+}
+
+struct TomlArrayIter {
+    TomlValue* array;
+    size_t next;
+    TomlValue* value;           // Current element, in element for packed arrays
+    TomlValue element;
+};
+
+intern void toml_array_begin(TomlArrayIter* iter, TomlValue* array)
+{
+    assert(array->kind == TOMLVALUE_ARRAY);
+    iter->array = array;
+    iter->next = 0;
+    iter->value = NULL;
+}
+
+intern bool toml_array_next(TomlArrayIter* iter)
+{
+    if (iter->next >= iter->array->num_array_vals)
+    {
+        iter->value = NULL;
+        return false;
+    }
+    if (iter->array->array_kind == TOMLVALUE_NONE)
+    {
+        iter->value = iter->array->array_vals[iter->next++];
+    }
+    else
+    {
+        iter->element = toml_array_get(iter->array, iter->next++);
+        iter->value = &iter->element;
+    }
+    return true;
+}
+
+/*
+Lookups against a TomlIndex give the same results as toml_find_nodes, except
+that keys are always matched as full dotted paths. The index maps every
+top-level statement name, every table/list name, every "table.stmt" path and
+every dotted prefix of a table/list name (for the subtables of a key) to the
+nodes toml_find_nodes would return, in document order. Everything is built
+once, out of the document's arena, so lookups neither scan nor allocate.
+*/
+
+struct TomlIndexEntry {
+    const char* key;
+    size_t key_len;
+    uint64_t hash;
+    TomlNodes matches;
+};
+
+struct TomlIndex {
+    TomlIndexEntry* slots;
+    size_t num_slots;       // Always a power of two
+    size_t num_entries;
+};
+
+struct TomlIndexBuildEntry {
+    char* key;              // Stretchy buffer
+    uint64_t hash;
+    TomlNode** matches;     // Stretchy buffer
+    TomlNode* last_owner;   // Table or list that last contributed a statement
+};
+
+struct TomlIndexBuilder {
+    TomlIndexBuildEntry* entries;   // Stretchy buffer
+    size_t* slots;                  // entries index + 1, 0 for empty
+    size_t num_slots;
+};
+
+intern TomlIndexBuildEntry* index_builder_get(TomlIndexBuilder* builder, const char* key, size_t len)
+{
+    if ((size_t)sb_count(builder->entries) * 2 >= builder->num_slots)
+    {
+        size_t num_slots = builder->num_slots ? builder->num_slots * 2 : 64;
+        size_t* slots = (size_t*)TOML_MALLOC(num_slots * sizeof(size_t));
+        memset(slots, 0, num_slots * sizeof(size_t));
+        for (int i = 0; i < sb_count(builder->entries); i++)
+        {
+            size_t slot = builder->entries[i].hash & (num_slots - 1);
+            while (slots[slot])
+            {
+                slot = (slot + 1) & (num_slots - 1);
+            }
+            slots[slot] = i + 1;
+        }
+        TOML_FREE(builder->slots);
+        builder->slots = slots;
+        builder->num_slots = num_slots;
+    }
+    uint64_t hash = toml_hash(key, len);
+    size_t slot = hash & (builder->num_slots - 1);
+    while (builder->slots[slot])
+    {
+        TomlIndexBuildEntry* entry = &builder->entries[builder->slots[slot] - 1];
+        if (entry->hash == hash && (size_t)sb_count(entry->key) == len && memcmp(entry->key, key, len) == 0)
+        {
+            return entry;
+        }
+        slot = (slot + 1) & (builder->num_slots - 1);
+    }
+    TomlIndexBuildEntry entry = {};
+    memcpy(sb_add(entry.key, (int)len), key, len);
+    entry.hash = hash;
+    sb_push(builder->entries, entry);
+    builder->slots[slot] = sb_count(builder->entries);
+    return &sb_last(builder->entries);
+}
+
+intern void index_collection(TomlIndexBuilder* builder, TomlArena* arena, TomlNode* node, const char* name, TomlStmt** stmts, size_t num_stmts)
+{
+    size_t name_len = strlen(name);
+    for (size_t i = 0; i < name_len; i++)
+    {
+        if (name[i] == '.')
+        {
+            sb_push(index_builder_get(builder, name, i)->matches, node);
+        }
+    }
+    sb_push(index_builder_get(builder, name, name_len)->matches, node);
+
+    char* path = NULL;
+    for (size_t i = 0; i < num_stmts; i++)
+    {
+        TomlStmt* stmt = stmts[i];
+        size_t stmt_len = strlen(stmt->name);
+        toml_sb_truncate(path, 0);
+        char* ptr = sb_add(path, (int)(name_len + 1 + stmt_len));
+        memcpy(ptr, name, name_len);
+        ptr[name_len] = '.';
+        memcpy(ptr + name_len + 1, stmt->name, stmt_len);
+        TomlIndexBuildEntry* entry = index_builder_get(builder, path, sb_count(path));
+        // Like toml_find_nodes, only the first matching statement of each
+        // table counts.
+        if (entry->last_owner != node)
+        {
+            TomlNode* wrapper = new_toml_node(arena, TOMLDECL_STMT);
+            wrapper->stmt = stmt;
+            sb_push(entry->matches, wrapper);
+            entry->last_owner = node;
+        }
+    }
+    sb_free(path);
+}
+
+intern TomlIndex* toml_build_index(TomlNodes* doc)
+{
+    TomlArena* arena = doc->arena;
+    TomlIndexBuilder builder = {};
+    for (size_t i = 0; i < doc->num_nodes; i++)
+    {
+        TomlNode* node = doc->nodes[i];
+        switch (node->kind)
+        {
+            case TOMLDECL_STMT:
+                sb_push(index_builder_get(&builder, node->stmt->name, strlen(node->stmt->name))->matches, node);
+                break;
+            case TOMLDECL_TABLE:
+                index_collection(&builder, arena, node, node->tbl->name, node->tbl->stmts, node->tbl->num_stmts);
+                break;
+            case TOMLDECL_LIST:
+                index_collection(&builder, arena, node, node->list->name, node->list->stmts, node->list->num_stmts);
+                break;
+            default:
+                assert(0);
+                break;
+        }
+    }
+
+    size_t num_entries = sb_count(builder.entries);
+    TomlIndex* index = TOML_ARENA_ALLOC(arena, TomlIndex);
+    index->num_entries = num_entries;
+    index->num_slots = 16;
+    while (index->num_slots < num_entries * 2)
+    {
+        index->num_slots *= 2;
+    }
+    index->slots = (TomlIndexEntry*)toml_arena_alloc(arena, index->num_slots * sizeof(TomlIndexEntry));
+    memset(index->slots, 0, index->num_slots * sizeof(TomlIndexEntry));
+    for (size_t i = 0; i < num_entries; i++)
+    {
+        TomlIndexBuildEntry* entry = &builder.entries[i];
+        size_t slot = entry->hash & (index->num_slots - 1);
+        while (index->slots[slot].key)
+        {
+            slot = (slot + 1) & (index->num_slots - 1);
+        }
+        TomlIndexEntry* dest = &index->slots[slot];
+        dest->key_len = sb_count(entry->key);
+        dest->key = dup_str(arena, entry->key, dest->key_len);
+        dest->hash = entry->hash;
+        dest->matches.num_nodes = sb_count(entry->matches);
+        dest->matches.nodes = (TomlNode**)toml_arena_dup(arena, entry->matches, dest->matches.num_nodes * sizeof(TomlNode*));
+        dest->matches.arena = NULL;
+        dest->matches.interns = NULL;
+        dest->matches.mapped = NULL;
+        dest->matches.mapped_size = 0;
+        dest->matches.root = NULL;
+        sb_free(entry->key);
+        sb_free(entry->matches);
+    }
+    sb_free(builder.entries);
+    TOML_FREE(builder.slots);
+    return index;
+}
+
+global const TomlNodes toml_no_matches = {};
+
+// The returned nodes belong to the index and must not be freed.
+intern const TomlNodes* toml_index_find(const TomlIndex* index, const char* key)
+{
+    size_t len = strlen(key);
+    uint64_t hash = toml_hash(key, len);
+    size_t slot = hash & (index->num_slots - 1);
+    for (;;)
+    {
+        const TomlIndexEntry* entry = &index->slots[slot];
+        if (!entry->key)
+        {
+            return &toml_no_matches;
+        }
+        if (entry->hash == hash && entry->key_len == len && memcmp(entry->key, key, len) == 0)
+        {
+            return &entry->matches;
+        }
+        slot = (slot + 1) & (index->num_slots - 1);
+    }
+}
+
+/*
+A snapshot is a parsed document and its TomlIndex serialized into one
+position-independent blob, so a process can map it and answer lookups without
+lexing, parsing or allocating. Everything refers to everything else by byte
+offset from the start of the blob, except strings, which are offsets into
+the string table. Strings are NUL terminated there so names can be used as
+C strings. Multi-byte fields are in the writer's byte order. The writer
+builds the blob and string table in stretchy buffers, whose sizes are ints,
+so each is limited to TOML_SNAPSHOT_MAX_SIZE (about 1GB) and documents that
+would need more fail to serialize.
+
+The header records a checksum of the rest of the blob and the size, mtime
+and hash of the source text it was compiled from. toml_load_snapshot checks
+both and falls back to parsing the source when the snapshot is corrupt or
+stale, serializing the fresh parse in memory so the caller sees the same
+snapshot API either way.
+*/
+
+#define TOML_SNAPSHOT_MAGIC "TOMLSNAP"
+// A stretchy buffer doubles its capacity when it grows, which must stay an int.
+#define TOML_SNAPSHOT_MAX_SIZE (((size_t)INT_MAX - 64) / 2)
+#define TOML_SNAPSHOT_VERSION 1
+
+struct TomlSnapHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t size;
+    uint64_t checksum;          // toml_hash of everything after the header
+    uint64_t source_size;
+    int64_t source_mtime;
+    uint64_t source_hash;
+    uint32_t nodes;             // TomlSnapNode[num_nodes]
+    uint32_t num_nodes;
+    uint32_t slots;             // TomlSnapEntry[num_slots], a power of two
+    uint32_t num_slots;
+    uint32_t strings;
+    uint32_t strings_size;
+};
+
+struct TomlSnapValue {
+    uint32_t kind;              // TomlValueKind
+    uint32_t count;             // String length, array values or inline table statements
+    union {
+        uint64_t bool_val;
+        long long int_val;
+        double float_val;
+        uint64_t offset;        // String, TomlSnapValue[count] or TomlSnapStmt[count]
+    };
+};
+
+struct TomlSnapStmt {
+    uint32_t name;
+    uint32_t name_len;
+    TomlSnapValue value;
+};
+
+struct TomlSnapNode {
+    uint32_t kind;              // TomlDeclKind
+    uint32_t name;              // Table or list name
+    uint32_t name_len;
+    uint32_t num_stmts;         // 1 for a top-level statement
+    uint32_t stmts;             // TomlSnapStmt[num_stmts]
+    uint32_t pad;
+};
+
+struct TomlSnapMatch {
+    uint32_t kind;              // TOMLDECL_STMT for statements, else the node's kind
+    uint32_t offset;            // TomlSnapStmt or TomlSnapNode
+};
+
+struct TomlSnapEntry {
+    uint64_t hash;
+    uint32_t key;
+    uint32_t key_len;
+    uint32_t matches;           // TomlSnapMatch[num_matches], 0 for an empty slot
+    uint32_t num_matches;
+};
+
+struct TomlSnapshot {
+    const char* base;
+    const TomlSnapHeader* header;
+    void* mapped;               // Mapped snapshot file, if any
+    size_t mapped_size;
+    void* owned;                // Blob serialized in memory after a fallback, if any
+};
+
+struct TomlSourceInfo {
+    uint64_t size;
+    int64_t mtime;
+    uint64_t hash;
+};
+
+// Size and modification time of a file; false if it doesn't exist.
+intern bool toml_file_stat(const char* path, uint64_t* size, int64_t* mtime)
+{
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesExA(path, GetFileExInfoStandard, &data))
+    {
+        return false;
+    }
+    *size = ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+    *mtime = (int64_t)(((uint64_t)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime);
+#else
+    struct stat st;
+    if (stat(path, &st) != 0)
+    {
+        return false;
+    }
+    *size = (uint64_t)st.st_size;
+#if defined(__APPLE__)
+    *mtime = (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    *mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+#endif
+    return true;
+}
+
+/* Writing */
+
+// Maps TomlNode and TomlStmt pointers to where they were written.
+struct TomlSnapOffsets {
+    const void** keys;
+    uint32_t* values;
+    size_t num_slots;
+    size_t num_keys;
+};
+
+intern size_t snap_offsets_slot(const TomlSnapOffsets* offsets, const void* key)
+{
+    size_t slot = (size_t)(((uintptr_t)key >> 4) * 0x9E3779B97F4A7C15ull) & (offsets->num_slots - 1);
+    while (offsets->keys[slot] && offsets->keys[slot] != key)
+    {
+        slot = (slot + 1) & (offsets->num_slots - 1);
+    }
+    return slot;
+}
+
+intern void snap_offsets_put(TomlSnapOffsets* offsets, const void* key, uint32_t value)
+{
+    if ((offsets->num_keys + 1) * 2 > offsets->num_slots)
+    {
+        TomlSnapOffsets grown = {};
+        grown.num_slots = offsets->num_slots ? offsets->num_slots * 2 : 256;
+        grown.keys = (const void**)TOML_MALLOC(grown.num_slots * sizeof(void*));
+        grown.values = (uint32_t*)TOML_MALLOC(grown.num_slots * sizeof(uint32_t));
+        memset(grown.keys, 0, grown.num_slots * sizeof(void*));
+        memset(grown.values, 0, grown.num_slots * sizeof(uint32_t));
+        for (size_t i = 0; i < offsets->num_slots; i++)
+        {
+            if (offsets->keys[i])
+            {
+                snap_offsets_put(&grown, offsets->keys[i], offsets->values[i]);
+            }
+        }
+        TOML_FREE(offsets->keys);
+        TOML_FREE(offsets->values);
+        *offsets = grown;
+    }
+    size_t slot = snap_offsets_slot(offsets, key);
+    if (!offsets->keys[slot])
+    {
+        offsets->keys[slot] = key;
+        offsets->num_keys++;
+    }
+    offsets->values[slot] = value;
+}
+
+intern uint32_t snap_offsets_get(const TomlSnapOffsets* offsets, const void* key)
+{
+    size_t slot = snap_offsets_slot(offsets, key);
+    assert(offsets->keys[slot] == key);
+    return offsets->values[slot];
+}
+
+struct TomlSnapWriter {
+    char* blob;                 // Stretchy buffer
+    char* strings;              // Stretchy buffer
+    TomlSnapOffsets names;      // Interned name -> string table offset
+    TomlSnapOffsets offsets;    // Node or statement -> blob offset
+    size_t max_size;            // Of the blob and of the string table
+    bool failed;                // Something didn't fit, nothing more is written
+};
+
+// Reserves zeroed, 8 byte aligned space in the blob and returns its offset.
+// Returns 0 and fails the writer if the blob would grow past max_size, so
+// callers must check failed before writing to the space.
+intern uint32_t snap_reserve(TomlSnapWriter* writer, size_t size)
+{
+    size_t offset = (sb_count(writer->blob) + 7) & ~(size_t)7;
+    if (writer->failed || offset > writer->max_size || size > writer->max_size - offset)
+    {
+        writer->failed = true;
+        return 0;
+    }
+    size_t grow = offset + size - sb_count(writer->blob);
+    memset(sb_add(writer->blob, (int)grow), 0, grow);
+    return (uint32_t)offset;
+}
+
+intern uint32_t snap_string(TomlSnapWriter* writer, const char* str, size_t len)
+{
+    size_t used = sb_count(writer->strings);
+    if (writer->failed || len >= writer->max_size - used)
+    {
+        writer->failed = true;
+        return 0;
+    }
+    uint32_t offset = (uint32_t)used;
+    char* dest = sb_add(writer->strings, (int)(len + 1));
+    memcpy(dest, str, len);
+    dest[len] = 0;
+    return offset;
+}
+
+intern uint32_t snap_name(TomlSnapWriter* writer, const char* name)
+{
+    if (writer->names.num_slots)
+    {
+        size_t slot = snap_offsets_slot(&writer->names, name);
+        if (writer->names.keys[slot])
+        {
+            return writer->names.values[slot];
+        }
+    }
+    uint32_t offset = snap_string(writer, name, toml_name_len(name));
+    snap_offsets_put(&writer->names, name, offset);
+    return offset;
+}
+
+intern uint32_t snap_write_stmts(TomlSnapWriter* writer, TomlStmt** stmts, size_t num_stmts);
+
+// Fills in the TomlSnapValue at offset dest.
+intern void snap_write_value(TomlSnapWriter* writer, uint32_t dest, TomlValue* value)
+{
+    TomlSnapValue snap = {};
+    snap.kind = value->kind;
+    switch (value->kind)
+    {
+        case TOMLVALUE_BOOL:
+            snap.bool_val = value->bool_val;
+            break;
+        case TOMLVALUE_INT:
+            snap.int_val = value->int_val;
+            break;
+        case TOMLVALUE_FLOAT:
+            snap.float_val = value->float_val;
+            break;
+        case TOMLVALUE_STR:
+            snap.count = (uint32_t)value->str_len;
+            snap.offset = snap_string(writer, value->str_val, value->str_len);
+            break;
+        case TOMLVALUE_ARRAY: {
+            snap.count = (uint32_t)value->num_array_vals;
+            uint32_t vals = snap_reserve(writer, value->num_array_vals * sizeof(TomlSnapValue));
+            if (writer->failed)
+            {
+                return;
+            }
+            for (size_t i = 0; i < value->num_array_vals; i++)
+            {
+                TomlValue element = toml_array_get(value, i);
+                snap_write_value(writer, vals + (uint32_t)(i * sizeof(TomlSnapValue)), &element);
+            }
+            snap.offset = vals;
+        } break;
+        case TOMLVALUE_INLINETABLE: {
+            size_t num_stmts = value->table_nodes->num_nodes;
+            uint32_t stmts = snap_reserve(writer, num_stmts * sizeof(TomlSnapStmt));
+            if (writer->failed)
+            {
+                return;
+            }
+            for (size_t i = 0; i < num_stmts; i++)
+            {
+                TomlStmt* stmt = value->table_nodes->nodes[i]->stmt;
+                uint32_t at = stmts + (uint32_t)(i * sizeof(TomlSnapStmt));
+                uint32_t name = snap_name(writer, stmt->name);
+                ((TomlSnapStmt*)(writer->blob + at))->name = name;
+                ((TomlSnapStmt*)(writer->blob + at))->name_len = (uint32_t)toml_name_len(stmt->name);
+                snap_write_value(writer, at + (uint32_t)offsetof(TomlSnapStmt, value), stmt->value);
+            }
+            snap.count = (uint32_t)num_stmts;
+            snap.offset = stmts;
+        } break;
+        default:
+            assert(0);
+            break;
+    }
+    // The blob may have moved while writing children.
+    memcpy(writer->blob + dest, &snap, sizeof(snap));
+}
+
+intern uint32_t snap_write_stmts(TomlSnapWriter* writer, TomlStmt** stmts, size_t num_stmts)
+{
+    uint32_t result = snap_reserve(writer, num_stmts * sizeof(TomlSnapStmt));
+    if (writer->failed)
+    {
+        return 0;
+    }
+    for (size_t i = 0; i < num_stmts; i++)
+    {
+        uint32_t at = result + (uint32_t)(i * sizeof(TomlSnapStmt));
+        uint32_t name = snap_name(writer, stmts[i]->name);
+        ((TomlSnapStmt*)(writer->blob + at))->name = name;
+        ((TomlSnapStmt*)(writer->blob + at))->name_len = (uint32_t)toml_name_len(stmts[i]->name);
+        snap_offsets_put(&writer->offsets, stmts[i], at);
+        snap_write_value(writer, at + (uint32_t)offsetof(TomlSnapStmt, value), stmts[i]->value);
+    }
+    return result;
+}
+
+intern void snap_free_writer(TomlSnapWriter* writer)
+{
+    sb_free(writer->blob);
+    sb_free(writer->strings);
+    TOML_FREE(writer->names.keys);
+    TOML_FREE(writer->names.values);
+    TOML_FREE(writer->offsets.keys);
+    TOML_FREE(writer->offsets.values);
+}
+
+// Serializes doc with a fresh writer. Returns NULL, with *size 0, if the
+// blob or string table would grow past the writer's max_size.
+intern void* snap_write_document(TomlSnapWriter* writer, TomlNodes* doc, const TomlSourceInfo* source, size_t* size)
+{
+    *size = 0;
+    snap_reserve(writer, sizeof(TomlSnapHeader));
+
+    uint32_t nodes = snap_reserve(writer, doc->num_nodes * sizeof(TomlSnapNode));
+    for (size_t i = 0; i < doc->num_nodes && !writer->failed; i++)
+    {
+        TomlNode* node = doc->nodes[i];
+        uint32_t at = nodes + (uint32_t)(i * sizeof(TomlSnapNode));
+        TomlSnapNode snap = {};
+        snap.kind = node->kind;
+        switch (node->kind)
+        {
+            case TOMLDECL_STMT:
+                snap.num_stmts = 1;
+                snap.stmts = snap_write_stmts(writer, &node->stmt, 1);
+                break;
+            case TOMLDECL_TABLE:
+                snap.name = snap_name(writer, node->tbl->name);
+                snap.name_len = (uint32_t)toml_name_len(node->tbl->name);
+                snap.num_stmts = (uint32_t)node->tbl->num_stmts;
+                snap.stmts = snap_write_stmts(writer, node->tbl->stmts, node->tbl->num_stmts);
+                break;
+            case TOMLDECL_LIST:
+                snap.name = snap_name(writer, node->list->name);
+                snap.name_len = (uint32_t)toml_name_len(node->list->name);
+                snap.num_stmts = (uint32_t)node->list->num_stmts;
+                snap.stmts = snap_write_stmts(writer, node->list->stmts, node->list->num_stmts);
+                break;
+            default:
+                assert(0);
+                break;
+        }
+        memcpy(writer->blob + at, &snap, sizeof(snap));
+        snap_offsets_put(&writer->offsets, node, at);
+    }
+    if (writer->failed)
+    {
+        return NULL;
+    }
+
+    // The index is laid out slot for slot, so lookups probe the same way.
+    TomlIndex* index = toml_build_index(doc);
+    uint32_t slots = snap_reserve(writer, index->num_slots * sizeof(TomlSnapEntry));
+    for (size_t i = 0; i < index->num_slots && !writer->failed; i++)
+    {
+        TomlIndexEntry* entry = &index->slots[i];
+        if (!entry->key)
+        {
+            continue;
+        }
+        uint32_t matches = snap_reserve(writer, entry->matches.num_nodes * sizeof(TomlSnapMatch));
+        if (writer->failed)
+        {
+            break;
+        }
+        for (size_t j = 0; j < entry->matches.num_nodes; j++)
+        {
+            TomlNode* node = entry->matches.nodes[j];
+            TomlSnapMatch match;
+            match.kind = node->kind;
+            match.offset = node->kind == TOMLDECL_STMT ? snap_offsets_get(&writer->offsets, node->stmt) : snap_offsets_get(&writer->offsets, node);
+            memcpy(writer->blob + matches + j * sizeof(TomlSnapMatch), &match, sizeof(match));
+        }
+        TomlSnapEntry snap = {};
+        snap.hash = entry->hash;
+        snap.key = snap_string(writer, entry->key, entry->key_len);
+        snap.key_len = (uint32_t)entry->key_len;
+        snap.matches = matches;
+        snap.num_matches = (uint32_t)entry->matches.num_nodes;
+        memcpy(writer->blob + slots + i * sizeof(TomlSnapEntry), &snap, sizeof(snap));
+    }
+
+    uint32_t strings = snap_reserve(writer, sb_count(writer->strings));
+    if (writer->failed)
+    {
+        return NULL;
+    }
+    memcpy(writer->blob + strings, writer->strings, sb_count(writer->strings));
+
+    TomlSnapHeader header = {};
+    memcpy(header.magic, TOML_SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = TOML_SNAPSHOT_VERSION;
+    header.header_size = sizeof(TomlSnapHeader);
+    header.size = sb_count(writer->blob);
+    header.checksum = toml_hash(writer->blob + sizeof(TomlSnapHeader), header.size - sizeof(TomlSnapHeader));
+    header.source_size = source->size;
+    header.source_mtime = source->mtime;
+    header.source_hash = source->hash;
+    header.nodes = nodes;
+    header.num_nodes = (uint32_t)doc->num_nodes;
+    header.slots = slots;
+    header.num_slots = (uint32_t)index->num_slots;
+    header.strings = strings;
+    header.strings_size = (uint32_t)sb_count(writer->strings);
+    memcpy(writer->blob, &header, sizeof(header));
+
+    *size = sb_count(writer->blob);
+    return toml_dup(writer->blob, *size);
+}
+
+// Serializes a document returned by parse_toml into a TOML_MALLOC'd blob.
+// source describes the text it was parsed from, for staleness checks. Returns
+// NULL if the document is too large for a snapshot.
+intern void* toml_write_snapshot(TomlNodes* doc, const TomlSourceInfo* source, size_t* size)
+{
+    TomlSnapWriter writer = {};
+    writer.max_size = TOML_SNAPSHOT_MAX_SIZE;
+    void* result = snap_write_document(&writer, doc, source, size);
+    snap_free_writer(&writer);
+    return result;
+}
+
+// Parses source_path and writes its snapshot to snapshot_path. Returns false
+// if either file can't be opened or the document is too large for a snapshot.
+intern bool toml_compile_snapshot(const char* source_path, const char* snapshot_path)
+{
+    TomlSourceInfo source;
+    if (!toml_file_stat(source_path, &source.size, &source.mtime))
+    {
+        return false;
+    }
+    TomlNodes* doc = toml_parse_file(source_path);
+    if (!doc)
+    {
+        return false;
+    }
+    source.hash = toml_hash((const char*)doc->mapped, doc->mapped_size);
+    size_t size;
+    void* blob = toml_write_snapshot(doc, &source, &size);
+    toml_free_document(doc);
+    if (!blob)
+    {
+        return false;
+    }
+
+    FILE* file = fopen(snapshot_path, "wb");
+    bool written = file && fwrite(blob, 1, size, file) == size;
+    if (file)
+    {
+        written = fclose(file) == 0 && written;
+    }
+    TOML_FREE(blob);
+    return written;
+}
+
+/* Loading */
+
+intern bool toml_snapshot_header_valid(const void* blob, size_t size)
+{
+    const TomlSnapHeader* header = (const TomlSnapHeader*)blob;
+    return size >= sizeof(TomlSnapHeader) &&
+           memcmp(header->magic, TOML_SNAPSHOT_MAGIC, sizeof(header->magic)) == 0 &&
+           header->version == TOML_SNAPSHOT_VERSION &&
+           header->header_size == sizeof(TomlSnapHeader) &&
+           header->size == size;
+}
+
+intern bool toml_snapshot_valid(const void* blob, size_t size)
+{
+    const TomlSnapHeader* header = (const TomlSnapHeader*)blob;
+    return toml_snapshot_header_valid(blob, size) &&
+           header->checksum == toml_hash((const char*)blob + sizeof(TomlSnapHeader), size - sizeof(TomlSnapHeader));
+}
+
+// Whether the header still describes the file at source_path. A matching
+// size and mtime is enough; otherwise the text is hashed, so touching the
+// file doesn't make its snapshot stale.
+intern bool toml_snapshot_fresh(const TomlSnapHeader* header, const char* source_path)
+{
+    uint64_t size;
+    int64_t mtime;
+    if (!toml_file_stat(source_path, &size, &mtime) || size != header->source_size)
+    {
+        return false;
+    }
+    if (mtime == header->source_mtime)
+    {
+        return true;
+    }
+    size_t mapped_size;
+    void* text = toml_map_file(source_path, &mapped_size);
+    if (!text)
+    {
+        return false;
+    }
+    bool same = toml_hash((const char*)text, mapped_size) == header->source_hash;
+    toml_unmap_file(text, mapped_size);
+    return same;
+}
+
+// Maps snapshot_path, returning false (and leaving snapshot empty) if it is
+// missing, corrupt or stale with respect to source_path.
+intern bool toml_open_snapshot(TomlSnapshot* snapshot, const char* snapshot_path, const char* source_path)
+{
+    memset(snapshot, 0, sizeof(*snapshot));
+    size_t size;
+    void* blob = toml_map_file(snapshot_path, &size);
+    if (!blob)
+    {
+        return false;
+    }
+    if (!toml_snapshot_valid(blob, size) || !toml_snapshot_fresh((const TomlSnapHeader*)blob, source_path))
+    {
+        toml_unmap_file(blob, size);
+        return false;
+    }
+    snapshot->base = (const char*)blob;
+    snapshot->header = (const TomlSnapHeader*)blob;
+    snapshot->mapped = blob;
+    snapshot->mapped_size = size;
+    return true;
+}
+
+// Opens the snapshot of source_path, or parses source_path when that fails.
+// Returns false only if the source can't be read or serialized either.
+intern bool toml_load_snapshot(TomlSnapshot* snapshot, const char* source_path, const char* snapshot_path)
+{
+    if (toml_open_snapshot(snapshot, snapshot_path, source_path))
+    {
+        return true;
+    }
+    TomlSourceInfo source;
+    if (!toml_file_stat(source_path, &source.size, &source.mtime))
+    {
+        return false;
+    }
+    TomlNodes* doc = toml_parse_file(source_path);
+    if (!doc)
+    {
+        return false;
+    }
+    source.hash = toml_hash((const char*)doc->mapped, doc->mapped_size);
+    size_t size;
+    snapshot->owned = toml_write_snapshot(doc, &source, &size);
+    snapshot->base = (const char*)snapshot->owned;
+    snapshot->header = (const TomlSnapHeader*)snapshot->owned;
+    toml_free_document(doc);
+    return snapshot->owned != NULL;
+}
+
+intern void toml_close_snapshot(TomlSnapshot* snapshot)
+{
+    if (snapshot->mapped)
+    {
+        toml_unmap_file(snapshot->mapped, snapshot->mapped_size);
+    }
+    TOML_FREE(snapshot->owned);
+    memset(snapshot, 0, sizeof(*snapshot));
+}
+
+/*
+Compact documents
+
+A snapshot is also the compact form of a document: one contiguous block with
+no pointers in it, so it can be placed anywhere, including memory shared by
+several processes. toml_share_document compacts a document into a named
+shared memory object, and toml_attach_document maps that object read-only in
+any other process, so a pre-fork server's workers all read one copy of the
+config through the snapshot accessors instead of each holding its own tree.
+
+The creator is trusted, so attaching checks the header but doesn't checksum
+the block, which would fault in every page of it in every worker. Names
+follow the platform's rules: "/name" for shm_open, and a kernel object name
+such as "Local\\name" on Windows, where the object goes away with the last
+view of it and toml_unlink_document does nothing.
+*/
+
+// Lays doc out as a single block, to be released with TOML_FREE. Returns NULL
+// if doc is too large for one.
+intern void* toml_compact(TomlNodes* doc, size_t* size)
+{
+    TomlSourceInfo source = {};
+    return toml_write_snapshot(doc, &source, size);
+}
+
+// Wraps a compact block that lives somewhere else, e.g. in memory inherited
+// across fork. The snapshot doesn't own the block.
+intern bool toml_view_compact(TomlSnapshot* snapshot, const void* block, size_t size)
+{
+    memset(snapshot, 0, sizeof(*snapshot));
+    if (!toml_snapshot_header_valid(block, size))
+    {
+        return false;
+    }
+    snapshot->base = (const char*)block;
+    snapshot->header = (const TomlSnapHeader*)block;
+    return true;
+}
+
+// Copies a compact block into fresh shared memory. Attaching processes
+// check the magic first, so it goes in last: one that attaches mid-copy
+// finds no document rather than half of one.
+intern void toml_publish_compact(void* view, const void* block, size_t size)
+{
+    size_t magic_size = sizeof(((TomlSnapHeader*)0)->magic);
+    memcpy((char*)view + magic_size, (const char*)block + magic_size, size - magic_size);
+#ifdef _WIN32
+    MemoryBarrier();
+#else
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+#endif
+    memcpy(view, block, magic_size);
+}
+
+// Compacts doc into a new shared memory object shm_name and maps it read-only
+// into snapshot. A previous object of that name is unlinked, not overwritten,
+// so processes attached to it keep reading the old document. On Windows,
+// where names can't be unlinked, sharing fails while the old object lives.
+intern bool toml_share_document(TomlSnapshot* snapshot, TomlNodes* doc, const char* shm_name)
+{
+    memset(snapshot, 0, sizeof(*snapshot));
+    size_t size;
+    void* block = toml_compact(doc, &size);
+    if (!block)
+    {
+        return false;
+    }
+#ifdef _WIN32
+    HANDLE mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD)((uint64_t)size >> 32), (DWORD)size, shm_name);
+    if (mapping && GetLastError() == ERROR_ALREADY_EXISTS)
+    {
+        CloseHandle(mapping);
+        mapping = NULL;
+    }
+    if (!mapping)
+    {
+        TOML_FREE(block);
+        return false;
+    }
+    void* view = MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, size);
+    CloseHandle(mapping);
+    if (!view)
+    {
+        TOML_FREE(block);
+        return false;
+    }
+    toml_publish_compact(view, block, size);
+    DWORD old_protect;
+    VirtualProtect(view, size, PAGE_READONLY, &old_protect);
+#else
+    shm_unlink(shm_name);
+    int fd = shm_open(shm_name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0)
+    {
+        TOML_FREE(block);
+        return false;
+    }
+    if (ftruncate(fd, (off_t)size) != 0)
+    {
+        close(fd);
+        shm_unlink(shm_name);
+        TOML_FREE(block);
+        return false;
+    }
+    void* view = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (view == MAP_FAILED)
+    {
+        shm_unlink(shm_name);
+        TOML_FREE(block);
+        return false;
+    }
+    toml_publish_compact(view, block, size);
+    mprotect(view, size, PROT_READ);
+#endif
+    TOML_FREE(block);
+    snapshot->base = (const char*)view;
+    snapshot->header = (const TomlSnapHeader*)view;
+    snapshot->mapped = view;
+    snapshot->mapped_size = size;
+    return true;
+}
+
+// Maps a document shared by toml_share_document. Returns false if there is
+// no such object or it doesn't hold a compact document.
+intern bool toml_attach_document(TomlSnapshot* snapshot, const char* shm_name)
+{
+    memset(snapshot, 0, sizeof(*snapshot));
+#ifdef _WIN32
+    HANDLE mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, shm_name);
+    if (!mapping)
+    {
+        return false;
+    }
+    void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!view)
+    {
+        return false;
+    }
+    // Views are rounded up to pages, so the header has the real size.
+    MEMORY_BASIC_INFORMATION info;
+    VirtualQuery(view, &info, sizeof(info));
+    size_t size = info.RegionSize >= sizeof(TomlSnapHeader) ? (size_t)((const TomlSnapHeader*)view)->size : 0;
+    if (size > info.RegionSize || !toml_snapshot_header_valid(view, size))
+    {
+        UnmapViewOfFile(view);
+        return false;
+    }
+    MemoryBarrier();
+#else
+    int fd = shm_open(shm_name, O_RDONLY, 0);
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        return false;
+    }
+    size_t size = (size_t)st.st_size;
+    void* view = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (view == MAP_FAILED)
+    {
+        return false;
+    }
+    if (!toml_snapshot_header_valid(view, size))
+    {
+        munmap(view, size);
+        return false;
+    }
+    // Pairs with toml_publish_compact's fence, so the body is complete.
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+#endif
+    snapshot->base = (const char*)view;
+    snapshot->header = (const TomlSnapHeader*)view;
+    snapshot->mapped = view;
+    snapshot->mapped_size = size;
+    return true;
+}
+
+// Removes the name; processes that have it mapped keep their view.
+intern void toml_unlink_document(const char* shm_name)
+{
+#ifndef _WIN32
+    shm_unlink(shm_name);
+#endif
+}
+
+/* Lookups, mirroring toml_index_find and the document structs */
+
+struct TomlSnapMatches {
+    const TomlSnapMatch* matches;
+    size_t num_matches;
+};
+
+intern const char* toml_snap_str(const TomlSnapshot* snapshot, uint32_t offset)
+{
+    return snapshot->base + snapshot->header->strings + offset;
+}
+
+intern TomlSnapMatches toml_snapshot_find(const TomlSnapshot* snapshot, const char* key)
+{
+    TomlSnapMatches result = {};
+    size_t len = strlen(key);
+    uint64_t hash = toml_hash(key, len);
+    const TomlSnapEntry* slots = (const TomlSnapEntry*)(snapshot->base + snapshot->header->slots);
+    size_t mask = snapshot->header->num_slots - 1;
+    for (size_t slot = hash & mask;; slot = (slot + 1) & mask)
+    {
+        const TomlSnapEntry* entry = &slots[slot];
+        if (!entry->num_matches)
+        {
+            return result;
+        }
+        if (entry->hash == hash && entry->key_len == len && memcmp(toml_snap_str(snapshot, entry->key), key, len) == 0)
+        {
+            result.matches = (const TomlSnapMatch*)(snapshot->base + entry->matches);
+            result.num_matches = entry->num_matches;
+            return result;
+        }
+    }
+}
+
+intern const TomlSnapNode* toml_snap_nodes(const TomlSnapshot* snapshot)
+{
+    return (const TomlSnapNode*)(snapshot->base + snapshot->header->nodes);
+}
+
+// The statement a TOMLDECL_STMT match refers to.
+intern const TomlSnapStmt* toml_snap_match_stmt(const TomlSnapshot* snapshot, const TomlSnapMatch* match)
+{
+    assert(match->kind == TOMLDECL_STMT);
+    return (const TomlSnapStmt*)(snapshot->base + match->offset);
+}
+
+// The table or list a TOMLDECL_TABLE/TOMLDECL_LIST match refers to.
+intern const TomlSnapNode* toml_snap_match_node(const TomlSnapshot* snapshot, const TomlSnapMatch* match)
+{
+    assert(match->kind != TOMLDECL_STMT);
+    return (const TomlSnapNode*)(snapshot->base + match->offset);
+}
+
+intern const TomlSnapStmt* toml_snap_stmts(const TomlSnapshot* snapshot, const TomlSnapNode* node)
+{
+    return (const TomlSnapStmt*)(snapshot->base + node->stmts);
+}
+
+intern const TomlSnapValue* toml_snap_array_vals(const TomlSnapshot* snapshot, const TomlSnapValue* value)
+{
+    assert(value->kind == TOMLVALUE_ARRAY);
+    return (const TomlSnapValue*)(snapshot->base + value->offset);
+}
+
+intern const TomlSnapStmt* toml_snap_table_stmts(const TomlSnapshot* snapshot, const TomlSnapValue* value)
+{
+    assert(value->kind == TOMLVALUE_INLINETABLE);
+    return (const TomlSnapStmt*)(snapshot->base + value->offset);
+}
+
+// Not NUL terminated any more than TomlValue::str_val is; use value->count.
+intern const char* toml_snap_str_val(const TomlSnapshot* snapshot, const TomlSnapValue* value)
+{
+    assert(value->kind == TOMLVALUE_STR);
+    return toml_snap_str(snapshot, (uint32_t)value->offset);
+}
+
+#ifndef TOML_NO_THREADS
+/*
+Hot reloading
+
+A TomlDocumentHandle publishes the current document through an atomic
+pointer. Readers bracket their use of it with toml_read_begin/toml_read_end,
+which only store to the reader's own slot and never wait, so a reload can't
+stall a request thread. Documents are immutable once published.
+
+Old documents are reclaimed by epoch: publishing swaps the pointer and then
+bumps the global epoch, tagging the old document with the new value. A
+reader announces the epoch it started in before loading the pointer, so one
+that can still see the old document announced an earlier epoch. Once every
+active slot is at least the tag, nobody can, and the document's arena is
+freed. Reclamation happens on the writer's side, in toml_handle_publish and
+toml_handle_collect.
+*/
+
+#define TOML_MAX_READERS 128
+
+struct TomlReaderSlot {
+    std::atomic<uint64_t> epoch;    // Epoch of the current read, 0 when idle
+    std::atomic<bool> used;
+    char pad[64 - sizeof(std::atomic<uint64_t>) - sizeof(std::atomic<bool>)];
+};
+
+struct TomlRetiredDocument {
+    TomlNodes* doc;
+    uint64_t epoch;
+};
+
+struct TomlDocumentHandle {
+    std::atomic<TomlNodes*> current;
+    std::atomic<uint64_t> epoch;
+    TomlReaderSlot readers[TOML_MAX_READERS];
+    std::mutex writer;                  // Serializes publishers, never taken by readers
+    TomlRetiredDocument* retired;       // Stretchy buffer, guarded by writer
+    std::atomic<uint64_t> num_freed;
+};
+
+intern TomlDocumentHandle* toml_new_document_handle(TomlNodes* doc)
+{
+    TomlDocumentHandle* handle = new TomlDocumentHandle();
+    handle->current = doc;
+    handle->epoch = 1;
+    for (int i = 0; i < TOML_MAX_READERS; i++)
+    {
+        handle->readers[i].epoch = 0;
+        handle->readers[i].used = false;
+    }
+    handle->retired = NULL;
+    handle->num_freed = 0;
+    return handle;
+}
+
+// Claims a reader slot for the calling thread; pass it to toml_read_begin.
+// Returns -1 if all TOML_MAX_READERS slots are taken.
+intern int toml_register_reader(TomlDocumentHandle* handle)
+{
+    for (int i = 0; i < TOML_MAX_READERS; i++)
+    {
+        bool expected = false;
+        if (!handle->readers[i].used.load(std::memory_order_relaxed) && handle->readers[i].used.compare_exchange_strong(expected, true))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+intern void toml_unregister_reader(TomlDocumentHandle* handle, int reader)
+{
+    assert(handle->readers[reader].epoch == 0);
+    handle->readers[reader].used = false;
+}
+
+// The returned document stays valid until the matching toml_read_end.
+intern TomlNodes* toml_read_begin(TomlDocumentHandle* handle, int reader)
+{
+    handle->readers[reader].epoch.store(handle->epoch.load());
+    return handle->current.load();
+}
+
+intern void toml_read_end(TomlDocumentHandle* handle, int reader)
+{
+    handle->readers[reader].epoch.store(0, std::memory_order_release);
+}
+
+// Frees retired documents that no reader can still hold. Returns how many
+// are still waiting.
+intern size_t toml_handle_collect(TomlDocumentHandle* handle)
+{
+    std::lock_guard<std::mutex> lock(handle->writer);
+    uint64_t oldest = UINT64_MAX;
+    for (int i = 0; i < TOML_MAX_READERS; i++)
+    {
+        uint64_t epoch = handle->readers[i].epoch.load();
+        if (epoch && epoch < oldest)
+        {
+            oldest = epoch;
+        }
+    }
+    int kept = 0;
+    for (int i = 0; i < sb_count(handle->retired); i++)
+    {
+        TomlRetiredDocument retired = handle->retired[i];
+        if (retired.epoch <= oldest)
+        {
+            toml_free_document(retired.doc);
+            handle->num_freed++;
+        }
+        else
+        {
+            handle->retired[kept++] = retired;
+        }
+    }
+    toml_sb_truncate(handle->retired, kept);
+    return kept;
+}
+
+// Makes doc the current document. The previous one is freed once its last
+// reader is done with it.
+intern void toml_handle_publish(TomlDocumentHandle* handle, TomlNodes* doc)
+{
+    {
+        std::lock_guard<std::mutex> lock(handle->writer);
+        TomlNodes* old = handle->current.exchange(doc);
+        TomlRetiredDocument retired;
+        retired.doc = old;
+        retired.epoch = handle->epoch.fetch_add(1) + 1;
+        if (old)
+        {
+            sb_push(handle->retired, retired);
+        }
+    }
+    toml_handle_collect(handle);
+}
+
+// Loads path with toml_load_file and publishes it. Returns false, keeping the
+// current document, if the file can't be read or doesn't parse. The parse
+// error goes to *message when one is passed, to be released with TOML_FREE.
+intern bool toml_handle_reload(TomlDocumentHandle* handle, const char* path, char** message = NULL)
+{
+    char* error_message;
+    TomlNodes* doc = toml_load_file(path, &error_message);
+    if (message)
+    {
+        *message = error_message;
+    }
+    else if (error_message)
+    {
+        TOML_FREE(error_message);
+    }
+    if (!doc)
+    {
+        return false;
+    }
+    toml_handle_publish(handle, doc);
+    return true;
+}
+
+// All readers must be done and unregistered.
+intern void toml_free_document_handle(TomlDocumentHandle* handle)
+{
+    size_t waiting = toml_handle_collect(handle);
+    assert(waiting == 0);
+    (void)waiting;
+    toml_free_document(handle->current.load());
+    sb_free(handle->retired);
+    delete handle;
+}
+
+/*
+A file watch reloads a handle from its file whenever the file is written or
+replaced. Editors and deploy tools often write a new file and rename it over
+the old one, so on Linux the watch is an inotify watch on the directory,
+filtered by name, for files closed after writing or renamed into place. A
+file being written in place is only read once it is closed. Elsewhere it
+polls the file's size and mtime, and reloads once they have stopped changing
+for a poll interval. A version that doesn't parse leaves the current
+document in place and only counts in num_failed.
+*/
+
+#define TOML_WATCH_POLL_MS 250
+
+struct TomlFileWatch {
+    TomlDocumentHandle* handle;
+    char* path;
+    std::thread thread;
+    std::atomic<bool> quit;
+    std::atomic<uint64_t> num_reloads;
+    std::atomic<uint64_t> num_failed;  // Reloads that didn't parse
+#ifdef __linux__
+    int inotify_fd;
+    int wake_fds[2];        // Pipe that wakes the watch thread to quit
+    const char* file_name;  // Within path
+#else
+    std::mutex mutex;
+    std::condition_variable wake;
+#endif
+};
+
+intern void toml_watch_reload(TomlFileWatch* watch)
+{
+    char* message;
+    if (toml_handle_reload(watch->handle, watch->path, &message))
+    {
+        watch->num_reloads++;
+    }
+    else if (message)
+    {
+        watch->num_failed++;
+        TOML_FREE(message);
+    }
+}
+
+#ifdef __linux__
+intern void toml_watch_thread(TomlFileWatch* watch)
+{
+    alignas(struct inotify_event) char buf[4096];
+    while (!watch->quit)
+    {
+        struct pollfd fds[2] = { { watch->inotify_fd, POLLIN, 0 }, { watch->wake_fds[0], POLLIN, 0 } };
+        if (poll(fds, 2, -1) < 0 || (fds[1].revents & POLLIN))
+        {
+            continue;
+        }
+        ssize_t len = read(watch->inotify_fd, buf, sizeof(buf));
+        bool changed = false;
+        for (ssize_t at = 0; at < len;)
+        {
+            struct inotify_event* event = (struct inotify_event*)(buf + at);
+            if (event->len && strcmp(event->name, watch->file_name) == 0)
+            {
+                changed = true;
+            }
+            at += sizeof(struct inotify_event) + event->len;
+        }
+        if (changed)
+        {
+            toml_watch_reload(watch);
+        }
+    }
+}
+#else
+intern void toml_watch_thread(TomlFileWatch* watch)
+{
+    // What was last loaded, and what the previous poll saw
+    uint64_t size = 0, seen_size = 0;
+    int64_t mtime = 0, seen_mtime = 0;
+    toml_file_stat(watch->path, &size, &mtime);
+    seen_size = size;
+    seen_mtime = mtime;
+    std::unique_lock<std::mutex> lock(watch->mutex);
+    while (!watch->quit)
+    {
+        watch->wake.wait_for(lock, std::chrono::milliseconds(TOML_WATCH_POLL_MS));
+        uint64_t new_size;
+        int64_t new_mtime;
+        if (watch->quit || !toml_file_stat(watch->path, &new_size, &new_mtime))
+        {
+            continue;
+        }
+        if (new_size != seen_size || new_mtime != seen_mtime)
+        {
+            // Possibly still being written
+            seen_size = new_size;
+            seen_mtime = new_mtime;
+        }
+        else if (new_size != size || new_mtime != mtime)
+        {
+            size = new_size;
+            mtime = new_mtime;
+            toml_watch_reload(watch);
+        }
+    }
+}
+#endif
+
+// Starts reloading handle from path on every change. Returns NULL if the
+// file's directory can't be watched.
+intern TomlFileWatch* toml_watch_file(TomlDocumentHandle* handle, const char* path)
+{
+    TomlFileWatch* watch = new TomlFileWatch();
+    watch->handle = handle;
+    watch->path = (char*)toml_dup(path, strlen(path) + 1);
+    watch->quit = false;
+    watch->num_reloads = 0;
+    watch->num_failed = 0;
+#ifdef __linux__
+    const char* slash = strrchr(watch->path, '/');
+    watch->file_name = slash ? slash + 1 : watch->path;
+    char* dir = slash ? (char*)toml_dup(watch->path, slash - watch->path + 1) : (char*)toml_dup(".", 2);
+    if (slash)
+    {
+        dir[slash - watch->path] = 0;
+        if (!dir[0])
+        {
+            TOML_FREE(dir);
+            dir = (char*)toml_dup("/", 2);
+        }
+    }
+    watch->inotify_fd = inotify_init1(IN_CLOEXEC);
+    int wd = watch->inotify_fd >= 0 ? inotify_add_watch(watch->inotify_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) : -1;
+    TOML_FREE(dir);
+    if (wd < 0 || pipe(watch->wake_fds) != 0)
+    {
+        if (watch->inotify_fd >= 0)
+        {
+            close(watch->inotify_fd);
+        }
+        TOML_FREE(watch->path);
+        delete watch;
+        return NULL;
+    }
+#endif
+    watch->thread = std::thread(toml_watch_thread, watch);
+    return watch;
+}
+
+intern void toml_stop_watch(TomlFileWatch* watch)
+{
+    watch->quit = true;
+#ifdef __linux__
+    char byte = 0;
+    ssize_t written = write(watch->wake_fds[1], &byte, 1);
+    (void)written;
+#else
+    {
+        std::lock_guard<std::mutex> lock(watch->mutex);
+    }
+    watch->wake.notify_all();
+#endif
+    watch->thread.join();
+#ifdef __linux__
+    close(watch->inotify_fd);
+    close(watch->wake_fds[0]);
+    close(watch->wake_fds[1]);
+#endif
+    TOML_FREE(watch->path);
+    delete watch;
+}
+#endif
+
+/*
+Schema binding
+
+A struct can be decoded straight from a parse's events, with no tree built
+and no lookups by name afterwards. Its fields are declared once:
+
+    struct ServerConfig {
+        TomlStr host;
+        int port;
+        double timeout;
+    };
+
+    TOML_SCHEMA(ServerConfig,
+        TOML_FIELD(ServerConfig, "server.host", host),
+        TOML_FIELD(ServerConfig, "server.port", port),
+        TOML_OPTIONAL(ServerConfig, "server.timeout", timeout));
+
+Keys are full dotted paths, however the document spells them: a [table]
+header, an inline table or a dotted key all extend the path the same way.
+They are hashed at compile time, and a perfect hash over them is built at
+compile time too (hash and displace: every key in a bucket uses the bucket's
+displacement to pick its slot). Decoding a key then costs its own characters
+of FNV-1a, continued from its table's prefix, two table loads and a compare.
+
+toml_decode stores each value the document sets and leaves other fields
+alone, so defaults can be filled in beforehand. The report lists keys no
+field binds as unknown, values of the wrong type (or out of range for an
+int) as mismatched, and required fields the document doesn't mention at all
+as missing.
+
+Every field binds one scalar value. A field may be an element of an array
+member, as in TOML_FIELD(S, "limits.first", limits[0]), but TOML arrays
+themselves can't be bound: an array value at a field's key is mismatched.
+Nothing inside a [[list]] can be bound either, so keys there are unknown.
+String fields point into buf or into arena, which must outlive the struct.
+
+Documents are checked as parse_toml checks them, so a key or table defined
+twice is an error, not a value that silently replaces the first one.
+*/
+
+#include <stddef.h>
+
+enum TomlFieldType {
+    TOMLFIELD_BOOL,
+    TOMLFIELD_INT,
+    TOMLFIELD_LONG,
+    TOMLFIELD_DOUBLE,
+    TOMLFIELD_FLOAT,
+    TOMLFIELD_STR,
+};
+
+template <typename T> struct TomlFieldTypeOf;
+template <> struct TomlFieldTypeOf<bool> { static constexpr TomlFieldType type = TOMLFIELD_BOOL; };
+template <> struct TomlFieldTypeOf<int> { static constexpr TomlFieldType type = TOMLFIELD_INT; };
+template <> struct TomlFieldTypeOf<long long> { static constexpr TomlFieldType type = TOMLFIELD_LONG; };
+template <> struct TomlFieldTypeOf<double> { static constexpr TomlFieldType type = TOMLFIELD_DOUBLE; };
+template <> struct TomlFieldTypeOf<float> { static constexpr TomlFieldType type = TOMLFIELD_FLOAT; };
+template <> struct TomlFieldTypeOf<TomlStr> { static constexpr TomlFieldType type = TOMLFIELD_STR; };
+// Elements of array members, as in TOML_FIELD(S, "limits.first", limits[0])
+template <typename T> struct TomlFieldTypeOf<T&> : TomlFieldTypeOf<T> {};
+
+struct TomlField {
+    const char* key;
+    size_t key_len;
+    uint64_t hash;
+    TomlFieldType type;
+    size_t offset;
+    bool required;
+};
+
+intern constexpr size_t toml_const_strlen(const char* str)
+{
+    size_t len = 0;
+    while (str[len])
+    {
+        len++;
+    }
+    return len;
+}
+
+intern constexpr TomlField toml_field(const char* key, TomlFieldType type, size_t offset, bool required)
+{
+    return { key, toml_const_strlen(key), toml_hash(key, toml_const_strlen(key)), type, offset, required };
+}
+
+#define TOML_FIELD(S, key, member) toml_field(key, TomlFieldTypeOf<decltype(S::member)>::type, offsetof(S, member), true)
+#define TOML_OPTIONAL(S, key, member) toml_field(key, TomlFieldTypeOf<decltype(S::member)>::type, offsetof(S, member), false)
+
+intern constexpr size_t toml_schema_pow2(size_t n)
+{
+    size_t pow2 = 1;
+    while (pow2 < n)
+    {
+        pow2 *= 2;
+    }
+    return pow2;
+}
+
+// About two keys per bucket, and a table at most half full.
+#define TOML_SCHEMA_BUCKETS(n) toml_schema_pow2((n) / 2 + 1)
+#define TOML_SCHEMA_SLOTS(n) toml_schema_pow2(2 * (n))
+#define TOML_SCHEMA_MAX_DISPLACEMENT (1u << 20)
+
+intern constexpr size_t toml_schema_bucket(uint64_t hash, size_t num_buckets)
+{
+    return (size_t)((hash * 0x9E3779B97F4A7C15ull) >> 40) & (num_buckets - 1);
+}
+
+intern constexpr size_t toml_schema_slot(uint64_t hash, uint32_t displacement, size_t num_slots)
+{
+    uint64_t x = hash + displacement * 0xBF58476D1CE4E5B9ull;
+    x ^= x >> 31;
+    x *= 0x94D049BB133111EBull;
+    x ^= x >> 29;
+    return (size_t)x & (num_slots - 1);
+}
+
+template <size_t N>
+struct TomlSchemaHash {
+    uint32_t displacements[TOML_SCHEMA_BUCKETS(N)];
+    uint16_t slots[TOML_SCHEMA_SLOTS(N)];     // Field index + 1, 0 when empty
+};
+
+// Neither is constexpr, so reaching one while a schema's hash is being
+// built at compile time is a compile error.
+intern void toml_schema_duplicate_key() {}
+intern void toml_schema_no_perfect_hash() {}
+
+template <size_t N>
+constexpr TomlSchemaHash<N> toml_schema_hash(const TomlField (&fields)[N])
+{
+    static_assert(N < 0xFFFF, "Too many fields for one schema");
+    const size_t num_buckets = TOML_SCHEMA_BUCKETS(N);
+    const size_t num_slots = TOML_SCHEMA_SLOTS(N);
+    TomlSchemaHash<N> result = {};
+    size_t sizes[TOML_SCHEMA_BUCKETS(N)] = {};
+    for (size_t i = 0; i < N; i++)
+    {
+        for (size_t j = 0; j < i; j++)
+        {
+            bool same = fields[i].key_len == fields[j].key_len;
+            for (size_t c = 0; same && c < fields[i].key_len; c++)
+            {
+                same = fields[i].key[c] == fields[j].key[c];
+            }
+            if (same)
+            {
+                toml_schema_duplicate_key();
+            }
+        }
+        sizes[toml_schema_bucket(fields[i].hash, num_buckets)]++;
+    }
+
+    // Biggest buckets first, while the table is emptiest
+    for (size_t size = N; size > 0; size--)
+    {
+        for (size_t bucket = 0; bucket < num_buckets; bucket++)
+        {
+            if (sizes[bucket] != size)
+            {
+                continue;
+            }
+            for (uint32_t displacement = 0;; displacement++)
+            {
+                if (displacement == TOML_SCHEMA_MAX_DISPLACEMENT)
+                {
+                    toml_schema_no_perfect_hash();
+                }
+                bool placed = true;
+                for (size_t i = 0; placed && i < N; i++)
+                {
+                    if (toml_schema_bucket(fields[i].hash, num_buckets) == bucket)
+                    {
+                        uint16_t* slot = &result.slots[toml_schema_slot(fields[i].hash, displacement, num_slots)];
+                        placed = *slot == 0;
+                        *slot = placed ? (uint16_t)(i + 1) : *slot;
+                    }
+                }
+                if (placed)
+                {
+                    result.displacements[bucket] = displacement;
+                    break;
+                }
+                for (size_t i = 0; i < N; i++)
+                {
+                    uint16_t* slot = &result.slots[toml_schema_slot(fields[i].hash, displacement, num_slots)];
+                    if (toml_schema_bucket(fields[i].hash, num_buckets) == bucket && *slot == i + 1)
+                    {
+                        *slot = 0;
+                    }
+                }
+            }
+        }
+    }
+    return result;
+}
+
+struct TomlSchemaInfo {
+    const TomlField* fields;
+    size_t num_fields;
+    const uint32_t* displacements;
+    size_t num_buckets;
+    const uint16_t* slots;
+    size_t num_slots;
+};
+
+template <typename S> struct TomlSchema;
+
+#define TOML_SCHEMA(S, ...) \
+    template <> struct TomlSchema<S> { \
+        static const TomlSchemaInfo* info() \
+        { \
+            static constexpr TomlField fields[] = { __VA_ARGS__ }; \
+            static constexpr size_t num_fields = sizeof(fields) / sizeof(fields[0]); \
+            static constexpr TomlSchemaHash<num_fields> hash = toml_schema_hash(fields); \
+            static constexpr TomlSchemaInfo info = { fields, num_fields, hash.displacements, TOML_SCHEMA_BUCKETS(num_fields), \
+                                                     hash.slots, TOML_SCHEMA_SLOTS(num_fields) }; \
+            return &info; \
+        } \
+    }
+
+struct TomlDecodeReport {
+    char** unknown;             // Stretchy buffer of TOML_MALLOC'd keys
+    char** mismatched;          // Likewise
+    const char** missing;       // Stretchy buffer of the fields' keys
+};
+
+struct TomlDecodePrefix {
+    size_t len;
+    uint64_t hash;              // Of path[0..len]
+};
+
+struct TomlDecoder {
+    const TomlSchemaInfo* schema;
+    char* out;
+    TomlDecodeReport* report;
+    bool* seen;                 // Stretchy buffer, one per field
+    char* path;                 // Stretchy buffer, the prefix of the keys being decoded
+    TomlDecodePrefix* prefixes; // Stretchy buffer: the root, the table, then open inline tables
+    const char* key;            // Interned
+    int array_depth;            // Arrays and the inline tables inside them
+    bool in_list;
+    // The same redefinition checks as parse_toml's. Statements are added as
+    // their values start, since the values themselves are never built.
+    TomlKeyBuilder keys;
+    TomlKeyTable** key_tables;  // Stretchy buffer: open inline tables, NULL for arrays
+    const char* stmt_key;       // The innermost statement's, at any depth
+    TomlValue placeholder;      // What the entries point to; never read back
+    TomlNodes no_nodes;
+};
+
+// Adds the statement whose value of kind is starting to the innermost table.
+// Returns the table made for an inline table value, or NULL.
+intern TomlKeyTable* toml_decode_add_key(TomlDecoder* decoder, TomlValueKind kind)
+{
+    TomlKeyTable* table = sb_count(decoder->key_tables) ? sb_last(decoder->key_tables) : decoder->keys.current;
+    memset(&decoder->placeholder, 0, sizeof(decoder->placeholder));
+    decoder->placeholder.kind = kind;
+    decoder->placeholder.array_kind = TOMLVALUE_NONE;
+    if (kind == TOMLVALUE_INLINETABLE)
+    {
+        decoder->placeholder.table_nodes = &decoder->no_nodes;
+    }
+    return toml_key_add_stmt(&decoder->keys, table, decoder->stmt_key, &decoder->placeholder);
+}
+
+// Array elements have no keys.
+intern bool toml_decode_in_array(TomlDecoder* decoder)
+{
+    return sb_count(decoder->key_tables) && !sb_last(decoder->key_tables);
+}
+
+intern void toml_decode_push_prefix(TomlDecoder* decoder, const char* name)
+{
+    size_t len = toml_name_len(name);
+    TomlDecodePrefix prefix;
+    prefix.len = sb_last(decoder->prefixes).len + len + 1;
+    prefix.hash = toml_hash(".", 1, toml_hash(name, len, sb_last(decoder->prefixes).hash));
+    memcpy(sb_add(decoder->path, (int)len), name, len);
+    sb_push(decoder->path, '.');
+    sb_push(decoder->prefixes, prefix);
+}
+
+intern void toml_decode_pop_prefix(TomlDecoder* decoder)
+{
+    toml_sb_truncate(decoder->prefixes, sb_count(decoder->prefixes) - 1);
+    toml_sb_truncate(decoder->path, sb_last(decoder->prefixes).len);
+}
+
+intern void toml_decode_reset(TomlDecoder* decoder)
+{
+    toml_sb_truncate(decoder->prefixes, 1);
+    toml_sb_truncate(decoder->path, 0);
+    decoder->in_list = false;
+}
+
+// Index of the field bound to the current key, or -1.
+intern int toml_decode_find(TomlDecoder* decoder)
+{
+    const TomlSchemaInfo* schema = decoder->schema;
+    const TomlDecodePrefix* prefix = &sb_last(decoder->prefixes);
+    size_t key_len = toml_name_len(decoder->key);
+    uint64_t hash = toml_hash(decoder->key, key_len, prefix->hash);
+    uint32_t displacement = schema->displacements[toml_schema_bucket(hash, schema->num_buckets)];
+    int index = (int)schema->slots[toml_schema_slot(hash, displacement, schema->num_slots)] - 1;
+    if (index < 0)
+    {
+        return -1;
+    }
+    const TomlField* field = &schema->fields[index];
+    if (field->hash != hash || field->key_len != prefix->len + key_len ||
+        (prefix->len && memcmp(field->key, decoder->path, prefix->len) != 0) ||
+        memcmp(field->key + prefix->len, decoder->key, key_len) != 0)
+    {
+        return -1;
+    }
+    return index;
+}
+
+intern void toml_decode_report_key(TomlDecoder* decoder, char*** list)
+{
+    size_t prefix_len = sb_last(decoder->prefixes).len;
+    size_t key_len = toml_name_len(decoder->key);
+    char* key = (char*)TOML_MALLOC(prefix_len + key_len + 1);
+    if (prefix_len)
+    {
+        memcpy(key, decoder->path, prefix_len);
+    }
+    memcpy(key + prefix_len, decoder->key, key_len);
+    key[prefix_len + key_len] = 0;
+    sb_push(*list, key);
+}
+
+intern void toml_decode_store(TomlDecoder* decoder, const TomlValue* value)
+{
+    int index = decoder->in_list ? -1 : toml_decode_find(decoder);
+    if (index < 0)
+    {
+        toml_decode_report_key(decoder, &decoder->report->unknown);
+        return;
+    }
+    const TomlField* field = &decoder->schema->fields[index];
+    char* dest = decoder->out + field->offset;
+    bool stored = true;
+    switch (field->type)
+    {
+        case TOMLFIELD_BOOL:
+            stored = value->kind == TOMLVALUE_BOOL;
+            if (stored)
+            {
+                *(bool*)dest = value->bool_val;
+            }
+            break;
+        case TOMLFIELD_INT:
+            stored = value->kind == TOMLVALUE_INT && value->int_val >= INT_MIN && value->int_val <= INT_MAX;
+            if (stored)
+            {
+                *(int*)dest = (int)value->int_val;
+            }
+            break;
+        case TOMLFIELD_LONG:
+            stored = value->kind == TOMLVALUE_INT;
+            if (stored)
+            {
+                *(long long*)dest = value->int_val;
+            }
+            break;
+        case TOMLFIELD_DOUBLE:
+        case TOMLFIELD_FLOAT: {
+            stored = value->kind == TOMLVALUE_FLOAT || value->kind == TOMLVALUE_INT;
+            double float_val = value->kind == TOMLVALUE_INT ? (double)value->int_val : value->float_val;
+            if (stored && field->type == TOMLFIELD_DOUBLE)
+            {
+                *(double*)dest = float_val;
+            }
+            else if (stored)
+            {
+                *(float*)dest = (float)float_val;
             }
-            if (*parser.stream == '\n') {
-                token.pos.line++;
+        } break;
+        case TOMLFIELD_STR:
+            stored = value->kind == TOMLVALUE_STR;
+            if (stored)
+            {
+                ((TomlStr*)dest)->str = value->str_val;
+                ((TomlStr*)dest)->len = value->str_len;
             }
-            parser.stream++;
+            break;
+    }
+    // Mismatched fields aren't missing as well
+    decoder->seen[index] = true;
+    if (!stored)
+    {
+        toml_decode_report_key(decoder, &decoder->report->mismatched);
+    }
+}
+
+intern void decode_on_table_begin(void* user, const char* name)
+{
+    TomlDecoder* decoder = (TomlDecoder*)user;
+    toml_key_open_table(&decoder->keys, name);
+    toml_decode_reset(decoder);
+    toml_decode_push_prefix(decoder, name);
+}
+
+intern void decode_on_array_table_begin(void* user, const char* name)
+{
+    TomlDecoder* decoder = (TomlDecoder*)user;
+    toml_key_open_list_item(&decoder->keys, name);
+    toml_decode_reset(decoder);
+    toml_decode_push_prefix(decoder, name);
+    decoder->in_list = true;
+}
+
+intern void decode_on_table_end(void* user)
+{
+    toml_decode_reset((TomlDecoder*)user);
+}
+
+intern void decode_on_key(void* user, const char* name)
+{
+    TomlDecoder* decoder = (TomlDecoder*)user;
+    decoder->stmt_key = name;
+    if (decoder->array_depth == 0)
+    {
+        decoder->key = name;
+    }
+}
+
+intern void decode_on_value(void* user, const TomlValue* value)
+{
+    TomlDecoder* decoder = (TomlDecoder*)user;
+    if (!toml_decode_in_array(decoder))
+    {
+        toml_decode_add_key(decoder, value->kind);
+    }
+    if (decoder->array_depth == 0)
+    {
+        toml_decode_store(decoder, value);
+    }
+}
+
+intern void decode_on_array_begin(void* user)
+{
+    TomlDecoder* decoder = (TomlDecoder*)user;
+    if (!toml_decode_in_array(decoder))
+    {
+        toml_decode_add_key(decoder, TOMLVALUE_ARRAY);
+    }
+    sb_push(decoder->key_tables, (TomlKeyTable*)NULL);
+    if (decoder->array_depth++ == 0)
+    {
+        TomlValue array = {};
+        array.kind = TOMLVALUE_ARRAY;
+        toml_decode_store(decoder, &array);
+    }
+}
+
+intern void decode_on_array_end(void* user)
+{
+    TomlDecoder* decoder = (TomlDecoder*)user;
+    toml_sb_truncate(decoder->key_tables, sb_count(decoder->key_tables) - 1);
+    decoder->array_depth--;
+}
+
+intern void decode_on_inline_table_begin(void* user)
+{
+    TomlDecoder* decoder = (TomlDecoder*)user;
+    // Inline tables inside arrays are only checked, as in toml_key_check_array
+    TomlKeyTable* table = toml_decode_in_array(decoder) ? toml_new_key_table(decoder->keys.arena, TOMLTABLE_INLINE)
+                                                        : toml_decode_add_key(decoder, TOMLVALUE_INLINETABLE);
+    sb_push(decoder->key_tables, table);
+    if (decoder->array_depth > 0)
+    {
+        decoder->array_depth++;
+        return;
+    }
+    int index = decoder->in_list ? -1 : toml_decode_find(decoder);
+    if (index >= 0)
+    {
+        decoder->seen[index] = true;
+        toml_decode_report_key(decoder, &decoder->report->mismatched);
+    }
+    toml_decode_push_prefix(decoder, decoder->key);
+}
+
+intern void decode_on_inline_table_end(void* user)
+{
+    TomlDecoder* decoder = (TomlDecoder*)user;
+    toml_sb_truncate(decoder->key_tables, sb_count(decoder->key_tables) - 1);
+    if (decoder->array_depth > 0)
+    {
+        decoder->array_depth--;
+        return;
+    }
+    toml_decode_pop_prefix(decoder);
+}
+
+global const TomlEvents toml_decode_events = {
+    decode_on_table_begin,
+    decode_on_array_table_begin,
+    decode_on_table_end,
+    decode_on_key,
+    decode_on_value,
+    decode_on_array_begin,
+    decode_on_array_end,
+    decode_on_inline_table_begin,
+    decode_on_inline_table_end,
+};
+
+// Decodes buf into out as schema describes, see toml_decode. Returns true
+// if the report is empty.
+intern bool toml_decode_schema(const char* name, const char* buf, size_t len, const TomlSchemaInfo* schema, void* out,
+                               TomlDecodeReport* report, TomlArena* arena)
+{
+    for (size_t i = 0; !arena && i < schema->num_fields; i++)
+    {
+        assert(schema->fields[i].type != TOMLFIELD_STR && "String fields need an arena to live in");
+    }
+    memset(report, 0, sizeof(*report));
+    TomlDecoder decoder = {};
+    decoder.schema = schema;
+    decoder.out = (char*)out;
+    decoder.report = report;
+    memset(sb_add(decoder.seen, (int)schema->num_fields), 0, schema->num_fields * sizeof(bool));
+    TomlDecodePrefix root = { 0, toml_hash("", 0) };
+    sb_push(decoder.prefixes, root);
+
+    // The key tables go in the arena, beside the names they're keyed by
+    TomlArena* own_arena = arena ? NULL : toml_new_arena();
+    TomlParseContext ctx;
+    toml_init_context(&ctx, name, buf, len, arena ? arena : own_arena);
+    toml_key_builder_init(&decoder.keys, ctx.arena, ctx.interns);
+    decoder.keys.pos = &ctx.token.pos;
+    ctx.events = &toml_decode_events;
+    ctx.user = &decoder;
+    parse_toml_document(&ctx);
+    toml_release_context(&ctx);
+    if (own_arena)
+    {
+        toml_arena_free(own_arena);
+    }
+
+    for (size_t i = 0; i < schema->num_fields; i++)
+    {
+        if (schema->fields[i].required && !decoder.seen[i])
+        {
+            sb_push(report->missing, schema->fields[i].key);
         }
-        if (!*parser.stream) {
-            error_here("Unexpected end of file within multi-line string literal");
+    }
+    sb_free(decoder.seen);
+    sb_free(decoder.path);
+    sb_free(decoder.prefixes);
+    sb_free(decoder.key_tables);
+    return sb_count(report->unknown) == 0 && sb_count(report->mismatched) == 0 && sb_count(report->missing) == 0;
+}
+
+template <typename S>
+intern bool toml_decode(const char* name, const char* buf, size_t len, S* out, TomlDecodeReport* report, TomlArena* arena = NULL)
+{
+    return toml_decode_schema(name, buf, len, TomlSchema<S>::info(), out, report, arena);
+}
+
+intern void toml_free_decode_report(TomlDecodeReport* report)
+{
+    for (int i = 0; i < sb_count(report->unknown); i++)
+    {
+        TOML_FREE(report->unknown[i]);
+    }
+    for (int i = 0; i < sb_count(report->mismatched); i++)
+    {
+        TOML_FREE(report->mismatched[i]);
+    }
+    sb_free(report->unknown);
+    sb_free(report->mismatched);
+    sb_free(report->missing);
+    memset(report, 0, sizeof(*report));
+}
+
+#ifdef TOML_STATIC_PARSE
+/*
+Compile-time documents
+
+In C++20 builds a document embedded in the program can be parsed while the
+program is compiled, into storage sized for exactly that text:
+
+    global TOML_STATIC_DOCUMENT(defaults, R"(
+        [server]
+        host = "localhost"
+        port = 8080
+    )");
+
+    TomlNodes* doc = &defaults.doc;
+
+defaults is a constinit TomlStaticDocument. It holds every node, statement,
+value, name and string of the document, and the compiler resolves the
+pointers between them. Nothing runs at startup and nothing is allocated. A
+syntax error stops the compile at a call to toml_static_error, and the
+call's argument says what was wrong.
+
+The lexer and parser below mirror next_token and parse_toml_value, and share
+their number conversion. toml_static_caps lexes the text once to size the
+storage, then toml_static_parse fills it in. Names are interned the way
+parse_toml interns them, headers included, and the key tables are built
+with parse_toml's checks for redefined keys. So toml_find_nodes, toml_lookup,
+the iterators, compiled queries and the array accessors all work on the
+document unchanged.
+
+There is no arena, and the document must never be freed. A float literal that can only be rounded
+correctly by strtod is a compile error. Compilers limit how much work a
+constant evaluation may do, so large documents may need
+-fconstexpr-ops-limit (GCC), -fconstexpr-steps (Clang) or /constexpr:steps
+(MSVC) raised.
+*/
+
+struct TomlStaticToken {
+    TokenKind kind;
+    const char* start;
+    const char* end;
+    long long int_val;
+    double float_val;
+    size_t str_offset;          // Of the unescaped string in chars
+    size_t str_len;
+};
+
+// chars is NULL while a document is only being measured.
+struct TomlStaticLexer {
+    const char* stream;
+    const char* end;
+    char* chars;
+    size_t num_chars;
+    TomlStaticToken token;
+};
+
+// Neither is constexpr, so reaching one while a document is being parsed at
+// compile time is a compile error that shows the argument.
+intern void toml_static_error(const char*) {}
+intern void toml_static_expected(TokenKind) {}
+
+intern constexpr char toml_static_peek(const TomlStaticLexer* lex, size_t offset)
+{
+    return (size_t)(lex->end - lex->stream) > offset ? lex->stream[offset] : 0;
+}
+
+intern constexpr void toml_static_put(TomlStaticLexer* lex, char c)
+{
+    if (lex->chars)
+    {
+        lex->chars[lex->num_chars] = c;
+    }
+    lex->num_chars++;
+}
+
+intern constexpr void toml_static_scan_float(TomlStaticLexer* lex, int sign)
+{
+    uint64_t mantissa = 0;
+    int num_digits = 0;
+    long long exp10 = 0;
+    bool truncated = false;
+    for (;; lex->stream++)
+    {
+        char c = toml_static_peek(lex, 0);
+        if (c == '_')
+        {
+            continue;
+        }
+        if (!IS_DIGIT(c))
+        {
+            break;
+        }
+        if (num_digits < 19)
+        {
+            mantissa = mantissa * 10 + (c - '0');
+            num_digits += mantissa != 0;
+        }
+        else
+        {
+            exp10++;
+            truncated |= c != '0';
+        }
+    }
+    if (toml_static_peek(lex, 0) == '.')
+    {
+        lex->stream++;
+        for (;; lex->stream++)
+        {
+            char c = toml_static_peek(lex, 0);
+            if (c == '_')
+            {
+                continue;
+            }
+            if (!IS_DIGIT(c))
+            {
+                break;
+            }
+            if (num_digits < 19)
+            {
+                mantissa = mantissa * 10 + (c - '0');
+                num_digits += mantissa != 0;
+                exp10--;
+            }
+            else
+            {
+                truncated |= c != '0';
+            }
+        }
+    }
+    if (TO_LOWER(toml_static_peek(lex, 0)) == 'e')
+    {
+        lex->stream++;
+        int exp_sign = 1;
+        if (toml_static_peek(lex, 0) == '+' || toml_static_peek(lex, 0) == '-')
+        {
+            exp_sign = toml_static_peek(lex, 0) == '-' ? -1 : 1;
+            lex->stream++;
+        }
+        if (!IS_DIGIT(toml_static_peek(lex, 0)))
+        {
+            toml_static_error("Expected digit after float literal exponent");
+        }
+        long long exp = 0;
+        for (char c = toml_static_peek(lex, 0); IS_DIGIT(c) || c == '_'; c = toml_static_peek(lex, 0))
+        {
+            if (c != '_' && exp < 100000)
+            {
+                exp = exp * 10 + (c - '0');
+            }
+            lex->stream++;
+        }
+        exp10 += exp_sign * exp;
+    }
+
+    double val = 0;
+    uint64_t bits = 0, bits_up = 0;
+    if (!truncated && mantissa <= ((uint64_t)1 << 53) && exp10 >= -22 && exp10 <= 22)
+    {
+        // Powers of ten up to 1e22 are exact, however they're multiplied out.
+        double pow10 = 1;
+        for (long long i = 0; i < (exp10 < 0 ? -exp10 : exp10); i++)
+        {
+            pow10 *= 10;
+        }
+        val = exp10 < 0 ? (double)mantissa / pow10 : (double)mantissa * pow10;
+    }
+    else if (toml_eisel_lemire(mantissa, exp10, &bits) &&
+             (!truncated || (toml_eisel_lemire(mantissa + 1, exp10, &bits_up) && bits == bits_up)))
+    {
+        val = toml_bits_to_double(bits);
+    }
+    else
+    {
+        toml_static_error("Float literal needs strtod to round, which isn't available at compile time");
+    }
+    lex->token.kind = TOKEN_FLOAT;
+    lex->token.float_val = sign < 0 ? -val : val;
+}
+
+intern constexpr bool toml_static_scan_float_special(TomlStaticLexer* lex, int sign)
+{
+    double val = 0;
+    if (toml_static_peek(lex, 0) == 'i' && toml_static_peek(lex, 1) == 'n' && toml_static_peek(lex, 2) == 'f')
+    {
+        val = std::numeric_limits<double>::infinity();
+    }
+    else if (toml_static_peek(lex, 0) == 'n' && toml_static_peek(lex, 1) == 'a' && toml_static_peek(lex, 2) == 'n')
+    {
+        val = std::numeric_limits<double>::quiet_NaN();
+    }
+    else
+    {
+        return false;
+    }
+    char next = toml_static_peek(lex, 3);
+    if (IS_ALNUM(next) || next == '_' || next == '.')
+    {
+        return false;
+    }
+    lex->stream += 3;
+    lex->token.kind = TOKEN_FLOAT;
+    lex->token.float_val = sign < 0 ? -val : val;
+    return true;
+}
+
+intern constexpr void toml_static_scan_int(TomlStaticLexer* lex, int sign)
+{
+    int base = 10;
+    if (toml_static_peek(lex, 0) == '0')
+    {
+        switch (toml_static_peek(lex, 1))
+        {
+            case 'x': base = 16; break;
+            case 'o': base = 8; break;
+            case 'b': base = 2; break;
+            default: break;
+        }
+        if (base != 10)
+        {
+            if (lex->token.start != lex->stream)
+            {
+                toml_static_error("Prefixed integer literals cannot have a sign");
+            }
+            lex->stream += 2;
+        }
+    }
+    const char* start_digits = lex->stream;
+    uint64_t limit = sign < 0 ? (uint64_t)LLONG_MAX + 1 : (uint64_t)LLONG_MAX;
+    int safe_digits = int_safe_digits(base);
+    int num_digits = 0;
+    uint64_t val = 0;
+    for (;;)
+    {
+        char c = toml_static_peek(lex, 0);
+        unsigned int digit = toml_digit_values[(unsigned char)c];
+        if (digit >= (unsigned int)base)
+        {
+            if (c == '_')
+            {
+                lex->stream++;
+                continue;
+            }
+            if (digit == TOML_NOT_DIGIT)
+            {
+                break;
+            }
+            toml_static_error("Digit out of range for the integer literal's base");
+        }
+        if (++num_digits > safe_digits && val > (limit - digit) / base)
+        {
+            toml_static_error("Integer literal overflow");
+        }
+        val = val * base + digit;
+        lex->stream++;
+    }
+    if (lex->stream == start_digits)
+    {
+        toml_static_error("Expected digit in integer literal");
+    }
+    lex->token.kind = TOKEN_INT;
+    lex->token.int_val = sign < 0 ? (long long)(0 - val) : (long long)val;
+}
+
+// Unescapes the string into chars (or only counts its characters while
+// measuring), NUL terminated.
+intern constexpr void toml_static_scan_str(TomlStaticLexer* lex)
+{
+    lex->stream++;
+    lex->token.kind = TOKEN_STR;
+    lex->token.str_offset = lex->num_chars;
+    if (toml_static_peek(lex, 0) == '"' && toml_static_peek(lex, 1) == '"')
+    {
+        lex->stream += 2;
+        for (;;)
+        {
+            char c = toml_static_peek(lex, 0);
+            if (c == 0)
+            {
+                toml_static_error("Unexpected end of file within multi-line string literal");
+            }
+            lex->stream++;
+            if (c == '"' && toml_static_peek(lex, 0) == '"' && toml_static_peek(lex, 1) == '"')
+            {
+                lex->stream += 2;
+                break;
+            }
+            if (c != '\r')
+            {
+                toml_static_put(lex, c);
+            }
         }
     }
-    else {
-        while (*parser.stream && *parser.stream != '"') {
-            char val = *parser.stream;
-            if (val == '\n') {
-                error_here("String literal cannot contain newline");
+    else
+    {
+        for (;;)
+        {
+            char c = toml_static_peek(lex, 0);
+            if (c == '"')
+            {
+                lex->stream++;
                 break;
             }
-            else if (val == '\\') {
-                parser.stream++;
-                if (*parser.stream == 'x') {
-                    val = scan_hex_escape();
+            if (c == '\n')
+            {
+                toml_static_error("String literal cannot contain newline");
+            }
+            if (c == 0)
+            {
+                toml_static_error("Unexpected end of file within string literal");
+            }
+            lex->stream++;
+            if (c == '\\')
+            {
+                c = toml_static_peek(lex, 0);
+                if (c == 'x')
+                {
+                    lex->stream++;
+                    unsigned int val = toml_digit_values[(unsigned char)toml_static_peek(lex, 0)];
+                    if (val == TOML_NOT_DIGIT)
+                    {
+                        toml_static_error("\\x needs at least 1 hex digit");
+                    }
+                    lex->stream++;
+                    unsigned int digit = toml_digit_values[(unsigned char)toml_static_peek(lex, 0)];
+                    if (digit != TOML_NOT_DIGIT)
+                    {
+                        val = val * 16 + digit;
+                        lex->stream++;
+                    }
+                    c = (char)val;
                 }
-                else {
-                    val = escape_to_char((unsigned char)*parser.stream);
-                    if (val == 0 && *parser.stream != '0') {
-                        error_here("Invalid string literal escape '\\%c'", *parser.stream);
+                else
+                {
+                    char val = escape_to_char((unsigned char)c);
+                    if (val == 0 && c != '0')
+                    {
+                        toml_static_error("Invalid string literal escape");
                     }
-                    parser.stream++;
+                    c = val;
+                    lex->stream++;
                 }
             }
-            else {
-                parser.stream++;
-            }
-            sb_push(str, val);
-        }
-        if (*parser.stream) {
-            parser.stream++;
-        }
-        else {
-            error_here("Unexpected end of file within string literal");
+            toml_static_put(lex, c);
         }
     }
-    sb_push(str, 0);
-    token.kind = TOKEN_STR;
-    token.str_val = str;
+    lex->token.str_len = lex->num_chars - lex->token.str_offset;
+    toml_static_put(lex, 0);
 }
 
-intern void next_token()
+intern constexpr void toml_static_next(TomlStaticLexer* lex)
 {
-repeat:
-    token.start = parser.stream;
-    switch (*parser.stream)
+    for (;;)
     {
-        case ' ': case '\n': case '\t': case '\v': case '\r':
-            while (IS_SPACE(*parser.stream))
-            {
-                if (*parser.stream == '\n')
-                {
-                    parser.line_start = parser.stream;
-                    token.pos.line++;
-                }
-                parser.stream++;
-            }
-            goto repeat;
-        case '#':
-            while (*parser.stream != '\n' && *parser.stream != 0)
-            {
-                parser.stream++;
-            }
-            goto repeat;
-        case '0': case '1': case '2': case '3': case '4': case '5': case '6': case '7': case '8': case '9':
-        case '-': case '+': {
-            int sign = 1;
-            if (*parser.stream == '-')
-            {
-                parser.stream++;
-                sign = -1;
-            }
-            if (*parser.stream == '+')
+        char c = toml_static_peek(lex, 0);
+        if (c == ' ' || c == '\n' || c == '\t' || c == '\v' || c == '\r')
+        {
+            lex->stream++;
+        }
+        else if (c == '#')
+        {
+            while (toml_static_peek(lex, 0) != '\n' && toml_static_peek(lex, 0) != 0)
             {
-                parser.stream++;
+                lex->stream++;
             }
-            if (!IS_DIGIT(*parser.stream))
+        }
+        else
+        {
+            break;
+        }
+    }
+    lex->token.start = lex->stream;
+    char c = toml_static_peek(lex, 0);
+    if (IS_DIGIT(c) || c == '-' || c == '+')
+    {
+        int sign = 1;
+        if (toml_static_peek(lex, 0) == '-')
+        {
+            lex->stream++;
+            sign = -1;
+        }
+        if (toml_static_peek(lex, 0) == '+')
+        {
+            lex->stream++;
+        }
+        if (!IS_DIGIT(toml_static_peek(lex, 0)))
+        {
+            if (!toml_static_scan_float_special(lex, sign))
             {
-                error_here("Expected digit after sign");
+                toml_static_error("Expected digit after sign");
             }
-            const char* start = parser.stream;
-            while (IS_DIGIT(*parser.stream) || *parser.stream == '_')
+        }
+        else
+        {
+            size_t len = 0;
+            while (IS_DIGIT(toml_static_peek(lex, len)) || toml_static_peek(lex, len) == '_')
             {
-                parser.stream++;
+                len++;
             }
-            char c = *parser.stream;
-            parser.stream = start;
-            if (c == '.' || TO_LOWER(c) == 'e')
+            char next = toml_static_peek(lex, len);
+            if (next == '.' || TO_LOWER(next) == 'e')
             {
-                scan_float(sign);
+                toml_static_scan_float(lex, sign);
             }
             else
             {
-                scan_int(sign);
-            }
-        } break;
-        case 'a': case 'b': case 'c': case 'd': case 'e': case 'f': case 'g': case 'h': case 'i': case 'j':
-        case 'k': case 'l': case 'm': case 'n': case 'o': case 'p': case 'q': case 'r': case 's': case 't':
-        case 'u': case 'v': case 'w': case 'x': case 'y': case 'z':
-        case 'A': case 'B': case 'C': case 'D': case 'E': case 'F': case 'G': case 'H': case 'I': case 'J':
-        case 'K': case 'L': case 'M': case 'N': case 'O': case 'P': case 'Q': case 'R': case 'S': case 'T':
-        case 'U': case 'V': case 'W': case 'X': case 'Y': case 'Z':
-        case '_': {
-            while (IS_ALNUM(*parser.stream) || *parser.stream == '_' || *parser.stream == '.')
-            {
-                parser.stream++;
+                toml_static_scan_int(lex, sign);
             }
-            token.name = dup_str(token.start, parser.stream - token.start);
-            token.kind = TOKEN_NAME;
-        } break;
-        case '[':
-            token.kind = TOKEN_LBRACKET;
-            parser.stream++;
-            break;
-        case ']':
-            token.kind = TOKEN_RBRACKET;
-            parser.stream++;
-            break;
-        case '{':
-            token.kind = TOKEN_LBRACE;
-            parser.stream++;
-            break;
-        case '}':
-            token.kind = TOKEN_RBRACE;
-            parser.stream++;
-            break;
-        case '.':
-            token.kind = TOKEN_DOT;
-            parser.stream++;
-            break;
-        case ',':
-            token.kind = TOKEN_COMMA;
-            parser.stream++;
-            break;
-        case '=':
-            token.kind = TOKEN_EQ;
-            parser.stream++;
-            break;
-        case 0:
-            token.kind = TOKEN_EOF;
-            parser.stream++;
-            break;
-        case '"':
-            scan_str();
-            break;
-        default:
-            assert(0);
-            break;
+        }
     }
-    token.end = parser.stream;
-}
-
-intern bool is_token(TokenKind kind)
-{
-    return token.kind == kind;
-}
-
-intern bool match_token(TokenKind kind)
-{
-    if (token.kind == kind)
+    else if (IS_ALPHA(c) || c == '_')
     {
-        next_token();
-        return true;
+        for (c = toml_static_peek(lex, 0); IS_ALNUM(c) || c == '_' || c == '.'; c = toml_static_peek(lex, 0))
+        {
+            lex->stream++;
+        }
+        lex->token.kind = TOKEN_NAME;
     }
     else
     {
-        return false;
+        switch (c)
+        {
+            case '[': lex->token.kind = TOKEN_LBRACKET; break;
+            case ']': lex->token.kind = TOKEN_RBRACKET; break;
+            case '{': lex->token.kind = TOKEN_LBRACE; break;
+            case '}': lex->token.kind = TOKEN_RBRACE; break;
+            case '.': lex->token.kind = TOKEN_DOT; break;
+            case ',': lex->token.kind = TOKEN_COMMA; break;
+            case '=': lex->token.kind = TOKEN_EQ; break;
+            case 0: lex->token.kind = TOKEN_EOF; break;
+            case '"': toml_static_scan_str(lex); break;
+            default: toml_static_error("Unexpected character"); break;
+        }
+        if (c != 0 && c != '"')
+        {
+            lex->stream++;
+        }
     }
+    lex->token.end = lex->stream;
 }
 
-intern bool expect_token(TokenKind kind)
+intern constexpr void toml_static_expect(TomlStaticLexer* lex, TokenKind kind)
 {
-    if (token.kind == kind)
-    {
-        next_token();
-        return true;
-    }
-    else
+    if (lex->token.kind != kind)
     {
-        error_here("Expected token %s, got %s", token_name(kind), token_info());
-        return false;
+        toml_static_expected(kind);
     }
+    toml_static_next(lex);
 }
 
-/*
-Syntax looks something like:
+intern constexpr void toml_static_lexer_init(TomlStaticLexer* lex, const char* src, char* chars)
+{
+    lex->stream = src;
+    lex->end = src + toml_const_strlen(src);
+    lex->chars = chars;
+    lex->num_chars = 0;
+    lex->token = {};
+}
 
-array = '[' value (, value)* ']'
+// How much of each kind of storage a document needs. Array elements cover
+// nested arrays and inline tables too; arrays of them, and each statement,
+// need a TomlValue and a pointer to it.
+struct TomlStaticCaps {
+    size_t names;
+    size_t name_chars;          // Longest name, with its NUL
+    size_t segments;            // Dotted segments of all names; key entries
+    size_t slots;
+    size_t nodes;
+    size_t node_lists;          // Inline tables, plus one spare
+    size_t tables;
+    size_t lists;
+    size_t stmts;
+    size_t values;
+    size_t elements;
+    size_t floats;
+    size_t ints;
+    size_t bools;               // Bytes of packed bits
+    size_t strs;
+    size_t chars;
+    size_t key_tables;
+    size_t key_slots;
+};
 
-value = INT
-| FLOAT
-| STRING
-| array
+// Upper bounds on what toml_static_parse will store for src, from one pass of
+// the lexer. A '[' after '=', ',' or an array's '[' opens an array; any other
+// opens a header, and a second '[' makes it a [[list]].
+intern constexpr TomlStaticCaps toml_static_caps(const char* src)
+{
+    TomlStaticCaps caps = {};
+    TomlStaticLexer lex = {};
+    toml_static_lexer_init(&lex, src, NULL);
+    TokenKind prev = TOKEN_EOF;
+    bool prev_array = false;
+    size_t max_name = 5;        // "false"
+    for (toml_static_next(&lex); lex.token.kind != TOKEN_EOF; toml_static_next(&lex))
+    {
+        bool array = false;
+        switch (lex.token.kind)
+        {
+            case TOKEN_NAME:
+                caps.names++;
+                caps.bools++;
+                caps.elements++;
+                caps.segments++;
+                for (const char* c = lex.token.start; c < lex.token.end; c++)
+                {
+                    caps.segments += *c == '.';
+                }
+                max_name = (size_t)(lex.token.end - lex.token.start) > max_name ? lex.token.end - lex.token.start : max_name;
+                break;
+            case TOKEN_INT:
+                caps.ints++;
+                caps.elements++;
+                break;
+            case TOKEN_FLOAT:
+                caps.floats++;
+                caps.elements++;
+                break;
+            case TOKEN_STR:
+                caps.strs++;
+                caps.elements++;
+                break;
+            case TOKEN_EQ:
+                caps.stmts++;
+                break;
+            case TOKEN_LBRACE:
+                caps.node_lists++;
+                caps.elements++;
+                break;
+            case TOKEN_LBRACKET:
+                array = prev == TOKEN_EQ || prev == TOKEN_COMMA || (prev == TOKEN_LBRACKET && prev_array);
+                if (array)
+                {
+                    caps.elements++;
+                }
+                else if (prev == TOKEN_LBRACKET)
+                {
+                    caps.tables--;
+                    caps.lists++;
+                }
+                else
+                {
+                    caps.tables++;
+                }
+                break;
+            default:
+                break;
+        }
+        prev = lex.token.kind;
+        prev_array = array;
+    }
+    caps.names += 4;            // true, false, inf and nan
+    caps.names += caps.segments;
+    caps.name_chars = max_name + 1;
+    for (caps.slots = 1; caps.slots < 2 * (caps.names + 1); caps.slots *= 2)
+    {
+    }
+    caps.nodes = caps.stmts + caps.tables + caps.lists;
+    caps.node_lists++;
+    caps.values = caps.stmts + caps.elements;
+    caps.chars = lex.num_chars;
+    // The root, a table per segment at most, list items and inline tables.
+    // A table of n > TOML_KEY_TABLE_LINEAR entries has at most 4n slots.
+    caps.key_tables = 1 + caps.segments + caps.lists + caps.node_lists;
+    caps.key_slots = 4 * caps.segments;
+    return caps;
+}
 
-stmt = NAME '=' value
+// An interned name, laid out as toml_intern_keyword lays it out in an arena.
+template <size_t N>
+struct TomlStaticName {
+    TomlInternHeader header;
+    char chars[N];
+};
 
-table = '[' NAME ']' (stmt)+
+static_assert(offsetof(TomlStaticName<1>, chars) == sizeof(TomlInternHeader), "Names must follow their headers directly");
 
-list_item = '[' '[' NAME ']' ']' (stmt)+
+// Everything a document points to. Arrays that may be needed empty get one
+// spare element.
+template <TomlStaticCaps C>
+struct TomlStaticDocument {
+    TomlNodes doc;
+    TomlInterns interns;
+    const char* slots[C.slots];
+    TomlStaticName<C.name_chars> names[C.names];
+    TomlNode nodes[C.nodes + 1];
+    TomlNode* node_ptrs[C.nodes + 1];
+    TomlNodes node_lists[C.node_lists];
+    TomlTable tables[C.tables + 1];
+    TomlList lists[C.lists + 1];
+    TomlStmt stmts[C.stmts + 1];
+    TomlStmt* stmt_ptrs[C.stmts + 1];
+    TomlValue values[C.values + 1];
+    TomlValue* value_ptrs[C.elements + 1];
+    double floats[C.floats + 1];
+    long long ints[C.ints + 1];
+    uint8_t bools[C.bools + 1];
+    TomlStr strs[C.strs + 1];
+    char chars[C.chars + 1];
+    TomlKeyTable key_tables[C.key_tables];
+    TomlKeyEntry key_entries[C.segments + 1];
+    uint32_t key_slots[C.key_slots + 1];
+    TomlKeyList key_lists[C.lists + 1];
+    TomlKeyTable* key_items[C.lists + 1];
+};
 
-list = (list_item)+
+/*
+Key tables are built while parsing, as parse_toml builds them, but a table's
+final size isn't known until the end. So they are built from indices first,
+each table's entries and each list's items chained in definition order, and
+laid out contiguously by toml_static_key_layout.
 */
-
-enum TomlValueKind {
-    TOMLVALUE_NONE,
-    TOMLVALUE_BOOL,
-    TOMLVALUE_INT,
-    TOMLVALUE_FLOAT,
-    TOMLVALUE_STR,
-    TOMLVALUE_ARRAY,
-    TOMLVALUE_INLINETABLE,
+struct TomlStaticKeyTable {
+    size_t first_entry;         // Index + 1, or 0
+    size_t last_entry;
+    size_t num_entries;
+    TomlKeyTableOrigin origin;
 };
 
-struct TomlNodes;
-
-struct TomlValue {
-    TomlValueKind kind;
-    union {
-        bool bool_val;
-        double float_val;
-        const char* str_val;
-        struct {
-            TomlValue** array_vals;
-            size_t num_array_vals;
-        };
-        struct {
-            TomlNodes* table_nodes;
-        };
-    };
+struct TomlStaticKeyEntry {
+    size_t name;
+    TomlKeyKind kind;
+    size_t target;              // Value, key table or key list index
+    size_t next;                // Index + 1 of the table's next entry, or 0
 };
 
-struct TomlStmt {
-    const char* name;
-    TomlValue* value;
+struct TomlStaticKeyList {
+    size_t first_item;          // Index + 1, or 0
+    size_t last_item;
+    size_t num_items;
 };
 
-struct TomlTable {
-    const char* name;
-    TomlStmt** stmts;
-    size_t num_stmts;
+struct TomlStaticKeyItem {
+    size_t table;
+    size_t next;
 };
 
-struct TomlList {
-    const char* name;
-    TomlStmt** stmts;
+/*
+The parser builds the document in doc, but every pointer it stores is into
+self, the variable doc is about to be copied into, so nothing is relocated
+afterwards. Reads only ever go to doc. Items of open lists wait on the
+stacks below, as in the tree builder, until they can be copied out in one
+piece.
+*/
+template <TomlStaticCaps C>
+struct TomlStaticParser {
+    TomlStaticDocument<C>* self;
+    TomlStaticDocument<C> doc;
+    TomlStaticLexer lex;
+    uint32_t slot_names[C.slots];   // Index + 1 of each slot's name, 0 when empty
+    size_t num_names;
+    size_t num_nodes;
+    size_t num_node_ptrs;
+    size_t num_node_lists;
+    size_t num_tables;
+    size_t num_lists;
     size_t num_stmts;
+    size_t num_stmt_ptrs;
+    size_t num_values;
+    size_t num_value_ptrs;
+    size_t num_floats;
+    size_t num_ints;
+    size_t num_bools;
+    size_t num_strs;
+    TomlNode* node_items[C.nodes + 1];
+    size_t num_node_items;
+    TomlStmt* stmt_items[C.stmts + 1];
+    size_t num_stmt_items;
+    TomlValue elements[C.elements + 1];
+    size_t num_elements;
+    TomlStaticKeyTable key_tables[C.key_tables];
+    size_t num_key_tables;
+    TomlStaticKeyEntry key_entries[C.segments + 1];
+    size_t num_key_entries;
+    TomlStaticKeyList key_lists[C.lists + 1];
+    size_t num_key_lists;
+    TomlStaticKeyItem key_items[C.lists + 1];
+    size_t num_key_items;
+    size_t key_current;         // Where statements go
 };
 
-enum TomlDeclKind {
-    TOMLDECL_NONE,
-    TOMLDECL_STMT,
-    TOMLDECL_TABLE,
-    TOMLDECL_LIST,
-};
+template <TomlStaticCaps C>
+constexpr size_t toml_static_intern(TomlStaticParser<C>* parser, const char* str, size_t len, TomlKeyword keyword)
+{
+    uint64_t hash = toml_hash(str, len);
+    size_t slot = hash & (C.slots - 1);
+    for (; parser->slot_names[slot]; slot = (slot + 1) & (C.slots - 1))
+    {
+        size_t index = parser->slot_names[slot] - 1;
+        const TomlStaticName<C.name_chars>* name = &parser->doc.names[index];
+        bool same = name->header.hash == hash && name->header.len == len;
+        for (size_t i = 0; same && i < len; i++)
+        {
+            same = name->chars[i] == str[i];
+        }
+        if (same)
+        {
+            return index;
+        }
+    }
+    size_t index = parser->num_names++;
+    TomlStaticName<C.name_chars>* name = &parser->doc.names[index];
+    name->header.hash = hash;
+    name->header.len = len;
+    name->header.keyword = keyword;
+    for (size_t i = 0; i < len; i++)
+    {
+        name->chars[i] = str[i];
+    }
+    name->chars[len] = 0;
+    parser->slot_names[slot] = (uint32_t)(index + 1);
+    parser->doc.slots[slot] = parser->self->names[index].chars;
+    return index;
+}
 
-struct TomlNode {
-    TomlDeclKind kind;
-    union {
-        TomlStmt* stmt;
-        TomlTable* tbl;
-        TomlList* list;
-    };
-};
+// Moves the node items from mark on into a list of their own.
+template <TomlStaticCaps C>
+constexpr TomlNodes toml_static_node_list(TomlStaticParser<C>* parser, size_t mark)
+{
+    TomlNodes result = {};
+    result.nodes = &parser->self->node_ptrs[parser->num_node_ptrs];
+    result.num_nodes = parser->num_node_items - mark;
+    for (size_t i = mark; i < parser->num_node_items; i++)
+    {
+        parser->doc.node_ptrs[parser->num_node_ptrs++] = parser->node_items[i];
+    }
+    parser->num_node_items = mark;
+    return result;
+}
 
-struct TomlNodes {
-    TomlNode** nodes;
-    size_t num_nodes;
-};
+template <TomlStaticCaps C>
+constexpr void toml_static_add_node(TomlStaticParser<C>* parser, TomlStmt* stmt)
+{
+    size_t index = parser->num_nodes++;
+    parser->doc.nodes[index].kind = TOMLDECL_STMT;
+    parser->doc.nodes[index].stmt = stmt;
+    parser->node_items[parser->num_node_items++] = &parser->self->nodes[index];
+}
 
-intern void* toml_dup(const void* src, size_t size)
+// Closes the open [table] or [[list]], taking every statement item.
+template <TomlStaticCaps C>
+constexpr void toml_static_close_table(TomlStaticParser<C>* parser, TomlDeclKind kind, const char* name)
 {
-    if (size == 0)
+    size_t num_stmts = parser->num_stmt_items;
+    TomlStmt** stmts = num_stmts ? &parser->self->stmt_ptrs[parser->num_stmt_ptrs] : NULL;
+    for (size_t i = 0; i < num_stmts; i++)
+    {
+        parser->doc.stmt_ptrs[parser->num_stmt_ptrs++] = parser->stmt_items[i];
+    }
+    parser->num_stmt_items = 0;
+    size_t index = parser->num_nodes++;
+    TomlNode* node = &parser->doc.nodes[index];
+    node->kind = kind;
+    if (kind == TOMLDECL_LIST)
+    {
+        parser->doc.lists[parser->num_lists] = { name, stmts, num_stmts };
+        node->list = &parser->self->lists[parser->num_lists++];
+    }
+    else
+    {
+        parser->doc.tables[parser->num_tables] = { name, stmts, num_stmts };
+        node->tbl = &parser->self->tables[parser->num_tables++];
+    }
+    parser->node_items[parser->num_node_items++] = &parser->self->nodes[index];
+}
+
+template <TomlStaticCaps C>
+constexpr size_t toml_static_new_key_table(TomlStaticParser<C>* parser, TomlKeyTableOrigin origin)
+{
+    size_t index = parser->num_key_tables++;
+    parser->key_tables[index] = { 0, 0, 0, origin };
+    return index;
+}
+
+// Index + 1 of the entry for the interned name, or 0.
+template <TomlStaticCaps C>
+constexpr size_t toml_static_key_find(TomlStaticParser<C>* parser, size_t table, size_t name)
+{
+    for (size_t entry = parser->key_tables[table].first_entry; entry; entry = parser->key_entries[entry - 1].next)
+    {
+        if (parser->key_entries[entry - 1].name == name)
+        {
+            return entry;
+        }
+    }
+    return 0;
+}
+
+template <TomlStaticCaps C>
+constexpr void toml_static_key_add(TomlStaticParser<C>* parser, size_t table, size_t name, TomlKeyKind kind, size_t target)
+{
+    size_t index = parser->num_key_entries++;
+    parser->key_entries[index] = { name, kind, target, 0 };
+    TomlStaticKeyTable* key_table = &parser->key_tables[table];
+    if (key_table->last_entry)
+    {
+        parser->key_entries[key_table->last_entry - 1].next = index + 1;
+    }
+    else
+    {
+        key_table->first_entry = index + 1;
+    }
+    key_table->last_entry = index + 1;
+    key_table->num_entries++;
+}
+
+// Appends an item to a list and returns its table.
+template <TomlStaticCaps C>
+constexpr size_t toml_static_key_list_push(TomlStaticParser<C>* parser, size_t list)
+{
+    size_t table = toml_static_new_key_table(parser, TOMLTABLE_LIST_ITEM);
+    size_t index = parser->num_key_items++;
+    parser->key_items[index] = { table, 0 };
+    TomlStaticKeyList* key_list = &parser->key_lists[list];
+    if (key_list->last_item)
+    {
+        parser->key_items[key_list->last_item - 1].next = index + 1;
+    }
+    else
     {
-        return NULL;
+        key_list->first_item = index + 1;
     }
-    void* ptr = TOML_MALLOC(size);
-    memcpy(ptr, src, size);
-    return ptr;
+    key_list->last_item = index + 1;
+    key_list->num_items++;
+    return table;
 }
 
-#define TOML_DUP(x) toml_dup(x, num_##x * sizeof(*x))
-
-intern TomlNodes* new_tomlnodes(TomlNode** nodes, size_t num_nodes)
+// As toml_key_segments, with names and segments as intern indices.
+template <TomlStaticCaps C>
+constexpr size_t toml_static_key_segments(TomlStaticParser<C>* parser, size_t name, size_t* segments)
 {
-    TomlNodes* result = TOML_ALLOC(TomlNodes);
-    result->nodes = (TomlNode**)TOML_DUP(nodes);
-    result->num_nodes = num_nodes;
-    return result;
+    size_t len = parser->doc.names[name].header.len;
+    size_t num_segments = 0;
+    size_t start = 0;
+    for (size_t i = 0; i <= len; i++)
+    {
+        if (i == len || parser->doc.names[name].chars[i] == '.')
+        {
+            if (i == start)
+            {
+                toml_static_error("Empty key segment");
+            }
+            if (num_segments == TOML_MAX_KEY_SEGMENTS)
+            {
+                toml_static_error("Too many dotted segments");
+            }
+            segments[num_segments++] = start == 0 && i == len ? name : toml_static_intern(parser, parser->doc.names[name].chars + start, i - start, TOML_KEYWORD_NONE);
+            start = i + 1;
+        }
+    }
+    return num_segments;
 }
 
-intern TomlTable* new_toml_table(const char* name, TomlStmt** stmts, size_t num_stmts)
+// As toml_key_header_parent.
+template <TomlStaticCaps C>
+constexpr size_t toml_static_key_header_parent(TomlStaticParser<C>* parser, const size_t* segments, size_t num_segments)
 {
-    TomlTable* result = TOML_ALLOC(TomlTable);
-    result->name = name;
-    result->stmts = (TomlStmt**)TOML_DUP(stmts);
-    result->num_stmts = num_stmts;
-    return result;
+    size_t table = 0;
+    for (size_t i = 0; i + 1 < num_segments; i++)
+    {
+        size_t entry = toml_static_key_find(parser, table, segments[i]);
+        const TomlStaticKeyEntry* found = entry ? &parser->key_entries[entry - 1] : NULL;
+        if (!found)
+        {
+            size_t child = toml_static_new_key_table(parser, TOMLTABLE_IMPLICIT);
+            toml_static_key_add(parser, table, segments[i], TOMLKEY_TABLE, child);
+            table = child;
+        }
+        else if (found->kind == TOMLKEY_TABLE && parser->key_tables[found->target].origin != TOMLTABLE_INLINE)
+        {
+            table = found->target;
+        }
+        else if (found->kind == TOMLKEY_LIST)
+        {
+            table = parser->key_items[parser->key_lists[found->target].last_item - 1].table;
+        }
+        else
+        {
+            toml_static_error("Table extends a key that isn't a table");
+        }
+    }
+    return table;
 }
 
-intern TomlList* new_toml_list(const char* name, TomlStmt** stmts, size_t num_stmts)
+template <TomlStaticCaps C>
+constexpr void toml_static_key_open_table(TomlStaticParser<C>* parser, size_t name)
 {
-    TomlList* result = TOML_ALLOC(TomlList);
-    result->name = name;
-    result->stmts = (TomlStmt**)TOML_DUP(stmts);
-    result->num_stmts = num_stmts;
-    return result;
+    size_t segments[TOML_MAX_KEY_SEGMENTS] = {};
+    size_t num_segments = toml_static_key_segments(parser, name, segments);
+    size_t parent = toml_static_key_header_parent(parser, segments, num_segments);
+    size_t entry = toml_static_key_find(parser, parent, segments[num_segments - 1]);
+    if (!entry)
+    {
+        parser->key_current = toml_static_new_key_table(parser, TOMLTABLE_HEADER);
+        toml_static_key_add(parser, parent, segments[num_segments - 1], TOMLKEY_TABLE, parser->key_current);
+    }
+    else if (parser->key_entries[entry - 1].kind == TOMLKEY_TABLE && parser->key_tables[parser->key_entries[entry - 1].target].origin == TOMLTABLE_IMPLICIT)
+    {
+        parser->key_current = parser->key_entries[entry - 1].target;
+        parser->key_tables[parser->key_current].origin = TOMLTABLE_HEADER;
+    }
+    else
+    {
+        toml_static_error("Table is already defined");
+    }
 }
 
-intern TomlStmt* new_toml_stmt(const char* name, TomlValue* value)
+template <TomlStaticCaps C>
+constexpr void toml_static_key_open_list_item(TomlStaticParser<C>* parser, size_t name)
 {
-    TomlStmt* result = TOML_ALLOC(TomlStmt);
-    result->name = name;
-    result->value = value;
-    return result;
+    size_t segments[TOML_MAX_KEY_SEGMENTS] = {};
+    size_t num_segments = toml_static_key_segments(parser, name, segments);
+    size_t parent = toml_static_key_header_parent(parser, segments, num_segments);
+    size_t entry = toml_static_key_find(parser, parent, segments[num_segments - 1]);
+    if (!entry)
+    {
+        size_t list = parser->num_key_lists++;
+        parser->key_lists[list] = {};
+        toml_static_key_add(parser, parent, segments[num_segments - 1], TOMLKEY_LIST, list);
+        parser->key_current = toml_static_key_list_push(parser, list);
+    }
+    else if (parser->key_entries[entry - 1].kind == TOMLKEY_LIST)
+    {
+        parser->key_current = toml_static_key_list_push(parser, parser->key_entries[entry - 1].target);
+    }
+    else
+    {
+        toml_static_error("Array of tables is already defined as a table or value");
+    }
 }
 
-intern TomlNode* parse_toml_stmt();
-
-intern TomlValue* parse_toml_value()
+// As toml_key_add_stmt. inline_table is the index + 1 of the key table
+// already built for an inline table value, or 0.
+template <TomlStaticCaps C>
+constexpr void toml_static_key_add_stmt(TomlStaticParser<C>* parser, size_t table, size_t name, size_t value, size_t inline_table)
 {
-    TomlValue* result = TOML_ALLOC(TomlValue);
-    if (is_token(TOKEN_NAME))
+    size_t segments[TOML_MAX_KEY_SEGMENTS] = {};
+    size_t num_segments = toml_static_key_segments(parser, name, segments);
+    for (size_t i = 0; i + 1 < num_segments; i++)
     {
-        if (strcmp(token.name, "true") == 0)
+        size_t entry = toml_static_key_find(parser, table, segments[i]);
+        if (!entry)
         {
-            result->kind = TOMLVALUE_BOOL;
-            result->bool_val = true;
+            size_t child = toml_static_new_key_table(parser, TOMLTABLE_DOTTED);
+            toml_static_key_add(parser, table, segments[i], TOMLKEY_TABLE, child);
+            table = child;
         }
-        else if (strcmp(token.name, "false") == 0)
+        else if (parser->key_entries[entry - 1].kind == TOMLKEY_TABLE &&
+                 (parser->key_tables[parser->key_entries[entry - 1].target].origin == TOMLTABLE_DOTTED ||
+                  parser->key_tables[parser->key_entries[entry - 1].target].origin == TOMLTABLE_IMPLICIT))
         {
-            result->kind = TOMLVALUE_BOOL;
-            result->bool_val = false;
+            table = parser->key_entries[entry - 1].target;
         }
         else
         {
-            error_here("Expected value type, found name");
+            toml_static_error("Dotted key extends a value or a table defined elsewhere");
         }
-        next_token();
     }
-    else if (is_token(TOKEN_INT))
+    size_t last = segments[num_segments - 1];
+    if (toml_static_key_find(parser, table, last))
     {
-        result->kind = TOMLVALUE_INT;
-        result->float_val = (double)token.int_val;
-        next_token();
+        toml_static_error("Duplicate key");
     }
-    else if (is_token(TOKEN_FLOAT))
+    if (inline_table)
     {
-        result->kind = TOMLVALUE_FLOAT;
-        result->float_val = token.float_val;
-        next_token();
+        toml_static_key_add(parser, table, last, TOMLKEY_TABLE, inline_table - 1);
     }
-    else if (is_token(TOKEN_STR))
+    else
     {
-        result->kind = TOMLVALUE_STR;
-        result->str_val = token.str_val;
-        next_token();
+        toml_static_key_add(parser, table, last, TOMLKEY_VALUE, value);
     }
-    else if (is_token(TOKEN_LBRACKET))
+}
+
+// Copies the chained tables, entries and items into self's arrays, with
+// slots laid out as toml_key_table_add leaves them.
+template <TomlStaticCaps C>
+constexpr void toml_static_key_layout(TomlStaticParser<C>* parser)
+{
+    TomlStaticDocument<C>* self = parser->self;
+    TomlStaticDocument<C>* doc = &parser->doc;
+    size_t num_entries = 0;
+    size_t num_slots = 0;
+    for (size_t t = 0; t < parser->num_key_tables; t++)
     {
-        result->kind = TOMLVALUE_ARRAY;
-        next_token();
-        TomlValue** values = NULL;
-        sb_push(values, parse_toml_value());
-        while (is_token(TOKEN_COMMA))
+        const TomlStaticKeyTable* key_table = &parser->key_tables[t];
+        TomlKeyTable* table = &doc->key_tables[t];
+        table->entries = key_table->num_entries ? &self->key_entries[num_entries] : NULL;
+        table->num_entries = key_table->num_entries;
+        table->max_entries = key_table->num_entries;
+        table->origin = key_table->origin;
+        for (size_t e = key_table->first_entry; e; e = parser->key_entries[e - 1].next)
         {
-            next_token();
-            if (is_token(TOKEN_RBRACKET)) // trailing commas are permitted
+            const TomlStaticKeyEntry* key_entry = &parser->key_entries[e - 1];
+            TomlKeyEntry* entry = &doc->key_entries[num_entries++];
+            entry->name = self->names[key_entry->name].chars;
+            entry->kind = key_entry->kind;
+            if (key_entry->kind == TOMLKEY_VALUE)
             {
-                break;
+                entry->value = &self->values[key_entry->target];
+            }
+            else if (key_entry->kind == TOMLKEY_TABLE)
+            {
+                entry->table = &self->key_tables[key_entry->target];
+            }
+            else
+            {
+                entry->list = &self->key_lists[key_entry->target];
             }
-            sb_push(values, parse_toml_value());
         }
-        expect_token(TOKEN_RBRACKET);
-        size_t num_values = sb_count(values);
-        result->array_vals = (TomlValue**)TOML_DUP(values);
-        result->num_array_vals = num_values;
-        sb_free(values);
-    }
-    else if (is_token(TOKEN_LBRACE))
-    {
-        result->kind = TOMLVALUE_INLINETABLE;
-        next_token();
-        TomlNode** stmts = NULL;
-        sb_push(stmts, parse_toml_stmt());
-        while (is_token(TOKEN_COMMA))
+        if (table->num_entries <= TOML_KEY_TABLE_LINEAR)
+        {
+            continue;
+        }
+        // Rehashing inserts in entry order, so one pass in that order lands
+        // every entry where the runtime builder's incremental inserts do.
+        size_t size = TOML_KEY_TABLE_LINEAR * 4;
+        while (table->num_entries * 2 > size)
         {
-            next_token();
-            if (is_token(TOKEN_RBRACE)) // trailing commas are permitted
+            size *= 2;
+        }
+        table->slots = &self->key_slots[num_slots];
+        table->num_slots = size;
+        size_t i = 0;
+        for (size_t e = key_table->first_entry; e; e = parser->key_entries[e - 1].next)
+        {
+            size_t slot = doc->names[parser->key_entries[e - 1].name].header.hash & (size - 1);
+            while (doc->key_slots[num_slots + slot])
             {
-                break;
+                slot = (slot + 1) & (size - 1);
             }
-            sb_push(stmts, parse_toml_stmt());
+            doc->key_slots[num_slots + slot] = (uint32_t)++i;
         }
-        expect_token(TOKEN_RBRACE);
-        size_t num_stmts = sb_count(stmts);
-        result->table_nodes = new_tomlnodes(stmts, num_stmts);
-        sb_free(stmts);
-        return result;
+        num_slots += size;
     }
-    else
+    size_t num_items = 0;
+    for (size_t l = 0; l < parser->num_key_lists; l++)
     {
-        error_here("Unexpected token %s", token_info());
+        TomlKeyList* list = &doc->key_lists[l];
+        list->items = &self->key_items[num_items];
+        list->num_items = parser->key_lists[l].num_items;
+        list->max_items = list->num_items;
+        for (size_t i = parser->key_lists[l].first_item; i; i = parser->key_items[i - 1].next)
+        {
+            doc->key_items[num_items++] = &self->key_tables[parser->key_items[i - 1].table];
+        }
     }
-
-    return result;
 }
 
-intern TomlNode* parse_toml_stmt()
+// As toml_pack_array, for the elements from mark on.
+template <TomlStaticCaps C>
+constexpr void toml_static_pack_array(TomlStaticParser<C>* parser, TomlValue* array, size_t mark)
 {
-    const char* name = token.name;
-    expect_token(TOKEN_NAME);
-    expect_token(TOKEN_EQ);
-    TomlValue* value = parse_toml_value();
-    TomlNode* node = TOML_ALLOC(TomlNode);
-    node->kind = TOMLDECL_STMT;
-    node->stmt = new_toml_stmt(name, value);
-    return node;
-}
-
-intern TomlNode* parse_toml_list_item()
-{
-    const char* name = token.name;
-    expect_token(TOKEN_NAME);
-    expect_token(TOKEN_RBRACKET);
-    expect_token(TOKEN_RBRACKET);
-    TomlStmt** stmts = NULL;
-    while (is_token(TOKEN_NAME))
+    TomlStaticDocument<C>* self = parser->self;
+    TomlStaticDocument<C>* doc = &parser->doc;
+    const TomlValue* vals = &parser->elements[mark];
+    size_t count = parser->num_elements - mark;
+    TomlValueKind kind = vals[0].kind;
+    if (kind == TOMLVALUE_ARRAY || kind == TOMLVALUE_INLINETABLE)
     {
-        TomlNode* stmt_node = parse_toml_stmt();
-        sb_push(stmts, stmt_node->stmt);
+        kind = TOMLVALUE_NONE;
     }
-    TomlNode* node = TOML_ALLOC(TomlNode);
-    node->kind = TOMLDECL_LIST;
-    node->list = new_toml_list(name, stmts, sb_count(stmts));
-    sb_free(stmts);
-    return node;
-}
-
-intern TomlNode* parse_toml_collection()
-{
-    expect_token(TOKEN_LBRACKET);
-    if (match_token(TOKEN_LBRACKET))
+    for (size_t i = 1; i < count && kind != TOMLVALUE_NONE; i++)
     {
-        return parse_toml_list_item();
+        kind = vals[i].kind == kind ? kind : TOMLVALUE_NONE;
     }
-    else
+    array->kind = TOMLVALUE_ARRAY;
+    array->array_kind = kind;
+    array->num_array_vals = count;
+    switch (kind)
     {
-        const char* name = token.name;
-        expect_token(TOKEN_NAME);
-        expect_token(TOKEN_RBRACKET);
-        TomlStmt** stmts = NULL;
-        while (is_token(TOKEN_NAME))
-        {
-            TomlNode* stmt_node = parse_toml_stmt();
-            sb_push(stmts, stmt_node->stmt);
-        }
-        TomlNode* node = TOML_ALLOC(TomlNode);
-        node->kind = TOMLDECL_TABLE;
-        node->tbl = new_toml_table(name, stmts, sb_count(stmts));
-        sb_free(stmts);
-        return node;
+        case TOMLVALUE_BOOL:
+            array->bool_bits = &self->bools[parser->num_bools];
+            for (size_t i = 0; i < count; i++)
+            {
+                doc->bools[parser->num_bools + (i >> 3)] |= (uint8_t)(vals[i].bool_val << (i & 7));
+            }
+            parser->num_bools += (count + 7) / 8;
+            break;
+        case TOMLVALUE_INT:
+            array->int_vals = &self->ints[parser->num_ints];
+            for (size_t i = 0; i < count; i++)
+            {
+                doc->ints[parser->num_ints++] = vals[i].int_val;
+            }
+            break;
+        case TOMLVALUE_FLOAT:
+            array->float_vals = &self->floats[parser->num_floats];
+            for (size_t i = 0; i < count; i++)
+            {
+                doc->floats[parser->num_floats++] = vals[i].float_val;
+            }
+            break;
+        case TOMLVALUE_STR:
+            array->str_vals = &self->strs[parser->num_strs];
+            for (size_t i = 0; i < count; i++)
+            {
+                doc->strs[parser->num_strs++] = { vals[i].str_val, vals[i].str_len };
+            }
+            break;
+        default:
+            array->array_vals = &self->value_ptrs[parser->num_value_ptrs];
+            for (size_t i = 0; i < count; i++)
+            {
+                doc->values[parser->num_values] = vals[i];
+                doc->value_ptrs[parser->num_value_ptrs++] = &self->values[parser->num_values++];
+            }
+            break;
     }
+    parser->num_elements = mark;
 }
 
-intern TomlNode* parse_node()
+template <TomlStaticCaps C>
+constexpr TomlStmt* toml_static_parse_stmt(TomlStaticParser<C>* parser, size_t key_table);
+
+// Sets *inline_table to the index + 1 of an inline table's key table.
+template <TomlStaticCaps C>
+constexpr TomlValue toml_static_parse_value(TomlStaticParser<C>* parser, size_t* inline_table)
 {
-    if (is_token(TOKEN_LBRACKET))
+    TomlStaticLexer* lex = &parser->lex;
+    TomlValue value = {};
+    value.array_kind = TOMLVALUE_NONE;
+    if (lex->token.kind == TOKEN_NAME)
+    {
+        size_t name = toml_static_intern(parser, lex->token.start, lex->token.end - lex->token.start, TOML_KEYWORD_NONE);
+        switch (parser->doc.names[name].header.keyword)
+        {
+            case TOML_KEYWORD_TRUE:
+                value.kind = TOMLVALUE_BOOL;
+                value.bool_val = true;
+                break;
+            case TOML_KEYWORD_FALSE:
+                value.kind = TOMLVALUE_BOOL;
+                value.bool_val = false;
+                break;
+            case TOML_KEYWORD_INF:
+                value.kind = TOMLVALUE_FLOAT;
+                value.float_val = std::numeric_limits<double>::infinity();
+                break;
+            case TOML_KEYWORD_NAN:
+                value.kind = TOMLVALUE_FLOAT;
+                value.float_val = std::numeric_limits<double>::quiet_NaN();
+                break;
+            default:
+                toml_static_error("Expected value type, found name");
+                break;
+        }
+        toml_static_next(lex);
+    }
+    else if (lex->token.kind == TOKEN_INT)
     {
-        return parse_toml_collection();
+        value.kind = TOMLVALUE_INT;
+        value.int_val = lex->token.int_val;
+        toml_static_next(lex);
     }
-    else if (is_token(TOKEN_NAME))
+    else if (lex->token.kind == TOKEN_FLOAT)
     {
-        return parse_toml_stmt();
+        value.kind = TOMLVALUE_FLOAT;
+        value.float_val = lex->token.float_val;
+        toml_static_next(lex);
     }
-    else
+    else if (lex->token.kind == TOKEN_STR)
     {
-        error_here("Expected one or more declarations");
-        return NULL;
+        value.kind = TOMLVALUE_STR;
+        value.str_val = &parser->self->chars[lex->token.str_offset];
+        value.str_len = lex->token.str_len;
+        toml_static_next(lex);
     }
-}
-
-intern TomlNodes* parse_toml(const char* name, const char* buf)
-{
-    parser.stream = buf;
-    parser.line_start = parser.stream;
-    token.pos.name = name;
-    token.pos.line = 1;
-    next_token();
-
-    TomlNode** nodes = NULL;
-    while (!is_token(TOKEN_EOF))
+    else if (lex->token.kind == TOKEN_LBRACKET)
     {
-        TomlNode* node = parse_node();
-        if (!node)
+        size_t mark = parser->num_elements;
+        size_t element_table = 0;
+        toml_static_next(lex);
+        TomlValue element = toml_static_parse_value(parser, &element_table);
+        parser->elements[parser->num_elements++] = element;
+        while (lex->token.kind == TOKEN_COMMA)
         {
-            assert(0);
-            return NULL;
+            toml_static_next(lex);
+            if (lex->token.kind == TOKEN_RBRACKET) // trailing commas are permitted
+            {
+                break;
+            }
+            element = toml_static_parse_value(parser, &element_table);
+            parser->elements[parser->num_elements++] = element;
         }
-        sb_push(nodes, node);
+        toml_static_expect(lex, TOKEN_RBRACKET);
+        toml_static_pack_array(parser, &value, mark);
     }
-    TomlNodes* result = TOML_ALLOC(TomlNodes);
-    size_t num_nodes = sb_count(nodes);
-    result->nodes = (TomlNode**)TOML_DUP(nodes);
-    result->num_nodes = num_nodes;
-    sb_free(nodes);
-    return result;
+    else if (lex->token.kind == TOKEN_LBRACE)
+    {
+        size_t mark = parser->num_node_items;
+        size_t key_table = toml_static_new_key_table(parser, TOMLTABLE_INLINE);
+        *inline_table = key_table + 1;
+        toml_static_next(lex);
+        toml_static_add_node(parser, toml_static_parse_stmt(parser, key_table));
+        while (lex->token.kind == TOKEN_COMMA)
+        {
+            toml_static_next(lex);
+            if (lex->token.kind == TOKEN_RBRACE) // trailing commas are permitted
+            {
+                break;
+            }
+            toml_static_add_node(parser, toml_static_parse_stmt(parser, key_table));
+        }
+        toml_static_expect(lex, TOKEN_RBRACE);
+        value.kind = TOMLVALUE_INLINETABLE;
+        value.table_nodes = &parser->self->node_lists[parser->num_node_lists];
+        parser->doc.node_lists[parser->num_node_lists++] = toml_static_node_list(parser, mark);
+    }
+    else
+    {
+        toml_static_error("Unexpected token");
+    }
+    return value;
 }
 
-intern size_t xpath_compare(const char* test, const char* key)
+template <TomlStaticCaps C>
+constexpr TomlStmt* toml_static_parse_stmt(TomlStaticParser<C>* parser, size_t key_table)
 {
-    size_t matching_chars = 0;
-    while (*test && *key && *test == *key)
-    {
-        matching_chars++;
-        test++;
-        key++;
-    }
-    return matching_chars;
+    TomlStaticLexer* lex = &parser->lex;
+    const char* start = lex->token.start;
+    size_t len = lex->token.end - start;
+    toml_static_expect(lex, TOKEN_NAME);
+    toml_static_expect(lex, TOKEN_EQ);
+    size_t name = toml_static_intern(parser, start, len, TOML_KEYWORD_NONE);
+    size_t inline_table = 0;
+    TomlValue value = toml_static_parse_value(parser, &inline_table);
+    size_t index = parser->num_values++;
+    parser->doc.values[index] = value;
+    toml_static_key_add_stmt(parser, key_table, name, index, inline_table);
+    parser->doc.stmts[parser->num_stmts] = { parser->self->names[name].chars, &parser->self->values[index] };
+    return &parser->self->stmts[parser->num_stmts++];
 }
 
-intern TomlNodes* toml_find_nodes(TomlNode** nodes, size_t num_nodes, const char* key)
+// Parses src into the document that will be stored at self, which must be
+// the variable being initialized; see TOML_STATIC_DOCUMENT.
+template <TomlStaticCaps C>
+constexpr TomlStaticDocument<C> toml_static_parse(TomlStaticDocument<C>* self, const char* src)
 {
-    TomlNodes* result = TOML_ALLOC(TomlNodes);
+    TomlStaticParser<C> parser = {};
+    parser.self = self;
+    toml_static_lexer_init(&parser.lex, src, parser.doc.chars);
+    toml_static_intern(&parser, "true", 4, TOML_KEYWORD_TRUE);
+    toml_static_intern(&parser, "false", 5, TOML_KEYWORD_FALSE);
+    toml_static_intern(&parser, "inf", 3, TOML_KEYWORD_INF);
+    toml_static_intern(&parser, "nan", 3, TOML_KEYWORD_NAN);
+    parser.key_current = toml_static_new_key_table(&parser, TOMLTABLE_HEADER);
 
-    TomlNode** matches = NULL;
-    for (size_t i = 0; i < num_nodes; i++)
+    TomlStaticLexer* lex = &parser.lex;
+    TomlDeclKind table_kind = TOMLDECL_NONE;
+    const char* table_name = NULL;
+    toml_static_next(lex);
+    while (lex->token.kind != TOKEN_EOF)
     {
-        TomlNode* node = nodes[i];
-        switch (node->kind)
+        if (lex->token.kind == TOKEN_LBRACKET)
         {
-            case TOMLDECL_STMT:
-                if (xpath_compare(node->stmt->name, key) == strlen(node->stmt->name))
-                {
-                    sb_push(matches, node);
-                }
-                break;
-            case TOMLDECL_TABLE: {
-                size_t matching_chars = xpath_compare(node->tbl->name, key);
-                if (matching_chars == strlen(node->tbl->name))
-                {
-                    // Table name is an exact match
-                    if (matching_chars == strlen(key))
-                    {
-                        sb_push(matches, node);
-                    }
-                    // Table name matched up to some dot - try matching a statement in 
-                    // the table to the rest of the key
-                    else if (*(key + matching_chars) == '.')
-                    {
-                        const char* subkey = key + matching_chars + 1;
-                        for (size_t i = 0; i < node->tbl->num_stmts; i++)
-                        {
-                            TomlStmt* stmt = node->tbl->stmts[i];
-                            if (xpath_compare(stmt->name, subkey) == strlen(stmt->name))
-                            {
-                                TomlNode* node = TOML_ALLOC(TomlNode);
-                                node->kind = TOMLDECL_STMT;
-                                node->stmt = stmt;
-                                sb_push(matches, node);
-                                break;
-                            }
-                        }
-                    }
-                }
-                // if this is a subtable of the key asked for, return it as well
-                else if (matching_chars > 0 && strlen(node->tbl->name) > matching_chars && node->tbl->name[matching_chars] == '.')
-                {
-                    sb_push(matches, node);
-                }
-            } break;
-            case TOMLDECL_LIST: {
-                size_t matching_chars = xpath_compare(node->list->name, key);
-                if (matching_chars == strlen(node->list->name))
-                {
-                    // List name is an exact match
-                    if (matching_chars == strlen(key))
-                    {
-                        sb_push(matches, node);
-                    }
-                    // List name matched up to some dot - try matching a statement
-                    // in the list to the rest of the key
-                    else if (*(key + matching_chars) == '.')
-                    {
-                        const char* subkey = key + matching_chars + 1;
-                        for (size_t i = 0; i < node->list->num_stmts; i++)
-                        {
-                            TomlStmt* stmt = node->list->stmts[i];
-                            if (xpath_compare(stmt->name, subkey) == strlen(stmt->name))
-                            {
-                                TomlNode* node = TOML_ALLOC(TomlNode);
-                                node->kind = TOMLDECL_STMT;
-                                node->stmt = stmt;
-                                sb_push(matches, node);
-                                break;
-                            }
-                        }
-                    }
-                }
-                else if (matching_chars > 0 && strlen(node->list->name) > matching_chars && node->list->name[matching_chars] == '.')
-                {
-                    sb_push(matches, node);
-                }
-            } break;
-            default:
-                assert(0);
-                break;
+            if (table_kind != TOMLDECL_NONE)
+            {
+                toml_static_close_table(&parser, table_kind, table_name);
+            }
+            toml_static_next(lex);
+            table_kind = TOMLDECL_TABLE;
+            if (lex->token.kind == TOKEN_LBRACKET)
+            {
+                toml_static_next(lex);
+                table_kind = TOMLDECL_LIST;
+            }
+            const char* start = lex->token.start;
+            size_t len = lex->token.end - start;
+            toml_static_expect(lex, TOKEN_NAME);
+            size_t name = toml_static_intern(&parser, start, len, TOML_KEYWORD_NONE);
+            table_name = self->names[name].chars;
+            toml_static_expect(lex, TOKEN_RBRACKET);
+            if (table_kind == TOMLDECL_LIST)
+            {
+                toml_static_expect(lex, TOKEN_RBRACKET);
+                toml_static_key_open_list_item(&parser, name);
+            }
+            else
+            {
+                toml_static_key_open_table(&parser, name);
+            }
+        }
+        else if (lex->token.kind == TOKEN_NAME)
+        {
+            TomlStmt* stmt = toml_static_parse_stmt(&parser, parser.key_current);
+            if (table_kind != TOMLDECL_NONE)
+            {
+                parser.stmt_items[parser.num_stmt_items++] = stmt;
+            }
+            else
+            {
+                toml_static_add_node(&parser, stmt);
+            }
+        }
+        else
+        {
+            toml_static_error("Expected one or more declarations");
         }
     }
+    if (table_kind != TOMLDECL_NONE)
+    {
+        toml_static_close_table(&parser, table_kind, table_name);
+    }
 
-    size_t num_matches = sb_count(matches);
-    result->nodes = (TomlNode**)TOML_DUP(matches);
-    result->num_nodes = num_matches;
-    return result;
+    parser.doc.doc = toml_static_node_list(&parser, 0);
+    parser.doc.doc.interns = &self->interns;
+    parser.doc.interns.slots = self->slots;
+    parser.doc.interns.num_slots = C.slots;
+    parser.doc.interns.num_names = parser.num_names;
+    toml_static_key_layout(&parser);
+    parser.doc.doc.root = &self->key_tables[0];
+    return parser.doc;
 }
 
+#define TOML_STATIC_DOCUMENT(var, src) \
+    constinit TomlStaticDocument<toml_static_caps(src)> var = toml_static_parse(&var, src)
+#endif
+
 #undef error_here
+#undef toml_emit
+#undef toml_emit_arg
 #undef TOML_DUP
+#undef TOML_ARENA_DUP
+#undef TOML_ARENA_ALLOC
 #undef TOML_ALLOC
 #undef TOML_MALLOC
 